@@ -416,7 +416,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                 params.draft_cpuparams.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-tbd", "--threads-batch-draft"}, "N",
         "number of threads to use during batch and prompt processing (default: same as --threads-draft)",
@@ -426,7 +426,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                 params.draft_cpuparams_batch.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-C", "--cpu-mask"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range (default: \"\")",
@@ -609,7 +609,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, int value) {
             params.n_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT"));
+    add_opt(common_arg(
+        {"--draft-ngram"},
+        "use n-gram lookup on the prompt and the generated text as the drafter when no draft model is given (default: disabled)",
+        [](common_params & params) {
+            params.draft_ngram = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_NGRAM"));
+    add_opt(common_arg(
+        {"--draft-ngram-max"}, "N",
+        string_format("max number of n-grams of the finished requests kept for the n-gram drafter, the least seen ones are dropped (default: %d, 0 = no limit)", params.n_draft_ngram_max),
+        [](common_params & params, int value) {
+            params.n_draft_ngram_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_NGRAM_MAX"));
     add_opt(common_arg(
         {"-ps", "--p-split"}, "N",
         string_format("speculative decoding split probability (default: %.1f)", (double)params.p_split),
@@ -623,14 +637,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
         [](common_params & params, const std::string & value) {
             params.lookup_cache_dynamic = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-c", "--ctx-size"}, "N",
         string_format("size of the prompt context (default: %d, 0 = loaded from model)", params.n_ctx),
@@ -673,6 +687,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.ctx_shift = false;
         }
     ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_NO_CONTEXT_SHIFT"));
+    add_opt(common_arg(
+        {"--ctx-shift-stream"}, "N",
+        string_format("streaming context shift: keep the first --keep tokens (at least 4) as attention sinks and evict N tokens at a time after them, without re-computing the RoPE of the kept tokens (default: %d, 0 - disabled)", params.ctx_shift_stream),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.ctx_shift_stream = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SHIFT_STREAM"));
     add_opt(common_arg(
         {"--chunks"}, "N",
         string_format("max number of chunks to process (default: %d, -1 = all)", params.n_chunks),
@@ -1269,6 +1293,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = value;
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"--cache-type-k-cold"}, "TYPE",
+        string_format("tiered KV cache data type for the older K (default: %s)", params.cache_type_k_cold.c_str()),
+        [](common_params & params, const std::string & value) {
+            params.cache_type_k_cold = value;
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_K_COLD"));
+    add_opt(common_arg(
+        {"--cache-type-v-cold"}, "TYPE",
+        string_format("tiered KV cache data type for the older V (default: %s)", params.cache_type_v_cold.c_str()),
+        [](common_params & params, const std::string & value) {
+            params.cache_type_v_cold = value;
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_V_COLD"));
     add_opt(common_arg(
         {"--perplexity", "--all-logits"},
         string_format("return logits for all tokens in the batch (default: %s)", params.logits_all ? "true" : "false"),
@@ -1353,6 +1391,26 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-block-size"}, "N",
+        string_format("KV cache block size for paged allocation, lets a batch use non-contiguous free cells (default: %d, 0 - disabled)", params.kv_block_size),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--kv-hot"}, "N",
+        string_format("tiered KV cache: number of recent tokens per sequence kept in the cache types, the older tokens are stored in the cold cache types (default: %d, 0 - disabled)", params.kv_n_hot),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_n_hot = value;
+        }
+    ).set_env("LLAMA_ARG_KV_HOT"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -1424,12 +1482,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- mirror: like distribute, with a copy of the weights on each node\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggerganov/llama.cpp/issues/1437",
         [](common_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "mirror") { params.numa = GGML_NUMA_STRATEGY_MIRROR; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
@@ -1454,7 +1514,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
                 fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_N_GPU_LAYERS_DRAFT"));
     add_opt(common_arg(
         {"-sm", "--split-mode"}, "{none,layer,row}",
         "how to split the model across multiple GPUs, one of:\n"
@@ -1581,6 +1641,39 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.model_alias = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ALIAS"));
+    add_opt(common_arg(
+        {"--add-model"}, "ALIAS", "FNAME",
+        "serve another model under the name ALIAS, requests select it with their \"model\" field\n"
+        "the model is loaded on the first request, models with the same FNAME share the weights (can be repeated)",
+        [](common_params & params, const std::string & alias, const std::string & fname) {
+            for (const auto & sm : params.server_models) {
+                if (sm.alias == alias) {
+                    throw std::invalid_argument(string_format("error: model alias '%s' is used more than once", alias.c_str()));
+                }
+            }
+            params.server_models.push_back({ alias, fname, {} });
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--add-model-lora"}, "ALIAS", "FNAME",
+        "apply a LoRA adapter to the model added with --add-model ALIAS (can be repeated)",
+        [](common_params & params, const std::string & alias, const std::string & fname) {
+            for (auto & sm : params.server_models) {
+                if (sm.alias == alias) {
+                    sm.lora_adapters.push_back({ fname, 1.0f });
+                    return;
+                }
+            }
+            throw std::invalid_argument(string_format("error: unknown model alias '%s', use --add-model first", alias.c_str()));
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--models-mem"}, "N",
+        string_format("memory in MiB for the weights and KV caches of all models, the least recently used models added with --add-model are unloaded to stay below it (default: %d, 0 = unlimited)", params.n_models_mem),
+        [](common_params & params, int value) {
+            params.n_models_mem = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODELS_MEM"));
     add_opt(common_arg(
         {"-m", "--model"}, "FNAME",
         ex == LLAMA_EXAMPLE_EXPORT_LORA
@@ -1599,7 +1692,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.model_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODEL_DRAFT"));
     add_opt(common_arg(
         {"-mu", "--model-url"}, "MODEL_URL",
         "model download url (default: unused)",
@@ -1863,6 +1956,61 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefix-cache"}, "N",
+        string_format("max number of tokens kept in the prompt prefix cache shared by all slots (default: %d, 0 = disabled)", params.n_prefix_cache),
+        [](common_params & params, int value) {
+            params.n_prefix_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE"));
+    add_opt(common_arg(
+        {"--prefix-cache-seqs"}, "N",
+        string_format("max number of prompts in the prefix cache, each one is kept in a KV cache sequence of its own (default: %d)", params.n_prefix_cache_seq),
+        [](common_params & params, int value) {
+            params.n_prefix_cache_seq = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_SEQS"));
+    add_opt(common_arg(
+        {"--kv-spill-ram"}, "N",
+        string_format("host memory in MiB for the KV state of idle prompts, restored when a matching prompt arrives (default: %d, 0 = disabled)", params.n_kv_spill_ram),
+        [](common_params & params, int value) {
+            params.n_kv_spill_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_RAM"));
+    add_opt(common_arg(
+        {"--kv-spill-disk"}, "N",
+        string_format("disk space in MiB for the KV state of idle prompts that do not fit in --kv-spill-ram (default: %d, 0 = unlimited)", params.n_kv_spill_disk),
+        [](common_params & params, int value) {
+            params.n_kv_spill_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_DISK"));
+    add_opt(common_arg(
+        {"--sched-policy"}, "{decode-first,fcfs,shortest-first}",
+        "order in which the tokens of the slots are scheduled in each iteration (default: decode-first)\n"
+        "decode-first: generated tokens first, then the prompts in arrival order\n"
+        "fcfs: generated tokens and prompts in arrival order\n"
+        "shortest-first: generated tokens first, then the shortest remaining prompts",
+        [](common_params & params, const std::string & value) {
+            /**/ if (value == "decode-first")   { params.sched_policy = COMMON_SCHED_POLICY_DECODE_FIRST; }
+            else if (value == "fcfs")           { params.sched_policy = COMMON_SCHED_POLICY_FCFS; }
+            else if (value == "shortest-first") { params.sched_policy = COMMON_SCHED_POLICY_SHORTEST_FIRST; }
+            else { throw std::invalid_argument("invalid value"); }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_POLICY"));
+    add_opt(common_arg(
+        {"--sched-budget"}, "N",
+        string_format("max number of tokens decoded per iteration, prompts are processed in chunks that fit in it (default: %d, 0 = batch size)", params.n_sched_budget),
+        [](common_params & params, int value) {
+            params.n_sched_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_BUDGET"));
+    add_opt(common_arg(
+        {"--sched-chunk"}, "N",
+        string_format("max number of prompt tokens of a single slot per iteration (default: %d, 0 = no limit)", params.n_sched_chunk),
+        [](common_params & params, int value) {
+            params.n_sched_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_CHUNK"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -1902,6 +2050,17 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--kv-spill-path"}, "PATH",
+        "directory where the KV state of idle prompts is spilled when --kv-spill-ram is full, created if needed (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.kv_spill_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_spill_path.empty() && params.kv_spill_path[params.kv_spill_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_spill_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_PATH"));
     add_opt(common_arg(
         {"--chat-template"}, "JINJA_TEMPLATE",
         "set custom jinja chat template (default: template taken from model's metadata)\n"
@@ -866,12 +866,22 @@ struct common_init_result common_init_from_params(common_params & params) {
         }
     }
 
+    iparams = common_init_from_model(model, params);
+    if (iparams.context == NULL) {
+        llama_free_model(model);
+    }
+
+    return iparams;
+}
+
+struct common_init_result common_init_from_model(struct llama_model * model, common_params & params) {
+    common_init_result iparams;
+
     auto cparams = common_context_params_to_llama(params);
 
     llama_context * lctx = llama_new_context_with_model(model, cparams);
     if (lctx == NULL) {
         LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.c_str());
-        llama_free_model(model);
         return iparams;
     }
 
@@ -882,7 +892,6 @@ struct common_init_result common_init_from_params(common_params & params) {
         const auto cvec = common_control_vector_load(params.control_vectors);
         if (cvec.n_embd == -1) {
             llama_free(lctx);
-            llama_free_model(model);
 
             return iparams;
         }
@@ -895,7 +904,6 @@ struct common_init_result common_init_from_params(common_params & params) {
                                              params.control_vector_layer_end);
         if (err) {
             llama_free(lctx);
-            llama_free_model(model);
 
             return iparams;
         }
@@ -910,7 +918,10 @@ struct common_init_result common_init_from_params(common_params & params) {
         if (loaded_la.adapter == nullptr) {
             LOG_ERR("%s: failed to apply lora adapter '%s'\n", __func__, la.path.c_str());
             llama_free(lctx);
-            llama_free_model(model);
+            for (auto & la_loaded : iparams.lora_adapters) {
+                llama_lora_adapter_free(la_loaded.adapter);
+            }
+            iparams.lora_adapters.clear();
             return iparams;
         }
         iparams.lora_adapters.push_back(loaded_la); // copy to list of loaded adapters
@@ -1032,7 +1043,7 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     auto cparams = llama_context_default_params();
 
     cparams.n_ctx             = params.n_ctx;
-    cparams.n_seq_max         = params.n_parallel;
+    cparams.n_seq_max         = std::max(params.n_parallel, params.n_seq_max);
     cparams.n_batch           = params.n_batch;
     cparams.n_ubatch          = params.n_ubatch;
     cparams.n_threads         = params.cpuparams.n_threads;
@@ -1051,6 +1062,8 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.kv_n_hot          = params.kv_n_hot;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1065,6 +1078,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
 
+    cparams.type_k_cold = kv_cache_type_from_str(params.cache_type_k_cold);
+    cparams.type_v_cold = kv_cache_type_from_str(params.cache_type_v_cold);
+
     return cparams;
 }
 
@@ -1515,6 +1531,48 @@ std::vector<llama_token> common_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+        const struct llama_context * ctx,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special,
+                               int   n_threads) {
+    return common_tokenize_batch(llama_get_model(ctx), texts, add_special, parse_special, n_threads);
+}
+
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+          const struct llama_model * model,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special,
+                               int   n_threads) {
+    std::vector<const char *> ptrs(texts.size());
+    std::vector<int32_t>      lens(texts.size());
+    std::vector<int32_t>      offsets(texts.size() + 1);
+
+    // upper limit for the number of tokens
+    int n_tokens = 0;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        ptrs[i] = texts[i].data();
+        lens[i] = texts[i].length();
+        n_tokens += texts[i].length() + 2 * add_special;
+    }
+
+    std::vector<llama_token> tokens(n_tokens);
+    n_tokens = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), add_special, parse_special, n_threads);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        int check = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_tokens);
+    }
+
+    std::vector<std::vector<llama_token>> result(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        result[i].assign(tokens.begin() + offsets[i], tokens.begin() + offsets[i + 1]);
+    }
+    return result;
+}
+
 std::string common_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     std::string piece;
     piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
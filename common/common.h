@@ -33,6 +33,13 @@ struct common_lora_adapter_container : common_lora_adapter_info {
     struct llama_lora_adapter * adapter;
 };
 
+// a model served next to the main model of the server, loaded on demand
+struct common_server_model {
+    std::string alias; // name used in the "model" field of the requests
+    std::string path;  // models with the same path share the weights
+    std::vector<common_lora_adapter_info> lora_adapters;
+};
+
 // build info
 extern int LLAMA_BUILD_NUMBER;
 extern char const * LLAMA_COMMIT;
@@ -101,6 +108,13 @@ enum dimre_method {
     DIMRE_METHOD_MEAN,
 };
 
+// order in which the server schedules the tokens of its slots in each iteration
+enum common_sched_policy {
+    COMMON_SCHED_POLICY_DECODE_FIRST,   // all generated tokens first, then the prompts in arrival order
+    COMMON_SCHED_POLICY_FCFS,           // generated tokens and prompts in arrival order
+    COMMON_SCHED_POLICY_SHORTEST_FIRST, // all generated tokens first, then the shortest remaining prompts
+};
+
 // sampler parameters
 struct common_sampler_params {
     uint32_t seed = LLAMA_DEFAULT_SEED; // the seed used to initialize llama_sampler
@@ -162,6 +176,7 @@ struct common_params {
     int32_t n_draft               =     5; // number of tokens to draft during speculative decoding
     int32_t n_chunks              =    -1; // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            =     1; // number of parallel sequences to decode
+    int32_t n_seq_max             =     0; // number of sequences in the KV cache (0 = n_parallel)
     int32_t n_sequences           =     1; // number of sequences to decode
     float   p_split               =  0.1f; // speculative decoding split probability
     int32_t n_gpu_layers          =    -1; // number of layers to store in VRAM (-1 - use default)
@@ -179,6 +194,8 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // KV cache block size for paged allocation (0 = disabled)
+    int32_t kv_n_hot              =     0; // tiered KV cache: recent tokens per sequence kept in full precision (0 = disabled)
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -259,6 +276,7 @@ struct common_params {
     bool flash_attn        = false; // flash attention
     bool no_perf           = false; // disable performance metrics
     bool ctx_shift         = true;  // context shift on inifinite text generation
+    int32_t ctx_shift_stream = 0;   // streaming context shift: number of tokens evicted at a time after the attention sinks (0 = disabled)
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool logits_all        = false; // return logits for all tokens in the batch
@@ -274,6 +292,9 @@ struct common_params {
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
 
+    std::string cache_type_k_cold = "q8_0"; // tiered KV cache data type for the older K
+    std::string cache_type_v_cold = "q8_0"; // tiered KV cache data type for the older V
+
     // multimodal models (see examples/llava)
     std::string mmproj = "";        // path to multimodal projector                                         // NOLINT
     std::vector<std::string> image; // path to image file(s)
@@ -291,6 +312,18 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_prefix_cache = 0;            // max number of tokens kept in the server-wide prefix cache (0 = disabled)
+    int32_t n_prefix_cache_seq = 32;       // max number of prompts in the prefix cache, each one uses a KV cache sequence
+    int32_t n_kv_spill_ram  = 0;           // host memory for the KV state of idle prompts in MiB (0 = disabled)
+    int32_t n_kv_spill_disk = 0;           // disk space for the KV state of idle prompts in MiB (0 = unlimited)
+    int32_t n_sched_budget  = 0;           // max number of tokens decoded per server iteration (0 = n_batch)
+    int32_t n_sched_chunk   = 0;           // max number of prompt tokens of a slot per server iteration (0 = no limit)
+    int32_t n_models_mem    = 0;           // memory budget for the models loaded on demand in MiB (0 = unlimited)
+
+    common_sched_policy sched_policy = COMMON_SCHED_POLICY_DECODE_FIRST;
+
+    bool    draft_ngram       = false;  // draft with n-gram lookup when there is no draft model (speculative decoding)
+    int32_t n_draft_ngram_max = 262144; // max number of n-grams of the finished tasks kept for drafting (0 = no limit)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -299,6 +332,8 @@ struct common_params {
 
     std::vector<std::string> api_keys;
 
+    std::vector<common_server_model> server_models; // additional models routed by the "model" field of the requests
+
     std::string ssl_file_key  = "";                                                                         // NOLINT
     std::string ssl_file_cert = "";                                                                         // NOLINT
 
@@ -311,6 +346,7 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string kv_spill_path; // directory where the KV state of idle prompts is spilled (empty = no disk tier)
 
     float slot_prompt_similarity = 0.5f;
 
@@ -451,6 +487,7 @@ struct common_init_result {
 };
 
 struct common_init_result     common_init_from_params(common_params & params);
+struct common_init_result     common_init_from_model (struct llama_model * model, common_params & params); // the model is not freed on failure
 
 struct llama_model_params     common_model_params_to_llama  (const common_params & params);
 struct llama_context_params   common_context_params_to_llama(const common_params & params);
@@ -491,6 +528,21 @@ std::vector<llama_token> common_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenizes the texts in parallel with llama_tokenize_batch, n_threads <= 0 for GGML_DEFAULT_N_THREADS
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+        const struct llama_context * ctx,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special = false,
+                               int   n_threads     = 0);
+
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+          const struct llama_model * model,
+    const std::vector<std::string> & texts,
+                              bool   add_special,
+                              bool   parse_special = false,
+                               int   n_threads     = 0);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string common_token_to_piece(
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
@@ -191,7 +192,7 @@ void common_ngram_cache_draft(
             break;
         }
 
-        LOG(" - draft candidate: token=%d\n", drafted_token);
+        LOG_DBG(" - draft candidate: token=%d\n", drafted_token);
         draft.push_back(drafted_token);
     }
 }
@@ -283,3 +284,41 @@ void common_ngram_cache_merge(common_ngram_cache & ngram_cache_target, common_ng
         }
     }
 }
+
+void common_ngram_cache_prune(common_ngram_cache & ngram_cache, size_t n_keep) {
+    if (ngram_cache.size() <= n_keep) {
+        return;
+    }
+
+    // number of times each n-gram has been seen
+    std::vector<int64_t> counts;
+    counts.reserve(ngram_cache.size());
+    for (const std::pair<const common_ngram, common_ngram_cache_part> & ngram_part : ngram_cache) {
+        int64_t count = 0;
+        for (const std::pair<const llama_token, int32_t> & token_count : ngram_part.second) {
+            count += token_count.second;
+        }
+        counts.push_back(count);
+    }
+
+    // the n-grams seen less often than the threshold are dropped, then the ones seen as often until n_keep are left
+    const size_t n_drop = ngram_cache.size() - n_keep;
+    std::nth_element(counts.begin(), counts.begin() + (n_drop - 1), counts.end());
+    const int64_t count_drop = counts[n_drop - 1];
+
+    size_t n_drop_equal = n_drop - std::count_if(counts.begin(), counts.end(), [count_drop](int64_t count) { return count < count_drop; });
+
+    for (common_ngram_cache::iterator it = ngram_cache.begin(); it != ngram_cache.end();) {
+        int64_t count = 0;
+        for (const std::pair<const llama_token, int32_t> & token_count : it->second) {
+            count += token_count.second;
+        }
+
+        if (count < count_drop || (count == count_drop && n_drop_equal > 0)) {
+            n_drop_equal -= count == count_drop;
+            it = ngram_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -99,3 +99,8 @@ common_ngram_cache common_ngram_cache_load(std::string & filename);
 // ngram_cache_target: the ngram cache to which to add the information from ngram_cache_add.
 // ngram_cache_add:    the ngram cache to add to ngram_cache_target.
 void common_ngram_cache_merge(common_ngram_cache & ngram_cache_target, common_ngram_cache & ngram_cache_add);
+
+// Drop the n-grams seen the least often from an ngram cache.
+// ngram_cache: the ngram cache to prune.
+// n_keep:      the max number of n-grams left in ngram_cache.
+void common_ngram_cache_prune(common_ngram_cache & ngram_cache, size_t n_keep);
@@ -110,11 +110,42 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
+    // number of candidates selected directly from the logits by the sparse path (0 - always use the full vocabulary)
+    int32_t n_sparse;
+
+    void set_logits(struct llama_context * ctx, int idx, bool sparse) {
         const auto * logits = llama_get_logits_ith(ctx, idx);
 
         const int n_vocab = llama_n_vocab(llama_get_model(ctx));
 
+        if (sparse && n_sparse > 0) {
+            cur.resize(n_sparse + params.logit_bias.size());
+
+            size_t n = llama_logits_top_k(logits, n_vocab, n_sparse, cur.data());
+
+            // a positive bias can move a token from anywhere in the vocabulary into the top-k
+            for (const auto & lb : params.logit_bias) {
+                if (lb.bias <= 0.0f || lb.token < 0 || lb.token >= n_vocab) {
+                    continue;
+                }
+
+                bool found = false;
+                for (size_t i = 0; i < n && !found; ++i) {
+                    found = cur[i].id == lb.token;
+                }
+
+                if (!found) {
+                    cur[n++] = llama_token_data{lb.token, logits[lb.token], 0.0f};
+                }
+            }
+
+            cur.resize(n);
+
+            cur_p = { cur.data(), cur.size(), -1, false };
+
+            return;
+        }
+
         cur.resize(n_vocab);
 
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -141,18 +172,65 @@ std::string common_sampler_params::print() const {
     return std::string(result);
 }
 
+// the sampling chain only needs the full vocabulary when a sampler ahead of top-k can raise a logit
+// otherwise, the top-k is among the largest raw logits, plus the few tokens that the logit biases and the penalties can
+// push down, plus the tokens with a positive bias (added separately)
+static int32_t common_sampler_n_sparse(const struct llama_model * model, const struct common_sampler_params & params) {
+    if (params.mirostat != 0 || params.top_k <= 0) {
+        return 0;
+    }
+
+    bool has_top_k = false;
+    for (const auto & cnstr : params.samplers) {
+        if (cnstr == COMMON_SAMPLER_TYPE_TOP_K) {
+            has_top_k = true;
+            break;
+        }
+
+        const bool dry_off = params.dry_multiplier == 0.0f || params.dry_base < 1.0f || params.dry_penalty_last_n == 0;
+        if (cnstr != COMMON_SAMPLER_TYPE_DRY || !dry_off) {
+            return 0;
+        }
+    }
+
+    if (!has_top_k) {
+        return 0;
+    }
+
+    int32_t n = params.top_k + (int32_t) params.logit_bias.size() + (params.ignore_eos ? 1 : 0);
+
+    const bool has_penalties = params.penalty_last_n != 0 &&
+        (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f);
+
+    if (has_penalties) {
+        if (params.penalty_last_n < 0 || params.penalty_repeat < 1.0f || params.penalty_freq < 0.0f || params.penalty_present < 0.0f) {
+            return 0;
+        }
+
+        n += params.penalty_last_n;
+    }
+
+    // not worth it when the selection is a large share of the vocabulary
+    if (n > llama_n_vocab(model)/8) {
+        return 0;
+    }
+
+    return n;
+}
+
 struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_sampler_params & params) {
     llama_sampler_chain_params lparams = llama_sampler_chain_default_params();
 
     lparams.no_perf = params.no_perf;
 
     auto * result = new common_sampler {
-        /* .params = */ params,
-        /* .grmr   = */ llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
-        /* .chain  = */ llama_sampler_chain_init(lparams),
-        /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
-        /* .cur    = */ {},
-        /* .cur_p  = */ {},
+        /* .params   = */ params,
+        /* .grmr     = */ llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
+        /* .chain    = */ llama_sampler_chain_init(lparams),
+        /* .prev     = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
+        /* .cur      = */ {},
+        /* .cur_p    = */ {},
+        /* .n_sparse = */ common_sampler_n_sparse(model, params),
     };
 
     llama_sampler_chain_add(result->chain,
@@ -254,12 +332,13 @@ void common_sampler_reset(struct common_sampler * gsmpl) {
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
     return new common_sampler {
-        /* .params = */ gsmpl->params,
-        /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
-        /* .chain  = */ llama_sampler_clone(gsmpl->chain),
-        /* .prev   = */ gsmpl->prev,
-        /* .cur    = */ gsmpl->cur,
-        /* .cur_p  = */ gsmpl->cur_p,
+        /* .params   = */ gsmpl->params,
+        /* .grmr     = */ llama_sampler_clone(gsmpl->grmr),
+        /* .chain    = */ llama_sampler_clone(gsmpl->chain),
+        /* .prev     = */ gsmpl->prev,
+        /* .cur      = */ gsmpl->cur,
+        /* .cur_p    = */ gsmpl->cur_p,
+        /* .n_sparse = */ gsmpl->n_sparse,
     };
 }
 
@@ -275,7 +354,8 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+    // the grammar can reject any of the top candidates, so it has to see the full vocabulary
+    gsmpl->set_logits(ctx, idx, !grammar_first || gsmpl->params.grammar.empty());
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -310,7 +390,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(ctx, idx, false);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
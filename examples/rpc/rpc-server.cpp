@@ -13,6 +13,7 @@
 #endif
 
 #include "ggml-rpc.h"
+#include "common.h"
 #ifdef _WIN32
 #  include <windows.h>
 #else
@@ -25,6 +26,9 @@ struct rpc_server_params {
     std::string host        = "127.0.0.1";
     int         port        = 50052;
     size_t      backend_mem = 0;
+    bool        use_cache   = false;
+    size_t      cache_size  = 32768ull * 1024 * 1024;
+    bool        share       = false;
 };
 
 static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
@@ -34,6 +38,9 @@ static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
     fprintf(stderr, "  -H HOST, --host HOST  host to bind to (default: %s)\n", params.host.c_str());
     fprintf(stderr, "  -p PORT, --port PORT  port to bind to (default: %d)\n", params.port);
     fprintf(stderr, "  -m MEM, --mem MEM     backend memory size (in MB)\n");
+    fprintf(stderr, "  -c,     --cache       enable the local cache of the weights uploaded by the clients\n");
+    fprintf(stderr, "  -cs N,  --cache-size N  maximum size of the cache (in MB, 0 - no limit, default: %zu)\n", params.cache_size / (1024 * 1024));
+    fprintf(stderr, "  -s,     --share       store the weights of the clients once when they are identical (CPU backend only)\n");
     fprintf(stderr, "\n");
 }
 
@@ -59,6 +66,15 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
                 return false;
             }
             params.backend_mem = std::stoul(argv[i]) * 1024 * 1024;
+        } else if (arg == "-c" || arg == "--cache") {
+            params.use_cache = true;
+        } else if (arg == "-cs" || arg == "--cache-size") {
+            if (++i >= argc) {
+                return false;
+            }
+            params.cache_size = std::stoull(argv[i]) * 1024 * 1024;
+        } else if (arg == "-s" || arg == "--share") {
+            params.share = true;
         } else if (arg == "-h" || arg == "--help") {
             print_usage(argc, argv, params);
             exit(0);
@@ -152,8 +168,17 @@ int main(int argc, char * argv[]) {
     } else {
         get_backend_memory(&free_mem, &total_mem);
     }
+    std::string cache_dir;
+    if (params.use_cache) {
+        cache_dir = fs_get_cache_directory() + "rpc" + DIRECTORY_SEPARATOR;
+        if (!fs_create_directory_with_parents(cache_dir)) {
+            fprintf(stderr, "Failed to create cache directory: %s\n", cache_dir.c_str());
+            return 1;
+        }
+        printf("Using cache directory: %s, size: %zu MB\n", cache_dir.c_str(), params.cache_size / (1024 * 1024));
+    }
     printf("Starting RPC server on %s, backend memory: %zu MB\n", endpoint.c_str(), free_mem / (1024 * 1024));
-    ggml_backend_rpc_start_server(backend, endpoint.c_str(), free_mem, total_mem);
+    ggml_backend_rpc_start_server(backend, endpoint.c_str(), cache_dir.empty() ? nullptr : cache_dir.c_str(), params.cache_size, params.share, free_mem, total_mem);
     ggml_backend_free(backend);
     return 0;
 }
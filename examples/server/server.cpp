@@ -3,6 +3,7 @@
 #include "arg.h"
 #include "common.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
@@ -22,11 +23,14 @@
 #include "deps_tailwindcss.js.hpp"
 #include "deps_vue.esm-browser.js.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <fstream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -34,6 +38,13 @@
 #include <unordered_map>
 #include <unordered_set>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::ordered_json;
 
 enum stop_type {
@@ -73,6 +84,16 @@ enum server_task_inf_type {
     SERVER_TASK_INF_TYPE_INFILL,
 };
 
+static const char * sched_policy_name(common_sched_policy policy) {
+    switch (policy) {
+        case COMMON_SCHED_POLICY_DECODE_FIRST:   return "decode-first";
+        case COMMON_SCHED_POLICY_FCFS:           return "fcfs";
+        case COMMON_SCHED_POLICY_SHORTEST_FIRST: return "shortest-first";
+    }
+
+    return "unknown";
+}
+
 struct server_task {
     int id        = -1; // to be filled by server_queue
     int id_target = -1; // used by SERVER_TASK_TYPE_CANCEL
@@ -110,11 +131,14 @@ struct slot_params {
     int32_t n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t n_predict = -1; // new tokens to predict
     int32_t n_indent  =  0; // mininum line indentation for the generated text in number of whitespace characters
+    int32_t n_draft   =  0; // max number of tokens to draft per step for speculative decoding (0 = disabled)
 
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
     std::vector<std::string> antiprompt;
+
+    std::vector<std::pair<int, float>> lora; // per-request adapters: index in server_context::loras and scale
 };
 
 struct server_slot {
@@ -152,6 +176,9 @@ struct server_slot {
     llama_tokens cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
+    // the per-request adapters that cache_tokens were computed with
+    std::vector<std::pair<int, float>> lora_cache;
+
     server_task_inf_type inf_type = SERVER_TASK_INF_TYPE_COMPLETION;
 
     bool has_next_token = true;
@@ -174,12 +201,26 @@ struct server_slot {
 
     llama_token sampled;
 
+    // speculative decoding
+    llama_tokens spec_tokens;   // the prompt and the generated tokens, including the last sampled token
+    llama_tokens tokens_dft;    // tokens in the KV cache of the draft model
+    llama_tokens draft;         // tokens drafted for the current step
+
+    common_ngram_cache ngram_cache;
+
+    int32_t n_draft          = 0; // drafted tokens of the current task
+    int32_t n_draft_accepted = 0;
+
+    uint64_t n_draft_total          = 0; // drafted tokens since the start of the server
+    uint64_t n_draft_accepted_total = 0;
+
     // stats
     size_t n_sent_text        = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token; // used for the inter-token latency
 
     double t_prompt_processing; // ms
     double t_token_generation;  // ms
@@ -202,8 +243,12 @@ struct server_slot {
         n_sent_text        = 0;
         n_sent_token_probs = 0;
         inf_type           = SERVER_TASK_INF_TYPE_COMPLETION;
+        n_draft            = 0;
+        n_draft_accepted   = 0;
 
         generated_token_probs.clear();
+        spec_tokens.clear();
+        draft.clear();
     }
 
     bool has_budget(common_params &global_params) {
@@ -246,7 +291,7 @@ struct server_slot {
     }
 
     json get_formated_timings() const {
-        return json {
+        json res = json {
             {"prompt_n",               n_prompt_tokens_processed},
             {"prompt_ms",              t_prompt_processing},
             {"prompt_per_token_ms",    t_prompt_processing / n_prompt_tokens_processed},
@@ -257,6 +302,23 @@ struct server_slot {
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
         };
+
+        if (n_draft > 0) {
+            res["draft_n"]          = n_draft;
+            res["draft_n_accepted"] = n_draft_accepted;
+        }
+
+        return res;
+    }
+
+    json get_formated_speculative() const {
+        return json {
+            {"n_draft",                n_draft},
+            {"n_accepted",             n_draft_accepted},
+            {"acceptance_rate",        n_draft > 0 ? (double) n_draft_accepted / n_draft : 0.0},
+            {"n_draft_total",          n_draft_total},
+            {"n_accepted_total",       n_draft_accepted_total},
+        };
     }
 
     size_t find_stopping_strings(const std::string & text, const size_t last_token_size, const stop_type type) {
@@ -322,6 +384,21 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    // scheduler
+    uint64_t n_sched_decode_tokens_total   = 0;
+    uint64_t n_sched_prompt_tokens_total   = 0;
+    uint64_t n_sched_decode_deferred_total = 0; // generated tokens that had to wait for the next iteration
+    uint64_t n_sched_prompt_chunked_total  = 0; // iterations that processed a prompt only partially
+
+    // speculative decoding
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+
+    // inter-token latency of the generated tokens
+    uint64_t n_itl      = 0;
+    uint64_t t_itl      = 0; // us
+    uint64_t t_itl_max  = 0; // us
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -340,6 +417,17 @@ struct server_metrics {
         t_tokens_generation_total  += slot.t_token_generation;
     }
 
+    void on_token_sampled(int64_t t_us) {
+        n_itl++;
+        t_itl    += t_us;
+        t_itl_max = std::max<uint64_t>(t_itl_max, t_us);
+    }
+
+    void on_draft_verified(int32_t n_draft, int32_t n_accepted) {
+        n_draft_total          += n_draft;
+        n_draft_accepted_total += n_accepted;
+    }
+
     void on_decoded(const std::vector<server_slot> & slots) {
         n_decode_total++;
         for (const auto & slot : slots) {
@@ -354,288 +442,1132 @@ struct server_metrics {
         t_prompt_processing       = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+        n_itl                     = 0;
+        t_itl                     = 0;
+        t_itl_max                 = 0;
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// server-wide cache of prompt prefixes, shared by all slots
+//
+// the cached prompts are stored in a radix tree over their tokens. each leaf owns a KV cache sequence that holds
+// the KV of the whole path from the root, so the KV of any prefix in the tree can be copied into a slot with
+// llama_kv_cache_seq_cp. the KV cells are shared between the sequences, so the copies do not use extra memory
+struct server_prefix_cache {
+    struct node {
+        llama_tokens tokens; // tokens on the edge from the parent
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        node * parent = nullptr;
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        std::unordered_map<llama_token, std::unique_ptr<node>> children;
 
-    // callback functions
-    std::function<void(server_task)> callback_new_task;
-    std::function<void(void)>        callback_update_slots;
+        // leaves only
+        llama_seq_id seq_id      = -1;
+        int64_t      t_last_used = -1;
+        int          id_slot     = -1; // the slot that released the prompt last, it may still hold its KV
+    };
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (task.id == -1) {
-            task.id = id++;
-        }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task.id;
-    }
+    node root;
 
-    // multi-task version of post()
-    int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
-        }
-        condition_tasks.notify_one();
-        return 0;
-    }
+    // the KV cache sequences in [seq_id_base, seq_id_base + leaves.size()) are reserved for the cache
+    llama_seq_id seq_id_base = 0;
+    std::vector<node *> leaves;
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+    size_t n_tokens     = 0; // number of tokens stored in the tree
+    size_t n_tokens_max = 0;
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+    uint64_t n_tokens_hit_total = 0; // number of prompt tokens loaded from the cache
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task)> callback) {
-        callback_new_task = std::move(callback);
-    }
+    // called with the KV cache sequence and the tokens of a prompt before it is evicted
+    std::function<void(llama_seq_id, const llama_tokens &)> callback_on_evict;
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
-    }
+    void init(llama_seq_id seq_id_base_, int32_t n_seq, size_t n_tokens_max_) {
+        seq_id_base  = seq_id_base_;
+        n_tokens_max = n_tokens_max_;
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
-        }
-        condition_tasks.notify_one();
+        leaves.assign(std::max(0, n_seq), nullptr);
     }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+    bool enabled() const {
+        return n_tokens_max > 0 && !leaves.empty();
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
-
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+    // walk the tree along the tokens
+    // returns the number of matched tokens, the last visited node and how many tokens of its edge were matched
+    size_t match(const llama_tokens & tokens, node *& cur, size_t & n_edge) {
+        size_t n = 0;
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
+        cur    = &root;
+        n_edge = 0;
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
+        while (n < tokens.size()) {
+            auto it = cur->children.find(tokens[n]);
+            if (it == cur->children.end()) {
+                break;
             }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+            node * child = it->second.get();
 
-            callback_update_slots();
+            size_t k = 0;
+            while (k < child->tokens.size() && n + k < tokens.size() && child->tokens[k] == tokens[n + k]) {
+                k++;
+            }
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        QUE_DBG("%s", "terminate\n");
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
+            n     += k;
+            cur    = child;
+            n_edge = k;
+
+            if (k < child->tokens.size()) {
+                break;
             }
         }
+
+        return n;
     }
-};
 
-struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // the tokens on the path from the root to the node
+    static llama_tokens tokens_of(const node * cur) {
+        llama_tokens res;
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+        for (; cur != nullptr; cur = cur->parent) {
+            res.insert(res.begin(), cur->tokens.begin(), cur->tokens.end());
+        }
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+        return res;
+    }
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+    // any leaf under the node holds the KV of its path
+    static node * leaf_of(node * cur) {
+        while (cur->seq_id < 0) {
+            GGML_ASSERT(!cur->children.empty());
+            cur = cur->children.begin()->second.get();
+        }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        return cur;
     }
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    // find the longest cached prefix of the tokens and the sequence that holds its KV
+    size_t find(const llama_tokens & tokens, llama_seq_id & seq_id) {
+        if (!enabled()) {
+            return 0;
+        }
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+        node * cur;
+        size_t n_edge;
+
+        const size_t n = match(tokens, cur, n_edge);
+        if (n == 0) {
+            return 0;
         }
-    }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        node * leaf = leaf_of(cur);
+        leaf->t_last_used = ggml_time_us();
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-    }
+        seq_id = leaf->seq_id;
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        return n;
+    }
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+    // the slot that released the longest cached prefix of the tokens, or -1
+    // the slot may have been reused since, so the caller has to check its tokens
+    int find_slot(const llama_tokens & tokens) {
+        if (!enabled()) {
+            return -1;
         }
-    }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+        node * cur;
+        size_t n_edge;
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        if (match(tokens, cur, n_edge) == 0) {
+            return -1;
         }
 
-        // should never reach here
+        return leaf_of(cur)->id_slot;
     }
 
-    // single-task version of recv()
-    server_task_result recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
-    }
+    // store the KV of the first tokens.size() positions of seq_id_src in the cache
+    // seq_id_src is the id of the slot that holds the tokens
+    void insert(llama_context * ctx, const llama_tokens & tokens, llama_seq_id seq_id_src) {
+        if (!enabled() || tokens.empty() || tokens.size() > n_tokens_max) {
+            return;
+        }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result & result) {
-        SRV_DBG("sending result for task id = %d\n", result.id);
+        node * cur;
+        size_t n_edge;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result.id == id_task) {
-                SRV_DBG("task id = %d moved to result queue\n", result.id);
+        const size_t n = match(tokens, cur, n_edge);
 
-                queue_results.push_back(std::move(result));
-                condition_results.notify_all();
+        if (n == tokens.size()) {
+            // already cached as a prefix of a longer prompt
+            node * leaf = leaf_of(cur);
+            leaf->t_last_used = ggml_time_us();
+            leaf->id_slot     = seq_id_src;
+            return;
+        }
+
+        if (cur->seq_id >= 0 && n_edge == cur->tokens.size()) {
+            // the prompt extends a cached prompt - grow the leaf
+            llama_kv_cache_seq_rm(ctx, cur->seq_id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, seq_id_src, cur->seq_id, 0, tokens.size());
+
+            cur->tokens.insert(cur->tokens.end(), tokens.begin() + n, tokens.end());
+            cur->t_last_used = ggml_time_us();
+            cur->id_slot     = seq_id_src;
+
+            n_tokens += tokens.size() - n;
+        } else {
+            llama_seq_id seq_id = -1;
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                if (leaves[i] == nullptr) {
+                    seq_id = seq_id_base + i;
+                    break;
+                }
+            }
+
+            if (seq_id < 0) {
+                // no free sequence - evict the least recently used prompt and start over, since the tree changed
+                evict(ctx);
+                insert(ctx, tokens, seq_id_src);
                 return;
             }
-        }
-    }
-};
 
-struct server_context {
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
-    std::vector<common_lora_adapter_container> loras;
+            if (cur != &root && n_edge < cur->tokens.size()) {
+                // split the edge at the first mismatch
+                node * parent = cur->parent;
 
-    common_params params;
+                auto mid = std::make_unique<node>();
+                mid->tokens.assign(cur->tokens.begin(), cur->tokens.begin() + n_edge);
+                mid->parent = parent;
 
-    llama_batch batch = {};
+                std::unique_ptr<node> & owner = parent->children[cur->tokens[0]];
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
-    bool has_eos_token  = false;
+                cur->tokens.erase(cur->tokens.begin(), cur->tokens.begin() + n_edge);
+                cur->parent = mid.get();
 
-    int32_t n_ctx; // total context for all clients / slots
+                mid->children[cur->tokens[0]] = std::move(owner);
+                owner = std::move(mid);
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+                cur = owner.get();
+            }
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+            auto leaf = std::make_unique<node>();
+            leaf->tokens.assign(tokens.begin() + n, tokens.end());
+            leaf->parent      = cur;
+            leaf->seq_id      = seq_id;
+            leaf->t_last_used = ggml_time_us();
+            leaf->id_slot     = seq_id_src;
 
-    server_metrics metrics;
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, seq_id_src, seq_id, 0, tokens.size());
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+            leaves[seq_id - seq_id_base] = leaf.get();
+            cur->children[leaf->tokens[0]] = std::move(leaf);
 
-    ~server_context() {
-        if (ctx) {
-            llama_free(ctx);
-            ctx = nullptr;
+            n_tokens += tokens.size() - n;
         }
 
-        if (model) {
-            llama_free_model(model);
-            model = nullptr;
+        while (n_tokens > n_tokens_max) {
+            evict(ctx);
         }
+    }
 
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
+    // remove the least recently used prompt from the cache and free its KV cache sequence
+    bool evict(llama_context * ctx) {
+        node * lru = nullptr;
+        for (node * leaf : leaves) {
+            if (leaf != nullptr && (lru == nullptr || leaf->t_last_used < lru->t_last_used)) {
+                lru = leaf;
             }
         }
 
-        llama_batch_free(batch);
+        if (lru == nullptr) {
+            return false;
+        }
+
+        SRV_DBG("evicting prefix, seq_id = %d, n_tokens = %zu\n", lru->seq_id, lru->tokens.size());
+
+        if (callback_on_evict) {
+            callback_on_evict(lru->seq_id, tokens_of(lru));
+        }
+
+        llama_kv_cache_seq_rm(ctx, lru->seq_id, -1, -1);
+
+        leaves[lru->seq_id - seq_id_base] = nullptr;
+        n_tokens -= lru->tokens.size();
+
+        node * parent = lru->parent;
+        parent->children.erase(lru->tokens[0]);
+
+        // keep the tree compressed - merge an inner node with its only child
+        if (parent != &root && parent->children.size() == 1) {
+            std::unique_ptr<node> child = std::move(parent->children.begin()->second);
+
+            child->tokens.insert(child->tokens.begin(), parent->tokens.begin(), parent->tokens.end());
+            child->parent = parent->parent;
+
+            // replaces (and frees) the parent
+            child->parent->children[child->tokens[0]] = std::move(child);
+        }
+
+        return true;
+    }
+
+    void clear(llama_context * ctx) {
+        for (node * leaf : leaves) {
+            if (leaf != nullptr) {
+                llama_kv_cache_seq_rm(ctx, leaf->seq_id, -1, -1);
+            }
+        }
+
+        std::fill(leaves.begin(), leaves.end(), nullptr);
+        root.children.clear();
+
+        n_tokens = 0;
+    }
+};
+
+// tiered store for the KV state of idle prompts
+//
+// when the KV of a cached prompt is dropped (evicted from the prefix cache, or overwritten by a new prompt in its slot),
+// its cells are first parked in a KV cache sequence reserved for the spill - they are shared, nothing is copied. a
+// background thread copies the parked state into a bounded host memory pool as soon as the task loop releases the
+// context, and moves the least recently used states to the spill directory when the pool is full, so the task loop
+// waits neither for the copy nor for the disk. while a decode is in flight, the state stays parked: the task loop
+// only copies it itself when it needs the sequence for the next state, or the cells for a batch.
+// a state is restored into a slot when a new prompt shares a longer prefix with it than with anything in the KV cache
+struct server_kv_spill {
+    struct entry {
+        llama_tokens tokens;
+
+        size_t size = 0;
+
+        std::shared_ptr<uint8_t[]> data; // host memory tier, released once the state is on disk
+        std::string path;                // disk tier
+
+        bool parked  = false; // the cells are still in the KV cache, in seq_id_park
+        bool writing = false;
+        bool failed  = false;
+        bool removed = false;
+
+        int64_t t_last_used = -1;
+    };
+
+    std::vector<std::shared_ptr<entry>> entries;
+
+    size_t ram_max  = 0;
+    size_t disk_max = 0; // 0 = unlimited
+
+    std::string dir;
+
+    // a single state is parked at a time, the next store() copies it if the worker has not done it yet
+    llama_context * ctx = nullptr;
+    llama_seq_id seq_id_park = -1;
+    std::shared_ptr<entry> park;
+
+    // held by the task loop while it uses the context
+    std::mutex mutex_ctx;
+
+    // a decode is in flight on the context, copying the state would wait for it - the worker leaves the parked state
+    // alone until the task loop releases the context without a decode in flight
+    // set with mutex_ctx held, so the worker can read it with either mutex
+    bool decoding = false;
+
+    size_t ram_used   = 0;
+    size_t ram_queued = 0; // states in host memory that are being written to disk
+    size_t disk_used  = 0;
+
+    uint32_t n_files = 0;
+
+    uint64_t n_tokens_restored_total = 0;
+
+    // the worker enforces the budgets and writes the states to disk, under the mutex except for the file I/O
+    std::thread worker;
+    std::mutex mutex_entries;
+    std::condition_variable condition_write;
+    std::deque<std::pair<std::shared_ptr<entry>, std::string>> queue_write;
+    bool running = false;
+    bool balance = false; // the budgets need to be enforced
+
+    ~server_kv_spill() {
+        stop();
+
+        // the spilled states do not outlive the server
+        for (auto & e : entries) {
+            if (!e->path.empty()) {
+                std::remove(e->path.c_str());
+            }
+        }
+    }
+
+    // the worker uses the context - it must be stopped before the context is freed
+    void stop() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_entries);
+                running = false;
+            }
+            condition_write.notify_all();
+            worker.join();
+        }
+    }
+
+    void init(int32_t ram_mib, int32_t disk_mib, const std::string & path, llama_context * ctx_, llama_seq_id seq_id_park_) {
+        ram_max     = (size_t) ram_mib  * 1024 * 1024;
+        disk_max    = (size_t) disk_mib * 1024 * 1024;
+        dir         = path;
+        ctx         = ctx_;
+        seq_id_park = seq_id_park_;
+
+        if (!dir.empty()) {
+            if (dir.back() != DIRECTORY_SEPARATOR) {
+                dir += DIRECTORY_SEPARATOR;
+            }
+            if (!fs_create_directory_with_parents(dir)) {
+                SRV_WRN("failed to create the KV spill directory '%s', the states are only kept in host memory\n", dir.c_str());
+                dir.clear();
+            }
+        }
+
+        if (enabled()) {
+            running = true;
+            worker  = std::thread(&server_kv_spill::process, this);
+        }
+    }
+
+    bool enabled() const {
+        return ram_max > 0;
+    }
+
+    // keep the KV state of the first tokens.size() positions of seq_id
+    // the cells are parked on the calling thread - the worker copies them and takes care of the budgets and of the disk
+    void store(llama_seq_id seq_id, const llama_tokens & tokens) {
+        if (!enabled() || tokens.empty()) {
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_entries);
+
+            for (size_t i = 0; i < entries.size(); ) {
+                auto & e = entries[i];
+
+                const size_t n_lcp = longest_common_prefix(e->tokens, tokens);
+
+                if (n_lcp == tokens.size()) {
+                    // already stored as a part of a longer prompt
+                    e->t_last_used = ggml_time_us();
+                    return;
+                }
+
+                if (n_lcp == e->tokens.size()) {
+                    // the new state supersedes it
+                    erase_entry(i);
+                    continue;
+                }
+
+                i++;
+            }
+        }
+
+        auto e = std::make_shared<entry>();
+        e->tokens      = tokens;
+        e->t_last_used = ggml_time_us();
+
+        // the previous state is copied, if the worker has not done it yet
+        unpark();
+
+        SRV_DBG("parking state, seq_id = %d, n_tokens = %zu\n", seq_id, tokens.size());
+
+        llama_kv_cache_seq_rm(ctx, seq_id_park, -1, -1);
+        llama_kv_cache_seq_cp(ctx, seq_id, seq_id_park, 0, tokens.size());
+
+        e->parked = true;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_entries);
+
+            entries.push_back(e);
+            park = std::move(e);
+        }
+
+        condition_write.notify_one();
+    }
+
+    // called by the task loop, with mutex_ctx held
+    void set_decoding(bool value) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_entries);
+            decoding = value;
+        }
+
+        if (!value) {
+            condition_write.notify_one();
+        }
+    }
+
+    // copy the parked state to host memory and release its cells
+    // returns false if there was no parked state
+    // the caller must own the context: the task loop, or the worker with mutex_ctx held
+    bool unpark() {
+        std::shared_ptr<entry> e;
+        {
+            std::unique_lock<std::mutex> lock(mutex_entries);
+            e = std::move(park);
+            park.reset();
+        }
+
+        if (!e) {
+            return false;
+        }
+
+        const bool ok = !e->removed && copy(*e, seq_id_park);
+
+        llama_kv_cache_seq_rm(ctx, seq_id_park, -1, -1);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_entries);
+
+            e->parked = false;
+
+            if (!ok && !e->removed) {
+                erase_entry(std::find(entries.begin(), entries.end(), e) - entries.begin());
+            }
+
+            balance = true;
+        }
+
+        condition_write.notify_one();
+
+        return true;
+    }
+
+    // copy the state of seq_id into the host memory of the entry
+    bool copy(entry & e, llama_seq_id seq_id) {
+        const size_t size = llama_state_seq_get_size(ctx, seq_id);
+        if (size == 0 || size > ram_max) {
+            return false;
+        }
+
+        // not zero-initialized, the state is written over it
+        std::shared_ptr<uint8_t[]> data(new uint8_t[size]);
+        if (llama_state_seq_get_data(ctx, data.get(), size, seq_id) != size) {
+            SRV_WRN("failed to get the state of seq_id = %d\n", seq_id);
+            return false;
+        }
+
+        SRV_DBG("storing state, seq_id = %d, n_tokens = %zu, size = %zu\n", seq_id, e.tokens.size(), size);
+
+        std::unique_lock<std::mutex> lock(mutex_entries);
+
+        if (e.removed) {
+            return false;
+        }
+
+        e.size = size;
+        e.data = std::move(data);
+
+        ram_used += size;
+
+        return true;
+    }
+
+    // find the stored state that shares the longest prefix with the tokens
+    std::shared_ptr<entry> find(const llama_tokens & tokens, size_t & n_match) {
+        std::unique_lock<std::mutex> lock(mutex_entries);
+
+        std::shared_ptr<entry> res;
+
+        n_match = 0;
+
+        for (const auto & e : entries) {
+            const size_t n_lcp = longest_common_prefix(e->tokens, tokens);
+            if (n_lcp > n_match) {
+                n_match = n_lcp;
+                res     = e;
+            }
+        }
+
+        if (res) {
+            res->t_last_used = ggml_time_us();
+        }
+
+        return res;
+    }
+
+    // restore a stored state into seq_id, replacing its content
+    bool load(const entry & e, llama_seq_id seq_id) {
+        std::shared_ptr<uint8_t[]> data;
+        std::string path;
+        bool parked = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_entries);
+            data   = e.data;
+            path   = e.path;
+            parked = e.parked;
+        }
+
+        size_t nread = 0;
+
+        if (parked) {
+            // the cells are still in the KV cache
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, seq_id_park, seq_id, -1, -1);
+            return true;
+        }
+
+        if (data) {
+            nread = llama_state_seq_set_data(ctx, data.get(), e.size, seq_id);
+        } else if (!path.empty()) {
+            nread = load_file(ctx, path, seq_id);
+        }
+
+        return nread > 0;
+    }
+
+    static size_t load_file(llama_context * ctx, const std::string & path, llama_seq_id seq_id) {
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return 0;
+        }
+
+        std::vector<uint8_t> buf(file.tellg());
+        file.seekg(0);
+        if (!file.read((char *) buf.data(), buf.size())) {
+            return 0;
+        }
+
+        return llama_state_seq_set_data(ctx, buf.data(), buf.size(), seq_id);
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+
+        void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (addr == MAP_FAILED) {
+            return 0;
+        }
+
+        const size_t nread = llama_state_seq_set_data(ctx, (const uint8_t *) addr, st.st_size, seq_id);
+
+        munmap(addr, st.st_size);
+
+        return nread;
+#endif
+    }
+
+    void get_usage(size_t & ram, size_t & disk) {
+        std::unique_lock<std::mutex> lock(mutex_entries);
+        ram  = ram_used;
+        disk = disk_used;
+    }
+
+    // must be called with the mutex held
+    void erase_entry(size_t i) {
+        auto & e = entries[i];
+
+        e->removed = true;
+
+        // the writer takes care of the states that are being written
+        if (!e->writing) {
+            if (e->data) {
+                ram_used -= e->size;
+            }
+            if (!e->path.empty()) {
+                std::remove(e->path.c_str());
+                disk_used -= e->size;
+            }
+        }
+
+        entries.erase(entries.begin() + i);
+    }
+
+    // must be called with the mutex held
+    void enforce_budgets() {
+        // move the least recently used states out of host memory
+        while (ram_used - ram_queued > ram_max) {
+            int i_lru = -1;
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const auto & cur = entries[i];
+                if (cur->data && !cur->writing && (i_lru < 0 || cur->t_last_used < entries[i_lru]->t_last_used)) {
+                    i_lru = i;
+                }
+            }
+
+            if (i_lru < 0) {
+                break;
+            }
+
+            auto & lru = entries[i_lru];
+
+            if (dir.empty() || lru->failed || (disk_max > 0 && lru->size > disk_max)) {
+                erase_entry(i_lru);
+                continue;
+            }
+
+            lru->writing = true;
+            ram_queued += lru->size;
+
+            queue_write.emplace_back(lru, dir + "kv-spill-" + std::to_string(n_files++) + ".bin");
+        }
+
+        // drop the least recently used states from the disk
+        while (disk_max > 0 && disk_used > disk_max) {
+            int i_lru = -1;
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const auto & cur = entries[i];
+                if (!cur->path.empty() && (i_lru < 0 || cur->t_last_used < entries[i_lru]->t_last_used)) {
+                    i_lru = i;
+                }
+            }
+
+            if (i_lru < 0) {
+                break;
+            }
+
+            erase_entry(i_lru);
+        }
+    }
+
+    void process() {
+        std::unique_lock<std::mutex> lock(mutex_entries);
+
+        while (true) {
+            condition_write.wait(lock, [&]{
+                return !running || (park && !decoding) || balance || !queue_write.empty();
+            });
+
+            if (!running) {
+                return;
+            }
+
+            if (park && !decoding) {
+                lock.unlock();
+                {
+                    // wait for the task loop to release the context
+                    // it may have submitted a decode in the meantime, which the copy must not wait for
+                    std::unique_lock<std::mutex> lock_ctx(mutex_ctx);
+                    if (!decoding) {
+                        unpark();
+                    }
+                }
+                lock.lock();
+                continue;
+            }
+
+            if (balance) {
+                balance = false;
+                enforce_budgets();
+            }
+
+            if (queue_write.empty()) {
+                continue;
+            }
+
+            std::shared_ptr<entry> e = std::move(queue_write.front().first);
+            std::string path         = std::move(queue_write.front().second);
+            queue_write.pop_front();
+
+            lock.unlock();
+
+            // the data is not modified while the entry is being written
+            bool ok = false;
+            {
+                std::ofstream file(path, std::ios::binary);
+                ok = file.write((const char *) e->data.get(), e->size) && file.flush();
+            }
+
+            lock.lock();
+
+            e->writing = false;
+            ram_queued -= e->size;
+
+            if (!ok) {
+                SRV_WRN("failed to write KV state to %s\n", path.c_str());
+                std::remove(path.c_str());
+                e->failed = true;
+                if (e->removed) {
+                    ram_used -= e->size;
+                }
+                continue;
+            }
+
+            ram_used -= e->size;
+
+            if (e->removed) {
+                std::remove(path.c_str());
+            } else {
+                e->data.reset();
+                e->path = path;
+                disk_used += e->size;
+
+                // the state is now on the disk - it may be over the budget
+                enforce_budgets();
+            }
+        }
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running = true;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // callback functions
+    std::function<void(server_task)> callback_new_task;
+    std::function<void(void)>        callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (task.id == -1) {
+            task.id = id++;
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task.id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> & tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
+            queue_tasks_deferred.pop_front();
+        }
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = queue_tasks.front();
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (queue_tasks.empty()) {
+                    if (!running) {
+                        QUE_DBG("%s", "terminate\n");
+                        return;
+                    }
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+};
+
+struct server_response {
+    // for keeping track of all tasks waiting for the result
+    std::unordered_set<int> waiting_task_ids;
+
+    // the main result queue
+    std::vector<server_task_result> queue_results;
+
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
+            waiting_task_ids.insert(task.id);
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.erase(id_task);
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+            waiting_task_ids.erase(id_task);
+        }
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result recv(const std::unordered_set<int> & id_tasks) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_results.wait(lock, [&]{
+                return !queue_results.empty();
+            });
+
+            for (int i = 0; i < (int) queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
+                    server_task_result res = queue_results[i];
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+        }
+
+        // should never reach here
+    }
+
+    // single-task version of recv()
+    server_task_result recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
+
+    // Send a new result to a waiting id_task
+    void send(server_task_result & result) {
+        SRV_DBG("sending result for task id = %d\n", result.id);
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto & id_task : waiting_task_ids) {
+            if (result.id == id_task) {
+                SRV_DBG("task id = %d moved to result queue\n", result.id);
+
+                queue_results.push_back(std::move(result));
+                condition_results.notify_all();
+                return;
+            }
+        }
+    }
+};
+
+struct server_context {
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    std::vector<common_lora_adapter_container> loras;
+
+    std::shared_ptr<llama_model> model_ref; // the weights can be shared with the contexts of other models
+
+    common_params params;
+
+    llama_batch batch = {};
+
+    // steady-state generation: the next tokens of the generating slots are decoded in the background while the
+    // sampled ones are processed - the decode is waited for at the start of the next update (see gen_step)
+    bool gen_pending = false;
+    std::vector<server_slot *> gen_slots;
+
+    // speculative decoding
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
+
+    llama_batch batch_dft = {};
+
+    common_ngram_cache ngram_cache_static;
+    common_ngram_cache ngram_cache_dynamic; // the n-grams of the finished tasks, saved to params.lookup_cache_dynamic
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+    bool has_eos_token  = false;
+
+    int32_t n_ctx; // total context for all clients / slots
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    server_queue    queue_tasks;
+    server_response queue_results;
+
+    server_metrics metrics;
+
+    server_prefix_cache prefix_cache;
+    server_kv_spill     kv_spill;
+
+    // the released slots whose prompts are inserted in the prefix cache once no decode is in flight
+    // (copying the KV cells waits for the pending decode, see prefix_cache_flush)
+    std::vector<int> prefix_cache_pending;
+
+    // GBNF of the "json_schema" of the requests, by schema
+    // the grammars compiled from it are cached by libllama, so repeated schemas skip the conversion and the parsing
+    // the least recently used schema is evicted when the cache is full, like in the grammar cache of libllama
+    struct schema_grammar {
+        std::string grammar;
+        uint64_t    last_used;
+    };
+
+    static constexpr size_t schema_grammars_max = 256;
+
+    std::unordered_map<std::string, schema_grammar> schema_grammars;
+    uint64_t schema_grammars_n_used = 0;
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    ~server_context() {
+        kv_spill.stop();
+
+        if (!params.lookup_cache_dynamic.empty()) {
+            common_ngram_cache_save(ngram_cache_dynamic, params.lookup_cache_dynamic);
+        }
+
+        if (ctx) {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+
+        // the adapters belong to the model, which can outlive this context
+        for (auto & la : loras) {
+            llama_lora_adapter_free(la.adapter);
+        }
+        loras.clear();
+
+        model_ref.reset();
+        model = nullptr;
+
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            if (slot.smpl != nullptr) {
+                common_sampler_free(slot.smpl);
+            }
+        }
+
+        llama_batch_free(batch);
+        llama_batch_free(batch_dft);
     }
 
-    bool load_model(const common_params & params_) {
+    // load the model from params_.model, or create a context for the already loaded model_base
+    bool load_model(const common_params & params_, const std::shared_ptr<llama_model> & model_base = nullptr) {
         params = params_;
 
-        common_init_result llama_init = common_init_from_params(params);
+        // the prefix cache keeps its prompts in KV cache sequences of its own, after the ones of the slots, and the KV
+        // spill parks the states that it copies in the last sequence
+        {
+            int32_t n_seq = params.n_parallel;
+            if (params.n_prefix_cache > 0) {
+                n_seq += std::max(0, params.n_prefix_cache_seq);
+            }
+            if (params.n_kv_spill_ram > 0) {
+                n_seq += 1;
+            }
+            if (n_seq > params.n_parallel) {
+                params.n_seq_max = std::min(n_seq, LLAMA_MAX_PARALLEL_SEQUENCES);
+            }
+        }
+
+        common_init_result llama_init = model_base ? common_init_from_model(model_base.get(), params) : common_init_from_params(params);
 
         model = llama_init.model;
         ctx   = llama_init.context;
@@ -646,14 +1578,94 @@ struct server_context {
             return false;
         }
 
+        model_ref = model_base ? model_base : std::shared_ptr<llama_model>(model, llama_free_model);
+
         n_ctx = llama_n_ctx(ctx);
 
         add_bos_token = llama_add_bos_token(model);
         has_eos_token = !llama_add_eos_token(model);
 
+        // the rejected drafted tokens cannot be removed from the state of a recurrent model
+        if (llama_model_is_recurrent(model) && (!params.model_draft.empty() || params.draft_ngram)) {
+            SRV_WRN("%s", "speculative decoding is not supported by recurrent models, disabling it\n");
+
+            params.model_draft = "";
+            params.draft_ngram = false;
+        }
+
+        if (!params.model_draft.empty()) {
+            SRV_INF("loading draft model '%s'\n", params.model_draft.c_str());
+
+            common_params params_dft = params;
+
+            params_dft.model           = params.model_draft;
+            params_dft.model_url       = "";
+            params_dft.hf_repo         = "";
+            params_dft.hf_file         = "";
+            params_dft.n_gpu_layers    = params.n_gpu_layers_draft;
+            params_dft.cpuparams       = params.draft_cpuparams;
+            params_dft.cpuparams_batch = params.draft_cpuparams_batch;
+            params_dft.lora_adapters.clear();
+            params_dft.control_vectors.clear();
+
+            common_init_result llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model;
+            ctx_dft   = llama_init_dft.context;
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params.model_draft.c_str());
+                return false;
+            }
+
+            // the drafted tokens are verified by the target model as they are, so the vocabs must be the same
+            if (llama_vocab_type(model_dft) != llama_vocab_type(model) ||
+                llama_n_vocab   (model_dft) != llama_n_vocab   (model) ||
+                llama_token_bos (model_dft) != llama_token_bos (model) ||
+                llama_token_eos (model_dft) != llama_token_eos (model)) {
+                SRV_ERR("the vocab of the draft model '%s' does not match the vocab of the target model\n", params.model_draft.c_str());
+                return false;
+            }
+        }
+
+        if (!params.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = common_ngram_cache_load(params.lookup_cache_static);
+            } catch (const std::ifstream::failure &) {
+                SRV_ERR("failed to open static lookup cache: %s\n", params.lookup_cache_static.c_str());
+                return false;
+            }
+        }
+
+        if (!params.lookup_cache_dynamic.empty()) {
+            try {
+                ngram_cache_dynamic = common_ngram_cache_load(params.lookup_cache_dynamic);
+            } catch (const std::ifstream::failure &) {} // if the file does not exist it is created when the server stops
+
+            spec_prune_ngrams();
+        }
+
         return true;
     }
 
+    bool spec_enabled() const {
+        return ctx_dft != nullptr || params.draft_ngram;
+    }
+
+    // bound the n-grams of the finished tasks - they are pruned to 3/4 of the limit, so that the pruning does not
+    // run again at each release once the limit is reached
+    void spec_prune_ngrams() {
+        const size_t n_max = params.n_draft_ngram_max;
+
+        if (n_max > 0 && ngram_cache_dynamic.size() > n_max) {
+            const size_t n_prev = ngram_cache_dynamic.size();
+
+            common_ngram_cache_prune(ngram_cache_dynamic, 3*n_max/4);
+
+            SRV_DBG("pruned the n-gram cache, %zu -> %zu n-grams\n", n_prev, ngram_cache_dynamic.size());
+        }
+    }
+
     bool validate_model_chat_template() const {
         llama_chat_message chat[] = {{"user", "test"}};
 
@@ -678,7 +1690,22 @@ struct server_context {
 
             slot.sparams = params.sparams;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id_slot) {
+                server_slot & slot = slots[id_slot];
+
+                // make the prompt available to the other slots
+                // (the KV state computed with per-request adapters is only valid for the same adapters)
+                if (slot.params.cache_prompt && slot.params.lora.empty() && prefix_cache.enabled()) {
+                    prefix_cache_pending.push_back(slot.id);
+                }
+
+                // the n-gram drafter of the next tasks also drafts from the text of this one
+                if (!ctx_dft && !slot.ngram_cache.empty()) {
+                    common_ngram_cache_merge(ngram_cache_dynamic, slot.ngram_cache);
+                    slot.ngram_cache.clear();
+                    spec_prune_ngrams();
+                }
+
                 queue_tasks.pop_deferred_task();
             };
 
@@ -687,6 +1714,48 @@ struct server_context {
             slots.push_back(slot);
         }
 
+        // the sequence in which the KV spill parks the states, if there is one to spare
+        const llama_seq_id seq_id_park = params.n_kv_spill_ram > 0 && params.n_seq_max > params.n_parallel ? params.n_seq_max - 1 : -1;
+
+        // the cached prefixes are kept in the KV cache sequences that are not used by the slots
+        if (params.n_prefix_cache > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "prefix cache is not supported by recurrent models, disabling it\n");
+            } else {
+                prefix_cache.init(params.n_parallel, params.n_seq_max - params.n_parallel - (seq_id_park >= 0), params.n_prefix_cache);
+
+                SRV_INF("prefix cache enabled, n_tokens_max = %d, n_seq = %zu\n", params.n_prefix_cache, prefix_cache.leaves.size());
+            }
+        }
+
+        if (params.n_kv_spill_ram > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "KV spilling is not supported by recurrent models, disabling it\n");
+            } else if (seq_id_park < 0) {
+                // copying the state of a slot before its cells are overwritten would stall the task loop
+                SRV_WRN("KV spilling needs a KV cache sequence to park the states, but all %d are used by the slots, disabling it\n", LLAMA_MAX_PARALLEL_SEQUENCES);
+            } else {
+                kv_spill.init(params.n_kv_spill_ram, params.n_kv_spill_disk, params.kv_spill_path, ctx, seq_id_park);
+
+                // keep the state of the prompts that are evicted from the prefix cache
+                prefix_cache.callback_on_evict = [this](llama_seq_id seq_id, const llama_tokens & tokens) {
+                    kv_spill.store(seq_id, tokens);
+                };
+
+                SRV_INF("KV spilling enabled, ram = %d MiB, disk = %d MiB, path = '%s'\n", params.n_kv_spill_ram, params.n_kv_spill_disk, params.kv_spill_path.c_str());
+            }
+        }
+
+        SRV_INF("scheduler: policy = %s, n_budget = %d, n_chunk = %d\n", sched_policy_name(params.sched_policy), params.n_sched_budget, params.n_sched_chunk);
+
+        if (ctx_dft) {
+            SRV_INF("speculative decoding enabled, draft model = '%s', n_draft = %d\n", params.model_draft.c_str(), params.n_draft);
+
+            batch_dft = llama_batch_init(std::max(llama_n_batch(ctx_dft), (uint32_t) params.n_parallel), 0, 1);
+        } else if (params.draft_ngram) {
+            SRV_INF("speculative decoding enabled, n-gram lookup, n_draft = %d\n", params.n_draft);
+        }
+
         default_generation_settings_for_props = get_formated_generation(slots.front());
         default_generation_settings_for_props["seed"] = -1;
 
@@ -695,83 +1764,296 @@ struct server_context {
         {
             const int32_t n_batch = llama_n_batch(ctx);
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
+        }
+
+        metrics.init();
+    }
+
+    server_slot * get_slot_by_id(int id) {
+        for (server_slot & slot : slots) {
+            if (slot.id == id) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_available_slot(const server_task & task) {
+        server_slot * ret = nullptr;
+
+        // the prompts of all slots are in the prefix cache, so the prefix can be loaded in any slot
+        // prefer the slot that released the longest cached prefix, if it still holds it, to avoid the copy
+        if (ret == nullptr && prefix_cache.enabled()) {
+            const int id_slot = prefix_cache.find_slot(task.prompt_tokens);
+
+            if (id_slot >= 0 && !slots[id_slot].is_processing()) {
+                const size_t lcp_len = longest_common_prefix(slots[id_slot].cache_tokens, task.prompt_tokens);
+
+                if (lcp_len > 0) {
+                    ret = &slots[id_slot];
+
+                    SLT_DBG(*ret, "selected slot by prefix cache, lcp_len = %zu\n", lcp_len);
+                }
+            }
+        }
+
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f && !prefix_cache.enabled()) {
+            int lcs_len = 0;
+            float similarity = 0;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // skip the slot if it does not contains cached tokens
+                if (slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
+                int cur_lcs_len = longest_common_subsequence(slot.cache_tokens, task.prompt_tokens);
+
+                // fraction of the common subsequence length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+
+                // select the current slot if the criteria match
+                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
+                    lcs_len = cur_lcs_len;
+                    similarity = cur_similarity;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            }
+        }
+
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = ggml_time_us();
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last) {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    // number of prompt tokens that the slot has left to process
+    static int32_t get_n_prompt_left(const server_slot & slot) {
+        // the prompt of a started slot may still be truncated or reused from the cache - use the upper bound
+        return slot.state == SLOT_STATE_STARTED ? (int32_t) slot.prompt_tokens.size() : slot.n_prompt_tokens - slot.n_past;
+    }
+
+    // max number of prompt tokens of the slot in one iteration
+    int32_t get_sched_prompt_chunk(const server_slot & slot) const {
+        const int32_t n_left = get_n_prompt_left(slot);
+
+        return params.n_sched_chunk > 0 ? std::min(params.n_sched_chunk, n_left) : n_left;
+    }
+
+    // order in which the slots are scheduled in this iteration
+    std::vector<server_slot *> get_sched_order() {
+        std::vector<server_slot *> res;
+        for (server_slot & slot : slots) {
+            res.push_back(&slot);
+        }
+
+        // arrival order - the task ids are increasing
+        std::stable_sort(res.begin(), res.end(), [](const server_slot * a, const server_slot * b) {
+            return a->id_task < b->id_task;
+        });
+
+        if (params.sched_policy == COMMON_SCHED_POLICY_SHORTEST_FIRST) {
+            std::stable_sort(res.begin(), res.end(), [](const server_slot * a, const server_slot * b) {
+                return get_n_prompt_left(*a) < get_n_prompt_left(*b);
+            });
+        }
+
+        return res;
+    }
+
+    // draft up to n_draft_max tokens in total for the given slots, into slot.draft
+    void spec_draft(const std::vector<server_slot *> & slots_gen, int32_t n_draft_max) {
+        std::vector<server_slot *> slots_spec;
+        for (server_slot * slot : slots_gen) {
+            slot->draft.clear();
+
+            // the last token of spec_tokens is the sampled token, at position n_past
+            if (slot->params.n_draft > 0 && (int32_t) slot->spec_tokens.size() == slot->n_past + 1) {
+                slots_spec.push_back(slot);
+            }
+        }
+
+        if (slots_spec.empty() || n_draft_max < (int32_t) slots_spec.size()) {
+            return;
+        }
+
+        // max number of tokens to draft for each slot
+        std::vector<int32_t> n_max(slots_spec.size());
+        for (size_t j = 0; j < slots_spec.size(); ++j) {
+            const server_slot & slot = *slots_spec[j];
+
+            n_max[j] = std::min<int32_t>(slot.params.n_draft, n_draft_max / slots_spec.size());
+
+            // the drafted tokens must fit in the context of the slot
+            n_max[j] = std::min(n_max[j], slot.n_ctx - slot.n_past - 2);
+
+            // no need to draft more tokens than the slot is allowed to generate
+            if (slot.n_remaining > 0) {
+                n_max[j] = std::min(n_max[j], slot.n_remaining - 1);
+            }
+        }
+
+        if (!ctx_dft) {
+            for (size_t j = 0; j < slots_spec.size(); ++j) {
+                server_slot & slot = *slots_spec[j];
+
+                if (n_max[j] <= 0) {
+                    continue;
+                }
+
+                slot.draft.push_back(slot.spec_tokens.back());
+
+                common_ngram_cache_draft(slot.spec_tokens, slot.draft, n_max[j], LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                        slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+                slot.draft.erase(slot.draft.begin());
+            }
+
+            return;
+        }
+
+        const int32_t n_batch_dft = llama_n_batch(ctx_dft);
+        const int32_t n_vocab     = llama_n_vocab(model_dft);
+
+        // on failure, the KV cache of the draft model is cleared for all slots - the drafted tokens are still valid
+        auto decode_dft = [&]() {
+            if (batch_dft.n_tokens == 0) {
+                return true;
+            }
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                SRV_WRN("failed to decode the draft batch, n_tokens = %d\n", batch_dft.n_tokens);
+
+                for (server_slot * slot : slots_spec) {
+                    llama_kv_cache_seq_rm(ctx_dft, slot->id, -1, -1);
+                    slot->tokens_dft.clear();
+                }
+
+                return false;
+            }
+
+            return true;
+        };
+
+        common_batch_clear(batch_dft);
+
+        // bring the KV cache of the draft model up to date with all but the last token of each slot
+        for (server_slot * slot : slots_spec) {
+            size_t n_keep = std::min(longest_common_prefix(slot->tokens_dft, slot->spec_tokens), slot->spec_tokens.size() - 1);
+
+            if (!llama_kv_cache_seq_rm(ctx_dft, slot->id, n_keep, -1)) {
+                llama_kv_cache_seq_rm(ctx_dft, slot->id, -1, -1);
+                n_keep = 0;
+            }
+
+            slot->tokens_dft.resize(n_keep);
+
+            for (size_t i = n_keep; i + 1 < slot->spec_tokens.size(); ++i) {
+                if (batch_dft.n_tokens == n_batch_dft) {
+                    if (!decode_dft()) {
+                        return;
+                    }
+                    common_batch_clear(batch_dft);
+                }
+
+                common_batch_add(batch_dft, slot->spec_tokens[i], i, { slot->id }, false);
+                slot->tokens_dft.push_back(slot->spec_tokens[i]);
+            }
         }
 
-        metrics.init();
-    }
-
-    server_slot * get_slot_by_id(int id) {
-        for (server_slot & slot : slots) {
-            if (slot.id == id) {
-                return &slot;
+        if (batch_dft.n_tokens + (int32_t) slots_spec.size() > n_batch_dft) {
+            if (!decode_dft()) {
+                return;
             }
+            common_batch_clear(batch_dft);
         }
 
-        return nullptr;
-    }
+        // draft greedily, one token of every slot per decode
+        std::vector<int32_t> i_batch_dft(slots_spec.size(), -1);
 
-    server_slot * get_available_slot(const server_task & task) {
-        server_slot * ret = nullptr;
+        while (true) {
+            for (size_t j = 0; j < slots_spec.size(); ++j) {
+                server_slot & slot = *slots_spec[j];
 
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
-            float similarity = 0;
+                i_batch_dft[j] = -1;
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
+                if ((int32_t) slot.draft.size() >= n_max[j]) {
                     continue;
                 }
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
+                const llama_token id  = slot.draft.empty() ? slot.spec_tokens.back() : slot.draft.back();
+                const llama_pos   pos = slot.spec_tokens.size() - 1 + slot.draft.size();
+
+                // stop drafting after the end of generation
+                if (!slot.draft.empty() && llama_token_is_eog(model_dft, id)) {
                     continue;
                 }
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = longest_common_subsequence(slot.cache_tokens, task.prompt_tokens);
+                i_batch_dft[j] = batch_dft.n_tokens;
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+                common_batch_add(batch_dft, id, pos, { slot.id }, true);
+                slot.tokens_dft.push_back(id);
+            }
 
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
-                    ret = &slot;
-                }
+            if (batch_dft.n_tokens == 0) {
+                break;
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            if (!decode_dft()) {
+                return;
             }
-        }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = ggml_time_us();
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
+            for (size_t j = 0; j < slots_spec.size(); ++j) {
+                if (i_batch_dft[j] < 0) {
                     continue;
                 }
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
+                const float * logits = llama_get_logits_ith(ctx_dft, i_batch_dft[j]);
+
+                llama_token id = 0;
+                for (llama_token v = 1; v < n_vocab; ++v) {
+                    if (logits[v] > logits[id]) {
+                        id = v;
+                    }
                 }
-            }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+                slots_spec[j]->draft.push_back(id);
             }
-        }
 
-        return ret;
+            common_batch_clear(batch_dft);
+        }
     }
 
     bool launch_slot_with_task(server_slot & slot, const server_task & task) {
@@ -792,6 +2074,7 @@ struct server_context {
         slot.params.cache_prompt        = json_value(data, "cache_prompt",       false);
         slot.params.n_predict           = json_value(data, "n_predict",          json_value(data, "max_tokens", default_params.n_predict));
         slot.params.n_indent            = json_value(data, "n_indent",           default_params.n_indent);
+        slot.params.n_draft             = json_value(data, "n_draft",            spec_enabled() ? params.n_draft : 0);
         slot.sparams.top_k              = json_value(data, "top_k",              default_sparams.top_k);
         slot.sparams.top_p              = json_value(data, "top_p",              default_sparams.top_p);
         slot.sparams.min_p              = json_value(data, "min_p",              default_sparams.min_p);
@@ -847,8 +2130,28 @@ struct server_context {
         }
         if (data.contains("json_schema") && !data.contains("grammar")) {
             try {
-                auto schema          = json_value(data, "json_schema", json::object());
-                slot.sparams.grammar = json_schema_to_grammar(schema);
+                const auto schema     = json_value(data, "json_schema", json::object());
+                const auto schema_str = schema.dump();
+
+                auto it = schema_grammars.find(schema_str);
+                if (it == schema_grammars.end()) {
+                    std::string grammar = json_schema_to_grammar(schema);
+
+                    if (schema_grammars.size() >= schema_grammars_max) {
+                        auto lru = schema_grammars.begin();
+                        for (auto jt = schema_grammars.begin(); jt != schema_grammars.end(); ++jt) {
+                            if (jt->second.last_used < lru->second.last_used) {
+                                lru = jt;
+                            }
+                        }
+                        schema_grammars.erase(lru);
+                    }
+
+                    it = schema_grammars.emplace(schema_str, schema_grammar { std::move(grammar), 0 }).first;
+                }
+                it->second.last_used = ++schema_grammars_n_used;
+
+                slot.sparams.grammar = it->second.grammar;
             } catch (const std::exception & e) {
                 send_error(task, std::string("\"json_schema\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
                 return false;
@@ -857,6 +2160,37 @@ struct server_context {
             slot.sparams.grammar = json_value(data, "grammar", default_sparams.grammar);
         }
 
+        // per-request adapters, applied to the tokens of this slot only
+        slot.params.lora.clear();
+        if (data.contains("lora") && !data.at("lora").is_null()) {
+            if (params.flash_attn) {
+                send_error(task, "Error: per-request LoRA adapters are not supported with flash attention", ERROR_TYPE_NOT_SUPPORTED);
+                return false;
+            }
+
+            const auto & lora = data.at("lora");
+            if (!lora.is_array()) {
+                send_error(task, "Error: \"lora\" must be an array of objects with \"id\" and \"scale\"", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+
+            for (const auto & entry : lora) {
+                const int   id    = json_value(entry, "id",    -1);
+                const float scale = json_value(entry, "scale", 1.0f);
+
+                if (id < 0 || id >= (int) loras.size()) {
+                    send_error(task, "Error: invalid adapter id " + std::to_string(id), ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+
+                if (scale != 0.0f) {
+                    slot.params.lora.emplace_back(id, scale);
+                }
+            }
+
+            std::sort(slot.params.lora.begin(), slot.params.lora.end());
+        }
+
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
             // Might be better to reject the request with a 400 ?
             slot.params.n_predict = slot.n_predict;
@@ -949,12 +2283,208 @@ struct server_context {
         return true;
     }
 
+    // insert the prompts of the released slots in the prefix cache
+    // the slots keep their KV cells until they are launched again, which happens after a flush
+    void prefix_cache_flush() {
+        for (int id_slot : prefix_cache_pending) {
+            const server_slot & slot = slots[id_slot];
+
+            prefix_cache.insert(ctx, slot.cache_tokens, slot.id);
+        }
+        prefix_cache_pending.clear();
+    }
+
     void kv_cache_clear() {
         SRV_DBG("%s", "clearing KV cache\n");
 
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
+        prefix_cache.clear(ctx);
+        prefix_cache_pending.clear();
         clean_kv_cache = false;
+
+        if (ctx_dft) {
+            llama_kv_cache_clear(ctx_dft);
+
+            for (server_slot & slot : slots) {
+                slot.tokens_dft.clear();
+            }
+        }
+    }
+
+    // sample the next token of the slot from the outputs at index idx of the last batch
+    completion_token_output sample_token(server_slot & slot, int32_t idx) {
+        completion_token_output result;
+        const llama_token id = common_sampler_sample(slot.smpl, ctx, idx);
+
+        common_sampler_accept(slot.smpl, id, true);
+
+        slot.n_decoded += 1;
+        if (slot.n_decoded == 1) {
+            slot.t_start_generation = ggml_time_us();
+            slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+            metrics.on_prompt_eval(slot);
+            slot.t_last_token = slot.t_start_generation;
+        } else {
+            const int64_t t_now = ggml_time_us();
+            metrics.on_token_sampled(t_now - slot.t_last_token);
+            slot.t_last_token = t_now;
+        }
+
+        result.tok = id;
+
+        const auto * cur_p = common_sampler_get_candidates(slot.smpl);
+
+        for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
+            result.probs.push_back({
+                cur_p->data[i].id,
+                i >= cur_p->size ? 0.0f : cur_p->data[i].p,
+            });
+        }
+
+        if (!slot.spec_tokens.empty()) {
+            slot.spec_tokens.push_back(id);
+
+            if (!ctx_dft) {
+                common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_tokens, 1, false);
+            }
+        }
+
+        return result;
+    }
+
+    // steady-state generation: sample the next tokens of the slots from the outputs of the last batch, which starts
+    // at index i0 of the batch of the slots, and process them - when nothing else has to be scheduled, the sampled
+    // tokens are first submitted for decoding, so that the next step is computed while they are detokenized,
+    // checked for stop strings and sent
+    void gen_step(const std::vector<server_slot *> & slots_out, int32_t i0) {
+        std::vector<completion_token_output> results;
+        results.reserve(slots_out.size());
+
+        for (server_slot * slot : slots_out) {
+            results.push_back(sample_token(*slot, slot->i_batch - i0));
+            slot->i_batch = -1;
+        }
+
+        gen_pending = gen_submit(slots_out, results);
+        kv_spill.set_decoding(gen_pending);
+
+        for (size_t k = 0; k < slots_out.size(); ++k) {
+            server_slot & slot = *slots_out[k];
+
+            // a slot that stops here keeps its submitted token in the KV cache - it is also in its cache_tokens
+            if (!process_token(results[k], slot)) {
+                // release slot because of stop condition
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+            }
+        }
+    }
+
+    // submit the sampled tokens for decoding if the next update would decode exactly them
+    bool gen_submit(const std::vector<server_slot *> & slots_out, const std::vector<completion_token_output> & results) {
+        const int32_t n_batch  = llama_n_batch(ctx);
+        const int32_t n_budget = params.n_sched_budget > 0 ? std::min(params.n_sched_budget, n_batch) : n_batch;
+
+        if (spec_enabled() || slots_out.empty() || (int32_t) slots_out.size() > n_budget) {
+            return false;
+        }
+
+        // the prompts and the deferred slots are scheduled by update_slots
+        int32_t n_generating = 0;
+        for (const server_slot & slot : slots) {
+            if (slot.state == SLOT_STATE_STARTED || slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_DONE_PROMPT) {
+                return false;
+            }
+            n_generating += slot.state == SLOT_STATE_GENERATING;
+        }
+
+        if (n_generating != (int32_t) slots_out.size()) {
+            return false;
+        }
+
+        // so is the context shift
+        for (const server_slot * slot : slots_out) {
+            if (slot->n_past + 1 >= slot->n_ctx) {
+                return false;
+            }
+        }
+
+        common_batch_clear(batch);
+
+        for (size_t k = 0; k < slots_out.size(); ++k) {
+            common_batch_add(batch, results[k].tok, slots_out[k]->n_past, { slots_out[k]->id }, true);
+        }
+
+        if (llama_decode_async(ctx, batch) != 0) {
+            return false;
+        }
+
+        for (size_t k = 0; k < slots_out.size(); ++k) {
+            server_slot & slot = *slots_out[k];
+
+            slot.i_batch = k;
+            slot.n_past += 1;
+
+            if (slot.params.cache_prompt) {
+                slot.cache_tokens.push_back(results[k].tok);
+            }
+        }
+
+        metrics.n_sched_decode_tokens_total += batch.n_tokens;
+
+        gen_slots = slots_out;
+
+        SRV_DBG("submitted generation step, n_tokens = %d\n", batch.n_tokens);
+
+        return true;
+    }
+
+    // wait for the generation step submitted by gen_step and process its outputs
+    void gen_wait() {
+        gen_pending = false;
+
+        const int ret = llama_decode_wait(ctx);
+        kv_spill.set_decoding(false);
+        metrics.on_decoded(slots);
+
+        if (ret != 0) {
+            SRV_WRN("failed to decode the generation step, ret = %d - the tokens are decoded again\n", ret);
+        }
+
+        std::vector<server_slot *> slots_out;
+
+        for (server_slot * slot : gen_slots) {
+            if (ret != 0) {
+                // undo the submission - the sampled token of the slot is added to the next batch instead
+                slot->n_past -= 1;
+
+                if (slot->params.cache_prompt && !slot->cache_tokens.empty()) {
+                    slot->cache_tokens.pop_back();
+                }
+
+                llama_kv_cache_seq_rm(ctx, slot->id, slot->n_past, -1);
+
+                slot->i_batch = -1;
+                continue;
+            }
+
+            // the slots that were stopped or cancelled meanwhile
+            if (slot->state != SLOT_STATE_GENERATING || slot->i_batch < 0) {
+                slot->i_batch = -1;
+                continue;
+            }
+
+            slots_out.push_back(slot);
+        }
+
+        gen_slots.clear();
+
+        if (!slots_out.empty()) {
+            gen_step(slots_out, 0);
+        }
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
@@ -1122,6 +2652,11 @@ struct server_context {
             samplers.emplace_back(common_sampler_type_to_str(sampler));
         }
 
+        json lora = json::array();
+        for (const auto & [id, scale] : slot.params.lora) {
+            lora.push_back({{"id", id}, {"scale", scale}});
+        }
+
         return json {
             {"n_ctx",                     slot.n_ctx},
             {"n_predict",                 slot.n_predict},     // Server configured n_predict
@@ -1161,6 +2696,7 @@ struct server_context {
             {"min_keep",                  slot.sparams.min_keep},
             {"grammar",                   slot.sparams.grammar},
             {"samplers",                  samplers},
+            {"lora",                      lora},
         };
     }
 
@@ -1497,6 +3033,13 @@ struct server_context {
     //
 
     void process_single_task(server_task task) {
+        std::unique_lock<std::mutex> lock_ctx(kv_spill.mutex_ctx);
+
+        // with a generation step in flight, the released prompts are inserted at the start of the next update
+        if (!gen_pending) {
+            prefix_cache_flush();
+        }
+
         switch (task.type) {
             case SERVER_TASK_TYPE_INFERENCE:
                 {
@@ -1567,6 +3110,10 @@ struct server_context {
                             {"stopping_word",  slot.stopping_word},
                         };
 
+                        if (spec_enabled()) {
+                            slot_data["speculative"] = slot.get_formated_speculative();
+                        }
+
                         if (slot.is_processing()) {
                             n_processing_slots++;
                         } else {
@@ -1577,6 +3124,10 @@ struct server_context {
                     }
                     SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
 
+                    size_t kv_spill_ram  = 0;
+                    size_t kv_spill_disk = 0;
+                    kv_spill.get_usage(kv_spill_ram, kv_spill_disk);
+
                     server_task_result res;
                     res.id       = task.id;
                     res.stop     = true;
@@ -1600,9 +3151,28 @@ struct server_context {
                         { "n_decode_total",                  metrics.n_decode_total},
                         { "n_busy_slots_total",              metrics.n_busy_slots_total},
 
+                        { "sched_policy",                    sched_policy_name(params.sched_policy)},
+                        { "n_sched_decode_tokens_total",     metrics.n_sched_decode_tokens_total},
+                        { "n_sched_prompt_tokens_total",     metrics.n_sched_prompt_tokens_total},
+                        { "n_sched_decode_deferred_total",   metrics.n_sched_decode_deferred_total},
+                        { "n_sched_prompt_chunked_total",    metrics.n_sched_prompt_chunked_total},
+                        { "n_draft_total",                   metrics.n_draft_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
+
+                        { "n_itl",                           metrics.n_itl},
+                        { "t_itl",                           metrics.t_itl},
+                        { "t_itl_max",                       metrics.t_itl_max},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
+                        { "n_prefix_cache_tokens",           prefix_cache.n_tokens},
+                        { "n_prefix_cache_hit_total",        prefix_cache.n_tokens_hit_total},
+
+                        { "kv_spill_ram_bytes",              kv_spill_ram},
+                        { "kv_spill_disk_bytes",             kv_spill_disk},
+                        { "n_kv_spill_restored_total",       kv_spill.n_tokens_restored_total},
+
                         { "slots",                           slots_data },
                     };
 
@@ -1744,6 +3314,16 @@ struct server_context {
     }
 
     void update_slots() {
+        std::unique_lock<std::mutex> lock_ctx(kv_spill.mutex_ctx);
+
+        // the generation step that was decoded in the background since the last update
+        if (gen_pending) {
+            gen_wait();
+        }
+
+        // before the prompts of this update are matched against the cache and before the slots are reused
+        prefix_cache_flush();
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -1775,6 +3355,11 @@ struct server_context {
             queue_tasks.post(task);
         }
 
+        // the next generation step is being decoded
+        if (gen_pending) {
+            return;
+        }
+
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
@@ -1788,14 +3373,24 @@ struct server_context {
                 }
 
                 // Shift context
-                const int n_keep    = slot.params.n_keep + add_bos_token;
+                const bool stream = params.ctx_shift_stream > 0;
+
+                // streaming: the first tokens are kept as attention sinks and a small block of tokens is evicted
+                const int n_keep    = stream ? std::max(slot.params.n_keep + add_bos_token, 4) : slot.params.n_keep + add_bos_token;
                 const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                const int n_discard = slot.params.n_discard ? slot.params.n_discard : stream ? std::min(params.ctx_shift_stream, n_left / 2) : (n_left / 2);
 
-                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+                if (stream) {
+                    SLT_DBG(slot, "slot context shift (stream), n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
-                llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                    // only the RoPE of the sinks is re-computed, the other tokens are moved lazily
+                    llama_kv_cache_seq_stream(ctx, slot.id, n_keep, n_discard);
+                } else {
+                    SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+
+                    llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
+                    llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                }
 
                 if (slot.params.cache_prompt) {
                     for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
@@ -1805,6 +3400,16 @@ struct server_context {
                     slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
                 }
 
+                if (!slot.spec_tokens.empty()) {
+                    slot.spec_tokens.erase(slot.spec_tokens.begin() + n_keep, slot.spec_tokens.begin() + n_keep + n_discard);
+
+                    // the n-gram cache can only be appended to, so it is rebuilt
+                    if (!ctx_dft) {
+                        slot.ngram_cache.clear();
+                        common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_tokens, slot.spec_tokens.size(), false);
+                    }
+                }
+
                 slot.n_past -= n_discard;
 
                 slot.truncated = true;
@@ -1814,12 +3419,50 @@ struct server_context {
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
+        // process in chunks of params.n_batch
+        int32_t n_batch  = llama_n_batch(ctx);
+        int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        // max number of tokens to decode in this iteration - the prompts are processed in chunks that fit in it
+        const int32_t n_budget = params.n_sched_budget > 0 ? std::min(params.n_sched_budget, n_batch) : n_batch;
+
+        const std::vector<server_slot *> order = get_sched_order();
+
+        // tokens reserved for the prompts of the slots that are ahead in the order (FCFS only)
+        int32_t n_reserved = 0;
+
         // frist, add sampled tokens from any ongoing sequences
-        for (auto & slot : slots) {
+        std::vector<server_slot *> slots_gen;
+
+        for (server_slot * pslot : order) {
+            server_slot & slot = *pslot;
+
+            if (params.sched_policy == COMMON_SCHED_POLICY_FCFS && (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED)) {
+                n_reserved += get_sched_prompt_chunk(slot);
+                continue;
+            }
+
             if (slot.state != SLOT_STATE_GENERATING) {
                 continue;
             }
 
+            if ((int32_t) slots_gen.size() + n_reserved >= n_budget) {
+                // the budget is taken by older requests - wait for the next iteration
+                metrics.n_sched_decode_deferred_total++;
+                continue;
+            }
+
+            slots_gen.push_back(&slot);
+        }
+
+        // draft the next tokens of the generating slots with the rest of the budget
+        if (spec_enabled()) {
+            spec_draft(slots_gen, n_budget - n_reserved - (int32_t) slots_gen.size());
+        }
+
+        for (server_slot * pslot : slots_gen) {
+            server_slot & slot = *pslot;
+
             slot.i_batch = batch.n_tokens;
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
@@ -1830,13 +3473,16 @@ struct server_context {
                 slot.cache_tokens.push_back(slot.sampled);
             }
 
-            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, truncated = %d\n",
-                    slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), slot.truncated);
+            // the drafted tokens follow the sampled token and are verified after the decode
+            for (size_t k = 0; k < slot.draft.size(); ++k) {
+                common_batch_add(batch, slot.draft[k], slot.n_past + k, { slot.id }, true);
+            }
+
+            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, n_draft = %d, truncated = %d\n",
+                    slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), (int) slot.draft.size(), slot.truncated);
         }
 
-        // process in chunks of params.n_batch
-        int32_t n_batch  = llama_n_batch(ctx);
-        int32_t n_ubatch = llama_n_ubatch(ctx);
+        metrics.n_sched_decode_tokens_total += batch.n_tokens;
 
         // track if this is an embedding or non-embedding batch
         // if we've added sampled tokens above, we are in non-embedding mode
@@ -1844,9 +3490,11 @@ struct server_context {
         // TODO: make enum
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
-        // next, batch any pending prompts without exceeding n_batch
+        // next, batch any pending prompts without exceeding the budget
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (server_slot * pslot : order) {
+                server_slot & slot = *pslot;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     auto & prompt_tokens = slot.prompt_tokens;
@@ -1939,7 +3587,78 @@ struct server_context {
                                 GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
                             }
 
-                            if (slot.params.cache_prompt) {
+                            // switch the adapters of the slot sequence - the cached tokens were computed with other weights
+                            if (slot.lora_cache != slot.params.lora) {
+                                SLT_INF(slot, "switching per-request adapters, n_lora = %zu\n", slot.params.lora.size());
+
+                                llama_lora_adapter_seq_clear(ctx, slot.id);
+                                for (const auto & [id, scale] : slot.params.lora) {
+                                    llama_lora_adapter_seq_set(ctx, loras[id].adapter, slot.id, scale);
+                                }
+
+                                slot.lora_cache = slot.params.lora;
+                                slot.cache_tokens.clear();
+                            }
+
+                            // the prefix cache and the spilled states are shared by all requests - only use them without adapters
+                            const bool use_shared_cache = slot.params.lora.empty();
+
+                            if (slot.params.cache_prompt) {
+                                size_t n_slot = longest_common_prefix(slot.cache_tokens, prompt_tokens);
+
+                                // the rest of the slot is about to be overwritten - keep its state unless the prefix cache has it
+                                if (use_shared_cache && !prefix_cache.enabled() && n_slot < slot.cache_tokens.size()) {
+                                    kv_spill.store(slot.id, slot.cache_tokens);
+                                }
+
+                                // load a longer prefix from the prefix cache, if any
+                                llama_seq_id seq_id_cache = -1;
+
+                                const size_t n_cached = use_shared_cache ? prefix_cache.find(prompt_tokens, seq_id_cache) : 0;
+
+                                if (n_cached > n_slot) {
+                                    SLT_INF(slot, "loading %zu prompt tokens from the prefix cache, seq_id = %d\n", n_cached, seq_id_cache);
+
+                                    llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                                    llama_kv_cache_seq_cp(ctx, seq_id_cache, slot.id, 0, n_cached);
+
+                                    slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_cached);
+
+                                    prefix_cache.n_tokens_hit_total += n_cached;
+
+                                    n_slot = n_cached;
+                                }
+
+                                // restore a spilled state that shares a longer prefix, if any
+                                if (use_shared_cache && kv_spill.enabled()) {
+                                    size_t n_spilled = 0;
+
+                                    const auto spilled = kv_spill.find(prompt_tokens, n_spilled);
+
+                                    // the whole state is restored - copying it is much cheaper than evaluating the
+                                    // tokens, but do not restore a long state to reuse a few tokens
+                                    if (n_spilled > n_slot && 4*n_spilled >= spilled->tokens.size()) {
+                                        SLT_INF(slot, "restoring %zu tokens of spilled KV state, n_match = %zu\n", spilled->tokens.size(), n_spilled);
+
+                                        // make room in the KV cache if needed
+                                        bool ok = kv_spill.load(*spilled, slot.id);
+                                        while (!ok && (kv_spill.unpark() || prefix_cache.evict(ctx))) {
+                                            ok = kv_spill.load(*spilled, slot.id);
+                                        }
+
+                                        if (ok) {
+                                            slot.cache_tokens = spilled->tokens;
+
+                                            kv_spill.n_tokens_restored_total += n_spilled;
+                                        } else {
+                                            SLT_WRN(slot, "%s", "failed to restore the spilled KV state\n");
+
+                                            // the state of the slot is cleared on failure
+                                            slot.cache_tokens.clear();
+                                        }
+                                    }
+                                }
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = longest_common_prefix(slot.cache_tokens, prompt_tokens);
 
@@ -2033,7 +3752,11 @@ struct server_context {
                     slot.cache_tokens.resize(slot.n_past);
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    // non-causal tasks cannot be split, their prompt is checked to fit in n_batch above
+                    const int32_t n_max   = slot_type == 1 ? n_batch : n_budget;
+                    const int32_t n_chunk = slot_type == 1 ? slot.n_prompt_tokens : get_sched_prompt_chunk(slot);
+
+                    for (int32_t i = 0; i < n_chunk && slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_max; ++i) {
                         common_batch_add(batch, prompt_tokens[slot.n_past], slot.n_past, { slot.id }, false);
 
                         if (slot.params.cache_prompt) {
@@ -2042,6 +3765,13 @@ struct server_context {
 
                         slot.n_prompt_tokens_processed++;
                         slot.n_past++;
+
+                        metrics.n_sched_prompt_tokens_total++;
+                    }
+
+                    if (slot.n_past < slot.n_prompt_tokens) {
+                        // the rest of the prompt is processed in the next iterations
+                        metrics.n_sched_prompt_chunked_total++;
                     }
 
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
@@ -2062,6 +3792,15 @@ struct server_context {
                         // extract the logits only for the last token
                         batch.logits[batch.n_tokens - 1] = true;
 
+                        if (slot.params.n_draft > 0 && slot.inf_type == SERVER_TASK_INF_TYPE_COMPLETION) {
+                            slot.spec_tokens = prompt_tokens;
+
+                            if (!ctx_dft) {
+                                slot.ngram_cache.clear();
+                                common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_tokens, slot.spec_tokens.size(), false);
+                            }
+                        }
+
                         slot.n_decoded = 0;
                         slot.i_batch   = batch.n_tokens - 1;
 
@@ -2069,7 +3808,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_budget) {
                     break;
                 }
             }
@@ -2085,11 +3824,11 @@ struct server_context {
         // make sure we're in the right embedding mode
         llama_set_embeddings(ctx, batch_type == 1);
 
-        // process the created batch of tokens
-        for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
-            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+        // slots with drafted tokens in more than one view of the batch
+        std::vector<server_slot *> slots_draft_split;
 
-            llama_batch batch_view = {
+        auto get_view = [&](int32_t i, int32_t n_tokens) {
+            return llama_batch {
                 n_tokens,
                 batch.token    + i,
                 nullptr,
@@ -2098,11 +3837,31 @@ struct server_context {
                 batch.seq_id   + i,
                 batch.logits   + i,
             };
+        };
+
+        // the next view is decoded asynchronously while the outputs of the current view are processed
+        bool next_submitted = false;
+
+        // process the created batch of tokens
+        for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
+            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
 
-            const int ret = llama_decode(ctx, batch_view);
+            llama_batch batch_view = get_view(i, n_tokens);
+
+            const int ret = next_submitted ? llama_decode_wait(ctx) : llama_decode(ctx, batch_view);
             metrics.on_decoded(slots);
 
+            next_submitted = false;
+
             if (ret != 0) {
+                // the parked state or the prefix cache may be holding the KV cells that are needed - release them first
+                if (ret == 1 && (kv_spill.unpark() || prefix_cache.evict(ctx))) {
+                    SRV_WRN("failed to find free space in the KV cache, evicted a cached prefix and retrying, i = %d, n_batch = %d\n", i, n_batch);
+
+                    i -= n_batch;
+                    continue;
+                }
+
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
@@ -2122,6 +3881,29 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // the outputs of this view stay readable until the next one is waited for
+            if (i + n_tokens < batch.n_tokens) {
+                const int32_t n_tokens_next = std::min(n_batch, batch.n_tokens - i - n_tokens);
+
+                next_submitted = llama_decode_async(ctx, get_view(i + n_tokens, n_tokens_next)) == 0;
+            } else if (!spec_enabled()) {
+                // the last view: if all its outputs are of generating slots, their next step can be pipelined
+                std::vector<server_slot *> slots_out;
+                bool steady = true;
+
+                for (auto & slot : slots) {
+                    if (slot.i_batch >= (int) i && slot.i_batch < (int) (i + n_tokens)) {
+                        steady &= slot.state == SLOT_STATE_GENERATING;
+                        slots_out.push_back(&slot);
+                    }
+                }
+
+                if (steady && !slots_out.empty()) {
+                    gen_step(slots_out, i);
+                    break;
+                }
+            }
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2149,30 +3931,60 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = common_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+                // the drafted tokens follow the sampled token in the batch - a drafted token is accepted when it is
+                // the token sampled from the logits of the previous position, so the output does not change
+                const int32_t n_draft = slot.draft.size();
+                const int32_t n_check = std::min(n_draft, i + n_tokens - 1 - slot.i_batch);
+
+                if (n_check < n_draft) {
+                    // the rest of the draft is decoded in the next view and has to be removed after it
+                    slots_draft_split.push_back(&slot);
+                }
+
+                int32_t n_accepted = 0;
+                bool    stop       = false;
+
+                for (int32_t k = 0; k <= n_check; ++k) {
+                    completion_token_output result = sample_token(slot, slot.i_batch - i + k);
+
+                    const llama_token id = result.tok;
+
+                    if (!process_token(result, slot)) {
+                        stop = true;
+                        break;
+                    }
+
+                    if (k == n_check || id != slot.draft[k]) {
+                        break;
+                    }
+
+                    // the drafted token is already in the KV cache
+                    slot.n_past += 1;
 
-                common_sampler_accept(slot.smpl, id, true);
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.push_back(id);
+                    }
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+                    n_accepted++;
                 }
 
-                result.tok = id;
+                if (n_draft > 0) {
+                    // remove the rejected tokens from the KV cache
+                    llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
 
-                const auto * cur_p = common_sampler_get_candidates(slot.smpl);
+                    slot.n_draft                += n_draft;
+                    slot.n_draft_accepted       += n_accepted;
+                    slot.n_draft_total          += n_draft;
+                    slot.n_draft_accepted_total += n_accepted;
 
-                for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
-                    result.probs.push_back({
-                        cur_p->data[i].id,
-                        i >= cur_p->size ? 0.0f : cur_p->data[i].p,
-                    });
+                    metrics.on_draft_verified(n_draft, n_accepted);
+
+                    SLT_DBG(slot, "draft verified, n_draft = %d, n_accepted = %d, n_past = %d\n", n_draft, n_accepted, slot.n_past);
+
+                    slot.draft.clear();
                 }
 
-                if (!process_token(result, slot)) {
+                if (stop) {
                     // release slot because of stop condition
                     slot.release();
                     slot.print_timings();
@@ -2184,6 +3996,10 @@ struct server_context {
             }
         }
 
+        for (server_slot * slot : slots_draft_split) {
+            llama_kv_cache_seq_rm(ctx, slot->id, slot->n_past, -1);
+        }
+
         SRV_DBG("%s", "run slots completed\n");
     }
 
@@ -2199,6 +4015,316 @@ struct server_context {
     }
 };
 
+// the models served by the server, routed by the "model" field of the requests
+// the main model is always loaded, the models added with --add-model are loaded on the first request that selects
+// them and the least recently used idle ones are unloaded when the memory budget would be exceeded
+struct server_models {
+    struct entry {
+        common_server_model info;
+
+        server_context * ctx_server = nullptr; // nullptr when the model is not loaded
+
+        std::unique_ptr<server_context> ctx_owned; // not set for the main model
+        std::thread thread;                        // runs the task loop of ctx_owned
+
+        int     n_active    = 0; // requests in flight, the model is not unloaded while there are any
+        int64_t t_last_used = 0;
+        size_t  size_ctx    = 0; // KV cache size of the last load, to estimate the memory of the next one
+    };
+
+    common_params params; // parameters of the main model
+
+    std::vector<std::unique_ptr<entry>> entries; // the main model first
+
+    // the weights of the loaded model files, shared by all models with the same path
+    std::map<std::string, std::weak_ptr<llama_model>> weights;
+
+    size_t mem_budget = 0; // 0 = unlimited
+
+    std::mutex mutex;      // protects the state of the entries and the weights
+    std::mutex mutex_load; // the models are loaded one at a time
+
+    ~server_models() {
+        for (size_t i = 1; i < entries.size(); i++) {
+            if (entries[i]->ctx_owned) {
+                unload(std::move(entries[i]->ctx_owned), std::move(entries[i]->thread));
+            }
+        }
+    }
+
+    void init(server_context & ctx_main, const common_params & params_) {
+        params     = params_;
+        mem_budget = (size_t) params.n_models_mem*1024*1024;
+
+        auto e = std::make_unique<entry>();
+        e->info       = { params.model_alias, params.model, params.lora_adapters };
+        e->ctx_server = &ctx_main;
+        e->size_ctx   = llama_get_kv_cache_size(ctx_main.ctx);
+        entries.push_back(std::move(e));
+
+        weights[params.model] = ctx_main.model_ref;
+
+        for (const auto & info : params.server_models) {
+            SRV_INF("serving model '%s', path = '%s', n_lora = %zu\n", info.alias.c_str(), info.path.c_str(), info.lora_adapters.size());
+
+            e = std::make_unique<entry>();
+            e->info = info;
+            entries.push_back(std::move(e));
+        }
+
+        if (mem_budget > 0) {
+            SRV_INF("memory budget for the models = %d MiB\n", params.n_models_mem);
+        }
+    }
+
+    // without additional models, all requests go to the main model whatever their "model" field is
+    entry * find(const std::string & name) const {
+        if (entries.size() == 1 || name.empty()) {
+            return entries[0].get();
+        }
+
+        for (const auto & e : entries) {
+            if (e->info.alias == name) {
+                return e.get();
+            }
+        }
+
+        return nullptr;
+    }
+
+    // get the context of the model selected by name, loading it if needed
+    // the model stays loaded until the returned pointer and all its copies are destroyed
+    std::shared_ptr<server_context> acquire(const std::string & name, json & error) {
+        entry * e = find(name);
+        if (e == nullptr) {
+            error = format_error_response(string_format("The model `%s` does not exist", name.c_str()), ERROR_TYPE_NOT_FOUND);
+            return nullptr;
+        }
+
+        bool loaded;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            e->n_active++;
+            e->t_last_used = ggml_time_us();
+            loaded = e->ctx_server != nullptr;
+        }
+
+        if (!loaded) {
+            std::unique_lock<std::mutex> lock_load(mutex_load);
+
+            // another request may have loaded it in the meantime
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                loaded = e->ctx_server != nullptr;
+            }
+
+            if (!loaded && !load(*e, error)) {
+                release(*e);
+                return nullptr;
+            }
+        }
+
+        return std::shared_ptr<server_context>(e->ctx_server, [this, e](server_context *) {
+            release(*e);
+        });
+    }
+
+    void release(entry & e) {
+        std::unique_lock<std::mutex> lock(mutex);
+        e.n_active--;
+        e.t_last_used = ggml_time_us();
+    }
+
+    // must be called with mutex_load held
+    bool load(entry & e, json & error) {
+        std::shared_ptr<llama_model> model_base;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto it = weights.find(e.info.path);
+            if (it != weights.end()) {
+                model_base = it->second.lock();
+            }
+        }
+
+        // the KV cache of the first load is estimated with the one of the main model
+        size_t size_need = e.size_ctx > 0 ? e.size_ctx : entries[0]->size_ctx;
+        if (!model_base) {
+            size_need += file_size(e.info.path);
+        }
+
+        if (!reserve(size_need, &e)) {
+            error = format_error_response(string_format("Not enough memory to load the model `%s`", e.info.alias.c_str()), ERROR_TYPE_UNAVAILABLE);
+            return false;
+        }
+
+        SRV_INF("loading model '%s', path = '%s', shared weights = %d\n", e.info.alias.c_str(), e.info.path.c_str(), model_base != nullptr);
+
+        common_params params_model = params;
+
+        params_model.model         = e.info.path;
+        params_model.model_alias   = e.info.alias;
+        params_model.model_url     = "";
+        params_model.hf_repo       = "";
+        params_model.hf_file       = "";
+        params_model.lora_adapters = e.info.lora_adapters;
+        params_model.model_draft   = ""; // the draft model is only used by the main model
+        params_model.control_vectors.clear();
+
+        // the dynamic lookup cache is saved by the main model only
+        params_model.lookup_cache_dynamic = "";
+
+        // the spilled KV states of the models must not use the same files
+        if (!params_model.kv_spill_path.empty()) {
+            std::string & path = params_model.kv_spill_path;
+            if (path.back() != DIRECTORY_SEPARATOR) {
+                path += DIRECTORY_SEPARATOR;
+            }
+            path += "model-" + std::to_string(index(e));
+        }
+
+        auto ctx_server = std::make_unique<server_context>();
+
+        if (!ctx_server->load_model(params_model, model_base)) {
+            error = format_error_response(string_format("Failed to load the model `%s`", e.info.alias.c_str()), ERROR_TYPE_SERVER);
+            return false;
+        }
+
+        ctx_server->init();
+        ctx_server->slot_prompt_similarity = params.slot_prompt_similarity;
+
+        if (ctx_server->params.chat_template.empty() && !ctx_server->validate_model_chat_template()) {
+            SRV_WRN("the chat template of model '%s' is not supported, falling back to chatml\n", e.info.alias.c_str());
+            ctx_server->params.chat_template = "chatml";
+        }
+
+        server_context * ptr = ctx_server.get();
+
+        ptr->queue_tasks.on_new_task(std::bind(
+                    &server_context::process_single_task, ptr, std::placeholders::_1));
+        ptr->queue_tasks.on_update_slots(std::bind(
+                    &server_context::update_slots, ptr));
+
+        std::thread thread([ptr]() {
+            ptr->queue_tasks.start_loop();
+        });
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (!model_base) {
+            weights[e.info.path] = ptr->model_ref;
+        }
+
+        e.ctx_owned  = std::move(ctx_server);
+        e.ctx_server = ptr;
+        e.thread     = std::move(thread);
+        e.size_ctx   = llama_get_kv_cache_size(ptr->ctx);
+
+        SRV_INF("model '%s' loaded, memory used = %zu MiB\n", e.info.alias.c_str(), mem_used()/(1024*1024));
+
+        return true;
+    }
+
+    // unload the least recently used idle models until size more bytes fit in the budget
+    bool reserve(size_t size, const entry * e_keep) {
+        if (mem_budget == 0) {
+            return true;
+        }
+
+        while (true) {
+            std::unique_ptr<server_context> ctx_server;
+            std::thread thread;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                if (mem_used() + size <= mem_budget) {
+                    return true;
+                }
+
+                entry * lru = nullptr;
+                for (size_t i = 1; i < entries.size(); i++) {
+                    entry * e = entries[i].get();
+                    if (e == e_keep || e->ctx_server == nullptr || e->n_active > 0) {
+                        continue;
+                    }
+                    if (lru == nullptr || e->t_last_used < lru->t_last_used) {
+                        lru = e;
+                    }
+                }
+
+                if (lru == nullptr) {
+                    return false;
+                }
+
+                SRV_INF("unloading model '%s' to free memory\n", lru->info.alias.c_str());
+
+                ctx_server = std::move(lru->ctx_owned);
+                thread     = std::move(lru->thread);
+
+                lru->ctx_server = nullptr;
+            }
+
+            unload(std::move(ctx_server), std::move(thread));
+        }
+    }
+
+    static void unload(std::unique_ptr<server_context> ctx_server, std::thread thread) {
+        ctx_server->queue_tasks.terminate();
+        thread.join();
+    }
+
+    // must be called with mutex held
+    size_t mem_used() {
+        size_t size = 0;
+
+        for (auto & it : weights) {
+            auto model = it.second.lock();
+            if (model) {
+                size += llama_model_size(model.get());
+            }
+        }
+
+        for (const auto & e : entries) {
+            if (e->ctx_server) {
+                size += llama_get_kv_cache_size(e->ctx_server->ctx);
+            }
+        }
+
+        return size;
+    }
+
+    size_t index(const entry & e) const {
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].get() == &e) {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    static size_t file_size(const std::string & path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        return file ? (size_t) file.tellg() : 0;
+    }
+
+    json list() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        json data = json::array();
+        for (const auto & e : entries) {
+            data.push_back({
+                {"id",       e->info.alias},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+                {"meta",     e->ctx_server ? e->ctx_server->model_meta() : json(nullptr)},
+            });
+        }
+
+        return data;
+    }
+};
+
 static void log_server_request(const httplib::Request & req, const httplib::Response & res) {
     // skip GH copilot requests when using default port
     if (req.path == "/v1/health" || req.path == "/v1/completions") {
@@ -2242,6 +4368,9 @@ int main(int argc, char ** argv) {
     // struct that contains llama context and inference
     server_context ctx_server;
 
+    // the main model and the models added with --add-model
+    server_models models;
+
     if (params.model_alias == "unknown") {
         params.model_alias = params.model;
     }
@@ -2289,6 +4418,16 @@ int main(int argc, char ** argv) {
         res.status = 200;
     };
 
+    // the context of the model selected by the "model" field of the request, nullptr after an error response
+    auto get_model = [&models, &res_error](const json & data, httplib::Response & res) -> std::shared_ptr<server_context> {
+        json error;
+        auto ctx_server = models.acquire(json_value(data, "model", std::string()), error);
+        if (!ctx_server) {
+            res_error(res, error);
+        }
+        return ctx_server;
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, std::exception_ptr ep) {
         std::string message;
         try {
@@ -2305,7 +4444,7 @@ int main(int argc, char ** argv) {
     });
 
     svr->set_error_handler([&res_error](const httplib::Request &, httplib::Response & res) {
-        if (res.status == 404) {
+        if (res.status == 404 && res.body.empty()) {
             res_error(res, format_error_response("File Not Found", ERROR_TYPE_NOT_FOUND));
         }
         // for other error codes, we skip processing here because it's already done by res_error()
@@ -2478,6 +4617,15 @@ int main(int argc, char ** argv) {
 
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
+        const uint64_t n_itl     = data.at("n_itl");
+        const uint64_t t_itl     = data.at("t_itl");
+        const uint64_t t_itl_max = data.at("t_itl_max");
+
+        const uint64_t n_draft_total = data.at("n_draft_total");
+
+        // the scheduler metrics are labeled with the policy, so that runs with different policies can be compared
+        const std::string sched_labels = "{policy=\"" + data.at("sched_policy").get<std::string>() + "\"}";
+
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
         json all_metrics_def = json {
             {"counter", {{
@@ -2504,6 +4652,42 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) n_busy_slots_total / (float) n_decode_total}
+            }, {
+                    {"name",  "prefix_cache_hit_tokens_total"},
+                    {"help",  "Number of prompt tokens loaded from the prefix cache."},
+                    {"value",  (uint64_t) data.at("n_prefix_cache_hit_total")}
+            }, {
+                    {"name",  "kv_spill_restored_tokens_total"},
+                    {"help",  "Number of prompt tokens restored from the spilled KV states."},
+                    {"value",  (uint64_t) data.at("n_kv_spill_restored_total")}
+            }, {
+                    {"name",   "sched_decode_tokens_total"},
+                    {"help",   "Number of generated tokens scheduled for decoding."},
+                    {"labels", sched_labels},
+                    {"value",  (uint64_t) data.at("n_sched_decode_tokens_total")}
+            }, {
+                    {"name",   "sched_prompt_tokens_total"},
+                    {"help",   "Number of prompt tokens scheduled for decoding."},
+                    {"labels", sched_labels},
+                    {"value",  (uint64_t) data.at("n_sched_prompt_tokens_total")}
+            }, {
+                    {"name",   "sched_decode_deferred_total"},
+                    {"help",   "Number of generated tokens deferred to the next iteration because of the token budget."},
+                    {"labels", sched_labels},
+                    {"value",  (uint64_t) data.at("n_sched_decode_deferred_total")}
+            }, {
+                    {"name",   "sched_prompt_chunked_total"},
+                    {"help",   "Number of iterations that processed only a chunk of a prompt."},
+                    {"labels", sched_labels},
+                    {"value",  (uint64_t) data.at("n_sched_prompt_chunked_total")}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of tokens drafted for speculative decoding."},
+                    {"value",  (uint64_t) data.at("n_draft_total")}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of drafted tokens accepted by the target model."},
+                    {"value",  (uint64_t) data.at("n_draft_accepted_total")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -2521,6 +4705,32 @@ int main(int argc, char ** argv) {
                     {"name",  "kv_cache_tokens"},
                     {"help",  "KV-cache tokens."},
                     {"value",  (uint64_t) data.at("kv_cache_tokens_count")}
+            },{
+                    {"name",  "prefix_cache_tokens"},
+                    {"help",  "Number of tokens in the prefix cache."},
+                    {"value",  (uint64_t) data.at("n_prefix_cache_tokens")}
+            },{
+                    {"name",  "kv_spill_ram_bytes"},
+                    {"help",  "Host memory used by the spilled KV states."},
+                    {"value",  (uint64_t) data.at("kv_spill_ram_bytes")}
+            },{
+                    {"name",  "kv_spill_disk_bytes"},
+                    {"help",  "Disk space used by the spilled KV states."},
+                    {"value",  (uint64_t) data.at("kv_spill_disk_bytes")}
+            },{
+                    {"name",   "inter_token_latency_seconds"},
+                    {"help",   "Average time between two generated tokens of a request."},
+                    {"labels", sched_labels},
+                    {"value",  n_itl ? 1.e-6 * t_itl / n_itl : 0.}
+            },{
+                    {"name",   "inter_token_latency_max_seconds"},
+                    {"help",   "Max time between two generated tokens of a request."},
+                    {"labels", sched_labels},
+                    {"value",  1.e-6 * t_itl_max}
+            },{
+                    {"name",  "draft_acceptance_rate"},
+                    {"help",  "Ratio of the drafted tokens accepted by the target model."},
+                    {"value",  n_draft_total ? 1. * data.at("n_draft_accepted_total").get<uint64_t>() / n_draft_total : 0.}
             },{
                     {"name",  "requests_processing"},
                     {"help",  "Number of request processing."},
@@ -2532,20 +4742,47 @@ int main(int argc, char ** argv) {
             }}}
         };
 
+        // the acceptance rate of the drafted tokens of each slot, since the start of the server
+        for (const auto & slot : data.at("slots")) {
+            if (!slot.contains("speculative")) {
+                continue;
+            }
+
+            const auto & spec = slot.at("speculative");
+
+            const uint64_t n_draft_slot    = spec.at("n_draft_total");
+            const uint64_t n_accepted_slot = spec.at("n_accepted_total");
+
+            all_metrics_def["gauge"].push_back({
+                    {"name",   "slot_draft_acceptance_rate"},
+                    {"help",   "Ratio of the drafted tokens accepted by the target model, per slot."},
+                    {"labels", "{slot=\"" + std::to_string(slot.at("id").get<int>()) + "\"}"},
+                    {"value",  n_draft_slot ? 1. * n_accepted_slot / n_draft_slot : 0.}
+            });
+        }
+
         std::stringstream prometheus;
 
         for (const auto & el : all_metrics_def.items()) {
             const auto & type        = el.key();
             const auto & metrics_def = el.value();
 
+            std::string name_prev;
+
             for (const auto & metric_def : metrics_def) {
-                const std::string name = metric_def.at("name");
-                const std::string help = metric_def.at("help");
+                const std::string name   = metric_def.at("name");
+                const std::string help   = metric_def.at("help");
+                const std::string labels = json_value(metric_def, "labels", std::string());
+
+                // the samples of a labeled metric share its HELP and TYPE lines
+                if (name != name_prev) {
+                    prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
+                               << "# TYPE llamacpp:" << name << " " << type  << "\n";
+                    name_prev = name;
+                }
 
                 auto value = json_value(metric_def, "value", 0.);
-                prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
-                            << "# TYPE llamacpp:" << name << " " << type  << "\n"
-                            << "llamacpp:"        << name << " " << value << "\n";
+                prometheus << "llamacpp:" << name << labels << " " << value << "\n";
             }
         }
 
@@ -2688,21 +4925,21 @@ int main(int argc, char ** argv) {
         res_ok(res, {{ "success", true }});
     };
 
-    const auto handle_completions_generic = [&ctx_server, &res_error, &res_ok](server_task_inf_type inf_type, json & data, httplib::Response & res) {
-        if (ctx_server.params.embedding) {
+    const auto handle_completions_generic = [&res_error, &res_ok](const std::shared_ptr<server_context> & ctx_server, server_task_inf_type inf_type, json & data, httplib::Response & res) {
+        if (ctx_server->params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, inf_type);
-        ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(tasks);
+        std::vector<server_task> tasks = ctx_server->create_tasks_inference(data, inf_type);
+        ctx_server->queue_results.add_waiting_tasks(tasks);
+        ctx_server->queue_tasks.post(tasks);
 
         bool stream = json_value(data, "stream", false);
         const auto task_ids = server_task::get_list_id(tasks);
 
         if (!stream) {
-            ctx_server.receive_cmpl_results(task_ids, [&](std::vector<server_task_result> & results) {
+            ctx_server->receive_cmpl_results(task_ids, [&](std::vector<server_task_result> & results) {
                 if (results.size() == 1) {
                     // single result
                     res_ok(res, results[0].data);
@@ -2718,10 +4955,10 @@ int main(int argc, char ** argv) {
                 res_error(res, error_data);
             });
 
-            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            ctx_server->queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
+            const auto chunked_content_provider = [task_ids, ctx_server](size_t, httplib::DataSink & sink) {
+                ctx_server->receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
                     return server_sent_event(sink, "data", result.data);
                 }, [&](const json & error_data) {
                     server_sent_event(sink, "error", error_data);
@@ -2730,29 +4967,42 @@ int main(int argc, char ** argv) {
                 return false;
             };
 
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            auto on_complete = [task_ids, ctx_server] (bool) {
+                ctx_server->queue_results.remove_waiting_task_ids(task_ids);
             };
 
             res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
         }
     };
 
-    const auto handle_completions = [&handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions = [&get_model, &handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
         json data = json::parse(req.body);
-        return handle_completions_generic(SERVER_TASK_INF_TYPE_COMPLETION, data, res);
+
+        auto ctx_server = get_model(data, res);
+        if (!ctx_server) {
+            return;
+        }
+
+        return handle_completions_generic(ctx_server, SERVER_TASK_INF_TYPE_COMPLETION, data, res);
     };
 
-    const auto handle_infill = [&ctx_server, &res_error, &handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&get_model, &res_error, &handle_completions_generic](const httplib::Request & req, httplib::Response & res) {
+        json data = json::parse(req.body);
+
+        auto ctx_server = get_model(data, res);
+        if (!ctx_server) {
+            return;
+        }
+
         // check model compatibility
         std::string err;
-        if (llama_token_fim_pre(ctx_server.model) == LLAMA_TOKEN_NULL) {
+        if (llama_token_fim_pre(ctx_server->model) == LLAMA_TOKEN_NULL) {
             err += "prefix token is missing. ";
         }
-        if (llama_token_fim_suf(ctx_server.model) == LLAMA_TOKEN_NULL) {
+        if (llama_token_fim_suf(ctx_server->model) == LLAMA_TOKEN_NULL) {
             err += "suffix token is missing. ";
         }
-        if (llama_token_fim_mid(ctx_server.model) == LLAMA_TOKEN_NULL) {
+        if (llama_token_fim_mid(ctx_server->model) == LLAMA_TOKEN_NULL) {
             err += "middle token is missing. ";
         }
         if (!err.empty()) {
@@ -2760,8 +5010,6 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        json data = json::parse(req.body);
-
         // validate input
         if (!data.contains("input_prefix")) {
             res_error(res, format_error_response("\"input_prefix\" is required", ERROR_TYPE_INVALID_REQUEST));
@@ -2790,28 +5038,35 @@ int main(int argc, char ** argv) {
         }
         data["input_extra"] = input_extra; // default to empty array if it's not exist
 
-        return handle_completions_generic(SERVER_TASK_INF_TYPE_INFILL, data, res);
+        return handle_completions_generic(ctx_server, SERVER_TASK_INF_TYPE_INFILL, data, res);
     };
 
     // TODO: maybe merge this function with "handle_completions_generic"
-    const auto handle_chat_completions = [&ctx_server, &params, &res_error, &res_ok, verbose](const httplib::Request & req, httplib::Response & res) {
-        if (ctx_server.params.embedding) {
+    const auto handle_chat_completions = [&get_model, &res_error, &res_ok, verbose](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+
+        auto ctx_server = get_model(body, res);
+        if (!ctx_server) {
+            return;
+        }
+
+        if (ctx_server->params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        json data = oaicompat_completion_params_parse(ctx_server.model, json::parse(req.body), params.chat_template);
+        json data = oaicompat_completion_params_parse(ctx_server->model, body, ctx_server->params.chat_template);
 
-        std::vector<server_task> tasks = ctx_server.create_tasks_inference(data, SERVER_TASK_INF_TYPE_COMPLETION);
-        ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(tasks);
+        std::vector<server_task> tasks = ctx_server->create_tasks_inference(data, SERVER_TASK_INF_TYPE_COMPLETION);
+        ctx_server->queue_results.add_waiting_tasks(tasks);
+        ctx_server->queue_tasks.post(tasks);
 
         bool stream = json_value(data, "stream", false);
         const auto task_ids = server_task::get_list_id(tasks);
         const auto completion_id = gen_chatcmplid();
 
         if (!stream) {
-            ctx_server.receive_cmpl_results(task_ids, [&](const std::vector<server_task_result> & results) {
+            ctx_server->receive_cmpl_results(task_ids, [&](const std::vector<server_task_result> & results) {
                 // multitask is never support in chat completion, there is only one result
                 json result_oai = format_final_response_oaicompat(data, results[0].data, completion_id, /*.streaming =*/ false, verbose);
                 res_ok(res, result_oai);
@@ -2819,10 +5074,10 @@ int main(int argc, char ** argv) {
                 res_error(res, error_data);
             });
 
-            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            ctx_server->queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server, completion_id](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
+            const auto chunked_content_provider = [task_ids, ctx_server, completion_id](size_t, httplib::DataSink & sink) {
+                ctx_server->receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
                     std::vector<json> result_array = format_partial_response_oaicompat(result.data, completion_id);
                     for (auto & event_data : result_array) {
                         if (event_data.empty()) {
@@ -2842,44 +5097,41 @@ int main(int argc, char ** argv) {
                 return true;
             };
 
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            auto on_complete = [task_ids, ctx_server] (bool) {
+                ctx_server->queue_results.remove_waiting_task_ids(task_ids);
             };
 
             res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
         }
     };
 
-    const auto handle_models = [&params, &ctx_server](const httplib::Request &, httplib::Response & res) {
-        json models = {
+    const auto handle_models = [&models](const httplib::Request &, httplib::Response & res) {
+        json data = {
             {"object", "list"},
-            {"data", {
-                {
-                    {"id",       params.model_alias},
-                    {"object",   "model"},
-                    {"created",  std::time(0)},
-                    {"owned_by", "llamacpp"},
-                    {"meta",     ctx_server.model_meta()}
-                },
-             }}
+            {"data",   models.list()},
         };
 
-        res.set_content(models.dump(), MIMETYPE_JSON);
+        res.set_content(data.dump(), MIMETYPE_JSON);
     };
 
-    const auto handle_tokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&get_model, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
+        auto ctx_server = get_model(body, res);
+        if (!ctx_server) {
+            return;
+        }
+
         json tokens_response = json::array();
         if (body.count("content") != 0) {
             const bool add_special = json_value(body, "add_special", false);
             const bool with_pieces = json_value(body, "with_pieces", false);
 
-            llama_tokens tokens = tokenize_mixed(ctx_server.ctx, body.at("content"), add_special, true);
+            llama_tokens tokens = tokenize_mixed(ctx_server->ctx, body.at("content"), add_special, true);
 
             if (with_pieces) {
                 for (const auto& token : tokens) {
-                    std::string piece = common_token_to_piece(ctx_server.ctx, token);
+                    std::string piece = common_token_to_piece(ctx_server->ctx, token);
                     json piece_json;
 
                     // Check if the piece is valid UTF-8
@@ -2907,21 +5159,31 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_detokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&get_model, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
 
+        auto ctx_server = get_model(body, res);
+        if (!ctx_server) {
+            return;
+        }
+
         std::string content;
         if (body.count("tokens") != 0) {
             const llama_tokens tokens = body.at("tokens");
-            content = tokens_to_str(ctx_server.ctx, tokens.cbegin(), tokens.cend());
+            content = tokens_to_str(ctx_server->ctx, tokens.cbegin(), tokens.cend());
         }
 
         const json data = format_detokenized_response(content);
         res_ok(res, data);
     };
 
-    const auto handle_embeddings = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_embeddings = [&get_model, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
         const json body = json::parse(req.body);
+
+        auto ctx_server = get_model(body, res);
+        if (!ctx_server) {
+            return;
+        }
         bool is_openai = false;
 
         // an input prompt can be a string or a list of tokens (integer)
@@ -2941,14 +5203,14 @@ int main(int argc, char ** argv) {
         json responses = json::array();
         bool error = false;
         {
-            std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_EMBEDDING);
-            ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(tasks);
+            std::vector<server_task> tasks = ctx_server->create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_EMBEDDING);
+            ctx_server->queue_results.add_waiting_tasks(tasks);
+            ctx_server->queue_tasks.post(tasks);
 
             // get the result
             std::unordered_set<int> task_ids = server_task::get_list_id(tasks);
 
-            ctx_server.receive_cmpl_results(task_ids, [&](std::vector<server_task_result> & results) {
+            ctx_server->receive_cmpl_results(task_ids, [&](std::vector<server_task_result> & results) {
                 for (const auto & res : results) {
                     responses.push_back(res.data);
                 }
@@ -2957,7 +5219,7 @@ int main(int argc, char ** argv) {
                 error = true;
             });
 
-            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            ctx_server->queue_results.remove_waiting_task_ids(task_ids);
         }
 
         if (error) {
@@ -2971,13 +5233,18 @@ int main(int argc, char ** argv) {
         res_ok(res, root);
     };
 
-    const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
-        if (!ctx_server.params.reranking || ctx_server.params.embedding) {
-            res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking` and without `--embedding`", ERROR_TYPE_NOT_SUPPORTED));
+    const auto handle_rerank = [&get_model, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+
+        auto ctx_server = get_model(body, res);
+        if (!ctx_server) {
             return;
         }
 
-        const json body = json::parse(req.body);
+        if (!ctx_server->params.reranking || ctx_server->params.embedding) {
+            res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking` and without `--embedding`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
 
         // TODO: implement
         //int top_n = 1;
@@ -3019,14 +5286,14 @@ int main(int argc, char ** argv) {
         json responses = json::array();
         bool error = false;
         {
-            std::vector<server_task> tasks = ctx_server.create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_RERANK);
-            ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(tasks);
+            std::vector<server_task> tasks = ctx_server->create_tasks_inference({{"prompt", prompt}}, SERVER_TASK_INF_TYPE_RERANK);
+            ctx_server->queue_results.add_waiting_tasks(tasks);
+            ctx_server->queue_tasks.post(tasks);
 
             // get the result
             std::unordered_set<int> task_ids = server_task::get_list_id(tasks);
 
-            ctx_server.receive_cmpl_results(task_ids, [&](std::vector<server_task_result> & results) {
+            ctx_server->receive_cmpl_results(task_ids, [&](std::vector<server_task_result> & results) {
                 for (const auto & res : results) {
                     responses.push_back(res.data);
                 }
@@ -3191,7 +5458,6 @@ int main(int argc, char ** argv) {
     }
 
     ctx_server.init();
-    state.store(SERVER_STATE_READY);
 
     LOG_INF("%s: model loaded\n", __func__);
 
@@ -3200,6 +5466,7 @@ int main(int argc, char ** argv) {
         if (!ctx_server.validate_model_chat_template()) {
             LOG_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
             params.chat_template = "chatml";
+            ctx_server.params.chat_template = params.chat_template;
         }
     }
 
@@ -3212,14 +5479,15 @@ int main(int argc, char ** argv) {
     ctx_server.queue_tasks.on_update_slots(std::bind(
                 &server_context::update_slots, &ctx_server));
 
+    // the other models are loaded on demand
+    models.init(ctx_server, params);
+    state.store(SERVER_STATE_READY);
+
     shutdown_handler = [&](int) {
         ctx_server.queue_tasks.terminate();
     };
 
-    LOG_INF("%s: server is listening on http://%s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
-
-    ctx_server.queue_tasks.start_loop();
-
+    // the handler stops the main loop, so that the server state (e.g. the dynamic lookup cache) is saved on exit
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
     struct sigaction sigint_action;
     sigint_action.sa_handler = signal_handler;
@@ -3234,6 +5502,10 @@ int main(int argc, char ** argv) {
     SetConsoleCtrlHandler(reinterpret_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
 #endif
 
+    LOG_INF("%s: server is listening on http://%s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
+
+    ctx_server.queue_tasks.start_loop();
+
     clean_up();
     t.join();
 
@@ -33,6 +33,24 @@ Feature: llama.cpp server
     And   the completion is  truncated
     And   109 prompt tokens are processed
 
+    # the streaming context shift keeps 4 attention sinks and evicts 16 tokens each time the slot context is full
+  Scenario: Inference with streaming context shift
+    And   64 server max tokens to predict
+    And   16 tokens evicted at a time by the streaming context shift
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+    """
+    Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+    Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+    Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+    Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+    """
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    And   the completion is  truncated
+    And   109 prompt tokens are processed
+
   Scenario Outline: Inference without context shift
     And   <n_predict> server max tokens to predict
     And   disable context shifting
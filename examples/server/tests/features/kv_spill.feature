@@ -0,0 +1,33 @@
+@llama.cpp
+@kv_spill
+Feature: llama.cpp server KV spilling
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   prompt caching is enabled
+    And   1 slots
+    And   16 MiB of KV spill memory
+    And   . as KV spill path
+    And   2048 KV cache size
+    And   42 as server seed
+    And   24 max tokens to predict
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Restore the KV state of an overwritten prompt
+    # First prompt should be fully processed
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   22 prompt tokens are processed
+    # The slot is reused by an unrelated prompt, the previous state is spilled
+    Given a user prompt "Once upon a time"
+    And   a completion request with no api error
+    Then  24 tokens are predicted
+    # The spilled state is restored,
+    # we should only be processing 1 prompt token and get the same output
+    Given a user prompt "What is the capital of France?"
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   1 prompt tokens are processed
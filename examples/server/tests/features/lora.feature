@@ -34,3 +34,18 @@ Feature: llama.cpp server
     """
     And   a completion request with no api error
     Then  64 tokens are predicted matching eye|love|glass|sun
+
+  Scenario: Completion LoRA enabled per request
+    Given switch off lora adapter 0
+    Given a prompt:
+    """
+    Look in thy glass
+    """
+    And   a completion request with lora adapter 0 at scale 1.0
+    Then  64 tokens are predicted matching eye|love|glass|sun
+    Given a prompt:
+    """
+    Look in thy glass
+    """
+    And   a completion request with no api error
+    Then  64 tokens are predicted matching little|girl|three|years|old
@@ -0,0 +1,36 @@
+@llama.cpp
+@multi_model
+Feature: llama.cpp server serving several models
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model alias stories260K
+    And   a served model stories260K-ft from stories260K.gguf
+    And   a served model stories260K-copy from stories260K.gguf
+    And   42 as server seed
+    And   256 KV cache size
+    And   8 max tokens to predict
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: List the served models
+    Given available models
+    Then  3 models are supported
+    And   model 0 is identified by stories260K
+    And   model 1 is identified by stories260K-ft
+    And   model 2 is identified by stories260K-copy
+
+  Scenario: Route the requests with the model field
+    Given a user prompt "Once upon a time"
+    And   a completion request for model stories260K-ft with 200 status code
+    Then  the completion is generated by model stories260K-ft
+    And   8 tokens are predicted
+    Given a user prompt "Once upon a time"
+    And   a completion request for model stories260K with 200 status code
+    Then  the completion is generated by model stories260K
+    And   8 tokens are predicted
+
+  Scenario: Unknown model
+    Given a user prompt "Once upon a time"
+    And   a completion request for model gpt-4 with 404 status code
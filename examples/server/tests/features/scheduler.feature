@@ -0,0 +1,85 @@
+@llama.cpp
+@scheduler
+Feature: llama.cpp server scheduler
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   42 as server seed
+    And   1536 KV cache size
+    And   continuous batching
+    And   prometheus compatible metrics exposed
+
+  Scenario Outline: Long prompt alongside streaming slots
+    Given 3 slots
+    And   <policy> as scheduler policy
+    And   16 tokens of scheduler budget
+    And   8 tokens of prompt chunk
+    Then  the server is starting
+    Then  the server is healthy
+    Given a system prompt You are a writer.
+    And   a model tinyllama-2
+    And   a prompt:
+      """
+      Write a story.
+      """
+    And   a prompt:
+      """
+      Write a poem.
+      """
+    And   a prompt:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her
+      friends. One day, she saw a big red ball under a tree and wanted to play with it. Her mom told her to
+      share the ball with the other kids, so Lily asked a boy named Tom if he wanted to play too. They threw
+      the ball to each other until the sun went down, and then they went home happy. Write what happened
+      to Lily and Tom the next day.
+      """
+    And   32 max tokens to predict
+    And   streaming is enabled
+    Given concurrent OAI completions requests
+    Then  the server is busy
+    Then  the server is idle
+    Then  all prompts are predicted with 32 tokens
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:sched_decode_tokens_total with policy <policy> is greater than 0
+    And   metric llamacpp:sched_prompt_tokens_total with policy <policy> is greater than 0
+    And   metric llamacpp:sched_prompt_chunked_total with policy <policy> is greater than 0
+    And   metric llamacpp:inter_token_latency_max_seconds with policy <policy> is greater than 0
+    And   at most 16 tokens are scheduled per decode with policy <policy>
+    Examples:
+      | policy         |
+      | decode-first   |
+      | fcfs           |
+      | shortest-first |
+
+  Scenario Outline: Generated tokens deferred by the scheduler budget
+    Given 2 slots
+    And   <policy> as scheduler policy
+    And   1 tokens of scheduler budget
+    Then  the server is starting
+    Then  the server is healthy
+    Given a system prompt You are a writer.
+    And   a model tinyllama-2
+    And   a prompt:
+      """
+      Write a story.
+      """
+    And   a prompt:
+      """
+      Write a poem.
+      """
+    And   16 max tokens to predict
+    And   streaming is enabled
+    Given concurrent OAI completions requests
+    Then  the server is busy
+    Then  the server is idle
+    Then  all prompts are predicted with 16 tokens
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:sched_decode_deferred_total with policy <policy> is greater than 0
+    And   at most 1 tokens are scheduled per decode with policy <policy>
+    Examples:
+      | policy         |
+      | decode-first   |
+      | fcfs           |
+      | shortest-first |
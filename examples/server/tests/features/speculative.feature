@@ -0,0 +1,67 @@
+@llama.cpp
+@speculative
+Feature: llama.cpp server speculative decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   8 as draft
+    And   2 slots
+    And   2048 KV cache size
+    And   42 as server seed
+    And   prometheus compatible metrics exposed
+    And   64 max tokens to predict
+
+  Scenario: Completion with n-gram drafting
+    Given n-gram drafting
+    Then  the server is starting
+    Then  the server is healthy
+    Given a user prompt "Once upon a time, there was a little girl named Lily. Once upon a time, there was a little"
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:draft_tokens_accepted_total is at most metric llamacpp:draft_tokens_total
+
+  Scenario: Multi users with drafted tokens
+    Given n-gram drafting
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    Then all prompts are predicted
+
+  Scenario: Greedy completion is the same with and without n-gram drafting
+    Given n-gram drafting
+    Then  the server is starting
+    Then  the server is healthy
+    Given 0.0 temperature
+    And   a user prompt "Once upon a time, there was a little girl named Lily. Once upon a time, there was a little"
+    And   a completion request with 0 drafted tokens
+    Given a user prompt "Once upon a time, there was a little girl named Lily. Once upon a time, there was a little"
+    And   a completion request with 8 drafted tokens
+    Then  all predictions are equal
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:draft_tokens_accepted_total is at most metric llamacpp:draft_tokens_total
+
+  Scenario: Greedy completion is the same with and without a draft model
+    # the downloaded target model is its own draft model, the vocabs match
+    Given a draft model file stories260K.gguf
+    Then  the server is starting
+    Then  the server is healthy
+    Given 0.0 temperature
+    And   a user prompt "Once upon a time, there was a little girl named Lily."
+    And   a completion request with 0 drafted tokens
+    Given a user prompt "Once upon a time, there was a little girl named Lily."
+    And   a completion request with 8 drafted tokens
+    Then  all predictions are equal
+    Then  prometheus metrics are exposed
+    And   metric llamacpp:draft_tokens_accepted_total is at most metric llamacpp:draft_tokens_total
@@ -62,6 +62,11 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.slot_save_path = None
     context.id_slot = None
     context.cache_prompt = None
+    context.n_prefix_cache = None
+    context.n_kv_spill_ram = None
+    context.kv_spill_path = None
+    context.server_models = []
+    context.n_models_mem = None
     context.n_slots = None
     context.prompt_prefix = None
     context.prompt_suffix = None
@@ -73,12 +78,18 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.server_process = None
     context.seed = None
     context.draft = None
+    context.draft_ngram = False
+    context.model_draft = None
     context.server_seed = None
     context.user_api_key = None
     context.response_format = None
     context.temperature = None
     context.lora_file = None
     context.disable_ctx_shift = False
+    context.ctx_shift_stream = None
+    context.sched_policy = None
+    context.n_sched_budget = None
+    context.n_sched_chunk = None
 
     # infill
     context.infill_input_extra = None
@@ -147,6 +158,16 @@ def step_draft(context, draft: int):
     context.draft = draft
 
 
+@step('a draft model file {model_draft}')
+def step_model_draft(context, model_draft: str):
+    context.model_draft = model_draft
+
+
+@step('n-gram drafting')
+def step_draft_ngram(context):
+    context.draft_ngram = True
+
+
 @step('{n_ctx:d} KV cache size')
 def step_n_ctx(context, n_ctx: int):
     context.n_ctx = n_ctx
@@ -177,6 +198,31 @@ def step_enable_prompt_cache(context):
     context.cache_prompt = True
 
 
+@step('{n_prefix_cache:d} tokens of prefix cache')
+def step_n_prefix_cache(context, n_prefix_cache: int):
+    context.n_prefix_cache = n_prefix_cache
+
+
+@step('{n_kv_spill_ram:d} MiB of KV spill memory')
+def step_n_kv_spill_ram(context, n_kv_spill_ram: int):
+    context.n_kv_spill_ram = n_kv_spill_ram
+
+
+@step('{kv_spill_path} as KV spill path')
+def step_kv_spill_path(context, kv_spill_path: str):
+    context.kv_spill_path = kv_spill_path
+
+
+@step('a served model {model_alias} from {model_file}')
+def step_served_model(context, model_alias: str, model_file: str):
+    context.server_models.append((model_alias, model_file))
+
+
+@step('{n_models_mem:d} MiB of model memory')
+def step_n_models_mem(context, n_models_mem: int):
+    context.n_models_mem = n_models_mem
+
+
 @step('continuous batching')
 def step_server_continuous_batching(context):
     context.server_continuous_batching = True
@@ -198,6 +244,26 @@ def step_server_metrics(context):
 def step_server_disable_ctx_shift(context):
     context.disable_ctx_shift = True
 
+
+@step('{n_stream:d} tokens evicted at a time by the streaming context shift')
+def step_server_ctx_shift_stream(context, n_stream: int):
+    context.ctx_shift_stream = n_stream
+
+
+@step('{sched_policy} as scheduler policy')
+def step_server_sched_policy(context, sched_policy: str):
+    context.sched_policy = sched_policy
+
+
+@step('{n_sched_budget:d} tokens of scheduler budget')
+def step_server_sched_budget(context, n_sched_budget: int):
+    context.n_sched_budget = n_sched_budget
+
+
+@step('{n_sched_chunk:d} tokens of prompt chunk')
+def step_server_sched_chunk(context, n_sched_chunk: int):
+    context.n_sched_chunk = n_sched_chunk
+
 @step("the server is starting")
 def step_start_server(context):
     start_server_background(context)
@@ -330,6 +396,52 @@ def step_n_tokens_predicted(context, predicted_n):
     assert_n_tokens_predicted(context.completion, predicted_n)
 
 
+@step('a completion request for model {model} with {status_code:d} status code')
+def step_request_completion_model(context, model: str, status_code: int):
+    response = requests.post(f'{context.base_url}/completion', json={
+        "prompt": context.prompts.pop(),
+        "model": model,
+        "n_predict": context.n_predict,
+        "seed": 42,
+    })
+    assert response.status_code == status_code, f"completion must be a {status_code} status code: {response.status_code}"
+    if status_code == 200:
+        context.tasks_result.append(response.json())
+
+
+@step('a completion request with lora adapter {lora_id:d} at scale {scale:f}')
+def step_request_completion_lora(context, lora_id: int, scale: float):
+    response = requests.post(f'{context.base_url}/completion', json={
+        "prompt": context.prompts.pop(),
+        "n_predict": context.n_predict,
+        "temperature": context.temperature,
+        "seed": 42,
+        "lora": [{"id": lora_id, "scale": scale}],
+    })
+    assert response.status_code == 200, f"completion must be a 200 status code: {response.status_code}"
+    completion = response.json()
+    assert completion['generation_settings']['lora'] == [{"id": lora_id, "scale": scale}]
+    context.tasks_result.append(completion)
+
+
+@step('a completion request with {n_draft:d} drafted tokens')
+def step_request_completion_draft(context, n_draft: int):
+    response = requests.post(f'{context.base_url}/completion', json={
+        "prompt": context.prompts.pop(),
+        "n_predict": context.n_predict,
+        "temperature": context.temperature,
+        "seed": 42,
+        "n_draft": n_draft,
+    })
+    assert response.status_code == 200, f"completion must be a 200 status code: {response.status_code}"
+    context.tasks_result.append(response.json())
+
+
+@step('the completion is generated by model {model}')
+def step_completion_model(context, model: str):
+    assert context.tasks_result[-1]['model'] == model, f"invalid model: {context.tasks_result[-1]['model']}"
+
+
 @step('all predictions are equal')
 @async_run_until_complete
 async def step_predictions_equal(context):
@@ -924,6 +1036,39 @@ def step_assert_metric_value(context, metric_name, metric_value):
     assert context.metrics[metric_name].samples[0].value == metric_value, f"metric: {context.metrics[metric_name]}"
 
 
+@step('metric {metric_name} is at most metric {metric_name_max}')
+def step_assert_metric_at_most(context, metric_name, metric_name_max):
+    for name in [metric_name, metric_name_max]:
+        if name not in context.metrics:
+            assert False, f"no metric {name} in {context.metrics.keys()}"
+    assert context.metrics[metric_name].samples[0].value <= context.metrics[metric_name_max].samples[0].value, \
+        f"metric: {context.metrics[metric_name]}, max: {context.metrics[metric_name_max]}"
+
+
+def metric_sample_value(context, metric_name, labels):
+    # the samples are looked up by name, the parser strips the _total suffix from the name of the counter families
+    for metric in context.metrics.values():
+        for sample in metric.samples:
+            if sample.name == metric_name and all(sample.labels.get(k) == v for k, v in labels.items()):
+                return sample.value
+    assert False, f"no metric {metric_name} with labels {labels} in {context.metrics.keys()}"
+
+
+@step('metric {metric_name} with policy {policy} is greater than {metric_value:d}')
+def step_assert_metric_policy_greater(context, metric_name, policy, metric_value):
+    value = metric_sample_value(context, metric_name, {'policy': policy})
+    assert value > metric_value, f"metric {metric_name}: {value}"
+
+
+@step('at most {n_budget:d} tokens are scheduled per decode with policy {policy}')
+def step_assert_sched_budget(context, n_budget, policy):
+    n_decode = metric_sample_value(context, 'llamacpp:n_decode_total', {})
+    n_tokens = metric_sample_value(context, 'llamacpp:sched_decode_tokens_total', {'policy': policy}) + \
+               metric_sample_value(context, 'llamacpp:sched_prompt_tokens_total', {'policy': policy})
+    assert n_decode > 0
+    assert n_tokens <= n_budget * n_decode, f"{n_tokens} tokens in {n_decode} decodes"
+
+
 @step('available models')
 def step_available_models(context):
     # openai client always expects an api_key
@@ -1456,6 +1601,10 @@ def start_server_background(context):
         server_args.extend(['--n-gpu-layers', context.n_gpu_layer])
     if context.draft is not None:
         server_args.extend(['--draft', context.draft])
+    if context.draft_ngram:
+        server_args.append('--draft-ngram')
+    if context.model_draft:
+        server_args.extend(['--model-draft', context.model_draft])
     if context.server_continuous_batching:
         server_args.append('--cont-batching')
     if context.server_embeddings:
@@ -1474,6 +1623,16 @@ def start_server_background(context):
         server_args.extend(['--n-predict', context.n_server_predict])
     if context.slot_save_path:
         server_args.extend(['--slot-save-path', context.slot_save_path])
+    if context.n_prefix_cache:
+        server_args.extend(['--prefix-cache', context.n_prefix_cache])
+    if context.n_kv_spill_ram:
+        server_args.extend(['--kv-spill-ram', context.n_kv_spill_ram])
+    if context.kv_spill_path:
+        server_args.extend(['--kv-spill-path', context.kv_spill_path])
+    for model_alias, model_file in context.server_models:
+        server_args.extend(['--add-model', model_alias, model_file])
+    if context.n_models_mem:
+        server_args.extend(['--models-mem', context.n_models_mem])
     if context.server_api_key:
         server_args.extend(['--api-key', context.server_api_key])
     if context.n_ga:
@@ -1486,6 +1645,14 @@ def start_server_background(context):
         server_args.extend(['--lora', context.lora_file])
     if context.disable_ctx_shift:
         server_args.extend(['--no-context-shift'])
+    if context.ctx_shift_stream:
+        server_args.extend(['--ctx-shift-stream', context.ctx_shift_stream])
+    if context.sched_policy:
+        server_args.extend(['--sched-policy', context.sched_policy])
+    if context.n_sched_budget:
+        server_args.extend(['--sched-budget', context.n_sched_budget])
+    if context.n_sched_chunk:
+        server_args.extend(['--sched-chunk', context.n_sched_chunk])
 
     args = [str(arg) for arg in [context.server_path, *server_args]]
     print(f"bench: starting server with: {' '.join(args)}")
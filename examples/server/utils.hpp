@@ -100,44 +100,71 @@ static bool json_is_array_of_mixed_numbers_strings(const json & data) {
 }
 
 /**
- * this handles 2 cases:
+ * tokenize several prompts at once with llama_tokenize_batch on up to n_threads threads, each of them one of these 2 cases:
  * - only string, example: "string"
  * - mixed string and tokens, example: [12, 34, "string", 56, 78]
  */
-static llama_tokens tokenize_mixed(const llama_context * ctx, const json & json_prompt, bool add_special, bool parse_special) {
+static std::vector<llama_tokens> tokenize_mixed_batch(const llama_context * ctx, const std::vector<const json *> & json_prompts, bool add_special, bool parse_special, int n_threads) {
     // If `add_bos` is true, we only add BOS, when json_prompt is a string,
     // or the first element of the json_prompt array is a string.
-    llama_tokens prompt_tokens;
-
-    if (json_prompt.is_array()) {
-        bool first = true;
-        for (const auto & p : json_prompt) {
-            if (p.is_string()) {
-                auto s = p.template get<std::string>();
-
-                llama_tokens p;
-                if (first) {
-                    p = common_tokenize(ctx, s, add_special, parse_special);
-                    first = false;
-                } else {
-                    p = common_tokenize(ctx, s, false, parse_special);
+    // texts[1] holds these strings, texts[0] all the others
+    std::vector<std::string> texts[2];
+
+    for (const json * json_prompt : json_prompts) {
+        if (json_prompt->is_array()) {
+            bool first = true;
+            for (const auto & p : *json_prompt) {
+                if (p.is_string()) {
+                    texts[first].push_back(p.template get<std::string>());
                 }
+                first = false;
+            }
+        } else {
+            texts[1].push_back(json_prompt->template get<std::string>());
+        }
+    }
 
-                prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
-            } else {
-                if (first) {
-                    first = false;
-                }
+    std::vector<llama_tokens> tokens[2] = {
+        common_tokenize_batch(ctx, texts[0], false,       parse_special, n_threads),
+        common_tokenize_batch(ctx, texts[1], add_special, parse_special, n_threads),
+    };
+
+    size_t next[2] = { 0, 0 };
+
+    std::vector<llama_tokens> result;
+    result.reserve(json_prompts.size());
+
+    for (const json * json_prompt : json_prompts) {
+        llama_tokens prompt_tokens;
 
-                prompt_tokens.push_back(p.template get<llama_token>());
+        if (json_prompt->is_array()) {
+            bool first = true;
+            for (const auto & p : *json_prompt) {
+                if (p.is_string()) {
+                    const auto & t = tokens[first][next[first]++];
+                    prompt_tokens.insert(prompt_tokens.end(), t.begin(), t.end());
+                } else {
+                    prompt_tokens.push_back(p.template get<llama_token>());
+                }
+                first = false;
             }
+        } else {
+            prompt_tokens = std::move(tokens[1][next[1]++]);
         }
-    } else {
-        auto s = json_prompt.template get<std::string>();
-        prompt_tokens = common_tokenize(ctx, s, add_special, parse_special);
+
+        result.push_back(std::move(prompt_tokens));
     }
 
-    return prompt_tokens;
+    return result;
+}
+
+/**
+ * this handles 2 cases:
+ * - only string, example: "string"
+ * - mixed string and tokens, example: [12, 34, "string", 56, 78]
+ */
+static llama_tokens tokenize_mixed(const llama_context * ctx, const json & json_prompt, bool add_special, bool parse_special) {
+    return tokenize_mixed_batch(ctx, { &json_prompt }, add_special, parse_special, 1)[0];
 }
 
 /**
@@ -160,18 +187,30 @@ static std::vector<llama_tokens> tokenize_input_prompts(llama_context * ctx, con
         // array of tokens
         result.push_back(json_prompt.get<llama_tokens>());
     } else if (json_prompt.is_array()) {
-        // array of prompts
-        result.reserve(json_prompt.size());
-        for (const auto & p : json_prompt) {
+        // array of prompts, the strings of all of them are tokenized at once
+        result.resize(json_prompt.size());
+
+        std::vector<const json *> to_tokenize;
+        std::vector<size_t>       to_tokenize_idx;
+
+        for (size_t i = 0; i < json_prompt.size(); ++i) {
+            const auto & p = json_prompt[i];
             if (p.is_string() || json_is_array_of_mixed_numbers_strings(p)) {
-                result.push_back(tokenize_mixed(ctx, p, add_special, parse_special));
+                to_tokenize.push_back(&p);
+                to_tokenize_idx.push_back(i);
             } else if (json_is_array_of_numbers(p)) {
                 // array of tokens
-                result.push_back(p.get<llama_tokens>());
+                result[i] = p.get<llama_tokens>();
             } else {
                 throw std::runtime_error("element of \"prompt\" must be a string, an list of tokens, or a list of mixed strings & tokens");
             }
         }
+
+        // the prompts of a request are tokenized on the batch threads of the context
+        auto tokenized = tokenize_mixed_batch(ctx, to_tokenize, add_special, parse_special, llama_n_threads_batch(ctx));
+        for (size_t j = 0; j < tokenized.size(); ++j) {
+            result[to_tokenize_idx[j]] = std::move(tokenized[j]);
+        }
     } else {
         throw std::runtime_error("\"prompt\" must be a string, an list of tokens, a list of mixed strings & tokens, or a list of prompts");
     }
@@ -42,6 +42,10 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // compute the nodes in lockstep, with a barrier after each node and without splitting them in chunks
+        // by default, barriers are placed only between dependent nodes and the simple ops are split in chunks
+        bool lockstep;
     };
 
     // numa strategies
@@ -57,6 +61,14 @@ extern "C" {
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // GGML_NUMA_STRATEGY_MIRROR: copy read-only data (e.g. the model weights) to each NUMA node
+    // the matrix multiplications then read the copy on the node of the thread
+    // the data must not change or be freed while it is mirrored
+    // the data is mirrored whenever the strategy is set, also on a single node: check ggml_is_numa() first
+    // the graphs that are being computed keep their copies when the data is unmirrored, the last one frees them
+    GGML_API bool    ggml_numa_mirror(const void * data, size_t size); // false if the data is not mirrored
+    GGML_API void    ggml_numa_unmirror(const void * data);
+
     GGML_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
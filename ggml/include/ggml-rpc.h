@@ -7,6 +7,9 @@
 extern "C" {
 #endif
 
+#define RPC_PROTO_MAJOR_VERSION    2
+#define RPC_PROTO_MINOR_VERSION    4
+#define RPC_PROTO_PATCH_VERSION    0
 #define GGML_RPC_MAX_SERVERS       16
 
 // backend API
@@ -17,7 +20,11 @@ GGML_API ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * en
 
 GGML_API void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total);
 
-GGML_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem);
+// serves several clients concurrently, each on its own thread
+// cache_dir:  directory of the weight cache, or NULL to disable it
+// cache_size: maximum size of the weight cache in bytes, the least recently used weights are removed beyond it (0 - no limit)
+// share_weights: store the identical weights of the clients once (CPU backends only)
+GGML_API void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t cache_size, bool share_weights, size_t free_mem, size_t total_mem);
 
 GGML_API ggml_backend_reg_t ggml_backend_rpc_reg(void);
 
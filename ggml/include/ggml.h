@@ -1742,6 +1742,24 @@ extern "C" {
             float                 max_bias,
             float                 logit_softcap);
 
+    // flash attention over two sets of KV cells, without concatenating them: the softmax is computed online over
+    // the cells of k0/v0 and then over those of k1/v1, which can have other types (e.g. the tiers of a KV cache)
+    // k0, v0: [n_embd, n_kv0, n_head_kv, 1]
+    // k1, v1: [n_embd, n_kv1, n_head_kv, 1]
+    // mask:   [n_kv0 + n_kv1, n_batch_pad, 1, 1] !! the columns of k0/v0 first !!
+    // only supported by the CPU backend
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext_split(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k0,
+            struct ggml_tensor  * v0,
+            struct ggml_tensor  * k1,
+            struct ggml_tensor  * v1,
+            struct ggml_tensor  * mask,
+            float                 scale,
+            float                 max_bias,
+            float                 logit_softcap);
+
     GGML_API void ggml_flash_attn_ext_set_prec(
             struct ggml_tensor * a,
             enum ggml_prec       prec);
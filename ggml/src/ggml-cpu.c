@@ -31,6 +31,7 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <sys/mman.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -165,6 +166,15 @@ static LONG atomic_fetch_add_explicit(atomic_int * ptr, LONG inc, memory_order m
     // TODO: add support for explicit memory order
     return InterlockedExchangeAdd(ptr, inc);
 }
+static bool atomic_compare_exchange_weak_explicit(atomic_int * ptr, LONG * expected, LONG desired, memory_order mo_ok, memory_order mo_fail) {
+    // TODO: add support for explicit memory order
+    const LONG old = InterlockedCompareExchange(ptr, desired, *expected);
+    if (old == *expected) {
+        return true;
+    }
+    *expected = old;
+    return false;
+}
 static atomic_bool atomic_flag_test_and_set(atomic_flag * ptr) {
     return InterlockedExchange(ptr, 1);
 }
@@ -1297,6 +1307,15 @@ typedef pthread_mutex_t    ggml_mutex_t;
 #endif
 
 // Threadpool def
+#define GGML_FUSION_MAX_NODES 3
+
+// schedule of a node of the graph
+struct ggml_sched_node {
+    uint8_t flags;                        // GGML_SCHED_NODE_*
+    uint8_t fusion;                       // enum ggml_fusion, the fused op computed at this node
+    int32_t fused[GGML_FUSION_MAX_NODES]; // the nodes of the fused op
+};
+
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
     ggml_cond_t  cond;        // cond.var for waiting for new work
@@ -1313,7 +1332,13 @@ struct ggml_threadpool {
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
-    atomic_bool abort;        // Used for aborting processing of a graph
+    atomic_int  abort;        // Used for aborting processing of a graph: the barrier at which all threads stop, -1 if none
+
+    // schedule of the current graph, see ggml_graph_sched_build()
+    struct ggml_sched_node * sched_nodes;
+    int          sched_nodes_size;
+    int          sched_n_nodes; // the graph of the schedule, -1 if none
+    uint64_t     sched_key;
 
     struct ggml_compute_state * workers;   // per thread state
     int          n_threads_max; // number of threads in the pool
@@ -1323,6 +1348,9 @@ struct ggml_threadpool {
     uint32_t     poll;        // Polling level (0 - no polling)
 
     enum ggml_status ec;
+
+    // the mirrored data of the current graph, NULL if none (see ggml_numa_mirrors_acquire)
+    const struct ggml_numa_mirror_set * numa_mirrors;
 };
 
 // Per-thread state
@@ -1335,6 +1363,9 @@ struct ggml_compute_state {
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
+
+    // chunks of the current node that have not been taken yet, see ggml_sched_chunks_take()
+    atomic_int GGML_CACHE_ALIGN chunks;
 };
 
 struct ggml_compute_params {
@@ -1346,6 +1377,9 @@ struct ggml_compute_params {
     void * wdata;
 
     struct ggml_threadpool * threadpool;
+
+    // NUMA node of the thread, for reading mirrored data (-1 if none)
+    int numa_node;
 };
 
 //
@@ -2223,6 +2257,7 @@ static inline void ggml_thread_cpu_relax(void) {;}
 
 #define GGML_NUMA_MAX_NODES 8
 #define GGML_NUMA_MAX_CPUS 512
+#define GGML_NUMA_MAX_MIRRORS 64
 
 struct ggml_numa_node {
     uint32_t cpus[GGML_NUMA_MAX_CPUS]; // hardware threads on this node
@@ -2242,12 +2277,31 @@ struct ggml_numa_nodes {
 #endif
 };
 
+// read-only data with a copy on each node (GGML_NUMA_STRATEGY_MIRROR)
+struct ggml_numa_mirror {
+    const char * data; // NULL if the slot is free
+    size_t size;
+    void * replicas[GGML_NUMA_MAX_NODES];
+
+    // the copies are freed when the mirror is removed and no graph that started before uses them
+    int  n_refs;
+    bool removed;
+};
+
+// the mirrors read by a graph, taken when the graph starts so that the threads see a stable set
+struct ggml_numa_mirror_set {
+    struct ggml_numa_mirror mirrors[GGML_NUMA_MAX_MIRRORS];
+    int slots[GGML_NUMA_MAX_MIRRORS]; // in g_state.numa_mirrors
+    int n;
+};
+
 //
 // ggml state
 //
 
 struct ggml_state {
     struct ggml_numa_nodes numa;
+    struct ggml_numa_mirror numa_mirrors[GGML_NUMA_MAX_MIRRORS]; // guarded by the critical section
 };
 
 // global state
@@ -2412,6 +2466,161 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+#if defined(__gnu_linux__)
+static void ggml_numa_free_replicas(struct ggml_numa_mirror * mirror) {
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        if (mirror->replicas[n] != NULL) {
+            munmap(mirror->replicas[n], mirror->size);
+            mirror->replicas[n] = NULL;
+        }
+    }
+}
+#endif
+
+bool ggml_numa_mirror(const void * data, size_t size) {
+#if defined(__gnu_linux__)
+    // a single node is not excluded, the callers check ggml_is_numa() - this keeps the path testable everywhere
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR || g_state.numa.n_nodes == 0 || size == 0) {
+        return false;
+    }
+
+    struct ggml_numa_mirror mirror = { (const char *) data, size, { NULL }, 0, false };
+
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        void * replica = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (replica == MAP_FAILED) {
+            GGML_LOG_WARN("%s: failed to allocate %zu bytes for node %u: %s\n", __func__, size, n, strerror(errno));
+            ggml_numa_free_replicas(&mirror);
+            return false;
+        }
+        mirror.replicas[n] = replica;
+
+        // bind the pages to the node before they are touched (MPOL_BIND = 2)
+        unsigned long nodemask = 1ul << n;
+        if (syscall(SYS_mbind, replica, size, 2, &nodemask, sizeof(nodemask)*8, 0) != 0) {
+            GGML_LOG_WARN("%s: mbind failed for node %u: %s\n", __func__, n, strerror(errno));
+            ggml_numa_free_replicas(&mirror);
+            return false;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(replica, size, MADV_HUGEPAGE);
+#endif
+        memcpy(replica, data, size);
+        mprotect(replica, size, PROT_READ);
+    }
+
+    bool ok = false;
+    ggml_critical_section_start();
+    for (int i = 0; i < GGML_NUMA_MAX_MIRRORS; ++i) {
+        if (g_state.numa_mirrors[i].data == NULL) {
+            g_state.numa_mirrors[i] = mirror;
+            ok = true;
+            break;
+        }
+    }
+    ggml_critical_section_end();
+
+    if (!ok) {
+        GGML_LOG_WARN("%s: too many mirrors\n", __func__);
+        ggml_numa_free_replicas(&mirror);
+    }
+    return ok;
+#else
+    UNUSED(data);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+void ggml_numa_unmirror(const void * data) {
+#if defined(__gnu_linux__)
+    struct ggml_numa_mirror mirror = { NULL, 0, { NULL }, 0, false };
+
+    ggml_critical_section_start();
+    for (int i = 0; i < GGML_NUMA_MAX_MIRRORS; ++i) {
+        struct ggml_numa_mirror * m = &g_state.numa_mirrors[i];
+        if (m->data == data && !m->removed) {
+            // the graphs that are being computed keep reading the copies, the last one frees them
+            m->removed = true;
+            if (m->n_refs == 0) {
+                mirror = *m;
+                m->data = NULL;
+            }
+            break;
+        }
+    }
+    ggml_critical_section_end();
+
+    ggml_numa_free_replicas(&mirror);
+#else
+    UNUSED(data);
+#endif
+}
+
+// take a reference to the mirrors for a graph, they cannot be freed until ggml_numa_mirrors_release
+static void ggml_numa_mirrors_acquire(struct ggml_numa_mirror_set * set) {
+    set->n = 0;
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_MIRROR) {
+        return;
+    }
+    ggml_critical_section_start();
+    for (int i = 0; i < GGML_NUMA_MAX_MIRRORS; ++i) {
+        struct ggml_numa_mirror * m = &g_state.numa_mirrors[i];
+        if (m->data != NULL && !m->removed) {
+            m->n_refs++;
+            set->mirrors[set->n] = *m;
+            set->slots[set->n] = i;
+            set->n++;
+        }
+    }
+    ggml_critical_section_end();
+}
+
+static void ggml_numa_mirrors_release(struct ggml_numa_mirror_set * set) {
+#if defined(__gnu_linux__)
+    int n_free = 0;
+    ggml_critical_section_start();
+    for (int i = 0; i < set->n; ++i) {
+        struct ggml_numa_mirror * m = &g_state.numa_mirrors[set->slots[i]];
+        if (--m->n_refs == 0 && m->removed) {
+            set->mirrors[n_free++] = *m;
+            m->data = NULL;
+        }
+    }
+    ggml_critical_section_end();
+
+    for (int i = 0; i < n_free; ++i) {
+        ggml_numa_free_replicas(&set->mirrors[i]);
+    }
+#endif
+    set->n = 0;
+}
+
+// the node whose copy of the mirrored data is read by a compute thread, or -1
+static int ggml_numa_thread_node(const struct ggml_threadpool * tp, int ith) {
+    if (tp->numa_mirrors == NULL) {
+        return -1;
+    }
+    // the threads are distributed on the nodes, see set_numa_thread_affinity
+    return ith % g_state.numa.n_nodes;
+}
+
+// the copy of data on the node of the thread, if it is mirrored
+static inline const char * ggml_numa_local_data(const struct ggml_compute_params * params, const void * data) {
+    const char * p = (const char *) data;
+    if (params->numa_node < 0) {
+        return p;
+    }
+    const struct ggml_numa_mirror_set * set = params->threadpool->numa_mirrors;
+    for (int i = 0; i < set->n; ++i) {
+        const struct ggml_numa_mirror * mirror = &set->mirrors[i];
+        if (p >= mirror->data && p < mirror->data + mirror->size) {
+            return (const char *) mirror->replicas[params->numa_node] + (p - mirror->data);
+        }
+    }
+    return p;
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -3996,6 +4205,42 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+// dequantize the rows of src0 into a F32 tensor of the same shape
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && "dup: quantized tensors can only be converted to F32");
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(nb00 == ggml_type_size(src0->type));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    ggml_to_float_t const dequantize_row_q = ggml_get_type_traits(src0->type)->to_float;
+
+    const int ith = params->ith; // thread index
+    const int nth = params->nth; // number of threads
+
+    // parallelize by rows
+    const int64_t nr  = ne01*ne02*ne03;
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        dequantize_row_q(
+                (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03,
+                (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3), ne00);
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -4007,6 +4252,11 @@ static void ggml_compute_forward_dup(
         return;
     }
 
+    if (ggml_is_quantized(src0->type)) {
+        ggml_compute_forward_dup_q(params, dst);
+        return;
+    }
+
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -7357,6 +7607,8 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
+    const char * src0_data = ggml_numa_local_data(params, src0->data);
+
     assert(ne12 % ne02 == 0);
     assert(ne13 % ne03 == 0);
 
@@ -7385,7 +7637,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 const int64_t i2 = i12;
                 const int64_t i3 = i13;
 
-                const char * src0_row = (const char*)src0->data + (0 + i02 * nb02 + i03 * nb03);
+                const char * src0_row = src0_data + (0 + i02 * nb02 + i03 * nb03);
 
                 // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
                 //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
@@ -7436,6 +7688,8 @@ static void ggml_compute_forward_mul_mat(
     ggml_gemv_t              const gemv                 = type_traits_cpu[type].gemv;
     ggml_gemm_t              const gemm                 = type_traits_cpu[type].gemm;
 
+    const char * src0_data = ggml_numa_local_data(params, src0->data);
+
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
     GGML_ASSERT(ne2 == ne12);
@@ -7465,7 +7719,7 @@ static void ggml_compute_forward_mul_mat(
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                     src0_data + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
@@ -7526,7 +7780,7 @@ UseGgmlGemm1:;
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                                     src0_data + i12/r2*nb02 + i13/r3*nb03,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
                                      row_size/ggml_type_size(vec_dot_type),
@@ -7594,12 +7848,12 @@ UseGgmlGemm2:;
 
         // If there are more than three rows in src1, use gemm; otherwise, use gemv.
         if (gemm && (ne11 > 3)) {
-            gemm(ne00, (float *)((char *) dst->data) + src0_start, ne01, (const char *) src0->data + src0_start * nb01,
+            gemm(ne00, (float *)((char *) dst->data) + src0_start, ne01, src0_data + src0_start * nb01,
                  (const char *) src1_wdata, ne11 - ne11 % 4, src0_end - src0_start);
         }
         for (int iter = gemm ? ne11 - ne11 % 4 : 0; iter < ne11; iter++) {
             gemv(ne00, (float *)((char *) dst->data + (iter * nb1)) + src0_start, ne01,
-                 (const char *) src0->data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
+                 src0_data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
                  src0_end - src0_start);
         }
         return;
@@ -7729,7 +7983,7 @@ static void ggml_compute_forward_mul_mat_id(
             continue;
         }
 
-        const char * src0_cur = (const char *) src0->data + cur_a*nb02;
+        const char * src0_cur = ggml_numa_local_data(params, src0->data) + cur_a*nb02;
 
         const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
@@ -7970,8 +8224,8 @@ static void ggml_compute_forward_out_prod_q_f32(
     const enum ggml_type type = src0->type;
     ggml_to_float_t const dequantize_row_q = ggml_get_type_traits(type)->to_float;
 
-    GGML_ASSERT(ne02 == ne12);
-    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne12 % ne02 == 0);
+    GGML_ASSERT(ne13 % ne03 == 0);
     GGML_ASSERT(ne2  == ne12);
     GGML_ASSERT(ne3  == ne13);
 
@@ -7986,8 +8240,12 @@ static void ggml_compute_forward_out_prod_q_f32(
 
     GGML_ASSERT(ne0 == ne00);
     GGML_ASSERT(ne1 == ne10);
-    GGML_ASSERT(ne2 == ne02);
-    GGML_ASSERT(ne3 == ne03);
+    GGML_ASSERT(ne2 == ne12);
+    GGML_ASSERT(ne3 == ne13);
+
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
 
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
@@ -8011,36 +8269,44 @@ static void ggml_compute_forward_out_prod_q_f32(
 
     // dst[:,:,:,:] = 0
     // for i2,i3:
-    //   for i1:
-    //     for i01:
+    //   for i01:
+    //     for i1:
     //       for i0:
-    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2,i3] * src1[i1,i01,i2,i3]
+    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2/r2,i3/r3] * src1[i1,i01,i2,i3]
 
     float * wdata = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
 
-    for (int64_t ir = ir0; ir < ir1; ++ir) {
+    for (int64_t ir = ir0; ir < ir1; ) {
         // dst indices
         const int64_t i3 = ir/(ne2*ne1);
         const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
         const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
-        const int64_t i02 = i2;
-        const int64_t i03 = i3;
+        // the rows of this thread with the same i2, i3 use the same rows of src0 - dequantize them once
+        const int64_t i1_end = MIN(ne1, i1 + (ir1 - ir));
+
+        const int64_t i02 = i2/r2;
+        const int64_t i03 = i3/r3;
 
-        //const int64_t i10 = i1;
         const int64_t i12 = i2;
         const int64_t i13 = i3;
 
         for (int64_t i01 = 0; i01 < ne01; ++i01) {
             const int64_t i11 = i01;
 
-            float * s0 = (float *) ((char *) src0->data + (          i01*nb01 + i02*nb02 + i03*nb03));
-            float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
-            float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
+            const void * s0 = (const void *) ((const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
 
             dequantize_row_q(s0, wdata, ne0);
-            ggml_vec_mad_f32(ne0, d, wdata, *s1);
+
+            for (int64_t j1 = i1; j1 < i1_end; ++j1) {
+                const float * s1 = (const float *) ((const char *) src1->data + (j1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+                float       * d  = (float       *) ((char       *)  dst->data + (j1*nb1 + i2*nb2 + i3*nb3));
+
+                ggml_vec_mad_f32(ne0, d, wdata, *s1);
+            }
         }
+
+        ir += i1_end - i1;
     }
 }
 
@@ -8075,14 +8341,10 @@ static void ggml_compute_forward_out_prod(
         case GGML_TYPE_Q4_0_4_4:
         case GGML_TYPE_Q4_0_4_8:
         case GGML_TYPE_Q4_0_8_8:
+        case GGML_TYPE_F16:
             {
                 ggml_compute_forward_out_prod_q_f32(params, dst);
             } break;
-        case GGML_TYPE_F16:
-            {
-                GGML_ABORT("fatal error"); // todo
-                // ggml_compute_forward_out_prod_f16_f32(params, dst);
-            }
         case GGML_TYPE_F32:
             {
                 ggml_compute_forward_out_prod_f32(params, dst);
@@ -9191,10 +9453,23 @@ void ggml_rope_yarn_corr_dims(
     dims[1] = MIN(n_dims - 1, end);
 }
 
+// store a row of a fused op in the contiguous destination of the GGML_OP_CPY that follows it
+static void ggml_fused_cpy_row(struct ggml_tensor * cpy, int64_t ir, const float * x, int64_t n) {
+    char * y = (char *) cpy->data + ir*ggml_row_size(cpy->type, n);
+
+    if (cpy->type == GGML_TYPE_F32) {
+        memcpy(y, x, n*sizeof(float));
+    } else {
+        ggml_get_type_traits(cpy->type)->from_float(x, y, n);
+    }
+}
+
+// if cpy is not NULL, the rows are also stored in the destination of cpy while they are in the cache
 static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst,
-        const bool forward) {
+        const bool forward,
+        struct ggml_tensor * cpy) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
@@ -9311,6 +9586,10 @@ static void ggml_compute_forward_rope_f32(
                     dst_data[0] = src[0];
                     dst_data[1] = src[1];
                 }
+
+                if (cpy) {
+                    ggml_fused_cpy_row(cpy, (i3*ne2 + i2)*ne1 + i1, (float *)((char *) dst->data + i3*nb3 + i2*nb2 + i1*nb1), ne0);
+                }
             }
         }
     }
@@ -9454,7 +9733,7 @@ static void ggml_compute_forward_rope(
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rope_f32(params, dst, true);
+                ggml_compute_forward_rope_f32(params, dst, true, NULL);
             } break;
         default:
             {
@@ -9478,7 +9757,7 @@ static void ggml_compute_forward_rope_back(
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rope_f32(params, dst, false);
+                ggml_compute_forward_rope_f32(params, dst, false, NULL);
             } break;
         default:
             {
@@ -10624,19 +10903,22 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(neq1 == N);
     GGML_ASSERT(nev0 == D);
 
+    // ggml_flash_attn_ext_split: a second set of KV cells, whose mask columns follow those of k/v
+    const struct ggml_tensor * k1 = dst->src[4];
+    const struct ggml_tensor * v1 = dst->src[5];
+
+    GGML_ASSERT((k1 == NULL) == (v1 == NULL));
+    GGML_ASSERT(!k1 || (k1->nb[0] == ggml_type_size(k1->type) && v1->nb[0] == ggml_type_size(v1->type)));
+
+    // the accumulator is in F16 only if all the V cells are
+    const bool v_f16 = v->type == GGML_TYPE_F16 && (!v1 || v1->type == GGML_TYPE_F16);
+
     // dst cannot be transposed or permuted
     GGML_ASSERT(nb0 == sizeof(float));
     GGML_ASSERT(nb0 <= nb1);
     GGML_ASSERT(nb1 <= nb2);
     GGML_ASSERT(nb2 <= nb3);
 
-    // broadcast factors
-    const int64_t rk2 = neq2/nek2;
-    const int64_t rk3 = neq3/nek3;
-
-    const int64_t rv2 = neq2/nev2;
-    const int64_t rv3 = neq3/nev3;
-
     // parallelize by q rows using ggml_vec_dot_f32
 
     // total rows in q
@@ -10667,13 +10949,15 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
     const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
 
-    enum ggml_type    const k_vec_dot_type = type_traits_cpu[k->type].vec_dot_type;
-    ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits(k_vec_dot_type)->from_float;
-    ggml_vec_dot_t    const kq_vec_dot     = type_traits_cpu[k->type].vec_dot;
-    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+    const struct ggml_tensor * k_sets[2] = { k, k1 };
+    const struct ggml_tensor * v_sets[2] = { v, v1 };
 
-    GGML_ASSERT(q_to_vec_dot && "fattn: unsupported K-type");
-    GGML_ASSERT(v_to_float   && "fattn: unsupported V-type");
+    const int n_sets = k1 ? 2 : 1;
+
+    for (int is = 0; is < n_sets; ++is) {
+        GGML_ASSERT(ggml_get_type_traits(type_traits_cpu[k_sets[is]->type].vec_dot_type)->from_float && "fattn: unsupported K-type");
+        GGML_ASSERT(ggml_get_type_traits(v_sets[is]->type)->to_float && "fattn: unsupported V-type");
+    }
 
     // loop over n_batch and n_head
     for (int ir = ir0; ir < ir1; ++ir) {
@@ -10693,7 +10977,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
         ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
 
-        if (v->type == GGML_TYPE_F16) {
+        if (v_f16) {
             memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
         } else {
             memset(VKQ32, 0, D*sizeof(float));
@@ -10701,84 +10985,94 @@ static void ggml_compute_forward_flash_attn_ext_f16(
 
         const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
 
-        // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
-
-        // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
-
         const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, D);
 
         // online softmax / attention
-        // loop over n_kv and n_head_kv
+        // loop over the sets of cells, n_kv and n_head_kv
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
-
-            float s; // KQ value
+        for (int is = 0, ic0 = 0; is < n_sets; ic0 += k_sets[is]->ne[1], ++is) {
+            const struct ggml_tensor * kc = k_sets[is];
+            const struct ggml_tensor * vc = v_sets[is];
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
+            ggml_from_float_t const q_to_vec_dot = ggml_get_type_traits(type_traits_cpu[kc->type].vec_dot_type)->from_float;
+            ggml_vec_dot_t    const kq_vec_dot   = type_traits_cpu[kc->type].vec_dot;
+            ggml_to_float_t   const v_to_float   = ggml_get_type_traits(vc->type)->to_float;
 
-            s = s*scale; // scale KQ value
+            // k indices
+            const int ik3 = iq3 / (neq3/kc->ne[3]);
+            const int ik2 = iq2 / (neq2/kc->ne[2]);
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+            // v indices
+            const int iv3 = iq3 / (neq3/vc->ne[3]);
+            const int iv2 = iq2 / (neq2/vc->ne[2]);
 
-            s += mv; // apply mask
+            q_to_vec_dot(pq, Q_q, D);
 
-            const float Mold = M;
+            for (int64_t ic = 0; ic < kc->ne[1]; ++ic) {
+                const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic0 + ic]) : 0.0f;
+                if (mv == -INFINITY) {
+                    continue;
+                }
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                float s; // KQ value
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                const char * k_data = (const char *) kc->data + ( ic*kc->nb[1] + ik2*kc->nb[2] + ik3*kc->nb[3]);
+                kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                s = s*scale; // scale KQ value
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(D, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                if (logit_softcap != 0.0f) {
+                    s = logit_softcap*tanhf(s);
                 }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                s += mv; // apply mask
+
+                const float Mold = M;
+
+                float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+                float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+
+                const char * v_data = ((const char *) vc->data + (ic*vc->nb[1] + iv2*vc->nb[2] + iv3*vc->nb[3]));
+
+                if (v_f16) {
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
+
+                        // V = V*expf(Mold - M)
+                        ggml_vec_scale_f16(D, VKQ16, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(D, VKQ32, ms);
+                    // V += v*expf(s - M)
+                    ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
                 } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
+
+                        // V = V*expf(Mold - M)
+                        ggml_vec_scale_f32(D, VKQ32, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
 
-                v_to_float(v_data, V32, D);
+                    v_to_float(v_data, V32, D);
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
-            }
+                    // V += v*expf(s - M)
+                    ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+                S = S*ms + vs; // scale and increment sum with partial sum
+            }
         }
 
-        if (v->type == GGML_TYPE_F16) {
+        if (v_f16) {
             for (int64_t d = 0; d < D; ++d) {
                 VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
             }
@@ -12682,6 +12976,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_MIRROR:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -13182,6 +13477,8 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     ggml_cond_destroy(&threadpool->cond);
 #endif // GGML_USE_OPENMP
 
+    free(threadpool->sched_nodes);
+
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
@@ -13307,7 +13604,7 @@ struct ggml_cplan ggml_graph_plan(
                 } break;
             case GGML_OP_OUT_PROD:
                 {
-                    if (ggml_is_quantized(node->src[0]->type)) {
+                    if (ggml_is_quantized(node->src[0]->type) || node->src[0]->type == GGML_TYPE_F16) {
                         cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
                     }
                 } break;
@@ -13406,70 +13703,781 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
-    struct ggml_threadpool    * tp    = state->threadpool;
-
-    const struct ggml_cgraph * cgraph = tp->cgraph;
-    const struct ggml_cplan  * cplan  = tp->cplan;
+//
+// graph scheduling
+//
+// all threads compute the nodes in graph order. instead of a barrier after each node, there is a barrier only
+// before the nodes that depend on the nodes computed since the previous barrier, so a thread that is done with its
+// part of a node continues with the next independent nodes. the rows of the simple ops are split in chunks: each
+// thread takes the chunks of its own range and then steals the remaining chunks from the ranges of the other threads
+//
 
-    set_numa_thread_affinity(state->ith);
+// how the computation of an op interacts with the other threads
+enum ggml_sched_op_class {
+    GGML_SCHED_OP_NOOP,      // nothing to compute (views)
+    GGML_SCHED_OP_SHARED,    // rows split by (ith, nth) only - no work buffer and no barrier, can be split in chunks
+    GGML_SCHED_OP_WDATA_ITH, // uses the slice of the work buffer of the thread
+    GGML_SCHED_OP_EXCLUSIVE, // uses the whole work buffer or synchronizes the threads
+};
 
-    struct ggml_compute_params params = {
-        /*.ith       =*/ state->ith,
-        /*.nth       =*/ atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed),
-        /*.wsize     =*/ cplan->work_size,
-        /*.wdata     =*/ cplan->work_data,
-        /*.threadpool=*/ tp,
-    };
+#define GGML_SCHED_NODE_BARRIER 1 // barrier before the node
+#define GGML_SCHED_NODE_CHUNKED 2 // the rows of the node are split in work-stealing chunks
+#define GGML_SCHED_NODE_FUSED   4 // the node is computed by the fused op of another node
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
-        struct ggml_tensor * node = cgraph->nodes[node_n];
+#define GGML_SCHED_MAX_EPOCH       64  // max number of nodes between two barriers
+#define GGML_SCHED_MAX_EPOCH_SPAN  128 // max distance of the node indices between two barriers (see ggml_sched_chunks_pack)
+#define GGML_SCHED_CHUNKS_PER_TASK 4   // number of chunks per thread of a chunked node
 
-        ggml_compute_forward(&params, node);
+static enum ggml_sched_op_class ggml_sched_op_class(const struct ggml_tensor * node) {
+    const struct ggml_tensor * src0 = node->src[0];
+    const struct ggml_tensor * src1 = node->src[1];
 
-        if (state->ith == 0 && cplan->abort_callback &&
-                cplan->abort_callback(cplan->abort_callback_data)) {
-            tp->abort = true;
-            tp->ec    = GGML_STATUS_ABORTED;
-        }
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return GGML_SCHED_OP_NOOP;
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+            // the quantized variants convert the rows in the work buffer
+            return src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_F32 && node->type == GGML_TYPE_F32 ?
+                GGML_SCHED_OP_SHARED : GGML_SCHED_OP_EXCLUSIVE;
+        case GGML_OP_SCALE:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_UNARY:
+            return src0->type == GGML_TYPE_F32 && node->type == GGML_TYPE_F32 ?
+                GGML_SCHED_OP_SHARED : GGML_SCHED_OP_EXCLUSIVE;
+        case GGML_OP_GET_ROWS:
+            return node->type == GGML_TYPE_F32 ? GGML_SCHED_OP_SHARED : GGML_SCHED_OP_EXCLUSIVE;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            // the conversions to the quantized types go through the work buffer
+            return (src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16) &&
+                   (node->type == GGML_TYPE_F32 || node->type == GGML_TYPE_F16) ?
+                GGML_SCHED_OP_SHARED : GGML_SCHED_OP_EXCLUSIVE;
+        case GGML_OP_ROPE:
+        case GGML_OP_SOFT_MAX:
+            return GGML_SCHED_OP_WDATA_ITH;
+        default:
+            return GGML_SCHED_OP_EXCLUSIVE;
+    }
+}
 
-        ggml_barrier(state->threadpool);
+static bool ggml_sched_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
     }
 
-    return 0;
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
 }
 
-#ifndef GGML_USE_OPENMP
+// true if node must be computed after node_prev: read after write, write after read or write after write
+static bool ggml_sched_depends(const struct ggml_tensor * node, const struct ggml_tensor * node_prev) {
+    if (ggml_sched_overlap(node, node_prev)) {
+        return true;
+    }
 
-// check if thread is active
-static inline bool ggml_graph_compute_thread_active(struct ggml_compute_state * state) {
-    struct ggml_threadpool * threadpool = state->threadpool;
-    int n_threads = atomic_load_explicit(&threadpool->n_threads_cur, memory_order_relaxed);
-    return (state->ith < n_threads);
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (ggml_sched_overlap(node->src[i], node_prev) || ggml_sched_overlap(node, node_prev->src[i])) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-// check if thread is ready to proceed (exit from polling or sleeping)
-static inline bool ggml_graph_compute_thread_ready(struct ggml_compute_state * state) {
-    struct ggml_threadpool * threadpool = state->threadpool;
+//
+// fused ops
+//
+// the chains of elementwise ops of the norms, the gated FFN and the KV store are computed row by row, while the
+// intermediate rows are still in the cache and without a barrier between the ops. the intermediate results are
+// still written, since they can be used by other nodes or by other graphs. the rows are computed by the same
+// kernels as the separate ops, so the results are the same
+//
 
-    if (state->pending || threadpool->stop || threadpool->pause) { return true; }
+enum ggml_fusion {
+    GGML_FUSION_NONE,
+    GGML_FUSION_RMS_NORM_MUL,     // rms_norm(x)*w
+    GGML_FUSION_ADD_RMS_NORM,     // rms_norm(a + b)
+    GGML_FUSION_ADD_RMS_NORM_MUL, // rms_norm(a + b)*w
+    GGML_FUSION_UNARY_MUL,        // silu(g)*u, gelu(g)*u
+    GGML_FUSION_ROPE_CPY,         // cpy(rope(x), kv)
+};
 
-    // check for new graph/work
-    int new_graph = atomic_load_explicit(&threadpool->n_graph, memory_order_relaxed);
-    if (new_graph != state->last_graph) {
-        state->pending    = ggml_graph_compute_thread_active(state);
-        state->last_graph = new_graph;
-    }
+#define GGML_FUSION_MAX_DIST 8 // max number of nodes between two nodes of a fused op
 
-    return state->pending;
+static int ggml_fusion_n_nodes(enum ggml_fusion fusion) {
+    switch (fusion) {
+        case GGML_FUSION_NONE:             return 1;
+        case GGML_FUSION_ADD_RMS_NORM_MUL: return 3;
+        default:                           return 2;
+    }
 }
 
-// sync thread state after polling
-static inline void ggml_graph_compute_thread_sync(struct ggml_compute_state * state) {
-    // TSAN doesn't support standalone fence yet, we use a dummy read-modify-write instead
-    #ifdef GGML_TSAN_ENABLED
-    atomic_fetch_add_explicit(&state->threadpool->n_graph, 0, memory_order_seq_cst);
+// the first node after node i that uses its result, -1 if none
+static int ggml_graph_find_consumer(const struct ggml_cgraph * cgraph, int i) {
+    const struct ggml_tensor * node = cgraph->nodes[i];
+
+    for (int j = i + 1, n = 0; j < cgraph->n_nodes && n <= GGML_FUSION_MAX_DIST; j++) {
+        if (ggml_sched_op_class(cgraph->nodes[j]) == GGML_SCHED_OP_NOOP) {
+            continue;
+        }
+
+        for (int k = 0; k < GGML_MAX_SRC; k++) {
+            if (cgraph->nodes[j]->src[k] == node) {
+                return j;
+            }
+        }
+
+        n++;
+    }
+
+    return -1;
+}
+
+// true if the node i of a fused op can be computed at the position of node j, the other nodes in between are not
+// dependent on it
+static bool ggml_graph_can_move(const struct ggml_cgraph * cgraph, int i, int j, const int * nodes, int n_nodes) {
+    for (int k = MIN(i, j) + 1; k < MAX(i, j); k++) {
+        bool fused = false;
+        for (int l = 0; l < n_nodes; l++) {
+            fused |= nodes[l] == k;
+        }
+
+        if (fused || ggml_sched_op_class(cgraph->nodes[k]) == GGML_SCHED_OP_NOOP) {
+            continue;
+        }
+
+        if (ggml_sched_depends(cgraph->nodes[k], cgraph->nodes[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the node where the fused op is computed: the last one if the other nodes can be computed later, otherwise the first
+// one if the other nodes can be computed earlier, -1 if none
+static int ggml_graph_fusion_anchor(const struct ggml_cgraph * cgraph, const int * nodes, int n_nodes) {
+    for (int a = n_nodes - 1; a >= 0; a -= MAX(n_nodes - 1, 1)) {
+        bool ok = true;
+        for (int k = 0; k < n_nodes && ok; k++) {
+            ok = ggml_graph_can_move(cgraph, nodes[k], nodes[a], nodes, n_nodes);
+        }
+
+        if (ok) {
+            return nodes[a];
+        }
+    }
+
+    return -1;
+}
+
+static bool ggml_fusion_rows_f32(const struct ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32 && t->nb[0] == sizeof(float);
+}
+
+// rms_norm(x) with contiguous rows
+static bool ggml_fusion_can_rms_norm(const struct ggml_tensor * norm) {
+    return norm->op == GGML_OP_RMS_NORM && ggml_fusion_rows_f32(norm) && ggml_fusion_rows_f32(norm->src[0]);
+}
+
+// node*w with w broadcasted over the rows of node
+static bool ggml_fusion_can_mul(const struct ggml_tensor * mul, const struct ggml_tensor * node) {
+    const struct ggml_tensor * w = mul->src[1];
+
+    return mul->op == GGML_OP_MUL && mul->src[0] == node && ggml_fusion_rows_f32(mul) &&
+           ggml_fusion_rows_f32(w) && w->ne[0] == node->ne[0] && ggml_can_repeat(w, node);
+}
+
+// a + b with b broadcasted over the rows of a
+static bool ggml_fusion_can_add(const struct ggml_tensor * add) {
+    const struct ggml_tensor * b = add->src[1];
+
+    return add->op == GGML_OP_ADD && ggml_fusion_rows_f32(add) && ggml_fusion_rows_f32(add->src[0]) &&
+           ggml_fusion_rows_f32(b) && b->ne[0] == add->ne[0];
+}
+
+static bool ggml_fusion_can_unary(const struct ggml_tensor * unary) {
+    if (unary->op != GGML_OP_UNARY || unary->type != GGML_TYPE_F32 || unary->src[0]->type != GGML_TYPE_F32 ||
+        !ggml_is_contiguous(unary) || !ggml_is_contiguous(unary->src[0])) {
+        return false;
+    }
+
+    const enum ggml_unary_op op = ggml_get_unary_op(unary);
+
+    return op == GGML_UNARY_OP_SILU || op == GGML_UNARY_OP_GELU;
+}
+
+// the rows of rope stored in a contiguous KV cache view
+static bool ggml_fusion_can_rope_cpy(const struct ggml_tensor * rope, const struct ggml_tensor * cpy) {
+    if (rope->op != GGML_OP_ROPE || rope->type != GGML_TYPE_F32 || rope->src[0]->type != GGML_TYPE_F32 ||
+        !ggml_is_contiguous(rope)) {
+        return false;
+    }
+
+    if (cpy->op != GGML_OP_CPY || cpy->src[0] != rope || !ggml_is_contiguous(cpy->src[1])) {
+        return false;
+    }
+
+    return cpy->type == GGML_TYPE_F32 ||
+        (ggml_get_type_traits(cpy->type)->from_float && rope->ne[0] % ggml_blck_size(cpy->type) == 0);
+}
+
+// the fused op that starts at node i and the indices of its nodes
+static enum ggml_fusion ggml_graph_get_fusion(const struct ggml_cgraph * cgraph, int i, int * nodes) {
+    const struct ggml_tensor * node = cgraph->nodes[i];
+
+    nodes[0] = i;
+
+    const int i1 = ggml_graph_find_consumer(cgraph, i);
+    if (i1 < 0) {
+        return GGML_FUSION_NONE;
+    }
+
+    const struct ggml_tensor * next = cgraph->nodes[i1];
+
+    nodes[1] = i1;
+
+    switch (node->op) {
+        case GGML_OP_RMS_NORM:
+            if (ggml_fusion_can_rms_norm(node) && ggml_fusion_can_mul(next, node)) {
+                return GGML_FUSION_RMS_NORM_MUL;
+            }
+            break;
+        case GGML_OP_ADD:
+            if (ggml_fusion_can_add(node) && ggml_fusion_can_rms_norm(next) && next->src[0] == node) {
+                const int i2 = ggml_graph_find_consumer(cgraph, i1);
+                if (i2 >= 0 && ggml_fusion_can_mul(cgraph->nodes[i2], next)) {
+                    nodes[2] = i2;
+                    if (ggml_graph_fusion_anchor(cgraph, nodes, 3) >= 0) {
+                        return GGML_FUSION_ADD_RMS_NORM_MUL;
+                    }
+                }
+                return GGML_FUSION_ADD_RMS_NORM;
+            }
+            break;
+        case GGML_OP_UNARY:
+            if (ggml_fusion_can_unary(node) && ggml_fusion_can_mul(next, node)) {
+                return GGML_FUSION_UNARY_MUL;
+            }
+            break;
+        case GGML_OP_ROPE:
+            if (ggml_fusion_can_rope_cpy(node, next)) {
+                return GGML_FUSION_ROPE_CPY;
+            }
+            break;
+        default:
+            break;
+    }
+
+    return GGML_FUSION_NONE;
+}
+
+// rms_norm(x)*w, x = a + b if add is not NULL, no multiplication if mul is NULL
+static void ggml_compute_forward_fused_rms_norm(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * add,
+        struct ggml_tensor * dst,
+        struct ggml_tensor * mul) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nr = ggml_nrows(dst);
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    GGML_ASSERT(eps > 0.0f);
+
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+        if (add) {
+            // src0 is the result of the add
+            const struct ggml_tensor * a = add->src[0];
+            const struct ggml_tensor * b = add->src[1];
+
+            const float * a_ptr = (float *) ((char *) a->data + i01*a->nb[1] + i02*a->nb[2] + i03*a->nb[3]);
+            const float * b_ptr = (float *) ((char *) b->data + (i01 % b->ne[1])*b->nb[1] + (i02 % b->ne[2])*b->nb[2] + (i03 % b->ne[3])*b->nb[3]);
+
+#ifdef GGML_USE_ACCELERATE
+            vDSP_vadd(a_ptr, 1, b_ptr, 1, x, 1, ne00);
+#else
+            ggml_vec_add_f32(ne00, x, a_ptr, b_ptr);
+#endif
+        }
+
+        ggml_float sum = 0.0;
+        for (int64_t i00 = 0; i00 < ne00; i00++) {
+            sum += (ggml_float)(x[i00] * x[i00]);
+        }
+
+        const float mean = sum/ne00;
+
+        float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+        memcpy(y, x, ne00 * sizeof(float));
+
+        const float scale = 1.0f/sqrtf(mean + eps);
+
+        ggml_vec_scale_f32(ne00, y, scale);
+
+        if (mul) {
+            const struct ggml_tensor * w = mul->src[1];
+
+            const float * w_ptr = (float *) ((char *) w->data + (i01 % w->ne[1])*w->nb[1] + (i02 % w->ne[2])*w->nb[2] + (i03 % w->ne[3])*w->nb[3]);
+                  float * z_ptr = (float *) ((char *) mul->data + i01*mul->nb[1] + i02*mul->nb[2] + i03*mul->nb[3]);
+
+#ifdef GGML_USE_ACCELERATE
+            vDSP_vmul(y, 1, w_ptr, 1, z_ptr, 1, ne00);
+#else
+            ggml_vec_mul_f32(ne00, z_ptr, y, w_ptr);
+#endif
+        }
+    }
+}
+
+// act(g)*u
+static void ggml_compute_forward_fused_unary_mul(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst,
+        struct ggml_tensor * mul) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * u    = mul->src[1];
+
+    const enum ggml_unary_op op = ggml_get_unary_op(dst);
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nr = ggml_nrows(dst);
+
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+        float * y = (float *) ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+
+        if (op == GGML_UNARY_OP_SILU) {
+            ggml_vec_silu_f32(ne00, y, x);
+        } else {
+            ggml_vec_gelu_f32(ne00, y, x);
+        }
+
+        const float * u_ptr = (float *) ((char *) u->data + (i01 % u->ne[1])*u->nb[1] + (i02 % u->ne[2])*u->nb[2] + (i03 % u->ne[3])*u->nb[3]);
+              float * z_ptr = (float *) ((char *) mul->data + i01*mul->nb[1] + i02*mul->nb[2] + i03*mul->nb[3]);
+
+#ifdef GGML_USE_ACCELERATE
+        vDSP_vmul(y, 1, u_ptr, 1, z_ptr, 1, ne00);
+#else
+        ggml_vec_mul_f32(ne00, z_ptr, y, u_ptr);
+#endif
+    }
+}
+
+// the nodes of the fused op computed at node_n
+static int ggml_sched_node_get_fused(
+        const struct ggml_cgraph     * cgraph,
+        const struct ggml_sched_node * sn,
+        int node_n,
+        struct ggml_tensor ** nodes) {
+
+    if (sn->fusion == GGML_FUSION_NONE) {
+        nodes[0] = cgraph->nodes[node_n];
+        return 1;
+    }
+
+    const int n = ggml_fusion_n_nodes((enum ggml_fusion) sn->fusion);
+
+    for (int k = 0; k < n; k++) {
+        nodes[k] = cgraph->nodes[sn->fused[k]];
+    }
+
+    return n;
+}
+
+static void ggml_graph_compute_node(
+        struct ggml_compute_params   * params,
+        const struct ggml_cgraph     * cgraph,
+        const struct ggml_sched_node * sn,
+        int node_n) {
+
+    struct ggml_tensor * nodes[GGML_FUSION_MAX_NODES];
+
+    ggml_sched_node_get_fused(cgraph, sn, node_n, nodes);
+
+    switch ((enum ggml_fusion) sn->fusion) {
+        case GGML_FUSION_NONE:
+            {
+                ggml_compute_forward(params, nodes[0]);
+            } break;
+        case GGML_FUSION_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_fused_rms_norm(params, NULL, nodes[0], nodes[1]);
+            } break;
+        case GGML_FUSION_ADD_RMS_NORM:
+            {
+                ggml_compute_forward_fused_rms_norm(params, nodes[0], nodes[1], NULL);
+            } break;
+        case GGML_FUSION_ADD_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_fused_rms_norm(params, nodes[0], nodes[1], nodes[2]);
+            } break;
+        case GGML_FUSION_UNARY_MUL:
+            {
+                ggml_compute_forward_fused_unary_mul(params, nodes[0], nodes[1]);
+            } break;
+        case GGML_FUSION_ROPE_CPY:
+            {
+                ggml_compute_forward_rope_f32(params, nodes[0], true, nodes[1]);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+static inline uint64_t ggml_sched_key_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h*0xff51afd7ed558ccdULL;
+}
+
+// the key of a tensor does not depend on the previous keys, so the CPU can compute several of them at once
+static uint64_t ggml_sched_key_tensor(const struct ggml_tensor * t) {
+    uint64_t h = ggml_sched_key_mix((uint64_t) (uintptr_t) t, (uint64_t) (uintptr_t) t->data);
+    h = ggml_sched_key_mix(h, ((uint64_t) t->op << 40) | ((uint64_t) t->type << 32) | (uint32_t) t->op_params[0]);
+    for (int k = 0; k < GGML_MAX_DIMS; k++) {
+        h = ggml_sched_key_mix(h, (uint64_t) t->ne[k] ^ ((uint64_t) t->nb[k] << 32));
+    }
+
+    return h;
+}
+
+// the schedule depends on the ops, the types, the shapes and the data of the nodes and of their sources - the decode
+// graphs of consecutive tokens usually give the same key, so the schedule is reused instead of rebuilt
+static uint64_t ggml_graph_sched_key(const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan) {
+    uint64_t h = ggml_sched_key_mix(cgraph->n_nodes, cplan->lockstep);
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        h = ggml_sched_key_mix(h, ggml_sched_key_tensor(node));
+        for (int k = 0; k < GGML_MAX_SRC && node->src[k]; k++) {
+            h = ggml_sched_key_mix(h, ggml_sched_key_tensor(node->src[k]));
+        }
+    }
+
+    return h;
+}
+
+// compute the schedule of the nodes of the graph, or keep the schedule of the previous graph if it is the same
+static void ggml_graph_sched_build(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan) {
+    const uint64_t key = ggml_graph_sched_key(cgraph, cplan);
+
+    if (tp->sched_n_nodes == cgraph->n_nodes && tp->sched_key == key) {
+        return;
+    }
+
+    if (tp->sched_nodes_size < cgraph->n_nodes) {
+        free(tp->sched_nodes);
+        tp->sched_nodes      = malloc(cgraph->n_nodes*sizeof(struct ggml_sched_node));
+        tp->sched_nodes_size = cgraph->n_nodes;
+        GGML_ASSERT(tp->sched_nodes);
+    }
+
+    tp->sched_n_nodes = cgraph->n_nodes;
+    tp->sched_key     = key;
+
+    struct ggml_sched_node * sched = tp->sched_nodes;
+
+    memset(sched, 0, cgraph->n_nodes*sizeof(struct ggml_sched_node));
+
+    // the fused ops do not overlap
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        int nodes[GGML_FUSION_MAX_NODES];
+
+        const enum ggml_fusion fusion = ggml_graph_get_fusion(cgraph, i, nodes);
+        if (fusion == GGML_FUSION_NONE) {
+            continue;
+        }
+
+        const int n      = ggml_fusion_n_nodes(fusion);
+        const int anchor = ggml_graph_fusion_anchor(cgraph, nodes, n);
+        if (anchor < 0) {
+            continue;
+        }
+
+        for (int k = 0; k < n; k++) {
+            if (nodes[k] != anchor) {
+                sched[nodes[k]].flags |= GGML_SCHED_NODE_FUSED;
+            }
+            sched[anchor].fused[k] = nodes[k];
+        }
+        sched[anchor].fusion = fusion;
+
+        i = nodes[n - 1];
+    }
+
+    if (cplan->lockstep) {
+        for (int i = 1; i < cgraph->n_nodes; i++) {
+            if (!(sched[i].flags & GGML_SCHED_NODE_FUSED)) {
+                sched[i].flags |= GGML_SCHED_NODE_BARRIER;
+            }
+        }
+        return;
+    }
+
+    // the nodes computed since the last barrier
+    const struct ggml_tensor * epoch[GGML_SCHED_MAX_EPOCH];
+    int  n_epoch         = 0;
+    int  i_epoch         = 0; // the first node after the last barrier
+    bool epoch_exclusive = false;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        if (sched[i].flags & GGML_SCHED_NODE_FUSED) {
+            continue;
+        }
+
+        enum ggml_sched_op_class op_class = ggml_sched_op_class(cgraph->nodes[i]);
+
+        if (op_class == GGML_SCHED_OP_NOOP) {
+            continue;
+        }
+
+        // the nodes computed together
+        struct ggml_tensor * nodes[GGML_FUSION_MAX_NODES];
+
+        const int n_nodes = ggml_sched_node_get_fused(cgraph, &sched[i], i, nodes);
+
+        if (sched[i].fusion == GGML_FUSION_ROPE_CPY) {
+            op_class = GGML_SCHED_OP_WDATA_ITH; // the rows are stored without the work buffer
+        }
+
+        // the simple ops do not touch the work buffer, so they can run while other threads finish an exclusive op
+        // the views and the fused nodes are not in the epoch, so its span is limited separately
+        bool barrier = n_epoch > 0 && (op_class == GGML_SCHED_OP_EXCLUSIVE || n_epoch + n_nodes > GGML_SCHED_MAX_EPOCH ||
+                i - i_epoch >= GGML_SCHED_MAX_EPOCH_SPAN || (epoch_exclusive && op_class != GGML_SCHED_OP_SHARED));
+
+        for (int k = 0; k < n_nodes && !barrier; k++) {
+            for (int j = 0; j < n_epoch && !barrier; j++) {
+                barrier = ggml_sched_depends(nodes[k], epoch[j]);
+            }
+        }
+
+        if (barrier) {
+            sched[i].flags |= GGML_SCHED_NODE_BARRIER;
+
+            n_epoch         = 0;
+            epoch_exclusive = false;
+        }
+
+        if (n_epoch == 0) {
+            i_epoch = i;
+        }
+
+        if (op_class == GGML_SCHED_OP_SHARED) {
+            sched[i].flags |= GGML_SCHED_NODE_CHUNKED;
+        }
+
+        for (int k = 0; k < n_nodes; k++) {
+            epoch[n_epoch++] = nodes[k];
+        }
+        epoch_exclusive |= op_class == GGML_SCHED_OP_EXCLUSIVE;
+    }
+}
+
+// the chunks of a thread are packed in a single atomic: the low bits of the node index and the range [c0, c1)
+// the nodes between two barriers are less than GGML_SCHED_MAX_EPOCH_SPAN apart, so their tags are distinct
+#define GGML_SCHED_CHUNK_BITS 12
+#define GGML_SCHED_CHUNK_MASK ((1 << GGML_SCHED_CHUNK_BITS) - 1)
+#define GGML_SCHED_TAG_MASK   (GGML_SCHED_MAX_EPOCH_SPAN - 1)
+
+static_assert(GGML_SCHED_MAX_EPOCH_SPAN <= 128, "the tag has 7 bits");
+
+static inline int ggml_sched_chunks_pack(int node_n, int c0, int c1) {
+    return ((node_n & GGML_SCHED_TAG_MASK) << (2*GGML_SCHED_CHUNK_BITS)) | (c0 << GGML_SCHED_CHUNK_BITS) | c1;
+}
+
+// take a chunk of node_n - the owner takes them from the front of its range, the other threads steal from the back
+static int ggml_sched_chunks_take(atomic_int * chunks, int node_n, bool steal) {
+    int cur = atomic_load_explicit(chunks, memory_order_acquire);
+
+    while (true) {
+        if (((cur >> (2*GGML_SCHED_CHUNK_BITS)) & GGML_SCHED_TAG_MASK) != (node_n & GGML_SCHED_TAG_MASK)) {
+            return -1; // the range of another node
+        }
+
+        const int c0 = (cur >> GGML_SCHED_CHUNK_BITS) & GGML_SCHED_CHUNK_MASK;
+        const int c1 =  cur                           & GGML_SCHED_CHUNK_MASK;
+
+        if (c0 >= c1) {
+            return -1;
+        }
+
+        const int next = steal ? ggml_sched_chunks_pack(node_n, c0, c1 - 1) : ggml_sched_chunks_pack(node_n, c0 + 1, c1);
+
+        if (atomic_compare_exchange_weak_explicit(chunks, &cur, next, memory_order_acq_rel, memory_order_acquire)) {
+            return steal ? c1 - 1 : c0;
+        }
+    }
+}
+
+static void ggml_compute_forward_chunked(
+              struct ggml_compute_params * params,
+              struct ggml_compute_state  * state,
+        const struct ggml_cgraph         * cgraph,
+        const struct ggml_sched_node     * sn,
+                                     int   node_n) {
+    const struct ggml_tensor * node = cgraph->nodes[node_n];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nchunk = (int) MIN(MIN(ggml_nrows(node), (int64_t) nth*GGML_SCHED_CHUNKS_PER_TASK), GGML_SCHED_CHUNK_MASK);
+
+    if (nchunk <= nth) {
+        ggml_graph_compute_node(params, cgraph, sn, node_n);
+        return;
+    }
+
+    // the op splits its rows by (ith, nth) - each chunk is computed as a task of nchunk
+    struct ggml_compute_params params_chunk = *params;
+    params_chunk.nth = nchunk;
+
+    atomic_store_explicit(&state->chunks, ggml_sched_chunks_pack(node_n, nchunk*ith/nth, nchunk*(ith + 1)/nth), memory_order_release);
+
+    int chunk;
+    while ((chunk = ggml_sched_chunks_take(&state->chunks, node_n, false)) >= 0) {
+        params_chunk.ith = chunk;
+        ggml_graph_compute_node(&params_chunk, cgraph, sn, node_n);
+    }
+
+    // the threads that have not started the node yet compute their own range when they get to it
+    for (int i = 1; i < nth; i++) {
+        struct ggml_compute_state * victim = &state->threadpool->workers[(ith + i) % nth];
+
+        while ((chunk = ggml_sched_chunks_take(&victim->chunks, node_n, true)) >= 0) {
+            params_chunk.ith = chunk;
+            ggml_graph_compute_node(&params_chunk, cgraph, sn, node_n);
+        }
+    }
+}
+
+// barrier before node_n (n_nodes for the end of the graph), returns true if the graph has been aborted
+static bool ggml_graph_compute_barrier(struct ggml_compute_state * state, int node_n) {
+    struct ggml_threadpool * tp    = state->threadpool;
+    const struct ggml_cplan * cplan = tp->cplan;
+
+    // the abort is decided before the barrier, so that all threads stop at the same barrier
+    if (state->ith == 0 && cplan->abort_callback &&
+            cplan->abort_callback(cplan->abort_callback_data)) {
+        atomic_store_explicit(&tp->abort, node_n, memory_order_relaxed);
+        tp->ec = GGML_STATUS_ABORTED;
+    }
+
+    ggml_barrier(tp);
+
+    return atomic_load_explicit(&tp->abort, memory_order_relaxed) == node_n;
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * tp    = state->threadpool;
+
+    const struct ggml_cgraph * cgraph = tp->cgraph;
+    const struct ggml_cplan  * cplan  = tp->cplan;
+
+    const struct ggml_sched_node * sched = tp->sched_nodes;
+
+    set_numa_thread_affinity(state->ith);
+
+    struct ggml_compute_params params = {
+        /*.ith       =*/ state->ith,
+        /*.nth       =*/ atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed),
+        /*.wsize     =*/ cplan->work_size,
+        /*.wdata     =*/ cplan->work_data,
+        /*.threadpool=*/ tp,
+        /*.numa_node =*/ ggml_numa_thread_node(tp, state->ith),
+    };
+
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
+        const struct ggml_sched_node * sn = &sched[node_n];
+
+        if (sn->flags & GGML_SCHED_NODE_FUSED) {
+            continue;
+        }
+
+        if ((sn->flags & GGML_SCHED_NODE_BARRIER) && ggml_graph_compute_barrier(state, node_n)) {
+            return 0;
+        }
+
+        if (sn->flags & GGML_SCHED_NODE_CHUNKED) {
+            ggml_compute_forward_chunked(&params, state, cgraph, sn, node_n);
+        } else {
+            ggml_graph_compute_node(&params, cgraph, sn, node_n);
+        }
+    }
+
+    ggml_graph_compute_barrier(state, cgraph->n_nodes);
+
+    return 0;
+}
+
+#ifndef GGML_USE_OPENMP
+
+// check if thread is active
+static inline bool ggml_graph_compute_thread_active(struct ggml_compute_state * state) {
+    struct ggml_threadpool * threadpool = state->threadpool;
+    int n_threads = atomic_load_explicit(&threadpool->n_threads_cur, memory_order_relaxed);
+    return (state->ith < n_threads);
+}
+
+// check if thread is ready to proceed (exit from polling or sleeping)
+static inline bool ggml_graph_compute_thread_ready(struct ggml_compute_state * state) {
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    if (state->pending || threadpool->stop || threadpool->pause) { return true; }
+
+    // check for new graph/work
+    int new_graph = atomic_load_explicit(&threadpool->n_graph, memory_order_relaxed);
+    if (new_graph != state->last_graph) {
+        state->pending    = ggml_graph_compute_thread_active(state);
+        state->last_graph = new_graph;
+    }
+
+    return state->pending;
+}
+
+// sync thread state after polling
+static inline void ggml_graph_compute_thread_sync(struct ggml_compute_state * state) {
+    // TSAN doesn't support standalone fence yet, we use a dummy read-modify-write instead
+    #ifdef GGML_TSAN_ENABLED
+    atomic_fetch_add_explicit(&state->threadpool->n_graph, 0, memory_order_seq_cst);
     #else
     atomic_thread_fence(memory_order_seq_cst);
     #endif
@@ -13626,13 +14634,18 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->current_chunk    = 0;
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
-        threadpool->abort            = false;
+        threadpool->abort            = -1;
+        threadpool->sched_nodes      = NULL;
+        threadpool->sched_nodes_size = 0;
+        threadpool->sched_n_nodes    = -1;
+        threadpool->sched_key        = 0;
         threadpool->workers          = NULL;
         threadpool->n_threads_max    = tpp->n_threads;
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+        threadpool->numa_mirrors     = NULL;
     }
 
     // Allocate and init workers state
@@ -13705,10 +14718,17 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
         threadpool->current_chunk    = 0;
-        threadpool->abort            = false;
+        threadpool->abort            = -1;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    ggml_graph_sched_build(threadpool, cgraph, cplan);
+
+    // the mirrors cannot change while the threads read them
+    struct ggml_numa_mirror_set numa_mirrors;
+    ggml_numa_mirrors_acquire(&numa_mirrors);
+    threadpool->numa_mirrors = numa_mirrors.n > 0 ? &numa_mirrors : NULL;
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -13742,6 +14762,9 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    threadpool->numa_mirrors = NULL;
+    ggml_numa_mirrors_release(&numa_mirrors);
+
     enum ggml_status ret = threadpool->ec;
 
     if (disposable_threadpool) {
@@ -3,10 +3,13 @@
 #include "ggml-backend-impl.h"
 
 #include <cinttypes>
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -16,15 +19,22 @@
 #  endif
 #  include <windows.h>
 #  include <winsock2.h>
+#  include <sys/utime.h>
 #else
 #  include <arpa/inet.h>
+#  include <sys/mman.h>
 #  include <sys/socket.h>
 #  include <sys/types.h>
 #  include <netinet/in.h>
 #  include <netinet/tcp.h>
 #  include <netdb.h>
+#  include <dirent.h>
+#  include <fcntl.h>
 #  include <unistd.h>
+#  include <utime.h>
 #endif
+#include <sys/stat.h>
+#include <algorithm>
 #include <cstring>
 
 #define UNUSED GGML_UNUSED
@@ -93,9 +103,55 @@ enum rpc_cmd {
     RPC_CMD_COPY_TENSOR,
     RPC_CMD_GRAPH_COMPUTE,
     RPC_CMD_GET_DEVICE_MEMORY,
+    RPC_CMD_HELLO,
+    RPC_CMD_BATCH,
+    RPC_CMD_GRAPH_COMPUTE_CACHE,
+    RPC_CMD_GRAPH_RECOMPUTE,
+    RPC_CMD_SET_TENSOR_HASH,
     RPC_CMD_COUNT,
 };
 
+// weights of at least this size are looked up by hash in the cache of the server before being uploaded
+#define RPC_CACHE_MIN_SIZE (10*1024*1024)
+// size of the hashes of the weights, SHA-256
+#define RPC_HASH_SIZE 32
+// the weights that are looked up are kept by the client until it knows whether they have to be uploaded, the lookups
+// are resolved together when their data exceeds this size, or before a request that may use the data
+#define RPC_MAX_LOOKUP_SIZE (256*1024*1024)
+
+// capabilities of the server, advertised in the response to RPC_CMD_HELLO
+// the server has a weight cache or shares the weights of its clients - the clients look up their weights by hash
+#define RPC_CAP_WEIGHT_CACHE 1
+
+// number of graphs that the server keeps for each connection
+// the client decides in which slot each graph is stored, so that both sides always agree on the content of the cache
+#define RPC_GRAPH_CACHE_SIZE 8
+
+// RPC request : | rpc_msg_req_header | request_data (size bytes) |
+// RPC response: | rpc_msg_rsp_header | response_data (size bytes) |
+//
+// The server executes the requests of a connection in order and answers each of them with the id of the request,
+// so the client can keep many requests in flight and match the responses with its queue of pending requests.
+// RPC_CMD_BATCH carries several requests in its request_data; it has no response of its own, every request in it is answered.
+// RPC_CMD_HELLO must be the first request of a connection.
+struct rpc_msg_req_header {
+    uint8_t  cmd;
+    uint32_t id;
+    uint64_t size;
+};
+
+struct rpc_msg_rsp_header {
+    uint32_t id;
+    uint64_t size;
+};
+
+struct rpc_msg_hello_rsp {
+    uint8_t major;
+    uint8_t minor;
+    uint8_t patch;
+    uint8_t caps; // RPC_CAP_*
+};
+
 struct rpc_msg_alloc_buffer_req {
     uint64_t size;
 };
@@ -130,6 +186,17 @@ struct rpc_msg_buffer_clear_req {
     uint8_t value;
 };
 
+struct rpc_msg_set_tensor_hash_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint8_t hash[RPC_HASH_SIZE];
+};
+
+struct rpc_msg_set_tensor_hash_rsp {
+    uint8_t result;
+};
+
 struct rpc_msg_get_tensor_req {
     rpc_tensor tensor;
     uint64_t offset;
@@ -149,6 +216,11 @@ struct rpc_msg_graph_compute_rsp {
     uint8_t result;
 };
 
+struct rpc_msg_graph_cache_header {
+    uint32_t slot;
+    uint64_t hash;
+};
+
 struct rpc_msg_get_device_memory_rsp {
     uint64_t free_mem;
     uint64_t total_mem;
@@ -174,8 +246,68 @@ struct ggml_backend_rpc_context {
     std::string name;
 };
 
-struct ggml_backend_rpc_buffer_context {
+// a request that has been queued and is waiting for its response
+struct rpc_pending_cmd {
+    uint32_t id;
+    uint8_t  cmd;
+    void *   output; // nullptr if the response is not needed
+    size_t   output_size;
+};
+
+// a graph stored in a slot of the server's graph cache
+struct rpc_cached_graph {
+    bool valid = false;
+    uint64_t hash = 0;
+    uint64_t last_used = 0;
+    std::vector<uint64_t> nodes;
+    std::vector<rpc_tensor> tensors;
+};
+
+// a weight that is looked up in the cache of the server, uploaded if the lookup misses
+struct rpc_lookup {
+    rpc_msg_set_tensor_hash_req request;
+    rpc_msg_set_tensor_hash_rsp response;
+    std::vector<uint8_t> upload; // the RPC_CMD_SET_TENSOR request of the weight
+};
+
+// client side of the connection to a server, shared by all the buffers and backends of an endpoint
+struct rpc_connection {
     std::shared_ptr<socket_t> sock;
+    std::mutex mutex;
+
+    rpc_msg_hello_rsp server_version = {};
+
+    uint32_t next_id = 1;
+    std::deque<rpc_pending_cmd> pending;
+    int n_pending_outputs = 0;
+
+    // requests that have not been sent yet, starting with room for the header of a batch
+    std::vector<uint8_t> batch = std::vector<uint8_t>(sizeof(rpc_msg_req_header));
+    int n_batch = 0;
+
+    // bytes of the responses in flight, and bytes of the requests sent since they exceeded RPC_MAX_IN_FLIGHT
+    size_t n_rsp_bytes = 0;
+    size_t n_req_bytes = 0;
+
+    // result of the graph computations that were not waited for
+    uint8_t compute_status = GGML_STATUS_SUCCESS;
+
+    std::vector<uint8_t> scratch;
+
+    // mirror of the server's graph cache, empty if the server does not have one
+    std::vector<rpc_cached_graph> graphs;
+    uint64_t n_graphs_computed = 0;
+
+    // the lookups of weights that have not been resolved yet, and the size of their data
+    std::vector<std::unique_ptr<rpc_lookup>> lookups;
+    size_t n_lookup_bytes = 0;
+
+    rpc_connection(std::shared_ptr<socket_t> sock) : sock(std::move(sock)) {}
+    ~rpc_connection();
+};
+
+struct ggml_backend_rpc_buffer_context {
+    std::shared_ptr<rpc_connection> conn;
     std::unordered_map<ggml_backend_buffer_t, void *> base_cache;
     uint64_t remote_ptr;
 };
@@ -298,29 +430,7 @@ static bool recv_data(sockfd_t sockfd, void * data, size_t size) {
     return true;
 }
 
-static bool send_msg(sockfd_t sockfd, const void * msg, size_t msg_size) {
-    if (!send_data(sockfd, &msg_size, sizeof(msg_size))) {
-        return false;
-    }
-    return send_data(sockfd, msg, msg_size);
-}
-
-static bool recv_msg(sockfd_t sockfd, void * msg, size_t msg_size) {
-    uint64_t size;
-    if (!recv_data(sockfd, &size, sizeof(size))) {
-        return false;
-    }
-    if (size != msg_size) {
-        return false;
-    }
-    return recv_data(sockfd, msg, msg_size);
-}
-
-static bool recv_msg(sockfd_t sockfd, std::vector<uint8_t> & input) {
-    uint64_t size;
-    if (!recv_data(sockfd, &size, sizeof(size))) {
-        return false;
-    }
+static bool recv_input(sockfd_t sockfd, uint64_t size, std::vector<uint8_t> & input) {
     try {
         input.resize(size);
     } catch (const std::bad_alloc & e) {
@@ -340,46 +450,274 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
     return true;
 }
 
-// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
-// RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
-    uint8_t cmd_byte = cmd;
-    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
+// SHA-256 of a block of data, the key of the weight cache of the server
+// a strong hash is needed because the server uses the cached data in place of the data of the client without seeing it
+static void rpc_data_hash(const void * data, size_t size, uint8_t hash[RPC_HASH_SIZE]) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    auto rotr  = [](uint32_t x, int r) { return (x >> r) | (x << (32 - r)); };
+    auto block = [&](const uint8_t * p) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t) p[4*i] << 24 | (uint32_t) p[4*i + 1] << 16 | (uint32_t) p[4*i + 2] << 8 | p[4*i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2],  19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t v[8];
+        memcpy(v, h, sizeof(v));
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = v[7] + (rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+            const uint32_t t2 = (rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+            memmove(v + 1, v, 7*sizeof(uint32_t));
+            v[4] += t1;
+            v[0]  = t1 + t2;
+        }
+        for (int i = 0; i < 8; ++i) {
+            h[i] += v[i];
+        }
+    };
+
+    const uint8_t * p = (const uint8_t *) data;
+    size_t n = size;
+    for (; n >= 64; p += 64, n -= 64) {
+        block(p);
+    }
+
+    // padding: a 1 bit, zeros and the size in bits
+    uint8_t tail[128] = {};
+    memcpy(tail, p, n);
+    tail[n] = 0x80;
+    const size_t n_tail = n < 56 ? 64 : 128;
+    const uint64_t bits = (uint64_t) size*8;
+    for (int i = 0; i < 8; ++i) {
+        tail[n_tail - 1 - i] = (uint8_t) (bits >> (8*i));
+    }
+    for (size_t i = 0; i < n_tail; i += 64) {
+        block(tail + i);
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            hash[4*i + j] = (uint8_t) (h[i] >> (24 - 8*j));
+        }
+    }
+}
+
+// hexadecimal digest, the name of the files of the cache
+static std::string rpc_hash_str(const uint8_t hash[RPC_HASH_SIZE]) {
+    char str[2*RPC_HASH_SIZE + 1];
+    for (int i = 0; i < RPC_HASH_SIZE; ++i) {
+        snprintf(str + 2*i, 3, "%02x", hash[i]);
+    }
+    return std::string(str, 2*RPC_HASH_SIZE);
+}
+
+// requests up to this size are batched with the next ones, larger requests are sent right away
+#define RPC_MAX_BATCH_REQ  (64*1024)
+// size of the batches that are sent without waiting for a synchronous request
+#define RPC_MAX_BATCH_SIZE (1024*1024)
+// the server blocks when the client does not read its responses, and the client blocks when the server does not read
+// its requests - to avoid a deadlock, the client waits for the responses before sending more than this many bytes
+// while more than this many bytes of responses are in flight
+#define RPC_MAX_IN_FLIGHT  (64*1024)
+
+static bool rpc_flush(rpc_connection & conn) {
+    if (conn.n_batch == 0) {
+        return true;
+    }
+    bool status;
+    if (conn.n_batch == 1) {
+        status = send_data(conn.sock->fd, conn.batch.data() + sizeof(rpc_msg_req_header), conn.batch.size() - sizeof(rpc_msg_req_header));
+    } else {
+        rpc_msg_req_header header = { RPC_CMD_BATCH, 0, conn.batch.size() - sizeof(rpc_msg_req_header) };
+        memcpy(conn.batch.data(), &header, sizeof(header));
+        status = send_data(conn.sock->fd, conn.batch.data(), conn.batch.size());
+    }
+    conn.batch.resize(sizeof(rpc_msg_req_header));
+    conn.n_batch = 0;
+    return status;
+}
+
+static bool rpc_recv_rsp(rpc_connection & conn) {
+    rpc_msg_rsp_header header;
+    if (!recv_data(conn.sock->fd, &header, sizeof(header))) {
         return false;
     }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
+    const rpc_pending_cmd cmd = conn.pending.front();
+    conn.pending.pop_front();
+    if (header.id != cmd.id || header.size != cmd.output_size) {
+        fprintf(stderr, "Unexpected RPC response %u of size %" PRIu64 " to request %u\n", header.id, header.size, cmd.id);
         return false;
     }
-    if (!send_data(sock->fd, input, input_size)) {
+    if (cmd.output != nullptr) {
+        conn.n_pending_outputs--;
+        return recv_data(conn.sock->fd, cmd.output, cmd.output_size);
+    }
+    conn.scratch.resize(cmd.output_size);
+    if (!recv_data(conn.sock->fd, conn.scratch.data(), cmd.output_size)) {
         return false;
     }
-    // TODO: currently the output_size is always known, do we need support for commands with variable output size?
-    // even if we do, we can skip sending output_size from the server for commands with known output size
-    uint64_t out_size;
-    if (!recv_data(sock->fd, &out_size, sizeof(out_size))) {
+    if (cmd.cmd == RPC_CMD_GRAPH_COMPUTE && conn.scratch[0] != GGML_STATUS_SUCCESS) {
+        conn.compute_status = conn.scratch[0];
+    }
+    return true;
+}
+
+// send the queued requests and wait for all the responses
+static bool rpc_wait(rpc_connection & conn) {
+    if (!rpc_flush(conn)) {
         return false;
     }
-    if (out_size != output_size) {
+    while (!conn.pending.empty()) {
+        if (!rpc_recv_rsp(conn)) {
+            return false;
+        }
+    }
+    conn.n_rsp_bytes = 0;
+    conn.n_req_bytes = 0;
+    return true;
+}
+
+static bool rpc_resolve_lookups(rpc_connection & conn);
+
+// whether a request may use the data of the weights that are being looked up
+static bool rpc_uses_lookups(const rpc_connection & conn, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    switch (cmd) {
+        case RPC_CMD_ALLOC_BUFFER:
+        case RPC_CMD_GET_ALIGNMENT:
+        case RPC_CMD_GET_MAX_SIZE:
+        case RPC_CMD_BUFFER_GET_BASE:
+        case RPC_CMD_GET_DEVICE_MEMORY:
+        case RPC_CMD_HELLO:
+        case RPC_CMD_SET_TENSOR_HASH:
+            return false;
+        case RPC_CMD_SET_TENSOR: {
+            // the other weights are uploaded while the lookups are in flight, unless they overlap
+            rpc_tensor tensor;
+            uint64_t offset;
+            memcpy(&tensor, input, sizeof(tensor));
+            memcpy(&offset, (const uint8_t *)input + sizeof(tensor), sizeof(offset));
+            const uint64_t p0 = tensor.data + offset;
+            const uint64_t p1 = p0 + input_size - sizeof(tensor) - sizeof(offset);
+            for (const auto & lookup : conn.lookups) {
+                const uint64_t q0 = lookup->request.tensor.data + lookup->request.offset;
+                const uint64_t q1 = q0 + lookup->request.size;
+                if (p0 < q1 && q0 < p1) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            return true;
+    }
+}
+
+// queue a request without waiting for its response
+// the response is written to output by a later rpc_wait, if output is nullptr it is only checked
+static bool rpc_queue_cmd(rpc_connection & conn, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    // the server must have the data of the weights before the requests that use it
+    if (!conn.lookups.empty() && rpc_uses_lookups(conn, cmd, input, input_size) && !rpc_resolve_lookups(conn)) {
         return false;
     }
-    if (!recv_data(sock->fd, output, output_size)) {
+
+    rpc_msg_req_header header = { (uint8_t)cmd, conn.next_id++, input_size };
+    const size_t req_size = sizeof(header) + input_size;
+
+    bool backlog = conn.n_rsp_bytes > RPC_MAX_IN_FLIGHT;
+    if (backlog && conn.n_req_bytes + req_size > RPC_MAX_IN_FLIGHT) {
+        if (!rpc_wait(conn)) {
+            return false;
+        }
+        backlog = false;
+    }
+
+    if (input_size > RPC_MAX_BATCH_REQ) {
+        if (!rpc_flush(conn) || !send_data(conn.sock->fd, &header, sizeof(header)) || !send_data(conn.sock->fd, input, input_size)) {
+            return false;
+        }
+    } else {
+        const size_t pos = conn.batch.size();
+        conn.batch.resize(pos + req_size);
+        memcpy(conn.batch.data() + pos, &header, sizeof(header));
+        if (input_size > 0) {
+            memcpy(conn.batch.data() + pos + sizeof(header), input, input_size);
+        }
+        conn.n_batch++;
+        if (conn.batch.size() > RPC_MAX_BATCH_SIZE && !rpc_flush(conn)) {
+            return false;
+        }
+    }
+
+    conn.pending.push_back({header.id, (uint8_t)cmd, output, output_size});
+    conn.n_pending_outputs += output != nullptr;
+    conn.n_rsp_bytes += sizeof(rpc_msg_rsp_header) + output_size;
+    conn.n_req_bytes  = backlog ? conn.n_req_bytes + req_size : 0;
+    return true;
+}
+
+// wait for the responses of the lookups and upload the weights that the server does not have
+static bool rpc_resolve_lookups(rpc_connection & conn) {
+    if (conn.lookups.empty()) {
+        return true;
+    }
+    std::vector<std::unique_ptr<rpc_lookup>> lookups = std::move(conn.lookups);
+    conn.lookups.clear();
+    conn.n_lookup_bytes = 0;
+    if (!rpc_wait(conn)) {
         return false;
     }
+    for (const auto & lookup : lookups) {
+        if (!lookup->response.result &&
+            !rpc_queue_cmd(conn, RPC_CMD_SET_TENSOR, lookup->upload.data(), lookup->upload.size(), nullptr, 0)) {
+            return false;
+        }
+    }
     return true;
 }
 
+// send a request and wait for its response
+static bool send_rpc_cmd(const std::shared_ptr<rpc_connection> & conn, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    std::lock_guard<std::mutex> lock(conn->mutex);
+    return rpc_queue_cmd(*conn, cmd, input, input_size, output, output_size) && rpc_wait(*conn);
+}
+
+// send a request without waiting for its response - the output must stay valid until the connection is synchronized
+static bool send_rpc_cmd_async(const std::shared_ptr<rpc_connection> & conn, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    std::lock_guard<std::mutex> lock(conn->mutex);
+    return rpc_queue_cmd(*conn, cmd, input, input_size, output, output_size);
+}
+
+rpc_connection::~rpc_connection() {
+    // the outputs of the pending requests must not be written after they are gone
+    rpc_wait(*this);
+}
+
 // RPC client-side implementation
 
-static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
+static std::shared_ptr<rpc_connection> get_connection(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
-    static std::unordered_map<std::string, std::weak_ptr<socket_t>> sockets;
+    static std::unordered_map<std::string, std::weak_ptr<rpc_connection>> connections;
     static bool initialized = false;
 
-    auto it = sockets.find(endpoint);
-    if (it != sockets.end()) {
-        if (auto sock = it->second.lock()) {
-            return sock;
+    auto it = connections.find(endpoint);
+    if (it != connections.end()) {
+        if (auto conn = it->second.lock()) {
+            return conn;
         }
     }
     std::string host;
@@ -404,14 +742,37 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
         return nullptr;
     }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
-    sockets[endpoint] = sock;
-    return sock;
+    auto conn = std::make_shared<rpc_connection>(sock);
+    rpc_msg_hello_rsp response;
+    if (!send_rpc_cmd(conn, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response))) {
+        fprintf(stderr, "Failed to negotiate the RPC protocol with %s, the server may be too old\n", endpoint.c_str());
+        return nullptr;
+    }
+    if (response.major != RPC_PROTO_MAJOR_VERSION) {
+        fprintf(stderr, "RPC server %s uses protocol version %d.%d.%d, expected %d.x.x\n", endpoint.c_str(),
+                response.major, response.minor, response.patch, RPC_PROTO_MAJOR_VERSION);
+        return nullptr;
+    }
+    conn->server_version = response;
+    if (response.minor >= 1) {
+        conn->graphs.resize(RPC_GRAPH_CACHE_SIZE);
+    }
+    connections[endpoint] = conn;
+    return conn;
 }
 
 static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_msg_free_buffer_req request = {ctx->remote_ptr};
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
+    bool status;
+    {
+        std::lock_guard<std::mutex> lock(ctx->conn->mutex);
+        // the server drops its graph cache when a buffer is freed, since the graphs may point to it
+        for (auto & graph : ctx->conn->graphs) {
+            graph.valid = false;
+        }
+        status = rpc_queue_cmd(*ctx->conn, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
+    }
     GGML_ASSERT(status);
     delete ctx;
 }
@@ -423,7 +784,7 @@ static void * ggml_backend_rpc_buffer_get_base(ggml_backend_buffer_t buffer) {
     }
     rpc_msg_buffer_get_base_req request = {ctx->remote_ptr};
     rpc_msg_buffer_get_base_rsp response;
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_GET_BASE, &request, sizeof(request), &response, sizeof(response));
+    bool status = send_rpc_cmd(ctx->conn, RPC_CMD_BUFFER_GET_BASE, &request, sizeof(request), &response, sizeof(response));
     GGML_ASSERT(status);
     void * base_ptr = reinterpret_cast<void *>(response.base_ptr);
     ctx->base_cache[buffer] = base_ptr;
@@ -431,7 +792,8 @@ static void * ggml_backend_rpc_buffer_get_base(ggml_backend_buffer_t buffer) {
 }
 
 static rpc_tensor serialize_tensor(const ggml_tensor * tensor) {
-    rpc_tensor result;
+    // zero-initialized, so that serialized tensors can be compared with memcmp
+    rpc_tensor result = {};
     result.id = reinterpret_cast<uint64_t>(tensor);
     result.type = tensor->type;
     if (tensor->buffer) {
@@ -477,7 +839,29 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
+    if (size >= RPC_CACHE_MIN_SIZE && ggml_backend_buffer_get_usage(buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS &&
+        (ctx->conn->server_version.caps & RPC_CAP_WEIGHT_CACHE)) {
+        // the server may have the data in its cache - the lookup is sent without waiting for its response, the
+        // next weights are hashed and looked up in the meantime and the misses are uploaded when the lookups are resolved
+        std::unique_ptr<rpc_lookup> lookup(new rpc_lookup());
+        lookup->request.tensor = rpc_tensor;
+        lookup->request.offset = offset;
+        lookup->request.size = size;
+        rpc_data_hash(data, size, lookup->request.hash);
+        lookup->upload = std::move(input);
+        std::lock_guard<std::mutex> lock(ctx->conn->mutex);
+        rpc_connection & conn = *ctx->conn;
+        bool status = rpc_queue_cmd(conn, RPC_CMD_SET_TENSOR_HASH, &lookup->request, sizeof(lookup->request), &lookup->response, sizeof(lookup->response));
+        conn.lookups.push_back(std::move(lookup));
+        conn.n_lookup_bytes += size;
+        if (status && conn.n_lookup_bytes > RPC_MAX_LOOKUP_SIZE) {
+            status = rpc_resolve_lookups(conn);
+        }
+        GGML_ASSERT(status);
+        return;
+    }
+    // the server executes the requests in order, so there is no need to wait for the response
+    bool status = send_rpc_cmd_async(ctx->conn, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
     GGML_ASSERT(status);
 }
 
@@ -487,7 +871,7 @@ static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, con
     request.tensor = serialize_tensor(tensor);
     request.offset = offset;
     request.size = size;
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    bool status = send_rpc_cmd(ctx->conn, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
     GGML_ASSERT(status);
 }
 
@@ -497,7 +881,7 @@ static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, con
     ggml_backend_rpc_buffer_context * src_ctx = (ggml_backend_rpc_buffer_context *)src_buffer->context;
     ggml_backend_buffer_t dst_buffer = dst->buffer;
     ggml_backend_rpc_buffer_context * dst_ctx = (ggml_backend_rpc_buffer_context *)dst_buffer->context;
-    if (src_ctx->sock != dst_ctx->sock) {
+    if (src_ctx->conn != dst_ctx->conn) {
         return false;
     }
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
@@ -505,7 +889,7 @@ static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, con
     request.src = serialize_tensor(src);
     request.dst = serialize_tensor(dst);
     rpc_msg_copy_tensor_rsp response;
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_COPY_TENSOR, &request, sizeof(request), &response, sizeof(response));
+    bool status = send_rpc_cmd(ctx->conn, RPC_CMD_COPY_TENSOR, &request, sizeof(request), &response, sizeof(response));
     GGML_ASSERT(status);
     return response.result;
 }
@@ -513,7 +897,7 @@ static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, con
 static void ggml_backend_rpc_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_msg_buffer_clear_req request = {ctx->remote_ptr, value};
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_CLEAR, &request, sizeof(request), nullptr, 0);
+    bool status = send_rpc_cmd_async(ctx->conn, RPC_CMD_BUFFER_CLEAR, &request, sizeof(request), nullptr, 0);
     GGML_ASSERT(status);
 }
 
@@ -538,13 +922,13 @@ static ggml_backend_buffer_t ggml_backend_rpc_buffer_type_alloc_buffer(ggml_back
     ggml_backend_rpc_buffer_type_context * buft_ctx = (ggml_backend_rpc_buffer_type_context *)buft->context;
     rpc_msg_alloc_buffer_req request = {size};
     rpc_msg_alloc_buffer_rsp response;
-    auto sock = get_socket(buft_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_ALLOC_BUFFER, &request, sizeof(request), &response, sizeof(response));
+    auto conn = get_connection(buft_ctx->endpoint);
+    bool status = send_rpc_cmd(conn, RPC_CMD_ALLOC_BUFFER, &request, sizeof(request), &response, sizeof(response));
     GGML_ASSERT(status);
     if (response.remote_ptr != 0) {
         ggml_backend_buffer_t buffer = ggml_backend_buffer_init(buft,
             ggml_backend_rpc_buffer_interface,
-            new ggml_backend_rpc_buffer_context{sock, {}, response.remote_ptr},
+            new ggml_backend_rpc_buffer_context{conn, {}, response.remote_ptr},
             response.remote_size);
         return buffer;
     } else {
@@ -552,9 +936,9 @@ static ggml_backend_buffer_t ggml_backend_rpc_buffer_type_alloc_buffer(ggml_back
     }
 }
 
-static size_t get_alignment(const std::shared_ptr<socket_t> & sock) {
+static size_t get_alignment(const std::shared_ptr<rpc_connection> & conn) {
     rpc_msg_get_alignment_rsp response;
-    bool status = send_rpc_cmd(sock, RPC_CMD_GET_ALIGNMENT, nullptr, 0, &response, sizeof(response));
+    bool status = send_rpc_cmd(conn, RPC_CMD_GET_ALIGNMENT, nullptr, 0, &response, sizeof(response));
     GGML_ASSERT(status);
     return response.alignment;
 }
@@ -564,9 +948,9 @@ static size_t ggml_backend_rpc_buffer_type_get_alignment(ggml_backend_buffer_typ
     return buft_ctx->alignment;
 }
 
-static size_t get_max_size(const std::shared_ptr<socket_t> & sock) {
+static size_t get_max_size(const std::shared_ptr<rpc_connection> & conn) {
     rpc_msg_get_max_size_rsp response;
-    bool status = send_rpc_cmd(sock, RPC_CMD_GET_MAX_SIZE, nullptr, 0, &response, sizeof(response));
+    bool status = send_rpc_cmd(conn, RPC_CMD_GET_MAX_SIZE, nullptr, 0, &response, sizeof(response));
     GGML_ASSERT(status);
     return response.max_size;
 }
@@ -602,9 +986,40 @@ static void ggml_backend_rpc_free(ggml_backend_t backend) {
     delete backend;
 }
 
-static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
+static void ggml_backend_rpc_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    GGML_ASSERT(tensor->buffer->iface.get_base == ggml_backend_rpc_buffer_get_base && "unsupported buffer type");
+    // the buffer already sends the data without waiting
+    ggml_backend_rpc_buffer_set_tensor(tensor->buffer, tensor, data, offset, size);
+
+    UNUSED(backend);
+}
+
+static void ggml_backend_rpc_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    GGML_ASSERT(tensor->buffer->iface.get_base == ggml_backend_rpc_buffer_get_base && "unsupported buffer type");
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)tensor->buffer->context;
+    rpc_msg_get_tensor_req request;
+    request.tensor = serialize_tensor(tensor);
+    request.offset = offset;
+    request.size = size;
+    bool status = send_rpc_cmd_async(ctx->conn, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    GGML_ASSERT(status);
+
     UNUSED(backend);
-    // this is no-op because we don't have any async operations
+}
+
+static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto conn = get_connection(rpc_ctx->endpoint);
+    GGML_ASSERT(conn != nullptr);
+    std::lock_guard<std::mutex> lock(conn->mutex);
+    // the server executes the requests in order, so the client only has to wait for the data it reads back,
+    // the other requests are only sent
+    bool status = rpc_resolve_lookups(*conn) && (conn->n_pending_outputs > 0 ? rpc_wait(*conn) : rpc_flush(*conn));
+    GGML_ASSERT(status);
+    if (conn->compute_status != GGML_STATUS_SUCCESS) {
+        // the status is kept and returned by the next graph compute
+        fprintf(stderr, "RPC graph compute failed with status %d\n", conn->compute_status);
+    }
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -622,44 +1037,162 @@ static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors,
     tensors.push_back(serialize_tensor(tensor));
 }
 
-static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & output) {
-    uint32_t n_nodes = cgraph->n_nodes;
-    std::vector<rpc_tensor> tensors;
-    std::unordered_set<ggml_tensor*> visited;
-    for (uint32_t i = 0; i < n_nodes; i++) {
-        add_tensor(cgraph->nodes[i], tensors, visited);
-    }
+static void serialize_graph(const std::vector<uint64_t> & nodes, const std::vector<rpc_tensor> & tensors, std::vector<uint8_t> & output) {
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
+    // the graph is appended to output
+    uint32_t n_nodes = nodes.size();
     uint32_t n_tensors = tensors.size();
-    int output_size = sizeof(uint32_t) + n_nodes * sizeof(uint64_t) + sizeof(uint32_t) + n_tensors * sizeof(rpc_tensor);
-    output.resize(output_size, 0);
-    memcpy(output.data(), &n_nodes, sizeof(n_nodes));
-    for (uint32_t i = 0; i < n_nodes; i++) {
-        memcpy(output.data() + sizeof(n_nodes) + i * sizeof(uint64_t), &cgraph->nodes[i], sizeof(uint64_t));
+    size_t pos = output.size();
+    output.resize(pos + sizeof(uint32_t) + n_nodes * sizeof(uint64_t) + sizeof(uint32_t) + n_tensors * sizeof(rpc_tensor), 0);
+    memcpy(output.data() + pos, &n_nodes, sizeof(n_nodes));
+    pos += sizeof(n_nodes);
+    memcpy(output.data() + pos, nodes.data(), n_nodes * sizeof(uint64_t));
+    pos += n_nodes * sizeof(uint64_t);
+    memcpy(output.data() + pos, &n_tensors, sizeof(n_tensors));
+    pos += sizeof(n_tensors);
+    memcpy(output.data() + pos, tensors.data(), n_tensors * sizeof(rpc_tensor));
+}
+
+// hash of the topology of a graph, the parameters of the tensors (shapes, offsets, data) are not included
+static uint64_t graph_hash(const std::vector<uint64_t> & nodes, const std::vector<rpc_tensor> & tensors) {
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    auto add = [&hash](const void * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= ((const uint8_t *)data)[i];
+            hash *= 0x100000001b3ULL;
+        }
+    };
+    add(nodes.data(), nodes.size() * sizeof(uint64_t));
+    for (const auto & t : tensors) {
+        add(&t.id, sizeof(t.id));
+        add(&t.type, sizeof(t.type));
+        add(&t.op, sizeof(t.op));
+        add(t.src, sizeof(t.src));
+        add(&t.view_src, sizeof(t.view_src));
+    }
+    return hash;
+}
+
+static bool graph_same_topology(const rpc_cached_graph & graph, const std::vector<uint64_t> & nodes, const std::vector<rpc_tensor> & tensors) {
+    if (graph.nodes != nodes || graph.tensors.size() != tensors.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const rpc_tensor & a = graph.tensors[i];
+        const rpc_tensor & b = tensors[i];
+        if (a.id != b.id || a.type != b.type || a.op != b.op || a.view_src != b.view_src || memcmp(a.src, b.src, sizeof(a.src)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// prepare the request to compute a graph through the graph cache of the server:
+// a graph with the same topology as a cached one is sent as the list of the tensors that changed since its last computation,
+// other graphs are sent in full and stored in the least recently used slot
+// RPC_CMD_GRAPH_COMPUTE_CACHE: | slot (4 bytes) | hash (8 bytes) | serialized graph |
+// RPC_CMD_GRAPH_RECOMPUTE    : | slot (4 bytes) | hash (8 bytes) | n_changes (4 bytes) | (index (4 bytes) | rpc_tensor) * n_changes |
+static enum rpc_cmd serialize_graph_cached(rpc_connection & conn, std::vector<uint64_t> & nodes, std::vector<rpc_tensor> & tensors, std::vector<uint8_t> & output) {
+    const uint64_t hash = graph_hash(nodes, tensors);
+    conn.n_graphs_computed++;
+
+    uint32_t slot = 0;
+    for (uint32_t i = 0; i < conn.graphs.size(); ++i) {
+        if (!conn.graphs[i].valid) {
+            slot = i;
+            break;
+        }
+        if (conn.graphs[i].last_used < conn.graphs[slot].last_used) {
+            slot = i;
+        }
+    }
+    for (uint32_t i = 0; i < conn.graphs.size(); ++i) {
+        rpc_cached_graph & graph = conn.graphs[i];
+        if (!graph.valid || graph.hash != hash || !graph_same_topology(graph, nodes, tensors)) {
+            continue;
+        }
+        std::vector<uint32_t> changed;
+        for (uint32_t j = 0; j < tensors.size(); ++j) {
+            if (memcmp(&graph.tensors[j], &tensors[j], sizeof(rpc_tensor)) != 0) {
+                changed.push_back(j);
+            }
+        }
+        graph.last_used = conn.n_graphs_computed;
+        if (changed.size() > tensors.size() / 2) {
+            // the full graph is smaller
+            slot = i;
+            break;
+        }
+        rpc_msg_graph_cache_header header = { i, hash };
+        uint32_t n_changes = changed.size();
+        output.resize(sizeof(header) + sizeof(n_changes) + n_changes * (sizeof(uint32_t) + sizeof(rpc_tensor)));
+        uint8_t * dst = output.data();
+        memcpy(dst, &header, sizeof(header));
+        dst += sizeof(header);
+        memcpy(dst, &n_changes, sizeof(n_changes));
+        dst += sizeof(n_changes);
+        for (uint32_t j : changed) {
+            memcpy(dst, &j, sizeof(j));
+            dst += sizeof(j);
+            memcpy(dst, &tensors[j], sizeof(rpc_tensor));
+            dst += sizeof(rpc_tensor);
+        }
+        graph.tensors.swap(tensors);
+        return RPC_CMD_GRAPH_RECOMPUTE;
     }
-    uint32_t * out_ntensors = (uint32_t *)(output.data() + sizeof(n_nodes) + n_nodes * sizeof(uint64_t));
-    *out_ntensors = n_tensors;
-    rpc_tensor * out_tensors = (rpc_tensor *)(output.data() + sizeof(n_nodes) + n_nodes * sizeof(uint64_t) + sizeof(uint32_t));
-    memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
+
+    rpc_msg_graph_cache_header header = { slot, hash };
+    output.resize(sizeof(header));
+    memcpy(output.data(), &header, sizeof(header));
+    serialize_graph(nodes, tensors, output);
+
+    rpc_cached_graph & graph = conn.graphs[slot];
+    graph.valid = true;
+    graph.hash = hash;
+    graph.last_used = conn.n_graphs_computed;
+    graph.nodes.swap(nodes);
+    graph.tensors.swap(tensors);
+    return RPC_CMD_GRAPH_COMPUTE_CACHE;
 }
 
 static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    std::vector<uint64_t> nodes(cgraph->n_nodes);
+    std::vector<rpc_tensor> tensors;
+    std::unordered_set<ggml_tensor*> visited;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        nodes[i] = reinterpret_cast<uint64_t>(cgraph->nodes[i]);
+        add_tensor(cgraph->nodes[i], tensors, visited);
+    }
+    auto conn = get_connection(rpc_ctx->endpoint);
+    std::lock_guard<std::mutex> lock(conn->mutex);
+    // the graphs are computed asynchronously, their results arrive with the responses to the later requests:
+    // a failure of a previous graph is returned here, by the first graph compute after it is received
+    if (conn->compute_status != GGML_STATUS_SUCCESS) {
+        const enum ggml_status prev_status = (enum ggml_status) (int8_t) conn->compute_status;
+        conn->compute_status = GGML_STATUS_SUCCESS;
+        return prev_status;
+    }
     std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
-    auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+    enum rpc_cmd cmd = RPC_CMD_GRAPH_COMPUTE;
+    if (conn->graphs.empty()) {
+        serialize_graph(nodes, tensors, input);
+    } else {
+        cmd = serialize_graph_cached(*conn, nodes, tensors, input);
+    }
+    // the result is checked by the next synchronization, which is when the outputs can be read
+    // a failure is logged there and returned by the next graph compute
+    bool status = rpc_queue_cmd(*conn, cmd, input.data(), input.size(), nullptr, sizeof(rpc_msg_graph_compute_rsp));
     GGML_ASSERT(status);
-    return (enum ggml_status)response.result;
+    return GGML_STATUS_SUCCESS;
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
     /* .get_name                = */ ggml_backend_rpc_name,
     /* .free                    = */ ggml_backend_rpc_free,
-    /* .set_tensor_async        = */ NULL,
-    /* .get_tensor_async        = */ NULL,
+    /* .set_tensor_async        = */ ggml_backend_rpc_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_rpc_get_tensor_async,
     /* .cpy_tensor_async        = */ NULL,
     /* .synchronize             = */ ggml_backend_rpc_synchronize,
     /* .graph_plan_create       = */ NULL,
@@ -680,13 +1213,13 @@ GGML_API ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * en
     if (it != buft_map.end()) {
         return it->second;
     }
-    auto sock = get_socket(endpoint);
-    if (sock == nullptr) {
+    auto conn = get_connection(endpoint);
+    if (conn == nullptr) {
         fprintf(stderr, "Failed to connect to %s\n", endpoint);
         return nullptr;
     }
-    size_t alignment = get_alignment(sock);
-    size_t max_size = get_max_size(sock);
+    size_t alignment = get_alignment(conn);
+    size_t max_size = get_max_size(conn);
     ggml_backend_rpc_buffer_type_context * buft_ctx = new ggml_backend_rpc_buffer_type_context {
         /* .endpoint  = */ endpoint,
         /* .name      = */ "RPC[" + std::string(endpoint) + "]",
@@ -722,73 +1255,387 @@ GGML_API bool ggml_backend_is_rpc(ggml_backend_t backend) {
     return backend != NULL && ggml_guid_matches(backend->guid, ggml_backend_rpc_guid());
 }
 
-static void get_device_memory(const std::shared_ptr<socket_t> & sock, size_t * free, size_t * total) {
+static void get_device_memory(const std::shared_ptr<rpc_connection> & conn, size_t * free, size_t * total) {
     rpc_msg_get_device_memory_rsp response;
-    bool status = send_rpc_cmd(sock, RPC_CMD_GET_DEVICE_MEMORY, nullptr, 0, &response, sizeof(response));
+    bool status = send_rpc_cmd(conn, RPC_CMD_GET_DEVICE_MEMORY, nullptr, 0, &response, sizeof(response));
     GGML_ASSERT(status);
     *free = response.free_mem;
     *total = response.total_mem;
 }
 
 GGML_API void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total) {
-    auto sock = get_socket(endpoint);
-    if (sock == nullptr) {
+    auto conn = get_connection(endpoint);
+    if (conn == nullptr) {
         *free = 0;
         *total = 0;
         return;
     }
-    get_device_memory(sock, free, total);
+    get_device_memory(conn, free, total);
 }
 
 // RPC server-side implementation
 
-class rpc_server {
-public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
-    ~rpc_server();
+// a deserialized graph kept by the server for later computations
+struct rpc_server_graph {
+    uint64_t hash = 0;
+    ggml_context * ctx = nullptr;
+    ggml_cgraph * graph = nullptr;
+    std::vector<ggml_tensor *> tensors; // in the order of the request
+    std::vector<uint64_t> data;         // the data pointers of the client, before resolving the shared weights
 
-    void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
-    void get_alignment(rpc_msg_get_alignment_rsp & response);
-    void get_max_size(rpc_msg_get_max_size_rsp & response);
-    bool buffer_get_base(const rpc_msg_buffer_get_base_req & request, rpc_msg_buffer_get_base_rsp & response);
-    bool free_buffer(const rpc_msg_free_buffer_req & request);
-    bool buffer_clear(const rpc_msg_buffer_clear_req & request);
-    bool set_tensor(const std::vector<uint8_t> & input);
-    bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
-    bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
-    bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
+    void clear() {
+        ggml_free(ctx);
+        ctx = nullptr;
+        graph = nullptr;
+        tensors.clear();
+        data.clear();
+    }
+};
 
-private:
-    ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
-    ggml_tensor * create_node(uint64_t id,
-                              struct ggml_context * ctx,
-                              const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
-                              std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
+// a read-only mapping of a file of the weight cache
+struct rpc_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
 
+    rpc_mmap() {}
+    rpc_mmap(const rpc_mmap &) = delete;
+    rpc_mmap & operator=(const rpc_mmap &) = delete;
 
-    ggml_backend_t backend;
-    std::unordered_set<ggml_backend_buffer_t> buffers;
-};
+    // fails if the file does not have the expected size
+    bool open(const std::string & path, size_t expected_size) {
+        if (expected_size == 0) {
+            return false;
+        }
+#ifdef _WIN32
+        HANDLE hfile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hfile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        HANDLE hmap = NULL;
+        if (GetFileSizeEx(hfile, &file_size) && (uint64_t) file_size.QuadPart == expected_size) {
+            hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+        CloseHandle(hfile);
+        if (hmap == NULL) {
+            return false;
+        }
+        addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hmap);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64_t) st.st_size == expected_size) {
+            addr = mmap(NULL, expected_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                addr = nullptr;
+            }
+        }
+        close(fd);
+#endif
+        size = addr != nullptr ? expected_size : 0;
+        return addr != nullptr;
+    }
 
-void rpc_server::alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response) {
-    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
-    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(buft, request.size);
-    response.remote_ptr = 0;
-    response.remote_size = 0;
-    if (buffer != nullptr) {
-        response.remote_ptr = reinterpret_cast<uint64_t>(buffer);
-        response.remote_size = buffer->size;
-        GGML_PRINT_DEBUG("[%s] size: %" PRIu64 " -> remote_ptr: %" PRIx64 ", remote_size: %" PRIu64 "\n", __func__, request.size, response.remote_ptr, response.remote_size);
-        buffers.insert(buffer);
-    } else {
-        GGML_PRINT_DEBUG("[%s] size: %" PRIu64 " -> failed\n", __func__, request.size);
+    ~rpc_mmap() {
+        if (addr == nullptr) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(addr);
+#else
+        munmap(addr, size);
+#endif
     }
-}
+};
 
-void rpc_server::get_alignment(rpc_msg_get_alignment_rsp & response) {
-    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
-    size_t alignment = ggml_backend_buft_get_alignment(buft);
-    GGML_PRINT_DEBUG("[%s] alignment: %lu\n", __func__, alignment);
+// the files of the weight cache, named after the hash of their content
+// the least recently used files are removed when the cache grows beyond its budget, the times of use are kept in
+// the modification times of the files so that they survive the restarts of the server
+struct rpc_disk_cache {
+    struct entry {
+        uint64_t size;
+        uint64_t last_used;
+    };
+
+    std::string dir; // empty when the cache is disabled
+    size_t max_size = 0;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, entry> entries;
+    size_t total_size = 0;
+    uint64_t n_used = 0;
+
+    void init(const std::string & cache_dir, size_t cache_size) {
+        dir = cache_dir;
+        if (dir.empty()) {
+            return;
+        }
+        if (dir.back() != '/' && dir.back() != '\\') {
+            dir += '/';
+        }
+        max_size = cache_size;
+
+        std::vector<std::pair<time_t, std::string>> files;
+        for (const std::string & name : list_files()) {
+            struct stat st;
+            if (stat(path(name).c_str(), &st) != 0) {
+                continue;
+            }
+            if (name.size() != 2*RPC_HASH_SIZE || name.find_first_not_of("0123456789abcdef") != std::string::npos) {
+                // the temporary files of the writes that were interrupted
+                if (name.size() > 2*RPC_HASH_SIZE && name.compare(2*RPC_HASH_SIZE, 4, ".tmp") == 0) {
+                    remove(path(name).c_str());
+                }
+                continue;
+            }
+            files.emplace_back(st.st_mtime, name);
+            entries[name] = { (uint64_t) st.st_size, 0 };
+            total_size += st.st_size;
+        }
+        std::sort(files.begin(), files.end());
+        for (const auto & file : files) {
+            entries[file.second].last_used = ++n_used;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        evict();
+    }
+
+    std::string path(const std::string & name) const {
+        return dir + name;
+    }
+
+    // whether the cache has a file of this size, which becomes the most recently used one
+    bool find(const std::string & name, uint64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(name);
+        if (it == entries.end() || it->second.size != size) {
+            return false;
+        }
+        it->second.last_used = ++n_used;
+        utime(path(name).c_str(), NULL);
+        return true;
+    }
+
+    // write a file to the cache, tmp_suffix makes the name of its temporary file unique among the writers
+    bool store(const std::string & name, const void * data, size_t size, const std::string & tmp_suffix) {
+        if (max_size > 0 && size > max_size) {
+            return false;
+        }
+        const std::string file = path(name);
+        const std::string file_tmp = file + ".tmp" + tmp_suffix;
+        FILE * f = fopen(file_tmp.c_str(), "wb");
+        bool ok = f != nullptr && fwrite(data, 1, size, f) == size;
+        if (f != nullptr) {
+            ok = fclose(f) == 0 && ok;
+        }
+        if (ok) {
+            // the file is replaced while the lock is held, so that it cannot be evicted before it is counted
+            std::lock_guard<std::mutex> lock(mutex);
+            ok = rename(file_tmp.c_str(), file.c_str()) == 0;
+            if (ok) {
+                auto it = entries.find(name);
+                if (it != entries.end()) {
+                    total_size -= it->second.size;
+                }
+                entries[name] = { size, ++n_used };
+                total_size += size;
+                evict();
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "Failed to write cache file %s\n", file.c_str());
+            remove(file_tmp.c_str());
+        }
+        return ok;
+    }
+
+private:
+    // remove the least recently used files until the cache is within its budget
+    // the files that are mapped stay valid until they are unmapped
+    void evict() {
+        while (max_size > 0 && total_size > max_size && !entries.empty()) {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.last_used < lru->second.last_used) {
+                    lru = it;
+                }
+            }
+            remove(path(lru->first).c_str());
+            total_size -= lru->second.size;
+            entries.erase(lru);
+        }
+    }
+
+    std::vector<std::string> list_files() const {
+        std::vector<std::string> names;
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE h = FindFirstFileA((dir + "*").c_str(), &data);
+        if (h == INVALID_HANDLE_VALUE) {
+            return names;
+        }
+        do {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                names.push_back(data.cFileName);
+            }
+        } while (FindNextFileA(h, &data));
+        FindClose(h);
+#else
+        DIR * d = opendir(dir.c_str());
+        if (d == nullptr) {
+            return names;
+        }
+        while (struct dirent * e = readdir(d)) {
+            if (e->d_name[0] != '.') {
+                names.push_back(e->d_name);
+            }
+        }
+        closedir(d);
+#endif
+        return names;
+    }
+};
+
+// the data of a weight, shared by all the clients that uploaded the same content
+struct rpc_shared_weight {
+    std::string hash;
+    uint64_t size;
+    ggml_backend_buffer_t buffer;
+    std::unique_ptr<rpc_mmap> mapping; // the file of the cache that holds the data of the buffer, if any
+
+    ~rpc_shared_weight() {
+        ggml_backend_buffer_free(buffer);
+    }
+
+    uint64_t base() const {
+        return (uint64_t) ggml_backend_buffer_get_base(buffer);
+    }
+};
+
+// read-only weights in the memory of a CPU backend, keyed by the hash of their content (and size)
+// an entry is freed when the last client that uses it frees its buffer or disconnects
+struct rpc_weight_pool {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::weak_ptr<rpc_shared_weight>> weights;
+
+    std::shared_ptr<rpc_shared_weight> find(const std::string & hash, uint64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = weights.find(hash);
+        if (it == weights.end()) {
+            return nullptr;
+        }
+        auto weight = it->second.lock();
+        if (weight == nullptr) {
+            weights.erase(it);
+            return nullptr;
+        }
+        return weight->size == size ? weight : nullptr;
+    }
+
+    // takes the ownership of the buffer and of its mapping, returns the entry of another client if it was added first
+    std::shared_ptr<rpc_shared_weight> add(const std::string & hash, uint64_t size, ggml_backend_buffer_t buffer, rpc_mmap * mapping = nullptr) {
+        auto weight = std::shared_ptr<rpc_shared_weight>(new rpc_shared_weight { hash, size, buffer, std::unique_ptr<rpc_mmap>(mapping) });
+        std::lock_guard<std::mutex> lock(mutex);
+        auto & entry = weights[hash];
+        auto existing = entry.lock();
+        if (existing != nullptr && existing->size == size) {
+            return existing;
+        }
+        if (existing == nullptr) {
+            entry = weight;
+        }
+        return weight;
+    }
+};
+
+// state shared by the connections of a server
+struct rpc_server_context {
+    ggml_backend_t backend;
+    bool share_weights; // identical weights of the clients are stored once, in the pool
+    rpc_disk_cache cache;
+    size_t free_mem;
+    size_t total_mem;
+
+    std::mutex compute_mutex; // the backends cannot compute several graphs at the same time
+    rpc_weight_pool pool;
+};
+
+// a range of the buffers of a client whose data is in a shared weight
+struct rpc_shared_region {
+    uint64_t size;
+    std::shared_ptr<rpc_shared_weight> weight;
+};
+
+// serves one client, each client only has access to its own buffers
+class rpc_server {
+public:
+    rpc_server(rpc_server_context & shared) : shared(shared), backend(shared.backend), graphs(RPC_GRAPH_CACHE_SIZE) {}
+    ~rpc_server();
+
+    void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
+    void get_alignment(rpc_msg_get_alignment_rsp & response);
+    void get_max_size(rpc_msg_get_max_size_rsp & response);
+    bool buffer_get_base(const rpc_msg_buffer_get_base_req & request, rpc_msg_buffer_get_base_rsp & response);
+    bool free_buffer(const rpc_msg_free_buffer_req & request);
+    bool buffer_clear(const rpc_msg_buffer_clear_req & request);
+    bool set_tensor(const uint8_t * input, size_t input_size);
+    bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
+    bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
+    bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
+    bool graph_compute(const uint8_t * input, size_t input_size, rpc_msg_graph_compute_rsp & response);
+    bool graph_compute_cache(const uint8_t * input, size_t input_size, rpc_msg_graph_compute_rsp & response);
+    bool graph_recompute(const uint8_t * input, size_t input_size, rpc_msg_graph_compute_rsp & response);
+
+private:
+    ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+    void update_tensor(ggml_tensor * result, const rpc_tensor * tensor);
+    bool deserialize_graph(const uint8_t * input, size_t input_size, rpc_server_graph & result);
+    ggml_tensor * create_node(uint64_t id,
+                              struct ggml_context * ctx,
+                              const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
+                              std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
+    ggml_status compute(rpc_server_graph & graph);
+
+    // shared weights
+    std::shared_ptr<rpc_shared_weight> load_shared(const std::string & hash, uint64_t size);
+    void attach(uint64_t data, const std::shared_ptr<rpc_shared_weight> & weight);
+    void detach(uint64_t data, uint64_t size, bool keep_data = true);
+    uint64_t resolve(uint64_t data, uint64_t size);
+
+    rpc_server_context & shared;
+    ggml_backend_t backend;
+    std::unordered_set<ggml_backend_buffer_t> buffers;
+    std::vector<rpc_server_graph> graphs;
+    std::map<uint64_t, rpc_shared_region> regions; // by address in the buffers of the client
+
+    // weight cache, the data of the lookups that missed is stored when the client uploads it, by address
+    std::unordered_map<uint64_t, rpc_msg_set_tensor_hash_req> cache_misses;
+};
+
+void rpc_server::alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response) {
+    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(buft, request.size);
+    response.remote_ptr = 0;
+    response.remote_size = 0;
+    if (buffer != nullptr) {
+        response.remote_ptr = reinterpret_cast<uint64_t>(buffer);
+        response.remote_size = buffer->size;
+        GGML_PRINT_DEBUG("[%s] size: %" PRIu64 " -> remote_ptr: %" PRIx64 ", remote_size: %" PRIu64 "\n", __func__, request.size, response.remote_ptr, response.remote_size);
+        buffers.insert(buffer);
+    } else {
+        GGML_PRINT_DEBUG("[%s] size: %" PRIu64 " -> failed\n", __func__, request.size);
+    }
+}
+
+void rpc_server::get_alignment(rpc_msg_get_alignment_rsp & response) {
+    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+    size_t alignment = ggml_backend_buft_get_alignment(buft);
+    GGML_PRINT_DEBUG("[%s] alignment: %lu\n", __func__, alignment);
     response.alignment = alignment;
 }
 
@@ -818,8 +1665,16 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
         GGML_PRINT_DEBUG("[%s] buffer not found\n", __func__);
         return false;
     }
+    detach((uint64_t) ggml_backend_buffer_get_base(buffer), ggml_backend_buffer_get_size(buffer), false);
     ggml_backend_buffer_free(buffer);
     buffers.erase(buffer);
+    // the cached graphs may point to the buffer (the client drops its copy of the cache too)
+    for (auto & graph : graphs) {
+        graph.clear();
+    }
+    for (auto it = cache_misses.begin(); it != cache_misses.end(); ) {
+        it = it->second.tensor.buffer == request.remote_ptr ? cache_misses.erase(it) : std::next(it);
+    }
     return true;
 }
 
@@ -830,6 +1685,7 @@ bool rpc_server::buffer_clear(const rpc_msg_buffer_clear_req & request) {
         GGML_PRINT_DEBUG("[%s] buffer not found\n", __func__);
         return false;
     }
+    detach((uint64_t) ggml_backend_buffer_get_base(buffer), ggml_backend_buffer_get_size(buffer), false);
     ggml_backend_buffer_clear(buffer, request.value);
     return true;
 }
@@ -837,7 +1693,14 @@ bool rpc_server::buffer_clear(const rpc_msg_buffer_clear_req & request) {
 ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor) {
     ggml_tensor * result = ggml_new_tensor_4d(ctx, (ggml_type) tensor->type,
         tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+    update_tensor(result, tensor);
+    return result;
+}
+
+// set the parameters of a deserialized tensor, the type and the sources are kept
+void rpc_server::update_tensor(ggml_tensor * result, const rpc_tensor * tensor) {
     for (uint32_t i = 0; i < GGML_MAX_DIMS; i++) {
+        result->ne[i] = tensor->ne[i];
         result->nb[i] = tensor->nb[i];
     }
     result->buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor->buffer);
@@ -861,19 +1724,18 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
     result->flags = tensor->flags;
     result->data = reinterpret_cast<void *>(tensor->data);
     ggml_set_name(result, tensor->name);
-    return result;
 }
 
 
-bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
+bool rpc_server::set_tensor(const uint8_t * input, size_t input_size) {
     // serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    if (input.size() < sizeof(rpc_tensor) + sizeof(uint64_t)) {
+    if (input_size < sizeof(rpc_tensor) + sizeof(uint64_t)) {
         return false;
     }
-    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
+    const rpc_tensor * in_tensor = (const rpc_tensor *)input;
     uint64_t offset;
-    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
-    const size_t size = input.size() - sizeof(rpc_tensor) - sizeof(offset);
+    memcpy(&offset, input + sizeof(rpc_tensor), sizeof(offset));
+    const size_t size = input_size - sizeof(rpc_tensor) - sizeof(offset);
 
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -899,12 +1761,160 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
         }
     }
 
-    const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
-    ggml_backend_tensor_set(tensor, data, offset, size);
+    const void * data = input + sizeof(rpc_tensor) + sizeof(offset);
+    const uint64_t p = in_tensor->data + offset;
+
+    // the upload of a cache miss is stored if it has the expected content - the client may write the same address
+    // several times before it uploads the weight of the last lookup
+    bool upload = false;
+    auto miss = cache_misses.find(p);
+    if (miss != cache_misses.end() && miss->second.tensor.buffer == in_tensor->buffer && miss->second.size == size) {
+        uint8_t hash[RPC_HASH_SIZE];
+        rpc_data_hash(data, size, hash);
+        upload = memcmp(hash, miss->second.hash, RPC_HASH_SIZE) == 0;
+    }
+    const std::string hash = upload ? rpc_hash_str(miss->second.hash) : std::string();
+    if (upload) {
+        cache_misses.erase(miss);
+    }
+
+    // the data is written to the cache first, so that a shared weight can map it
+    const bool stored = upload && !shared.cache.dir.empty() &&
+        shared.cache.store(hash, data, size, std::to_string(reinterpret_cast<uintptr_t>(this)));
+
+    // with shared weights, the data goes to the pool and the buffer of the client is left untouched
+    bool shared_weight = false;
+    if (upload && shared.share_weights) {
+        std::shared_ptr<rpc_shared_weight> weight = stored ? load_shared(hash, size) : nullptr;
+        if (weight == nullptr) {
+            ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_get_default_buffer_type(backend), size);
+            if (buffer != nullptr) {
+                memcpy(ggml_backend_buffer_get_base(buffer), data, size);
+                weight = shared.pool.add(hash, size, buffer);
+            }
+        }
+        if (weight != nullptr) {
+            attach(p, weight);
+            shared_weight = true;
+        }
+    }
+    if (!shared_weight) {
+        detach(p, size);
+        ggml_backend_tensor_set(tensor, data, offset, size);
+    }
+    ggml_free(ctx);
+    return true;
+}
+
+bool rpc_server::set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response) {
+    response.result = 0;
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    if (tensor == nullptr) {
+        GGML_PRINT_DEBUG("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    const std::string hash = rpc_hash_str(request.hash);
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 ", hash: %s\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size, hash.c_str());
+
+    // sanitize tensor->data
+    {
+        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
+        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+
+        if (request.tensor.data + request.offset < p0 ||
+            request.tensor.data + request.offset >= p1 ||
+            request.size > (p1 - request.tensor.data - request.offset)) {
+                GGML_ABORT("[%s] tensor->data out of bounds\n", __func__);
+        }
+    }
+
+    if (shared.share_weights) {
+        auto weight = load_shared(hash, request.size);
+        if (weight != nullptr) {
+            attach(request.tensor.data + request.offset, weight);
+            response.result = 1;
+        }
+    } else if (!shared.cache.dir.empty()) {
+        rpc_mmap file;
+        if (shared.cache.find(hash, request.size) && file.open(shared.cache.path(hash), request.size)) {
+            ggml_backend_tensor_set(tensor, file.addr, request.offset, request.size);
+            response.result = 1;
+        }
+    }
+    const uint64_t p = request.tensor.data + request.offset;
+    if (response.result) {
+        cache_misses.erase(p);
+    } else if (shared.share_weights || !shared.cache.dir.empty()) {
+        cache_misses[p] = request;
+    }
     ggml_free(ctx);
     return true;
 }
 
+// find a weight in the shared weights or load it from the cache
+std::shared_ptr<rpc_shared_weight> rpc_server::load_shared(const std::string & hash, uint64_t size) {
+    auto weight = shared.pool.find(hash, size);
+    if (weight != nullptr || shared.cache.dir.empty() || !shared.cache.find(hash, size)) {
+        return weight;
+    }
+    // the cache files hold the raw data, so the weight maps its file: the pages are read on demand and are shared
+    // with the page cache of the system
+    std::unique_ptr<rpc_mmap> file(new rpc_mmap());
+    if (!file->open(shared.cache.path(hash), size)) {
+        return nullptr;
+    }
+    ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr(file->addr, size);
+    return shared.pool.add(hash, size, buffer, file.release());
+}
+
+// use a shared weight for the data at the given address of the buffers of the client
+void rpc_server::attach(uint64_t data, const std::shared_ptr<rpc_shared_weight> & weight) {
+    detach(data, weight->size);
+    regions[data] = { weight->size, weight };
+}
+
+// give back their own data to the ranges that overlap [data, data + size), before they are written
+void rpc_server::detach(uint64_t data, uint64_t size, bool keep_data) {
+    if (regions.empty() || size == 0) {
+        return;
+    }
+    auto it = regions.upper_bound(data);
+    if (it != regions.begin() && std::prev(it)->first + std::prev(it)->second.size > data) {
+        --it;
+    }
+    while (it != regions.end() && it->first < data + size) {
+        if (keep_data) {
+            memcpy(reinterpret_cast<void *>(it->first), reinterpret_cast<const void *>(it->second.weight->base()), it->second.size);
+        }
+        it = regions.erase(it);
+    }
+}
+
+// the address of the data of a tensor of the client, in a shared weight if it was attached
+uint64_t rpc_server::resolve(uint64_t data, uint64_t size) {
+    if (regions.empty()) {
+        return data;
+    }
+    auto it = regions.upper_bound(data);
+    if (it != regions.begin()) {
+        --it;
+        if (data >= it->first && data + size <= it->first + it->second.size) {
+            return it->second.weight->base() + (data - it->first);
+        }
+    }
+    // a tensor that is partly in a shared weight gets its own copy
+    detach(data, size);
+    return data;
+}
+
 bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -932,8 +1942,13 @@ bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<
         }
     }
 
-    response.resize(request.size, 0);
-    ggml_backend_tensor_get(tensor, response.data(), request.offset, request.size);
+    // the data may be in a shared weight
+    tensor->data = reinterpret_cast<void *>(resolve(request.tensor.data + request.offset, request.size) - request.offset);
+
+    // the data is appended to the response
+    const size_t pos = response.size();
+    response.resize(pos + request.size, 0);
+    ggml_backend_tensor_get(tensor, response.data() + pos, request.offset, request.size);
     ggml_free(ctx);
     return true;
 }
@@ -953,6 +1968,8 @@ bool rpc_server::copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_co
         return false;
     }
     GGML_PRINT_DEBUG("[%s] src->buffer: %p, dst->buffer: %p\n", __func__, (void*)src->buffer, (void*)dst->buffer);
+    detach(request.dst.data, ggml_nbytes(dst));
+    src->data = reinterpret_cast<void *>(resolve(request.src.data, ggml_nbytes(src)));
     response.result = ggml_backend_buffer_copy_tensor(src, dst);
     ggml_free(ctx);
     return true;
@@ -982,24 +1999,24 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
     return result;
 }
 
-bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+bool rpc_server::deserialize_graph(const uint8_t * input, size_t input_size, rpc_server_graph & result) {
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
-    if (input.size() < sizeof(uint32_t)) {
+    if (input_size < sizeof(uint32_t)) {
         return false;
     }
     uint32_t n_nodes;
-    memcpy(&n_nodes, input.data(), sizeof(n_nodes));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
+    memcpy(&n_nodes, input, sizeof(n_nodes));
+    if (input_size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
         return false;
     }
-    const uint64_t * nodes = (const uint64_t *)(input.data() + sizeof(n_nodes));
+    const uint64_t * nodes = (const uint64_t *)(input + sizeof(n_nodes));
     uint32_t n_tensors;
-    memcpy(&n_tensors, input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
+    memcpy(&n_tensors, input + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
+    if (input_size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
         return false;
     }
-    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
+    const rpc_tensor * tensors = (const rpc_tensor *)(input + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
     GGML_PRINT_DEBUG("[%s] n_nodes: %u, n_tensors: %u\n", __func__, n_nodes, n_tensors);
 
     size_t buf_size = ggml_tensor_overhead()*(n_nodes + n_tensors) + ggml_graph_overhead_custom(n_nodes, false);
@@ -1021,181 +2038,356 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
         memcpy(&id, &nodes[i], sizeof(id));
         graph->nodes[i] = create_node(id, ctx, tensor_ptrs, tensor_map);
     }
-    ggml_status status = ggml_backend_graph_compute(backend, graph);
-    response.result = status;
-    ggml_free(ctx);
+    result.tensors.resize(n_tensors);
+    result.data.resize(n_tensors);
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        auto it = tensor_map.find(tensors[i].id);
+        result.tensors[i] = it != tensor_map.end() ? it->second : nullptr;
+        result.data[i] = tensors[i].data;
+    }
+    result.ctx = ctx;
+    result.graph = graph;
+    return true;
+}
+
+static bool rpc_op_writes(ggml_op op) {
+    return op != GGML_OP_NONE && op != GGML_OP_VIEW && op != GGML_OP_RESHAPE && op != GGML_OP_PERMUTE && op != GGML_OP_TRANSPOSE;
+}
+
+ggml_status rpc_server::compute(rpc_server_graph & graph) {
+    // the shared weights are read-only, so the results of the graph cannot go there
+    // (all the writes are detached before the addresses are resolved, so that the reads see them)
+    if (!regions.empty()) {
+        for (size_t i = 0; i < graph.tensors.size(); i++) {
+            ggml_tensor * tensor = graph.tensors[i];
+            if (tensor != nullptr && tensor->buffer != nullptr && rpc_op_writes(tensor->op)) {
+                detach(graph.data[i], ggml_nbytes(tensor));
+            }
+        }
+    }
+    for (size_t i = 0; i < graph.tensors.size(); i++) {
+        ggml_tensor * tensor = graph.tensors[i];
+        if (tensor != nullptr && tensor->buffer != nullptr) {
+            tensor->data = reinterpret_cast<void *>(resolve(graph.data[i], ggml_nbytes(tensor)));
+        }
+    }
+    std::lock_guard<std::mutex> lock(shared.compute_mutex);
+    return ggml_backend_graph_compute(backend, graph.graph);
+}
+
+bool rpc_server::graph_compute(const uint8_t * input, size_t input_size, rpc_msg_graph_compute_rsp & response) {
+    rpc_server_graph graph;
+    if (!deserialize_graph(input, input_size, graph)) {
+        return false;
+    }
+    response.result = compute(graph);
+    graph.clear();
+    return true;
+}
+
+bool rpc_server::graph_compute_cache(const uint8_t * input, size_t input_size, rpc_msg_graph_compute_rsp & response) {
+    // serialization format: | slot (4 bytes) | hash (8 bytes) | serialized graph |
+    rpc_msg_graph_cache_header header;
+    if (input_size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, input, sizeof(header));
+    if (header.slot >= graphs.size()) {
+        return false;
+    }
+    rpc_server_graph & cached = graphs[header.slot];
+    cached.clear();
+    if (!deserialize_graph(input + sizeof(header), input_size - sizeof(header), cached)) {
+        return false;
+    }
+    cached.hash = header.hash;
+    GGML_PRINT_DEBUG("[%s] slot: %u, hash: %" PRIx64 "\n", __func__, header.slot, header.hash);
+    response.result = compute(cached);
+    return true;
+}
+
+bool rpc_server::graph_recompute(const uint8_t * input, size_t input_size, rpc_msg_graph_compute_rsp & response) {
+    // serialization format: | slot (4 bytes) | hash (8 bytes) | n_changes (4 bytes) | (index (4 bytes) | rpc_tensor) * n_changes |
+    rpc_msg_graph_cache_header header;
+    uint32_t n_changes;
+    if (input_size < sizeof(header) + sizeof(n_changes)) {
+        return false;
+    }
+    memcpy(&header, input, sizeof(header));
+    memcpy(&n_changes, input + sizeof(header), sizeof(n_changes));
+    if (input_size != sizeof(header) + sizeof(n_changes) + (uint64_t) n_changes*(sizeof(uint32_t) + sizeof(rpc_tensor))) {
+        return false;
+    }
+    if (header.slot >= graphs.size() || graphs[header.slot].graph == nullptr || graphs[header.slot].hash != header.hash) {
+        GGML_PRINT_DEBUG("[%s] slot %u does not hold graph %" PRIx64 "\n", __func__, header.slot, header.hash);
+        return false;
+    }
+    rpc_server_graph & cached = graphs[header.slot];
+    GGML_PRINT_DEBUG("[%s] slot: %u, hash: %" PRIx64 ", n_changes: %u\n", __func__, header.slot, header.hash, n_changes);
+    const uint8_t * changes = input + sizeof(header) + sizeof(n_changes);
+    for (uint32_t i = 0; i < n_changes; i++) {
+        uint32_t index;
+        memcpy(&index, changes, sizeof(index));
+        const rpc_tensor * tensor = (const rpc_tensor *)(changes + sizeof(index));
+        changes += sizeof(index) + sizeof(rpc_tensor);
+        if (index >= cached.tensors.size() || cached.tensors[index] == nullptr) {
+            return false;
+        }
+        update_tensor(cached.tensors[index], tensor);
+        cached.tensors[index]->view_offs = tensor->view_offs;
+        cached.data[index] = tensor->data;
+    }
+    response.result = compute(cached);
     return true;
 }
 
 rpc_server::~rpc_server() {
+    for (auto & graph : graphs) {
+        graph.clear();
+    }
+    regions.clear();
     for (auto buffer : buffers) {
         ggml_backend_buffer_free(buffer);
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
-    while (true) {
-        uint8_t cmd;
-        if (!recv_data(sockfd, &cmd, 1)) {
+template <typename T>
+static bool parse_request(const uint8_t * input, size_t input_size, T & request) {
+    if (input_size != sizeof(T)) {
+        return false;
+    }
+    memcpy(&request, input, sizeof(T));
+    return true;
+}
+
+// append a response, the data is appended by the caller if it is not given
+static size_t append_response(std::vector<uint8_t> & output, uint32_t id, const void * data, size_t size) {
+    rpc_msg_rsp_header header = { id, size };
+    const size_t pos = output.size();
+    output.resize(pos + sizeof(header) + (data ? size : 0));
+    memcpy(output.data() + pos, &header, sizeof(header));
+    if (data && size > 0) {
+        memcpy(output.data() + pos + sizeof(header), data, size);
+    }
+    return pos;
+}
+
+// execute a request and append its response to output, returns false if the connection must be closed
+static bool rpc_serve_cmd(rpc_server & server, const rpc_msg_req_header & header, const uint8_t * input,
+                          std::vector<uint8_t> & output, size_t free_mem, size_t total_mem) {
+    switch (header.cmd) {
+        case RPC_CMD_ALLOC_BUFFER: {
+            rpc_msg_alloc_buffer_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
+            }
+            rpc_msg_alloc_buffer_rsp response;
+            server.alloc_buffer(request, response);
+            append_response(output, header.id, &response, sizeof(response));
             break;
         }
-        if (cmd >= RPC_CMD_COUNT) {
-            // fail fast if the command is invalid
-            fprintf(stderr, "Unknown command: %d\n", cmd);
+        case RPC_CMD_GET_ALIGNMENT: {
+            if (header.size != 0) {
+                return false;
+            }
+            rpc_msg_get_alignment_rsp response;
+            server.get_alignment(response);
+            append_response(output, header.id, &response, sizeof(response));
             break;
         }
-        switch (cmd) {
-            case RPC_CMD_ALLOC_BUFFER: {
-                rpc_msg_alloc_buffer_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
-                    return;
-                }
-                rpc_msg_alloc_buffer_rsp response;
-                server.alloc_buffer(request, response);
-                if (!send_msg(sockfd, &response, sizeof(response))) {
-                    return;
-                }
-                break;
+        case RPC_CMD_GET_MAX_SIZE: {
+            if (header.size != 0) {
+                return false;
             }
-            case RPC_CMD_GET_ALIGNMENT: {
-                if (!recv_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
-                rpc_msg_get_alignment_rsp response;
-                server.get_alignment(response);
-                if (!send_msg(sockfd, &response, sizeof(response))) {
-                    return;
-                }
-                break;
+            rpc_msg_get_max_size_rsp response;
+            server.get_max_size(response);
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_BUFFER_GET_BASE: {
+            rpc_msg_buffer_get_base_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
             }
-            case RPC_CMD_GET_MAX_SIZE: {
-                if (!recv_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
-                rpc_msg_get_max_size_rsp response;
-                server.get_max_size(response);
-                if (!send_msg(sockfd, &response, sizeof(response))) {
-                    return;
-                }
-                break;
+            rpc_msg_buffer_get_base_rsp response;
+            if (!server.buffer_get_base(request, response)) {
+                return false;
             }
-            case RPC_CMD_BUFFER_GET_BASE: {
-                rpc_msg_buffer_get_base_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
-                    return;
-                }
-                rpc_msg_buffer_get_base_rsp response;
-                if (!server.buffer_get_base(request, response)) {
-                    return;
-                }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
-                    return;
-                }
-                break;
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_FREE_BUFFER: {
+            rpc_msg_free_buffer_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
             }
-            case RPC_CMD_FREE_BUFFER: {
-                rpc_msg_free_buffer_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
-                    return;
-                }
-                if (!server.free_buffer(request)) {
-                    return;
-                }
-                if (!send_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
-                break;
+            if (!server.free_buffer(request)) {
+                return false;
             }
-            case RPC_CMD_BUFFER_CLEAR: {
-                rpc_msg_buffer_clear_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
-                    return;
-                }
-                if (!server.buffer_clear(request)) {
-                    return;
-                }
-                if (!send_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
-                break;
+            append_response(output, header.id, nullptr, 0);
+            break;
+        }
+        case RPC_CMD_BUFFER_CLEAR: {
+            rpc_msg_buffer_clear_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
             }
-            case RPC_CMD_SET_TENSOR: {
-                std::vector<uint8_t> input;
-                if (!recv_msg(sockfd, input)) {
-                    return;
-                }
-                if (!server.set_tensor(input)) {
-                    return;
-                }
-                if (!send_msg(sockfd, nullptr, 0)) {
-                    return;
-                }
-                break;
+            if (!server.buffer_clear(request)) {
+                return false;
             }
-            case RPC_CMD_GET_TENSOR: {
-                rpc_msg_get_tensor_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
-                    return;
-                }
-                std::vector<uint8_t> response;
-                if (!server.get_tensor(request, response)) {
-                    return;
-                }
-                if (!send_msg(sockfd, response.data(), response.size())) {
-                    return;
-                }
-                break;
+            append_response(output, header.id, nullptr, 0);
+            break;
+        }
+        case RPC_CMD_SET_TENSOR: {
+            if (!server.set_tensor(input, header.size)) {
+                return false;
             }
-            case RPC_CMD_COPY_TENSOR: {
-                rpc_msg_copy_tensor_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
-                    return;
-                }
-                rpc_msg_copy_tensor_rsp response;
-                if (!server.copy_tensor(request, response)) {
-                    return;
-                }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
-                    return;
-                }
-                break;
+            append_response(output, header.id, nullptr, 0);
+            break;
+        }
+        case RPC_CMD_SET_TENSOR_HASH: {
+            rpc_msg_set_tensor_hash_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
             }
-            case RPC_CMD_GRAPH_COMPUTE: {
-                std::vector<uint8_t> input;
-                if (!recv_msg(sockfd, input)) {
-                    return;
-                }
-                rpc_msg_graph_compute_rsp response;
-                if (!server.graph_compute(input, response)) {
-                    return;
-                }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+            rpc_msg_set_tensor_hash_rsp response;
+            if (!server.set_tensor_hash(request, response)) {
+                return false;
+            }
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_GET_TENSOR: {
+            rpc_msg_get_tensor_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
+            }
+            append_response(output, header.id, nullptr, request.size);
+            if (!server.get_tensor(request, output)) {
+                return false;
+            }
+            break;
+        }
+        case RPC_CMD_COPY_TENSOR: {
+            rpc_msg_copy_tensor_req request;
+            if (!parse_request(input, header.size, request)) {
+                return false;
+            }
+            rpc_msg_copy_tensor_rsp response;
+            if (!server.copy_tensor(request, response)) {
+                return false;
+            }
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_GRAPH_COMPUTE: {
+            rpc_msg_graph_compute_rsp response;
+            if (!server.graph_compute(input, header.size, response)) {
+                return false;
+            }
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_GRAPH_COMPUTE_CACHE: {
+            rpc_msg_graph_compute_rsp response;
+            if (!server.graph_compute_cache(input, header.size, response)) {
+                return false;
+            }
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_GRAPH_RECOMPUTE: {
+            rpc_msg_graph_compute_rsp response;
+            if (!server.graph_recompute(input, header.size, response)) {
+                return false;
+            }
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        case RPC_CMD_GET_DEVICE_MEMORY: {
+            if (header.size != 0) {
+                return false;
+            }
+            rpc_msg_get_device_memory_rsp response;
+            response.free_mem = free_mem;
+            response.total_mem = total_mem;
+            append_response(output, header.id, &response, sizeof(response));
+            break;
+        }
+        default: {
+            fprintf(stderr, "Unexpected command: %d\n", header.cmd);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void rpc_serve_client(rpc_server_context & ctx, sockfd_t sockfd) {
+    // the client must start with a hello, the command is checked first so that older clients are not left waiting
+    {
+        rpc_msg_req_header header;
+        if (!recv_data(sockfd, &header.cmd, sizeof(header.cmd))) {
+            return;
+        }
+        if (header.cmd != RPC_CMD_HELLO) {
+            fprintf(stderr, "Expected a hello from the client, it may use an older protocol version\n");
+            return;
+        }
+        if (!recv_data(sockfd, (uint8_t *)&header + sizeof(header.cmd), sizeof(header) - sizeof(header.cmd)) || header.size != 0) {
+            return;
+        }
+        const uint8_t caps = ctx.share_weights || !ctx.cache.dir.empty() ? RPC_CAP_WEIGHT_CACHE : 0;
+        rpc_msg_hello_rsp response = { RPC_PROTO_MAJOR_VERSION, RPC_PROTO_MINOR_VERSION, RPC_PROTO_PATCH_VERSION, caps };
+        std::vector<uint8_t> output;
+        append_response(output, header.id, &response, sizeof(response));
+        if (!send_data(sockfd, output.data(), output.size())) {
+            return;
+        }
+    }
+    rpc_server server(ctx);
+    while (true) {
+        rpc_msg_req_header header;
+        if (!recv_data(sockfd, &header, sizeof(header))) {
+            break;
+        }
+        if (header.cmd >= RPC_CMD_COUNT) {
+            // fail fast if the command is invalid
+            fprintf(stderr, "Unknown command: %d\n", header.cmd);
+            break;
+        }
+        std::vector<uint8_t> input;
+        if (!recv_input(sockfd, header.size, input)) {
+            break;
+        }
+        // the responses of a batch are sent together
+        std::vector<uint8_t> output;
+        if (header.cmd == RPC_CMD_BATCH) {
+            size_t pos = 0;
+            while (pos < input.size()) {
+                rpc_msg_req_header sub;
+                if (input.size() - pos < sizeof(sub)) {
                     return;
                 }
-                break;
-            }
-            case RPC_CMD_GET_DEVICE_MEMORY: {
-                if (!recv_msg(sockfd, nullptr, 0)) {
+                memcpy(&sub, input.data() + pos, sizeof(sub));
+                pos += sizeof(sub);
+                if (sub.size > input.size() - pos || sub.cmd == RPC_CMD_BATCH) {
                     return;
                 }
-                rpc_msg_get_device_memory_rsp response;
-                response.free_mem = free_mem;
-                response.total_mem = total_mem;
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!rpc_serve_cmd(server, sub, input.data() + pos, output, ctx.free_mem, ctx.total_mem)) {
                     return;
                 }
-                break;
-            }
-            default: {
-                fprintf(stderr, "Unknown command: %d\n", cmd);
-                return;
+                pos += sub.size;
             }
+        } else if (!rpc_serve_cmd(server, header, input.data(), output, ctx.free_mem, ctx.total_mem)) {
+            return;
+        }
+        if (!send_data(sockfd, output.data(), output.size())) {
+            return;
         }
     }
 }
 
-void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, const char * cache_dir, size_t cache_size, bool share_weights, size_t free_mem, size_t total_mem) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1216,6 +2408,19 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         fprintf(stderr, "Failed to create server socket\n");
         return;
     }
+    // the clients are served concurrently, each on its own thread
+    auto ctx = std::make_shared<rpc_server_context>();
+    ctx->backend = backend;
+    // a shared weight replaces the data of the tensors of the clients with a pointer into its own buffer, which only
+    // CPU backends can use - the host buffers of other backends (e.g. Metal) must hold the data of their tensors
+    ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_get_default_buffer_type(backend));
+    ctx->share_weights = share_weights && dev != nullptr && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+    if (share_weights && !ctx->share_weights) {
+        fprintf(stderr, "Weight sharing is only supported by CPU backends, it is disabled\n");
+    }
+    ctx->cache.init(cache_dir ? cache_dir : "", cache_size);
+    ctx->free_mem = free_mem;
+    ctx->total_mem = total_mem;
     while (true) {
         auto client_socket = socket_accept(server_socket->fd);
         if (client_socket == nullptr) {
@@ -1224,9 +2429,11 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         }
         printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
         fflush(stdout);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
-        printf("Client connection closed\n");
-        fflush(stdout);
+        std::thread([ctx, client_socket]() {
+            rpc_serve_client(*ctx, client_socket->fd);
+            printf("Client connection closed\n");
+            fflush(stdout);
+        }).detach();
     }
 #ifdef _WIN32
     WSACleanup();
@@ -1273,7 +2480,7 @@ static void ggml_backend_rpc_device_get_props(ggml_backend_dev_t dev, struct ggm
     props->type        = ggml_backend_rpc_device_get_type(dev);
     ggml_backend_rpc_device_get_memory(dev, &props->memory_free, &props->memory_total);
     props->caps = {
-        /* .async                 = */ false,
+        /* .async                 = */ true,
         /* .host_buffer           = */ false,
         /* .buffer_from_host_ptr  = */ false,
         /* .events                = */ false,
@@ -4218,6 +4218,31 @@ struct ggml_tensor * ggml_flash_attn_ext(
     return result;
 }
 
+struct ggml_tensor * ggml_flash_attn_ext_split(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k0,
+        struct ggml_tensor  * v0,
+        struct ggml_tensor  * k1,
+        struct ggml_tensor  * v1,
+        struct ggml_tensor  * mask,
+        float                 scale,
+        float                 max_bias,
+        float                 logit_softcap) {
+    GGML_ASSERT(ggml_can_mul_mat(k1, q));
+    GGML_ASSERT(k0->ne[0] == k1->ne[0] && k0->ne[2] == k1->ne[2] && k0->ne[3] == k1->ne[3]);
+    GGML_ASSERT(v0->ne[0] == v1->ne[0] && v0->ne[2] == v1->ne[2] && v0->ne[3] == v1->ne[3]);
+    GGML_ASSERT(v0->ne[1] == k0->ne[1] && v1->ne[1] == k1->ne[1]);
+    GGML_ASSERT(!mask || mask->ne[0] == k0->ne[1] + k1->ne[1]);
+
+    struct ggml_tensor * result = ggml_flash_attn_ext(ctx, q, k0, v0, mask, scale, max_bias, logit_softcap);
+
+    result->src[4] = k1;
+    result->src[5] = v1;
+
+    return result;
+}
+
 void ggml_flash_attn_ext_set_prec(
         struct ggml_tensor * a,
         enum ggml_prec       prec) {
@@ -37,6 +37,13 @@
 // TODO: use everywhere in the implementation
 #define LLAMA_TOKEN_NULL -1
 
+// max number of sequences that can share the KV cache (sequence ids must be in [0, LLAMA_MAX_PARALLEL_SEQUENCES))
+// this is a compile-time limit: every KV cell stores its sequences in a fixed-width bitset of this many bits
+// (32 bytes per cell), independently of n_seq_max - llama_new_context_with_model rejects larger n_seq_max
+// the llama_kv_cache_seq_* and llama_state_seq_* functions log an error and do nothing for a sequence id out of
+// this range (they return false, -1 or 0 when they return a value)
+#define LLAMA_MAX_PARALLEL_SEQUENCES 256
+
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
@@ -237,6 +244,7 @@ extern "C" {
     //            (if set to NULL, the token position will be tracked automatically by llama_decode)
     // - seq_id : the sequence to which the respective token belongs
     //            (if set to NULL, the sequence ID will be assumed to be 0)
+    //            (for models with a KV cache, the sequence IDs must be in [0, LLAMA_MAX_PARALLEL_SEQUENCES))
     // - logits : if zero, the logits (and/or the embeddings) for the respective token will not be output
     //            (if set to NULL, only the logits for last token will be returned)
     //
@@ -308,7 +316,7 @@ extern "C" {
         uint32_t n_ctx;             // text context, 0 = from model
         uint32_t n_batch;           // logical maximum batch size that can be submitted to llama_decode
         uint32_t n_ubatch;          // physical maximum batch size
-        uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
+        uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models), <= LLAMA_MAX_PARALLEL_SEQUENCES
         int32_t  n_threads;         // number of threads to use for generation
         int32_t  n_threads_batch;   // number of threads to use for batch processing
 
@@ -325,6 +333,8 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // KV cache block size for paged allocation, 0 = contiguous slots only (default)
+        uint32_t kv_n_hot;         // tiered KV cache: recent tokens per sequence kept in type_k/type_v, 0 = disabled (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -332,6 +342,11 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // tiered KV cache: the tokens older than the kv_n_hot most recent tokens of their sequences are moved to
+        // a second cache of these (usually quantized) types [EXPERIMENTAL]
+        enum ggml_type type_k_cold;
+        enum ggml_type type_v_cold;
+
         // Keep the booleans together and at the end of the struct to avoid misalignment during copy-by-value.
         // TODO: move at the end of the struct
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
@@ -519,6 +534,31 @@ extern "C" {
     LLAMA_API void llama_lora_adapter_clear(
             struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to the given sequence of the context
+    // It is applied only to the tokens of the batch that belong to this sequence, in addition to the adapters of the
+    // context. The tokens of a batch can belong to sequences with different adapters
+    // For tokens in several sequences, the adapters of their first sequence are used
+    // llama_decode returns -1 for the models whose graph does not allow it (e.g. adapted weights that are not applied
+    // to the tokens or to the outputs of the batch)
+    LLAMA_API int32_t llama_lora_adapter_seq_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Remove a specific LoRA adapter from the given sequence
+    // Return -1 if the adapter is not present in the sequence
+    LLAMA_API int32_t llama_lora_adapter_seq_remove(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id);
+
+    // Remove all LoRA adapters from the given sequence
+    // seq_id < 0 : all sequences
+    LLAMA_API void llama_lora_adapter_seq_clear(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Manually free a LoRA adapter
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
@@ -596,6 +636,9 @@ extern "C" {
     // Returns the number of used KV cells (i.e. have at least one sequence assigned to them)
     LLAMA_API int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx);
 
+    // Returns the size in bytes of the buffers of the KV cache
+    LLAMA_API size_t llama_get_kv_cache_size(const struct llama_context * ctx);
+
     // Clear the KV cache - both cell info is erased and KV data is zeroed
     LLAMA_API void llama_kv_cache_clear(
             struct llama_context * ctx);
@@ -613,6 +656,8 @@ extern "C" {
 
     // Copy all tokens that belong to the specified sequence to another sequence
     // Note that this does not allocate extra KV cache memory - it simply assigns the tokens to the new sequence
+    // The shared cells are copy-on-write: when one of the sequences shifts them with llama_kv_cache_seq_add()
+    // or llama_kv_cache_seq_div(), it gets its own copy of the cells and the other sequences are not affected
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
     LLAMA_API void llama_kv_cache_seq_cp(
@@ -653,6 +698,37 @@ extern "C" {
                        llama_pos   p1,
                              int   d);
 
+    // Streaming (attention sink) context shift: removes the n_discard tokens of the sequence that follow its first n_keep
+    // positions and moves the next tokens back by n_discard positions, same as llama_kv_cache_seq_rm() followed by
+    // llama_kv_cache_seq_add(), but without recomputing the RoPE of the moved tokens:
+    //   - the n_keep first tokens (the attention sinks) are rotated forward by n_discard positions instead
+    //   - the next tokens of the sequence are rotated with an offset of the accumulated n_discard, applied at llama_decode()
+    // The cost of the shift depends on n_keep only, so that endless generations can evict one block of tokens at a time
+    // The offset is folded into the KV cells of the sequence with a K-shift when its RoPE positions exceed twice the context of the model,
+    // when the state of the sequence is saved, or when the sequence is copied to a sequence with another offset
+    // Falls back to llama_kv_cache_seq_rm() + llama_kv_cache_seq_add() for models without RoPE
+    LLAMA_API void llama_kv_cache_seq_stream(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   n_keep,
+                       llama_pos   n_discard);
+
+    // Share the prefix [0, n_prefix) of seq_id_src with seq_id_dst, e.g. a system prompt common to several sequences
+    // The tokens of seq_id_dst in [0, n_prefix) are removed and replaced by the copy-on-write cells of seq_id_src
+    // (see llama_kv_cache_seq_cp): no KV cache memory is allocated and no token is evaluated
+    // n_prefix < 0 : the whole sequence
+    // Returns the number of cells that the sequences share, or -1 if they cannot share cells (recurrent models, invalid ids)
+    LLAMA_API int32_t llama_kv_cache_seq_share(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id_src,
+                    llama_seq_id   seq_id_dst,
+                       llama_pos   n_prefix);
+
+    // Returns the number of KV cells of the specified sequence that are shared with other sequences (see llama_kv_cache_seq_cp)
+    LLAMA_API int32_t llama_kv_cache_seq_n_shared(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
     // Returns the largest position present in the KV cache for the specified sequence
     LLAMA_API llama_pos llama_kv_cache_seq_pos_max(
             struct llama_context * ctx,
@@ -810,6 +886,24 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Asynchronous decoding: the batch is decoded by a worker thread while the caller continues
+    // The batch is copied and can be reused as soon as the call returns
+    // Until llama_decode_wait(), the llama_get_logits* and llama_get_embeddings* functions return the outputs of
+    // the previous batch (double-buffered), so that they can be sampled while the next batch is computed
+    // Any other function of the context waits for the decode to complete before it proceeds
+    //   0 - the batch was submitted
+    // < 0 - error (e.g. the previous asynchronous decode was not waited for)
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Returns true when the submitted batch has been decoded (or if there is no submitted batch)
+    LLAMA_API bool llama_decode_poll(struct llama_context * ctx);
+
+    // Wait for the submitted batch and make its outputs current
+    // Returns the result of the decode, with the same meaning as llama_decode(), or 0 if there is no submitted batch
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -933,6 +1027,33 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Convert a batch of texts into tokens, on n_threads threads with their own tokenizer sessions.
+    /// @param texts, text_lens The n_texts texts to tokenize, which do not need to be null-terminated.
+    /// @param tokens The tokens of all the texts, one after the other. The pointer must be large enough to hold them.
+    /// @param offsets The tokens of texts[i] are tokens[offsets[i]] ... tokens[offsets[i + 1] - 1]. Must hold n_texts + 1 entries.
+    /// @param n_threads The maximum number of threads, or <= 0 for GGML_DEFAULT_N_THREADS. Fewer are used for small batches.
+    /// @return Returns the total number of tokens on success, no more than n_tokens_max
+    /// @return Returns a negative number on failure - the total number of tokens that would have been returned.
+    ///         The offsets are still set, and the same as on success.
+    /// @param add_special, parse_special Same as for llama_tokenize(), for each text.
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_model * model,
+                     const char ** texts,
+                  const int32_t  * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
+    /// @details Set the number of words whose tokens are kept by the BPE tokenizer of the model (32768 by default) and clear them.
+    /// 0 disables the cache. Has no effect on the other tokenizers. Must not be called while the model is tokenizing.
+    LLAMA_API void llama_tokenizer_set_cache_size(
+              struct llama_model * model,
+                         int32_t   n_words);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1189,6 +1310,12 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Select the k largest logits of a row of n_vocab logits (e.g. from llama_get_logits_ith) into data,
+    /// sorted in descending order, without building a llama_token_data entry for every token of the vocabulary
+    /// data must have room for k entries
+    // Returns the number of selected candidates (at most min(k, n_vocab))
+    LLAMA_API int32_t llama_logits_top_k(const float * logits, int32_t n_vocab, int32_t k, llama_token_data * data);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
@@ -5,7 +5,9 @@
 
 #include <cmath>
 #include <algorithm>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
 
 //
 // helpers
@@ -815,7 +817,7 @@ static bool llama_grammar_detect_left_recursion(
 }
 
 const llama_grammar_rules & llama_grammar_get_rules(const struct llama_grammar * grammar) {
-    return grammar->rules;
+    return *grammar->rules;
 }
 
 llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar) {
@@ -904,6 +906,343 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// token trie and allowed-token masks
+//
+
+// the pieces of the vocabulary decoded to code points and arranged in a trie, so that a grammar stack can be matched
+// against all tokens sharing a prefix at once
+struct llama_grammar_trie {
+    struct node {
+        uint32_t i_edge; // children: edges[i_edge, i_edge + n_edge)
+        uint32_t n_edge;
+        uint32_t i_tok;  // tokens that end at this node: toks[i_tok, i_tok + n_tok)
+        uint32_t n_tok;
+    };
+
+    std::vector<node> nodes;
+
+    std::vector<std::pair<uint32_t,    uint32_t>>           edges; // code point, child node
+    std::vector<std::pair<llama_token, llama_partial_utf8>> toks;  // token, trailing partial UTF-8 sequence
+};
+
+struct llama_grammar_trie_entry {
+    std::vector<uint32_t> code_points;
+    llama_partial_utf8    partial_utf8;
+    llama_token           id;
+};
+
+// entries [i0, i1) share their first depth code points and are sorted, so the ones that end at this node come first
+static void llama_grammar_trie_build(
+        llama_grammar_trie & trie,
+        uint32_t inode,
+        const std::vector<llama_grammar_trie_entry> & entries,
+        size_t i0,
+        size_t i1,
+        size_t depth) {
+    size_t i = i0;
+
+    trie.nodes[inode].i_tok = trie.toks.size();
+    for (; i < i1 && entries[i].code_points.size() == depth; ++i) {
+        trie.toks.emplace_back(entries[i].id, entries[i].partial_utf8);
+    }
+    trie.nodes[inode].n_tok = trie.toks.size() - trie.nodes[inode].i_tok;
+
+    std::vector<std::pair<size_t, size_t>> groups;
+    while (i < i1) {
+        size_t j = i + 1;
+        while (j < i1 && entries[j].code_points[depth] == entries[i].code_points[depth]) {
+            ++j;
+        }
+        groups.emplace_back(i, j);
+        i = j;
+    }
+
+    const uint32_t i_edge = trie.edges.size();
+
+    trie.nodes[inode].i_edge = i_edge;
+    trie.nodes[inode].n_edge = groups.size();
+
+    for (const auto & group : groups) {
+        trie.edges.emplace_back(entries[group.first].code_points[depth], 0);
+    }
+
+    for (size_t ig = 0; ig < groups.size(); ++ig) {
+        const uint32_t ichild = trie.nodes.size();
+        trie.nodes.push_back({});
+        trie.edges[i_edge + ig].second = ichild;
+
+        llama_grammar_trie_build(trie, ichild, entries, groups[ig].first, groups[ig].second, depth + 1);
+    }
+}
+
+static const llama_grammar_trie & llama_grammar_get_trie(const llama_vocab & vocab) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (vocab.cache_grammar_trie) {
+        return *vocab.cache_grammar_trie;
+    }
+
+    // same rules as the per-candidate path of llama_grammar_apply_impl, starting from a complete UTF-8 sequence
+    // EOG tokens are handled separately, empty and invalid pieces are never allowed
+    std::vector<llama_grammar_trie_entry> entries;
+    entries.reserve(vocab.n_vocab);
+
+    for (llama_token id = 0; id < (llama_token) vocab.n_vocab; ++id) {
+        const std::string & piece = vocab.cache_token_to_piece.at(id);
+
+        if (llama_token_is_eog_impl(vocab, id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        decoded.first.pop_back(); // terminating 0
+
+        entries.push_back({ std::move(decoded.first), decoded.second, id });
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const llama_grammar_trie_entry & a, const llama_grammar_trie_entry & b) {
+        return a.code_points < b.code_points;
+    });
+
+    auto trie = std::make_shared<llama_grammar_trie>();
+    trie->nodes.push_back({});
+
+    llama_grammar_trie_build(*trie, 0, entries, 0, entries.size(), 0);
+
+    vocab.cache_grammar_trie = std::move(trie);
+
+    return *vocab.cache_grammar_trie;
+}
+
+using llama_grammar_mask = std::vector<uint64_t>;
+
+struct llama_grammar_stacks_hash {
+    size_t operator()(const llama_grammar_stacks & stacks) const {
+        size_t h = stacks.size();
+        for (const auto & stack : stacks) {
+            h ^= stack.size() + 0x9e3779b9 + (h << 6) + (h >> 2);
+            for (const llama_grammar_element * pos : stack) {
+                h ^= std::hash<const llama_grammar_element *>()(pos) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            }
+        }
+        return h;
+    }
+};
+
+struct llama_grammar_mask_entry {
+    std::shared_ptr<const llama_grammar_mask> mask;
+
+    size_t   n_bytes; // of the mask and of its key
+    uint64_t last_used;
+};
+
+// the masks of the states of the grammars that share the same rules
+struct llama_grammar_rules_masks {
+    // the states are keyed by their stacks, which point into these rules - holding the rules keeps their elements
+    // from being reused by other rules while the masks are cached
+    std::shared_ptr<const llama_grammar_rules> rules;
+
+    std::unordered_map<llama_grammar_stacks, llama_grammar_mask_entry, llama_grammar_stacks_hash> masks;
+};
+
+// shared by all the grammars of a vocab, so that the memory of the masks does not grow with the number of grammars
+struct llama_grammar_mask_cache {
+    // about 3500 masks of a 150k vocabulary
+    static constexpr size_t max_bytes = 64*1024*1024;
+
+    std::mutex mutex;
+
+    uint64_t n_used  = 0;
+    size_t   n_bytes = 0;
+
+    std::unordered_map<const llama_grammar_rules *, llama_grammar_rules_masks> rules_masks;
+};
+
+// below this many candidates, matching them one by one is cheaper than computing the mask of a new state
+static constexpr size_t LLAMA_GRAMMAR_MASK_MIN_CANDIDATES = 256;
+
+// the stacks that follow the char range on top of stack, whichever char it matched
+static const llama_grammar_stacks & llama_grammar_stacks_after(
+        const llama_grammar_rules & rules,
+        const llama_grammar_stack & stack,
+        std::map<llama_grammar_stack, llama_grammar_stacks> & memo) {
+    auto it = memo.find(stack);
+    if (it != memo.end()) {
+        return it->second;
+    }
+
+    const auto * pos_after = llama_grammar_match_char(stack.back(), 0).second;
+
+    llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(pos_after)) {
+        stack_after.push_back(pos_after);
+    }
+
+    llama_grammar_stacks stacks_after;
+    llama_grammar_advance_stack(rules, stack_after, stacks_after);
+
+    return memo.emplace(stack, std::move(stacks_after)).first->second;
+}
+
+// marks the tokens at and below inode that the grammar allows, with stack being the state after the node's prefix
+static void llama_grammar_trie_walk(
+        const llama_grammar_rules & rules,
+        const llama_grammar_trie  & trie,
+        uint32_t                    inode,
+        const llama_grammar_stack & stack,
+        std::map<llama_grammar_stack, llama_grammar_stacks> & memo,
+        llama_grammar_mask        & mask) {
+    const auto & node = trie.nodes[inode];
+
+    for (uint32_t it = node.i_tok; it < node.i_tok + node.n_tok; ++it) {
+        const llama_token        id           = trie.toks[it].first;
+        const llama_partial_utf8 partial_utf8 = trie.toks[it].second;
+
+        if (partial_utf8.n_remain == 0 || (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial_utf8))) {
+            mask[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+
+    if (stack.empty()) {
+        return;
+    }
+
+    for (uint32_t ie = node.i_edge; ie < node.i_edge + node.n_edge; ++ie) {
+        if (!llama_grammar_match_char(stack.back(), trie.edges[ie].first).first) {
+            continue;
+        }
+
+        for (const auto & stack_after : llama_grammar_stacks_after(rules, stack, memo)) {
+            llama_grammar_trie_walk(rules, trie, trie.edges[ie].second, stack_after, memo, mask);
+        }
+    }
+}
+
+// returns the mask of the tokens allowed in the current state of the grammar, or nullptr if the candidates should be
+// matched one by one instead
+static std::shared_ptr<const llama_grammar_mask> llama_grammar_get_mask(const llama_grammar & grammar, size_t n_candidates) {
+    // the trie is decoded from the start of a UTF-8 sequence
+    if (!grammar.masks || grammar.partial_utf8.n_remain != 0) {
+        return nullptr;
+    }
+
+    auto & cache = *grammar.masks;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        auto it_rules = cache.rules_masks.find(grammar.rules.get());
+        if (it_rules != cache.rules_masks.end()) {
+            auto it = it_rules->second.masks.find(grammar.stacks);
+            if (it != it_rules->second.masks.end()) {
+                it->second.last_used = ++cache.n_used;
+                return it->second.mask;
+            }
+        }
+    }
+
+    if (n_candidates < LLAMA_GRAMMAR_MASK_MIN_CANDIDATES) {
+        return nullptr;
+    }
+
+    const auto & trie = llama_grammar_get_trie(*grammar.vocab);
+
+    auto mask = std::make_shared<llama_grammar_mask>((grammar.vocab->n_vocab + 63) / 64, 0);
+
+    std::map<llama_grammar_stack, llama_grammar_stacks> memo;
+    for (const auto & stack : grammar.stacks) {
+        llama_grammar_trie_walk(*grammar.rules, trie, 0, stack, memo, *mask);
+
+        if (stack.empty()) {
+            for (const llama_token id : grammar.vocab->special_eog_ids) {
+                (*mask)[id / 64] |= uint64_t(1) << (id % 64);
+            }
+        }
+    }
+
+    size_t n_bytes = mask->size()*sizeof(uint64_t);
+    for (const auto & stack : grammar.stacks) {
+        n_bytes += sizeof(stack) + stack.size()*sizeof(stack[0]);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        // evict the least recently used masks of all the grammars until the new one fits
+        while (!cache.rules_masks.empty() && cache.n_bytes + n_bytes > llama_grammar_mask_cache::max_bytes) {
+            auto lru_rules = cache.rules_masks.end();
+            auto lru       = decltype(lru_rules->second.masks)::iterator();
+            for (auto it_rules = cache.rules_masks.begin(); it_rules != cache.rules_masks.end(); ++it_rules) {
+                for (auto it = it_rules->second.masks.begin(); it != it_rules->second.masks.end(); ++it) {
+                    if (lru_rules == cache.rules_masks.end() || it->second.last_used < lru->second.last_used) {
+                        lru_rules = it_rules;
+                        lru       = it;
+                    }
+                }
+            }
+
+            cache.n_bytes -= lru->second.n_bytes;
+            lru_rules->second.masks.erase(lru);
+
+            // the rules are released with their last mask
+            if (lru_rules->second.masks.empty()) {
+                cache.rules_masks.erase(lru_rules);
+            }
+        }
+
+        auto & rules_masks = cache.rules_masks[grammar.rules.get()];
+        rules_masks.rules = grammar.rules;
+
+        // another grammar may have added the mask of the same state in the meantime
+        auto res = rules_masks.masks.emplace(grammar.stacks, llama_grammar_mask_entry { mask, n_bytes, ++cache.n_used });
+        if (res.second) {
+            cache.n_bytes += n_bytes;
+        }
+    }
+
+    return mask;
+}
+
+// grammars compiled from the same text with the same vocab share the parsed rules and the initial stacks
+struct llama_grammar_compiled {
+    std::shared_ptr<const llama_grammar_rules> rules;
+
+    llama_grammar_stacks stacks;
+
+    uint64_t last_used;
+};
+
+struct llama_grammar_cache {
+    // only the rules and the initial stacks, the masks are bounded by the mask cache
+    static constexpr size_t max_size = 64;
+
+    std::mutex mutex;
+
+    uint64_t n_used = 0;
+
+    // by grammar root and text
+    std::unordered_map<std::string, llama_grammar_compiled> grammars;
+
+    const std::shared_ptr<llama_grammar_mask_cache> masks = std::make_shared<llama_grammar_mask_cache>();
+};
+
+static llama_grammar_cache & llama_grammar_get_cache(const llama_vocab & vocab) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!vocab.cache_grammars) {
+        vocab.cache_grammars = std::make_shared<llama_grammar_cache>();
+    }
+
+    return *vocab.cache_grammars;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -961,10 +1300,35 @@ struct llama_grammar * llama_grammar_init_impl(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    return new llama_grammar {
+        vocab,
+        std::make_shared<const llama_grammar_rules>(std::move(vec_rules)),
+        std::move(stacks),
+        {},
+        vocab ? llama_grammar_get_cache(*vocab).masks : nullptr,
+    };
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
+    // rule names cannot contain a newline
+    const std::string key = std::string(grammar_root) + "\n" + grammar_str;
+
+    llama_grammar_cache * cache = vocab ? &llama_grammar_get_cache(*vocab) : nullptr;
+
+    if (cache) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+
+        auto it = cache->grammars.find(key);
+        if (it != cache->grammars.end()) {
+            auto & compiled = it->second;
+
+            compiled.last_used = ++cache->n_used;
+
+            // only the stacks of the new grammar are allocated
+            return new llama_grammar { vocab, compiled.rules, compiled.stacks, {}, cache->masks, };
+        }
+    }
+
     llama_grammar_parser parser;
 
     // if there is a grammar, parse it
@@ -1039,7 +1403,26 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    auto rules = std::make_shared<const llama_grammar_rules>(std::move(vec_rules));
+    auto masks = cache ? cache->masks : nullptr;
+
+    if (cache) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+
+        if (cache->grammars.size() >= llama_grammar_cache::max_size) {
+            auto lru = cache->grammars.begin();
+            for (auto it = cache->grammars.begin(); it != cache->grammars.end(); ++it) {
+                if (it->second.last_used < lru->second.last_used) {
+                    lru = it;
+                }
+            }
+            cache->grammars.erase(lru);
+        }
+
+        cache->grammars[key] = { rules, stacks, ++cache->n_used };
+    }
+
+    return new llama_grammar { vocab, std::move(rules), std::move(stacks), {}, std::move(masks), };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1051,27 +1434,27 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
-    llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
-        }
-    }
-
-    return result;
+    // the rules are shared, so the stacks still point to the right elements
+    return new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, grammar.masks, };
 }
 
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
+    // repeated states (very common with JSON) only need a lookup in the mask of allowed tokens
+    const auto mask = llama_grammar_get_mask(grammar, cur_p->size);
+    if (mask) {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+
+            if (!((*mask)[id / 64] & (uint64_t(1) << (id % 64)))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+
+        return;
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
@@ -1102,7 +1485,7 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
-    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = llama_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
     for (const auto & reject : rejects) {
         cur_p->data[reject.index].logit = -INFINITY;
     }
@@ -1129,7 +1512,7 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
     llama_grammar_stacks stacks_new;
 
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        llama_grammar_accept(grammar.rules, grammar.stacks, *it, stacks_new);
+        llama_grammar_accept(*grammar.rules, grammar.stacks, *it, stacks_new);
         grammar.stacks = std::move(stacks_new);
     }
 
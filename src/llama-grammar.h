@@ -3,8 +3,10 @@
 #include "llama-impl.h"
 
 #include <map>
+#include <memory>
 
 struct llama_vocab;
+struct llama_grammar_mask_cache;
 
 // grammar element type
 enum llama_gretype {
@@ -110,11 +112,16 @@ struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    // immutable, shared with the clones of the grammar and with the other grammars compiled from the same text
+    std::shared_ptr<const llama_grammar_rules> rules;
+
+    llama_grammar_stacks stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // allowed-token masks of the grammar states seen so far, shared by all the grammars of the vocab
+    std::shared_ptr<llama_grammar_mask_cache> masks;
 };
 
 //
@@ -0,0 +1,77 @@
+#include "llama-kv-cells.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+void llama_kv_cells_build_mask(
+        const llama_kv_cell * cells,
+                    int64_t   n_kv,
+                    int64_t   n_seqs,
+                    int64_t   n_seq_tokens,
+         const llama_seq_id * seq_ids,
+            const llama_pos * pos,
+                       bool   use_alibi,
+                   uint32_t   n_swa,
+                      float * data,
+                      float * data_swa,
+                    int64_t   ld) {
+    if (ld == 0) {
+        ld = n_kv;
+    }
+
+    // cells that are not part of the sequence get a position that is never visible
+    const llama_pos pos_hidden = std::numeric_limits<llama_pos>::max();
+
+    // group the ubatch sequences by sequence id, so that the cells are gathered once per distinct sequence
+    std::vector<std::pair<llama_seq_id, int64_t>> order(n_seqs);
+    for (int64_t s = 0; s < n_seqs; ++s) {
+        order[s] = { seq_ids[s], s };
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<llama_pos> seq_pos(n_kv);
+
+    for (int64_t k = 0; k < n_seqs; ++k) {
+        const llama_seq_id seq_id = order[k].first;
+        const int64_t      s      = order[k].second;
+
+        if (k == 0 || order[k - 1].first != seq_id) {
+            for (int64_t i = 0; i < n_kv; ++i) {
+                seq_pos[i] = cells[i].has_seq_id(seq_id) ? cells[i].pos : pos_hidden;
+            }
+        }
+
+        const llama_pos * cpos = seq_pos.data();
+
+        for (int64_t j = 0; j < n_seq_tokens; ++j) {
+            const llama_pos p = pos[s*n_seq_tokens + j];
+
+            float * row = data ? data + (s*n_seq_tokens + j)*ld : nullptr;
+
+            if (row) {
+                if (use_alibi) {
+                    for (int64_t i = 0; i < n_kv; ++i) {
+                        row[i] = cpos[i] <= p ? -(float) std::abs(cpos[i] - p) : -INFINITY;
+                    }
+                } else {
+                    for (int64_t i = 0; i < n_kv; ++i) {
+                        row[i] = cpos[i] <= p ? 0.0f : -INFINITY;
+                    }
+                }
+            }
+
+            // may need to cut off old tokens for sliding window
+            if (data_swa) {
+                float * row_swa = data_swa + (s*n_seq_tokens + j)*ld;
+
+                for (int64_t i = 0; i < n_kv; ++i) {
+                    const bool visible = cpos[i] <= p && p - cpos[i] < (llama_pos) n_swa;
+                    row_swa[i] = visible ? (use_alibi ? -(float) std::abs(cpos[i] - p) : 0.0f) : -INFINITY;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "llama-impl.h"
+
+#include <bitset>
+
+struct llama_kv_cell {
+    llama_pos pos   = -1;
+    llama_pos delta = 0;
+    int32_t   src   = -1; // used by recurrent state models to copy states
+    int32_t   tail  = -1;
+
+    // fixed-width set of the sequences the cell belongs to - no heap allocations
+    std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seq_id;
+
+    bool has_seq_id(const llama_seq_id & id) const {
+        return id >= 0 && id < LLAMA_MAX_PARALLEL_SEQUENCES && seq_id[id];
+    }
+
+    bool is_empty() const {
+        return seq_id.none();
+    }
+
+    bool is_same_seq(const llama_kv_cell & other) const {
+        return seq_id == other.seq_id;
+    }
+};
+
+// build the causal KQ mask rows of a ubatch over the first n_kv cells of the cache
+//
+//   - the ubatch has n_seqs sequences of n_seq_tokens tokens, seq_ids[s] is the (first) sequence id of sequence s
+//   - data and data_swa (optional) have n_seqs*n_seq_tokens rows of n_kv elements, the padding rows are not written
+//   - the rows are ld elements apart (0 - n_kv), so that the masks of several caches can share the rows
+//   - a cell is visible to a token if it belongs to the token's sequence and its position is not after the token's
+//     in the sliding-window mask, it also has to be less than n_swa positions before the token
+//
+// the positions of the cells are gathered once per distinct sequence of the ubatch into a contiguous array,
+// so that the rows are filled by a branch-free loop that the compiler can vectorize
+void llama_kv_cells_build_mask(
+        const llama_kv_cell * cells,
+                    int64_t   n_kv,
+                    int64_t   n_seqs,
+                    int64_t   n_seq_tokens,
+         const llama_seq_id * seq_ids,
+            const llama_pos * pos,
+                       bool   use_alibi,
+                   uint32_t   n_swa,
+                      float * data,
+                      float * data_swa,
+                    int64_t   ld = 0);
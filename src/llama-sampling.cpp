@@ -285,6 +285,61 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
     return token;
 }
 
+int32_t llama_logits_top_k(const float * logits, int32_t n_vocab, int32_t k, llama_token_data * data) {
+    k = std::min(k, n_vocab);
+
+    if (k <= 0) {
+        return 0;
+    }
+
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    // scan the row in blocks, keeping the candidates at or above a running threshold
+    // the threshold test of a block is branch-free so that it vectorizes, and most blocks are skipped by it
+    // once the candidate buffer fills up, it is cut back to the k largest and the threshold is raised
+    constexpr int32_t block = 64;
+
+    std::vector<llama_token_data> buf;
+    buf.reserve(2*k + block);
+
+    float thold = -INFINITY;
+
+    for (int32_t i0 = 0; i0 < n_vocab; i0 += block) {
+        const int32_t i1 = std::min(i0 + block, n_vocab);
+
+        int any = 0;
+        for (int32_t i = i0; i < i1; ++i) {
+            any |= logits[i] >= thold;
+        }
+
+        if (!any) {
+            continue;
+        }
+
+        for (int32_t i = i0; i < i1; ++i) {
+            if (logits[i] >= thold) {
+                buf.push_back({ i, logits[i], 0.0f });
+            }
+        }
+
+        if ((int32_t) buf.size() >= 2*k) {
+            std::nth_element(buf.begin(), buf.begin() + (k - 1), buf.end(), comp);
+            buf.resize(k);
+            thold = buf[k - 1].logit;
+        }
+    }
+
+    // NaN logits never pass the threshold test
+    k = std::min(k, (int32_t) buf.size());
+
+    std::partial_sort(buf.begin(), buf.begin() + k, buf.end(), comp);
+    std::memcpy(data, buf.data(), k*sizeof(llama_token_data));
+
+    return k;
+}
+
 // sampler chain
 
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
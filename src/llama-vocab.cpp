@@ -3,14 +3,21 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <forward_list>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <sstream>
+#include <thread>
 
 //
 // helpers
@@ -204,6 +211,10 @@ struct llm_tokenizer_spm_session {
     llm_tokenizer_spm_session(const llama_vocab & vocab) : vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+        // the session can be reused for several texts
+        symbols.clear();
+        work_queue = llm_bigram_spm::queue();
+        rev_merge.clear();
 
         // split string into utf8 chars
         int index = 0;
@@ -361,9 +372,164 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_token left_id;  // tokens of the two symbols when the bigram was queued, to detect outdated bigrams
+    llama_token right_id;
+    llama_token id;       // token of the merged symbols
     int rank;
-    size_t size;
+};
+
+// the BPE merges keyed by the token ids of their two sides, in a flat open-addressing table
+struct llm_bpe_merges {
+    struct entry {
+        uint64_t    key; // (left id << 32) | right id
+        int32_t     rank;
+        llama_token id;
+    };
+
+    static constexpr uint64_t key_empty = UINT64_MAX;
+
+    static uint64_t make_key(llama_token left, llama_token right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    void init(const llama_vocab & vocab) {
+        size_t n_entries = 1;
+        while (n_entries < 2*vocab.bpe_ranks.size()) {
+            n_entries *= 2;
+        }
+
+        entries.assign(n_entries, { key_empty, -1, LLAMA_TOKEN_NULL });
+        shift = 64;
+        for (size_t n = n_entries; n > 1; n /= 2) {
+            shift--;
+        }
+
+        size_t n_skipped = 0;
+
+        for (const auto & it : vocab.bpe_ranks) {
+            const auto left   = vocab.token_to_id.find(it.first.first);
+            const auto right  = vocab.token_to_id.find(it.first.second);
+            const auto merged = vocab.token_to_id.find(it.first.first + it.first.second);
+
+            // a merge can only apply to tokens and produce a token
+            if (left == vocab.token_to_id.end() || right == vocab.token_to_id.end() || merged == vocab.token_to_id.end()) {
+                n_skipped++;
+                continue;
+            }
+
+            const uint64_t key = make_key(left->second, right->second);
+
+            size_t i = slot(key);
+            while (entries[i].key != key_empty && entries[i].key != key) {
+                i = (i + 1) & (entries.size() - 1);
+            }
+
+            // keep the lowest rank of duplicated merges
+            if (entries[i].key == key_empty || it.second < entries[i].rank) {
+                entries[i] = { key, it.second, merged->second };
+            }
+        }
+
+        if (n_skipped > 0) {
+            LLAMA_LOG_DEBUG("%s: skipped %zu merges of strings that are not tokens\n", __func__, n_skipped);
+        }
+    }
+
+    const entry * find(llama_token left, llama_token right) const {
+        const uint64_t key = make_key(left, right);
+
+        for (size_t i = slot(key); ; i = (i + 1) & (entries.size() - 1)) {
+            if (entries[i].key == key) {
+                return &entries[i];
+            }
+            if (entries[i].key == key_empty) {
+                return nullptr;
+            }
+        }
+    }
+
+private:
+    size_t slot(uint64_t key) const {
+        return shift < 64 ? (key * 0x9E3779B97F4A7C15ull) >> shift : 0;
+    }
+
+    std::vector<entry> entries;
+
+    int shift = 64;
+};
+
+// bounded LRU cache of the tokens of the pre-tokenized words, sharded to limit the contention between threads
+struct llm_bpe_word_cache {
+    static constexpr size_t n_shards     = 16;
+    static constexpr size_t default_size = 32768; // words
+
+    // also clears the cache
+    void init(size_t size) {
+        shard_size = (size + n_shards - 1) / n_shards;
+
+        for (auto & shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            shard.map.clear();
+            shard.lru.clear();
+        }
+    }
+
+    bool get(const std::string & word, std::vector<llama_token> & output) {
+        if (shard_size == 0) {
+            return false;
+        }
+
+        auto & shard = shards[std::hash<std::string>{}(word) % n_shards];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.map.find(word);
+        if (it == shard.map.end()) {
+            return false;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+
+        return true;
+    }
+
+    void put(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        if (shard_size == 0) {
+            return;
+        }
+
+        auto & shard = shards[std::hash<std::string>{}(word) % n_shards];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.map.find(word) != shard.map.end()) {
+            return;
+        }
+
+        if (shard.map.size() >= shard_size) {
+            shard.map.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+
+        shard.lru.emplace_front(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+        shard.map.emplace(word, shard.lru.begin());
+    }
+
+private:
+    using item = std::pair<std::string, std::vector<llama_token>>;
+
+    struct shard {
+        std::mutex mutex;
+
+        std::list<item> lru; // most recently used first
+        std::unordered_map<std::string, std::list<item>::iterator> map;
+    };
+
+    size_t shard_size = 0;
+
+    shard shards[n_shards];
 };
 
 struct llm_tokenizer_bpe : llm_tokenizer {
@@ -488,9 +654,27 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        merges.init(vocab);
+
+        for (int c = 0; c < 256; ++c) {
+            const auto it = vocab.token_to_id.find(std::string(1, (char) c));
+            byte_to_id[c] = it == vocab.token_to_id.end() ? LLAMA_TOKEN_NULL : it->second;
+        }
+
+        // the tokens of the most recent words
+        word_cache.init(llm_bpe_word_cache::default_size);
     }
 
     std::vector<std::string> regex_exprs;
+
+    llm_bpe_merges merges;
+
+    // tokens of the single-byte strings, for the symbols of ASCII chars
+    llama_token byte_to_id[256];
+
+    // shared by the sessions
+    mutable llm_bpe_word_cache word_cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -535,132 +719,134 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            if (bpe_tokenizer->word_cache.get(word, output)) {
+                continue;
+            }
+
+            const size_t n_output = output.size();
 
-            int index = 0;
-            size_t offset = 0;
+            tokenize_word(word, output);
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+            bpe_tokenizer->word_cache.put(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
+
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_vocab::id> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
+
+        int index = 0;
+        size_t offset = 0;
+
+        if (vocab.tokenizer_ignore_merges) {
+            const auto token = vocab.token_to_id.find(word);
+            if (token != vocab.token_to_id.end()) {
                 symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+                symbol_ids.push_back(token->second);
                 offset = word.size();
             }
+        }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+            if (sym.n == 1) {
+                symbol_ids.push_back(bpe_tokenizer->byte_to_id[(uint8_t) sym.text[0]]);
+            } else {
+                const auto token = vocab.token_to_id.find(std::string(sym.text, sym.n));
+                symbol_ids.push_back(token == vocab.token_to_id.end() ? LLAMA_TOKEN_NULL : token->second);
+            }
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            if (symbol_ids[bigram.left] != bigram.left_id || symbol_ids[bigram.right] != bigram.right_id) {
+                continue;  // Skip this bigram if it's outdated
+            }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
-
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
-                        }
+            if (symbol_ids[i] != LLAMA_TOKEN_NULL) {
+                output.push_back(symbol_ids[i]);
+            } else {
+                for (size_t j = 0; j < symbol.n; ++j) {
+                    const llama_token token_byte = bpe_tokenizer->byte_to_id[(uint8_t) symbol.text[j]];
+                    if (token_byte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_byte);
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
 
-        int rank_found = -1;
+        const llama_token left_id  = symbol_ids[left];
+        const llama_token right_id = symbol_ids[right];
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (left_id == LLAMA_TOKEN_NULL || right_id == LLAMA_TOKEN_NULL) {
+            return;
+        }
 
-        if (rank_found < 0) {
+        const auto * merge = bpe_tokenizer->merges.find(left_id, right_id);
+        if (merge == nullptr) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = left_id;
+        bigram.right_id = right_id;
+        bigram.id       = merge->id;
+        bigram.rank     = merge->rank;
 
         work_queue.push(bigram);
     }
@@ -668,8 +854,8 @@ private:
     const llama_vocab & vocab;
     const llm_tokenizer_bpe * bpe_tokenizer;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llm_symbol>  symbols;
+    std::vector<llama_token> symbol_ids; // token of each symbol, LLAMA_TOKEN_NULL if the symbol is not a token
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1434,14 +1620,39 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
     }
 }
 
-std::vector<llama_vocab::id> llama_tokenize_internal(
-        const llama_vocab & vocab,
-        std::string raw_text,
+// the tokenizer sessions of a thread over the shared tokenizer of the vocab, reused for all the texts it tokenizes
+struct llm_tokenizer_sessions {
+    llm_tokenizer_sessions(const llama_vocab & vocab) : vocab(vocab) {}
+
+    template <typename T>
+    T & get(std::unique_ptr<T> & session) {
+        if (!session) {
+            session = std::make_unique<T>(vocab);
+        }
+        return *session;
+    }
+
+    const llama_vocab & vocab;
+
+    std::unique_ptr<llm_tokenizer_spm_session>  spm;
+    std::unique_ptr<llm_tokenizer_bpe_session>  bpe;
+    std::unique_ptr<llm_tokenizer_wpm_session>  wpm;
+    std::unique_ptr<llm_tokenizer_ugm_session>  ugm;
+    std::unique_ptr<llm_tokenizer_rwkv_session> rwkv;
+};
+
+// clears output before tokenizing raw_text into it
+static void llama_tokenize_sessions(
+        llm_tokenizer_sessions & sessions,
+        const std::string & raw_text,
         bool add_special,
-        bool parse_special) {
+        bool parse_special,
+        std::vector<llama_vocab::id> & output) {
+    const llama_vocab & vocab = sessions.vocab;
+
     GGML_ASSERT(vocab.tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
-    std::vector<llama_vocab::id> output;
+    output.clear();
     std::forward_list<fragment_buffer_variant> fragment_buffer;
 
     if (!raw_text.empty()) {
@@ -1478,7 +1689,7 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
                         llama_escape_whitespace(raw_text);
-                        llm_tokenizer_spm_session session(vocab);
+                        auto & session = sessions.get(sessions.spm);
                         session.tokenize(raw_text, output);
                         is_prev_special = false;
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
@@ -1501,7 +1712,7 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
             } break;
         case LLAMA_VOCAB_TYPE_BPE:
             {
-                llm_tokenizer_bpe_session session(vocab);
+                auto & session = sessions.get(sessions.bpe);
                 // it calls some other methods that are not exist in llm_tokenizer,
                 // here just cast it to bpe tokenizer object
                 if (add_special) {
@@ -1532,7 +1743,7 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
                     output.push_back(vocab.special_cls_id);
                 }
 
-                llm_tokenizer_wpm_session session(vocab);
+                auto & session = sessions.get(sessions.wpm);
 
                 for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
@@ -1558,7 +1769,7 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
                     GGML_ASSERT(vocab.special_bos_id != -1);
                     output.push_back(vocab.special_bos_id);
                 }
-                llm_tokenizer_ugm_session session(vocab);
+                auto & session = sessions.get(sessions.ugm);
 
                 for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
@@ -1586,7 +1797,7 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
             } break;
         case LLAMA_VOCAB_TYPE_RWKV:
             {
-                llm_tokenizer_rwkv_session session(vocab);
+                auto & session = sessions.get(sessions.rwkv);
                 for (const auto & fragment : fragment_buffer) {
                     if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
                         auto raw_text = fragment.raw_text.substr(fragment.offset, fragment.length);
@@ -1604,6 +1815,17 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
         case LLAMA_VOCAB_TYPE_NONE:
             GGML_ABORT("fatal error");
     }
+}
+
+std::vector<llama_vocab::id> llama_tokenize_internal(
+        const llama_vocab & vocab,
+        std::string raw_text,
+        bool add_special,
+        bool parse_special) {
+    llm_tokenizer_sessions sessions(vocab);
+
+    std::vector<llama_vocab::id> output;
+    llama_tokenize_sessions(sessions, raw_text, add_special, parse_special, output);
 
     return output;
 }
@@ -1752,6 +1974,104 @@ int32_t llama_tokenize_impl(
     return res.size();
 }
 
+void llama_tokenizer_set_cache_size_impl(struct llama_vocab & vocab, int32_t n_words) {
+    if (vocab.type != LLAMA_VOCAB_TYPE_BPE || vocab.tokenizer == nullptr) {
+        return;
+    }
+
+    static_cast<llm_tokenizer_bpe *>(vocab.tokenizer)->word_cache.init(std::max(0, n_words));
+}
+
+int32_t llama_tokenize_batch_impl(
+        const struct llama_vocab & vocab,
+                     const char ** texts,
+                  const int32_t  * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+    n_threads = std::min<int32_t>(n_threads, std::max(1u, std::thread::hardware_concurrency()));
+
+    // do not start threads for less than a few KB of text each
+    size_t n_bytes = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        n_bytes += text_lens[i];
+    }
+    n_threads = std::max(1, std::min({ n_threads, n_texts, (int32_t) (n_bytes/4096) + 1 }));
+
+    // each thread appends the tokens of the texts it takes to its own buffer
+    struct span {
+        int32_t ith;
+        size_t  begin;
+        size_t  end;
+    };
+
+    std::vector<span>                         spans(n_texts);
+    std::vector<std::vector<llama_vocab::id>> results(n_threads);
+    std::vector<std::exception_ptr>           errors(n_threads);
+
+    std::atomic<int32_t> next(0);
+
+    auto compute = [&](int32_t ith) {
+        try {
+            llm_tokenizer_sessions       sessions(vocab);
+            std::vector<llama_vocab::id> output;
+
+            auto & result = results[ith];
+
+            for (int32_t i = next++; i < n_texts; i = next++) {
+                llama_tokenize_sessions(sessions, std::string(texts[i], text_lens[i]), add_special, parse_special, output);
+
+                spans[i] = { ith, result.size(), result.size() + output.size() };
+                result.insert(result.end(), output.begin(), output.end());
+            }
+        } catch (...) {
+            errors[ith] = std::current_exception();
+            next = n_texts;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int32_t ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(compute, ith);
+    }
+    compute(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    for (const auto & error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    int64_t n_tokens = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        offsets[i] = (int32_t) n_tokens;
+        n_tokens += spans[i].end - spans[i].begin;
+    }
+    offsets[n_texts] = (int32_t) n_tokens;
+
+    if (n_tokens_max < n_tokens) {
+        return -((int32_t) n_tokens);
+    }
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        const auto & result = results[spans[i].ith];
+        std::copy(result.begin() + spans[i].begin, result.begin() + spans[i].end, tokens + offsets[i]);
+    }
+
+    return (int32_t) n_tokens;
+}
+
 static std::string llama_decode_text(const std::string & text) {
     std::string decoded_text;
 
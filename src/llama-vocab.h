@@ -6,9 +6,12 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <memory>
 #include <set>
 
 struct llm_tokenizer;
+struct llama_grammar_trie;
+struct llama_grammar_cache;
 
 struct llama_vocab {
     using id    = llama_token;
@@ -34,6 +37,12 @@ struct llama_vocab {
     std::vector<id>    cache_special_tokens;
     std::vector<token> cache_token_to_piece; // llama_token_to_piece(special = true);
 
+    // code point trie over cache_token_to_piece, built by the grammar sampler on first use
+    mutable std::shared_ptr<llama_grammar_trie> cache_grammar_trie;
+
+    // grammars compiled for this vocab, by grammar text
+    mutable std::shared_ptr<llama_grammar_cache> cache_grammars;
+
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
     // default LLaMA special tokens
@@ -140,6 +149,20 @@ int32_t llama_tokenize_impl(
                             bool   add_special,
                             bool   parse_special);
 
+int32_t llama_tokenize_batch_impl(
+        const struct llama_vocab & vocab,
+                     const char ** texts,
+                  const int32_t  * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
+void llama_tokenizer_set_cache_size_impl(struct llama_vocab & vocab, int32_t n_words);
+
 // does not write null-terminator to buf
 int32_t llama_token_to_piece_impl(
         const struct llama_vocab & vocab,
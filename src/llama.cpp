@@ -1,6 +1,7 @@
 #include "llama-impl.h"
 #include "llama-vocab.h"
 #include "llama-sampling.h"
+#include "llama-kv-cells.h"
 
 #include "unicode.h"
 
@@ -45,12 +46,14 @@
 
 #include <algorithm>
 #include <array>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
@@ -80,6 +83,12 @@
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 160  // DeepSeekV2
 
+// the minimum number of cells moved at once from the hot to the cold tier of a tiered KV cache
+#define LLAMA_KV_REQUANT_CHUNK 256
+
+// set in the cell count of the KV cache in a state when the cells of the cold tier of a tiered KV cache follow
+#define LLAMA_STATE_KV_COLD_FLAG 0x80000000u
+
 //
 // helpers
 //
@@ -2571,6 +2580,9 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size;
+    uint32_t kv_n_hot;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
@@ -2753,27 +2765,6 @@ struct llama_ubatch {
     int8_t       *  output;   // [n_tokens]
 };
 
-struct llama_kv_cell {
-    llama_pos pos   = -1;
-    llama_pos delta = 0;
-    int32_t   src   = -1; // used by recurrent state models to copy states
-    int32_t   tail  = -1;
-
-    std::set<llama_seq_id> seq_id;
-
-    bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
-    }
-
-    bool is_empty() const {
-        return seq_id.empty();
-    }
-
-    bool is_same_seq(const llama_kv_cell & other) const {
-        return seq_id == other.seq_id;
-    }
-};
-
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -2794,6 +2785,23 @@ struct llama_kv_cache {
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
+    // paged allocation: when no contiguous run of free cells is available for a ubatch,
+    // scatter it over the free cells of the cache, one block of cells at a time
+    uint32_t block_size = 0; // 0 - disabled
+    uint32_t max_runs   = 1; // max number of cell runs per ubatch (each run adds nodes to the graph)
+
+    // the cells of the current ubatch as (first cell, number of cells) runs, in ubatch order
+    // empty when the ubatch occupies the contiguous cells [head, head + n_tokens)
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+
+    // copy-on-write: pending KV data copies (src cell, dst cell) of shared cells that were detached by a sequence
+    // applied in order on the next llama_kv_cache_update(), before the K-shift
+    std::vector<std::pair<uint32_t, uint32_t>> cow;
+
+    // streaming context shift: the K data of the tokens of sequence s is RoPEd at pos + rope_offs[s]
+    // the sequences that share cells always have the same offset (see llama_kv_cache_seq_stream)
+    std::vector<llama_pos> rope_offs;
+
     std::vector<llama_kv_cell> cells;
 
     std::vector<struct ggml_tensor *> k_l; // per layer
@@ -2802,11 +2810,21 @@ struct llama_kv_cache {
     std::vector<ggml_context_ptr> ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
-    size_t total_size() {
+    // tiered cache: only the last n_hot tokens of each sequence are kept in this cache, the older tokens are
+    // moved to the cold cache, stored in lower precision (see llama_kv_cache_requant_internal)
+    // the sequence operations apply to both tiers, and the attention is computed over the cold and the hot cells
+    std::unique_ptr<llama_kv_cache> cold;
+    uint32_t n_hot = 0;
+    bool cold_full = false; // the cold cache has no room for the cells to move - warned once until it has room again
+
+    size_t total_size() const {
         size_t size = 0;
-        for (auto & buf : bufs) {
+        for (const auto & buf : bufs) {
             size += ggml_backend_buffer_get_size(buf.get());
         }
+        if (cold) {
+            size += cold->total_size();
+        }
         return size;
     }
 };
@@ -2904,6 +2922,9 @@ struct llama_model {
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
 
+    // model memory buffers copied to each NUMA node (GGML_NUMA_STRATEGY_MIRROR)
+    std::vector<const void *> numa_mirrors;
+
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
@@ -2917,6 +2938,9 @@ struct llama_model {
        while (!lora_adapters.empty()) {
             llama_lora_adapter_free(*lora_adapters.begin());
         }
+        for (const void * data : numa_mirrors) {
+            ggml_numa_unmirror(data);
+        }
     }
 };
 
@@ -3225,6 +3249,64 @@ struct llama_sbatch {
     }
 };
 
+// the rows of a ubatch (its tokens or its outputs) grouped by the per-sequence LoRA adapters of their sequence
+struct llama_lora_rows {
+    int64_t n_rows = 0;
+
+    bool no_seq = false; // the ubatch has no sequence ids, the rows cannot be grouped
+
+    std::vector<std::map<struct llama_lora_adapter *, float>> adapters; // [n_groups] adapters of the group
+    std::vector<std::vector<int32_t>>                         ids;      // [n_groups] rows of the group
+
+    // the index inputs of the graph, created on first use
+    std::vector<struct ggml_tensor *>                 inp_ids; // [n_groups]
+    std::map<std::vector<bool>, struct ggml_tensor *> inp_inv; // by the groups that modify the weight
+};
+
+// the outputs of a batch - the outputs of the previous batch are moved out of the context by llama_decode_async
+struct llama_outputs {
+    ggml_backend_buffer_ptr buf_output;
+
+    size_t  logits_size = 0;
+    float * logits      = nullptr;
+
+    std::vector<int32_t> output_ids;
+    size_t  output_size = 0;
+    int32_t n_outputs   = 0;
+
+    size_t  embd_size = 0;
+    float * embd      = nullptr;
+
+    std::map<llama_seq_id, std::vector<float>> embd_seq;
+};
+
+// a batch decoded by the worker thread of the context (see llama_decode_async)
+// the worker is started by the first llama_decode_async and joined by llama_free
+struct llama_decode_task {
+    std::thread             worker;
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    bool queued  = false; // the batch is submitted to the worker and not decoded yet
+    bool exit    = false;
+    bool pending = false; // the outputs of the previous batch are current until llama_decode_wait()
+
+    llama_batch batch = {};
+    int32_t     ret   = 0;
+
+    // copy of the submitted batch
+    std::vector<llama_token>    token;
+    std::vector<float>          embd;
+    std::vector<llama_pos>      pos;
+    std::vector<int32_t>        n_seq_id;
+    std::vector<llama_seq_id>   seq_id_data;
+    std::vector<llama_seq_id *> seq_id;
+    std::vector<int8_t>         logits;
+
+    // the outputs of the previous batch, returned by the llama_get_logits* and llama_get_embeddings* functions
+    llama_outputs front;
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -3240,6 +3322,9 @@ struct llama_context {
 
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
 
+    // adapters applied only to the tokens of a sequence, on top of lora_adapters
+    std::map<llama_seq_id, std::map<struct llama_lora_adapter *, float>> lora_seq;
+
     std::vector<ggml_backend_ptr> backends;
     std::vector<std::pair<ggml_backend_t, ggml_backend_set_n_threads_t>> set_n_threads_fns;
 
@@ -3283,6 +3368,9 @@ struct llama_context {
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
     std::map<llama_seq_id, std::vector<float>> embd_seq;
 
+    // asynchronous decode - the functions that use the state of the context wait for it first
+    llama_decode_task decode_task;
+
     // whether we are computing encoder output or decoder output
     bool is_encoding = false;
 
@@ -3294,6 +3382,12 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_ptr sched;
 
+    // the node budget of the graphs, grown with the per-sequence adapters - the scheduler is created again for it
+    size_t max_nodes = 0;
+    std::vector<ggml_backend_t>             sched_backends;
+    std::vector<ggml_backend_buffer_type_t> sched_bufts;
+    bool                                    sched_pipeline_parallel = false;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -3313,6 +3407,15 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+
+    // per-sequence LoRA adapters: the rows of the ubatch by group and the index inputs with their data
+    llama_lora_rows lora_rows_tokens;
+    llama_lora_rows lora_rows_outputs;
+
+    // set by the graph build when the adapters of a weight cannot be applied to the rows of its input
+    bool lora_seq_failed = false;
+
+    std::vector<std::pair<struct ggml_tensor *, std::vector<int32_t>>> inp_lora; // I32
 };
 
 struct llama_lora_weight {
@@ -3423,6 +3526,13 @@ static bool llama_kv_cache_init(
     cache.type_k = type_k;
     cache.type_v = type_v;
 
+    // recurrent states are always stored in contiguous cells
+    cache.block_size = cache.recurrent ? 0 : std::min(cparams.kv_block_size, kv_size);
+    cache.runs.clear();
+    cache.cow.clear();
+
+    cache.rope_offs.assign(LLAMA_MAX_PARALLEL_SEQUENCES, 0);
+
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
@@ -3502,10 +3612,92 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// paged fallback of llama_kv_cache_find_slot, when no contiguous run of "n_tokens" free cells exists
+// the free cells are taken one block at a time, fully free blocks first, to keep the number of runs low
+// on success, cache.head points to the first cell of the slot and cache.runs lists all the cells of the slot
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch) {
+    const uint32_t n_tokens     = batch.n_tokens;
+    const uint32_t n_seq_tokens = batch.n_seq_tokens;
+
+    if (cache.used + n_tokens > cache.size) {
+        return false;
+    }
+
+    const uint32_t n_blocks = (cache.size + cache.block_size - 1)/cache.block_size;
+    const uint32_t b_head   = cache.head/cache.block_size;
+
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+
+    uint32_t n_found = 0;
+
+    // pass 0: fully free blocks, pass 1: partially used blocks
+    for (int pass = 0; pass < 2 && n_found < n_tokens; ++pass) {
+        for (uint32_t ib = 0; ib < n_blocks && n_found < n_tokens; ++ib) {
+            const uint32_t b  = (b_head + ib) % n_blocks;
+            const uint32_t c0 = b*cache.block_size;
+            const uint32_t c1 = std::min(cache.size, c0 + cache.block_size);
+
+            uint32_t n_free = 0;
+            for (uint32_t i = c0; i < c1; ++i) {
+                n_free += cache.cells[i].pos < 0;
+            }
+
+            if (n_free == 0 || (pass == 0) != (n_free == c1 - c0)) {
+                continue;
+            }
+
+            for (uint32_t i = c0; i < c1 && n_found < n_tokens; ++i) {
+                if (cache.cells[i].pos >= 0) {
+                    continue;
+                }
+
+                if (!runs.empty() && runs.back().first + runs.back().second == i) {
+                    runs.back().second++;
+                } else {
+                    if (runs.size() >= cache.max_runs) {
+                        // too fragmented for a ubatch of this size - a smaller ubatch may still fit
+                        return false;
+                    }
+                    runs.emplace_back(i, 1);
+                }
+                n_found++;
+            }
+        }
+    }
+
+    if (n_found < n_tokens) {
+        return false;
+    }
+
+    uint32_t k = 0;
+    for (const auto & run : runs) {
+        for (uint32_t i = 0; i < run.second; ++i, ++k) {
+            const uint32_t s = k/n_seq_tokens;
+
+            llama_kv_cell & cell = cache.cells[run.first + i];
+
+            cell.pos = batch.pos[k];
+
+            for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                cell.seq_id.set(batch.seq_id[s][j]);
+            }
+        }
+    }
+
+    cache.used += n_tokens;
+    cache.head  = runs.front().first;
+    cache.runs  = std::move(runs);
+
+    return true;
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
 // to the first cell of the slot.
+// With a paged cache, the slot may be split in several runs of cells (see cache.runs)
 static bool llama_kv_cache_find_slot(
            struct llama_kv_cache & cache,
        const struct llama_ubatch & batch) {
@@ -3542,9 +3734,9 @@ static bool llama_kv_cache_find_slot(
                         llama_kv_cell & cell = cache.cells[seq.tail];
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
+                        cell.seq_id.reset(seq_id);
                         seq.tail = -1;
-                        if (cell.seq_id.empty()) {
+                        if (cell.seq_id.none()) {
                             cell.pos = -1;
                             cell.src = -1;
                             cache.used -= 1;
@@ -3560,7 +3752,10 @@ static bool llama_kv_cache_find_slot(
             tails_verif.assign(cache.size, -1);
             for (uint32_t i = 0; i < cache.size; ++i) {
                 llama_kv_cell & cell = cache.cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
+                for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_PARALLEL_SEQUENCES; ++seq_id) {
+                    if (!cell.has_seq_id(seq_id)) {
+                        continue;
+                    }
                     if (tails_verif[seq_id] != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
                     }
@@ -3594,7 +3789,7 @@ static bool llama_kv_cache_find_slot(
                 llama_kv_cell & cell = cache.cells[seq_meta.tail];
                 GGML_ASSERT(cell.has_seq_id(seq_id));
                 // does this seq_id "own" the cell?
-                if (cell.seq_id.size() == 1) { has_cell = true; }
+                if (cell.seq_id.count() == 1) { has_cell = true; }
             }
             if (!has_cell) {
                 llama_kv_cell & empty_cell = cache.cells[next_empty_cell];
@@ -3604,8 +3799,8 @@ static bool llama_kv_cache_find_slot(
                     llama_kv_cell & orig_cell = cache.cells[seq_meta.tail];
                     empty_cell.pos = orig_cell.pos;
                     empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
+                    orig_cell.seq_id.reset(seq_id);
+                    empty_cell.seq_id.set(seq_id); // will be overwritten
                 }
                 seq_meta.tail = next_empty_cell;
                 // find next empty cell
@@ -3636,11 +3831,13 @@ static bool llama_kv_cache_find_slot(
                 std::swap(dst_cell.seq_id, src_cell.seq_id);
 
                 // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
-                    cache.cells[seq_id].tail = src_id;
-                }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
-                    cache.cells[seq_id].tail = dst_id;
+                for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_PARALLEL_SEQUENCES; ++seq_id) {
+                    if (src_cell.has_seq_id(seq_id)) {
+                        cache.cells[seq_id].tail = src_id;
+                    }
+                    if (dst_cell.has_seq_id(seq_id)) {
+                        cache.cells[seq_id].tail = dst_id;
+                    }
                 }
             }
         }
@@ -3658,10 +3855,10 @@ static bool llama_kv_cache_find_slot(
                     __func__, last_pos, cell.pos, batch.seq_id[s][0], n_seq_tokens);
             }
             cell.pos = last_pos;
-            cell.seq_id.clear();
+            cell.seq_id.reset();
             for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
                 const llama_seq_id seq_id = batch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
+                cell.seq_id.set(seq_id);
                 cache.cells[seq_id].tail = cell_id;
             }
         }
@@ -3680,6 +3877,8 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
+    cache.runs.clear();
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -3704,6 +3903,9 @@ static bool llama_kv_cache_find_slot(
         }
 
         if (n_tested >= cache.size) {
+            if (cache.block_size > 0) {
+                return llama_kv_cache_find_slot_paged(cache, batch);
+            }
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return false;
         }
@@ -3715,7 +3917,7 @@ static bool llama_kv_cache_find_slot(
             cache.cells[cache.head + k].pos = batch.pos[k];
 
             for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
-                cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
+                cache.cells[cache.head + k].seq_id.set(batch.seq_id[s][j]);
             }
         }
     }
@@ -3741,16 +3943,58 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].seq_id.reset();
         cache.cells[i].src = -1;
         cache.cells[i].tail = -1;
     }
     cache.head = 0;
     cache.used = 0;
+    cache.runs.clear();
+    cache.cow.clear();
+
+    std::fill(cache.rope_offs.begin(), cache.rope_offs.end(), 0);
 
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
+
+    if (cache.cold) {
+        llama_kv_cache_clear(*cache.cold);
+    }
+}
+
+// copy-on-write: give seq_id its own copy of the shared cell i, so that the sequence can modify
+// the cell without affecting the other sequences that share it
+// the KV data is copied on the next llama_kv_cache_update()
+// returns the index of the copy, or i if there is no free cell (the cell then stays shared)
+static uint32_t llama_kv_cache_cell_detach(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    GGML_ASSERT(!cache.recurrent);
+
+    for (uint32_t n = 0; n < cache.size; ++n) {
+        const uint32_t j = (cache.head + n) % cache.size;
+
+        llama_kv_cell & dst = cache.cells[j];
+
+        if (dst.pos >= 0) {
+            continue;
+        }
+
+        llama_kv_cell & src = cache.cells[i];
+
+        dst.pos   = src.pos;
+        dst.delta = src.delta;
+        dst.seq_id.reset();
+        dst.seq_id.set(seq_id);
+
+        src.seq_id.reset(seq_id);
+
+        cache.used++;
+        cache.cow.emplace_back(i, j);
+
+        return j;
+    }
+
+    return i;
 }
 
 static bool llama_kv_cache_seq_rm(
@@ -3793,9 +4037,9 @@ static bool llama_kv_cache_seq_rm(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].seq_id.reset();
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells[i].seq_id.reset(seq_id);
             } else {
                 continue;
             }
@@ -3813,6 +4057,19 @@ static bool llama_kv_cache_seq_rm(
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    // a sequence that is removed entirely starts again without a RoPE offset
+    if (p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+        if (seq_id < 0) {
+            std::fill(cache.rope_offs.begin(), cache.rope_offs.end(), 0);
+        } else if (seq_id < LLAMA_MAX_PARALLEL_SEQUENCES) {
+            cache.rope_offs[seq_id] = 0;
+        }
+    }
+
+    if (cache.cold) {
+        return llama_kv_cache_seq_rm(*cache.cold, seq_id, p0, p1);
+    }
+
     return true;
 }
 
@@ -3833,9 +4090,9 @@ static void llama_kv_cache_seq_cp(
                 // clear destination seq_id if it wasn't empty
                 llama_kv_cell & cell_dst = cache.cells[tail_dst.tail];
 
-                cell_dst.seq_id.erase(seq_id_dst);
+                cell_dst.seq_id.reset(seq_id_dst);
                 tail_dst.tail = -1;
-                if (cell_dst.seq_id.empty()) {
+                if (cell_dst.seq_id.none()) {
                     cell_dst.pos = -1;
                     cell_dst.delta = -1;
                     cell_dst.src = -1;
@@ -3845,7 +4102,7 @@ static void llama_kv_cache_seq_cp(
             if (tail_src.tail >= 0) {
                 llama_kv_cell & cell_src = cache.cells[tail_src.tail];
 
-                cell_src.seq_id.insert(seq_id_dst);
+                cell_src.seq_id.set(seq_id_dst);
                 tail_dst.tail = tail_src.tail;
             }
         }
@@ -3854,13 +4111,22 @@ static void llama_kv_cache_seq_cp(
     }
     // otherwise, this is the KV cache of a Transformer-like model
 
+    if (seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id_dst = %d > %d\n", __func__, seq_id_dst, LLAMA_MAX_PARALLEL_SEQUENCES - 1);
+        return;
+    }
+
     cache.head = 0;
 
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            cache.cells[i].seq_id.set(seq_id_dst);
         }
     }
+
+    if (cache.cold) {
+        llama_kv_cache_seq_cp(*cache.cold, seq_id_src, seq_id_dst, p0, p1);
+    }
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
@@ -3874,16 +4140,26 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
             if (cache.cells[i].pos >= 0) cache.used--;
             cache.cells[i].pos = -1;
             cache.cells[i].src = -1;
-            cache.cells[i].seq_id.clear();
+            cache.cells[i].seq_id.reset();
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            cache.cells[i].seq_id.reset();
+            cache.cells[i].seq_id.set(seq_id);
         }
     }
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    for (llama_seq_id s = 0; s < (llama_seq_id) cache.rope_offs.size(); ++s) {
+        if (s != seq_id) {
+            cache.rope_offs[s] = 0;
+        }
+    }
+
+    if (cache.cold) {
+        llama_kv_cache_seq_keep(*cache.cold, seq_id);
+    }
 }
 
 static void llama_kv_cache_seq_add(
@@ -3913,28 +4189,67 @@ static void llama_kv_cache_seq_add(
         return;
     }
 
+    uint32_t n_shared = 0;
+
+    // detached copies of shared cells can land on cells that are visited later - they must not be shifted twice
+    std::vector<bool> detached;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!detached.empty() && detached[i]) {
+            continue;
+        }
+
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            uint32_t id = i;
+
+            if (cache.cells[i].seq_id.count() > 1) {
+                if (cache.cells[i].pos + delta < 0) {
+                    // the token is dropped from this sequence only
+                    cache.cells[i].seq_id.reset(seq_id);
+                    continue;
+                }
+
+                id = llama_kv_cache_cell_detach(cache, i, seq_id);
+                if (id == i) {
+                    n_shared++;
+                } else {
+                    if (detached.empty()) {
+                        detached.resize(cache.size, false);
+                    }
+                    detached[id] = true;
+                }
+            }
+
+            llama_kv_cell & cell = cache.cells[id];
+
             cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+            cell.pos   += delta;
+            cell.delta += delta;
 
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].is_empty()) {
+            if (cell.pos < 0) {
+                if (!cell.is_empty()) {
                     cache.used--;
                 }
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                cell.pos = -1;
+                cell.seq_id.reset();
                 if (new_head == cache.size) {
-                    new_head = i;
+                    new_head = id;
                 }
             }
         }
     }
 
+    if (n_shared > 0) {
+        LLAMA_LOG_WARN("%s: no free cells to detach %u shared cells of seq %d - the shift applies to all their sequences\n", __func__, n_shared, seq_id);
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
+
+    if (cache.cold) {
+        llama_kv_cache_seq_add(*cache.cold, seq_id, p0, p1, delta);
+    }
 }
 
 static void llama_kv_cache_seq_div(
@@ -3962,17 +4277,177 @@ static void llama_kv_cache_seq_div(
         return;
     }
 
+    uint32_t n_shared = 0;
+
+    // detached copies of shared cells can land on cells that are visited later - they must not be divided twice
+    std::vector<bool> detached;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!detached.empty() && detached[i]) {
+            continue;
+        }
+
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            uint32_t id = i;
+
+            if (cache.cells[i].seq_id.count() > 1) {
+                id = llama_kv_cache_cell_detach(cache, i, seq_id);
+                if (id == i) {
+                    n_shared++;
+                } else {
+                    if (detached.empty()) {
+                        detached.resize(cache.size, false);
+                    }
+                    detached[id] = true;
+                }
+            }
+
+            llama_kv_cell & cell = cache.cells[id];
+
             cache.has_shift = true;
 
             {
-                llama_pos p_old = cache.cells[i].pos;
-                cache.cells[i].pos   /= d;
-                cache.cells[i].delta += cache.cells[i].pos - p_old;
+                llama_pos p_old = cell.pos;
+                cell.pos   /= d;
+                cell.delta += cell.pos - p_old;
+            }
+        }
+    }
+
+    if (n_shared > 0) {
+        LLAMA_LOG_WARN("%s: no free cells to detach %u shared cells of seq %d - the division applies to all their sequences\n", __func__, n_shared, seq_id);
+    }
+
+    if (cache.cold) {
+        llama_kv_cache_seq_div(*cache.cold, seq_id, p0, p1, d);
+    }
+}
+
+// streaming context shift of one tier: the tokens after the discarded ones keep their RoPE, only their positions
+// are moved back - the sink tokens [0, n_keep) are rotated forward instead, so that the distances are preserved
+// the tokens [n_keep, n_keep + n_discard) must already be removed and the shared cells of the sequence must have a free cell
+static void llama_kv_cache_seq_stream_tier(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   n_keep,
+                    llama_pos   n_discard) {
+    // detached copies of shared cells can land on cells that are visited later - they must not be moved twice
+    std::vector<bool> detached;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!detached.empty() && detached[i]) {
+            continue;
+        }
+
+        if (!cache.cells[i].has_seq_id(seq_id) || cache.cells[i].pos < 0) {
+            continue;
+        }
+
+        uint32_t id = i;
+
+        if (cache.cells[i].seq_id.count() > 1) {
+            id = llama_kv_cache_cell_detach(cache, i, seq_id);
+            GGML_ASSERT(id != i);
+
+            if (detached.empty()) {
+                detached.resize(cache.size, false);
+            }
+            detached[id] = true;
+        }
+
+        llama_kv_cell & cell = cache.cells[id];
+
+        if (cell.pos < n_keep) {
+            cache.has_shift = true;
+            cell.delta += n_discard;
+        } else {
+            cell.pos -= n_discard;
+        }
+    }
+
+    cache.head = 0;
+}
+
+// the RoPE positions of a sequence with an offset are folded back once they reach this bound
+// the attention only depends on the distances of the positions, so the bound leaves a context of headroom above the
+// positions of the sequence: after a fold, the next one is at least n_ctx shifted positions later instead of at the next shift
+static llama_pos llama_kv_cache_rope_pos_max(const llama_hparams & hparams, const llama_cparams & cparams) {
+    return 2*std::max<llama_pos>(hparams.n_ctx_train, cparams.n_ctx);
+}
+
+// fold the RoPE offsets into the K data with a K-shift on the next update
+// seq_id < 0 folds all sequences, otherwise only seq_id and the sequences that share cells with it (same offset)
+// returns false if there was no offset
+static bool llama_kv_cache_rope_offs_apply(struct llama_kv_cache & cache, llama_seq_id seq_id = -1) {
+    std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> group;
+
+    if (seq_id < 0) {
+        group.set();
+    } else if (seq_id < LLAMA_MAX_PARALLEL_SEQUENCES) {
+        group.set(seq_id);
+
+        // a shared cell is rotated for all its sequences, so they are folded together
+        for (bool grown = true; grown; ) {
+            grown = false;
+            for (const llama_kv_cache * kv = &cache; kv; kv = kv->cold.get()) {
+                for (uint32_t i = 0; i < kv->size; ++i) {
+                    const auto & cell_seqs = kv->cells[i].seq_id;
+                    if (cell_seqs.count() > 1 && (cell_seqs & group).any() && (cell_seqs & ~group).any()) {
+                        group |= cell_seqs;
+                        grown = true;
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<llama_seq_id> seqs;
+    for (llama_seq_id s = 0; s < (llama_seq_id) cache.rope_offs.size(); ++s) {
+        if (group[s] && cache.rope_offs[s] != 0) {
+            seqs.push_back(s);
+        }
+    }
+
+    if (seqs.empty()) {
+        return false;
+    }
+
+    for (llama_kv_cache * kv = &cache; kv; kv = kv->cold.get()) {
+        for (uint32_t i = 0; i < kv->size; ++i) {
+            llama_kv_cell & cell = kv->cells[i];
+
+            // the sequences that share the cell have the same offset
+            for (const llama_seq_id s : seqs) {
+                if (cell.has_seq_id(s)) {
+                    kv->has_shift = true;
+                    cell.delta -= cache.rope_offs[s];
+                    break;
+                }
             }
         }
     }
+
+    for (const llama_seq_id s : seqs) {
+        cache.rope_offs[s] = 0;
+    }
+
+    return true;
+}
+
+static int32_t llama_kv_cache_seq_n_shared(const struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    int32_t result = 0;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].seq_id.count() > 1 && cache.cells[i].has_seq_id(seq_id)) {
+            result++;
+        }
+    }
+
+    if (cache.cold) {
+        result += llama_kv_cache_seq_n_shared(*cache.cold, seq_id);
+    }
+
+    return result;
 }
 
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
@@ -3984,9 +4459,28 @@ static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama
         }
     }
 
+    if (cache.cold) {
+        result = std::max(result, llama_kv_cache_seq_pos_max(*cache.cold, seq_id));
+    }
+
     return result;
 }
 
+// the cells [first, last) that have to be rotated by the K-shift
+static std::pair<uint32_t, uint32_t> llama_kv_cache_shift_range(const struct llama_kv_cache & cache) {
+    uint32_t first = cache.size;
+    uint32_t last  = 0;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].pos >= 0 && cache.cells[i].delta != 0) {
+            first = std::min(first, i);
+            last  = i + 1;
+        }
+    }
+
+    return { std::min(first, last), last };
+}
+
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
     if (!cache.recurrent) {
         cache.do_defrag = true;
@@ -4204,8 +4698,25 @@ namespace GGUFMeta {
 
 using llama_buf_map = std::unordered_map<uint32_t, ggml_backend_buffer_t>;
 
-static size_t llama_model_max_nodes(const llama_model & model) {
-    return std::max<size_t>(8192, model.tensors_by_name.size()*5);
+static size_t llama_model_max_nodes(const llama_model & model, size_t n_extra = 0) {
+    return std::max<size_t>(8192, model.tensors_by_name.size()*5 + n_extra);
+}
+
+// the node budget of the graphs of a context: the nodes of the model and those of the per-sequence adapters
+static size_t llama_graph_max_nodes(const llama_context & lctx) {
+    size_t n_lora = 0;
+
+    // llm_build_lora_seq_mm, for each weight of an adapter of a sequence: two products, a scale and an add, and for
+    // its group of sequences (up to one per sequence) a gather, a concatenation, and the scatter of the result
+    for (const auto & seq : lctx.lora_seq) {
+        for (const auto & it : seq.second) {
+            n_lora += 9*it.first->ab_map.size();
+        }
+        // the index inputs of the group
+        n_lora += 4;
+    }
+
+    return llama_model_max_nodes(lctx.model, n_lora);
 }
 
 struct llama_model_loader {
@@ -9156,6 +9667,22 @@ static bool llm_load_tensors(
         }
     }
 
+    // copy the weights used by the CPU to each NUMA node, so that the threads do not read them from another node
+    if (ggml_is_numa()) {
+        for (auto & buf : model.bufs) {
+            ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(buf.get()));
+            if (!ggml_backend_buffer_is_host(buf.get()) || dev == nullptr || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+                continue;
+            }
+            const void * data = ggml_backend_buffer_get_base(buf.get());
+            const size_t size = ggml_backend_buffer_get_size(buf.get());
+            if (ggml_numa_mirror(data, size)) {
+                LLAMA_LOG_INFO("%s: %12s model buffer mirrored on each NUMA node\n", __func__, ggml_backend_buffer_name(buf.get()));
+                model.numa_mirrors.push_back(data);
+            }
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             model.mappings.emplace_back(std::move(mapping));
@@ -9289,15 +9816,56 @@ static void llm_build_kv_store(
                     int32_t   kv_head,
          const llm_build_cb & cb,
                     int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
+    const int64_t kv_size = kv.size;
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-    GGML_ASSERT(kv.size == n_ctx);
+    if (!kv.runs.empty()) {
+        // paged KV cache: the ubatch is scattered over several runs of cells - store each run separately
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cur = ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens);
 
-    struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
-    cb(k_cache_view, "k_cache_view", il);
+        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+
+        int64_t i0 = 0; // first token of the run
+
+        for (const auto & run : kv.runs) {
+            const int64_t n = run.second;
+
+            struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*run.first);
+            cb(k_cache_view, "k_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, ggml_view_2d(ctx, k_cur, n_embd_k_gqa, n, k_cur->nb[1], i0*k_cur->nb[1]), k_cache_view));
+
+            struct ggml_tensor * v_run = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, n, v_cur->nb[1], i0*v_cur->nb[1]);
+            struct ggml_tensor * v_cache_view = nullptr;
+
+            if (cparams.flash_attn) {
+                v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*run.first);
+            } else {
+                v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n, n_embd_v_gqa,
+                        (  kv_size)*ggml_element_size(kv.v_l[il]),
+                        (run.first)*ggml_element_size(kv.v_l[il]));
+
+                v_run = ggml_transpose(ctx, v_run);
+            }
+            cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, v_run, v_cache_view));
+
+            i0 += n;
+        }
+
+        GGML_ASSERT(i0 == n_tokens);
+
+        return;
+    }
+
+    struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
+    cb(k_cache_view, "k_cache_view", il);
 
     // note: storing RoPE-ed version of K in the KV cache
     ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur, k_cache_view));
@@ -9311,7 +9879,7 @@ static void llm_build_kv_store(
     } else {
         // note: the V cache is transposed when not using flash attention
         v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-                (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                (kv_size)*ggml_element_size(kv.v_l[il]),
                 (kv_head)*ggml_element_size(kv.v_l[il]));
 
         v_cur = ggml_transpose(ctx, v_cur);
@@ -9321,6 +9889,217 @@ static void llm_build_kv_store(
     ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
 }
 
+// group the rows by the adapters of their sequence, row i is the token row_tokens[i] of the ubatch
+static void llama_lora_rows_init(
+              llama_lora_rows & rows,
+   const struct llama_context & lctx,
+          const llama_ubatch & ubatch,
+  const std::vector<int32_t> & row_tokens) {
+    rows = {};
+    rows.n_rows = row_tokens.size();
+
+    if (ubatch.seq_id == nullptr) {
+        rows.no_seq = rows.n_rows > 0;
+        return;
+    }
+
+    std::map<llama_seq_id, int> seq_group;
+
+    for (int64_t i = 0; i < rows.n_rows; ++i) {
+        const llama_seq_id seq_id = ubatch.seq_id[row_tokens[i] / ubatch.n_seq_tokens][0];
+
+        auto it_group = seq_group.find(seq_id);
+        if (it_group == seq_group.end()) {
+            int g = -1;
+
+            auto it = lctx.lora_seq.find(seq_id);
+            if (it != lctx.lora_seq.end() && !it->second.empty()) {
+                // sequences with the same adapters share a group
+                for (g = 0; g < (int) rows.adapters.size(); ++g) {
+                    if (rows.adapters[g] == it->second) {
+                        break;
+                    }
+                }
+                if (g == (int) rows.adapters.size()) {
+                    rows.adapters.push_back(it->second);
+                    rows.ids.emplace_back();
+                }
+            }
+
+            it_group = seq_group.emplace(seq_id, g).first;
+        }
+
+        if (it_group->second >= 0) {
+            rows.ids[it_group->second].push_back(i);
+        }
+    }
+
+    rows.inp_ids.assign(rows.adapters.size(), nullptr);
+}
+
+static struct ggml_tensor * llm_build_inp_lora(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          std::vector<int32_t> data) {
+    struct ggml_tensor * inp = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, data.size());
+    ggml_format_name(inp, "inp_lora-%zu", lctx.inp_lora.size());
+    ggml_set_input(inp);
+    lctx.inp_lora.emplace_back(inp, std::move(data));
+    return inp;
+}
+
+// the product of the per-sequence adapters with cur: the rows of each group of sequences with the same adapters are
+// gathered, multiplied by the low-rank matrices of the group and put back in place, so each row is only multiplied
+// by its own adapters and a ubatch can mix any number of them
+// with ids, the weight is a stack of experts: the product is computed for all the tokens and the rows of the group are
+// gathered from it, since the expert ids cannot be gathered
+static struct ggml_tensor * llm_build_lora_seq_mm(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,
+          struct ggml_tensor * cur,
+          struct ggml_tensor * ids = nullptr) {
+    const int64_t n_rows = ids ? cur->ne[2] : cur->ne[1];
+
+    // the weights applied to the outputs only see the rows selected by inp_out_ids
+    llama_lora_rows * rows = nullptr;
+    if (n_rows == lctx.lora_rows_tokens.n_rows) {
+        rows = &lctx.lora_rows_tokens;
+    } else if (n_rows == lctx.lora_rows_outputs.n_rows) {
+        rows = &lctx.lora_rows_outputs;
+    }
+
+    if (rows == nullptr || rows->no_seq || cur->ne[3] != 1 || (!ids && cur->ne[2] != 1)) {
+        // the rows of cur are not those of the ubatch - fail the graph rather than drop the adapters of the weight
+        for (const auto & seq : lctx.lora_seq) {
+            for (const auto & it : seq.second) {
+                if (it.first->get_weight(w) != nullptr) {
+                    lctx.lora_seq_failed = true;
+                    return nullptr;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    if (rows->adapters.empty()) {
+        return nullptr;
+    }
+
+    const int n_groups = rows->adapters.size();
+
+    std::vector<struct ggml_tensor *> ab(n_groups, nullptr);
+    std::vector<bool> active(n_groups, false);
+
+    int64_t n_ab = 0;
+
+    for (int g = 0; g < n_groups; ++g) {
+        const bool all_rows = (int64_t) rows->ids[g].size() == rows->n_rows;
+
+        // the inputs are only created when used, the inputs that are not part of the graph have no buffer
+        auto inp_ids = [&]() {
+            if (rows->inp_ids[g] == nullptr) {
+                rows->inp_ids[g] = llm_build_inp_lora(lctx, ctx0, rows->ids[g]);
+            }
+            return rows->inp_ids[g];
+        };
+
+        struct ggml_tensor * x = nullptr;
+
+        for (auto & it : rows->adapters[g]) {
+            struct llama_lora_weight * lora = it.first->get_weight(w);
+            if (lora == nullptr) {
+                continue;
+            }
+
+            const float alpha = it.first->alpha;
+            const float rank  = (float) lora->b->ne[0];
+            const float scale = alpha ? it.second * alpha / rank : it.second;
+
+            struct ggml_tensor * ab_cur = nullptr;
+            if (ids) {
+                ab_cur = ggml_mul_mat_id(
+                    ctx0, lora->b,
+                    ggml_mul_mat_id(ctx0, lora->a, cur, ids),
+                    ids
+                );
+            } else {
+                if (x == nullptr) {
+                    x = all_rows ? cur : ggml_get_rows(ctx0, cur, inp_ids());
+                }
+                ab_cur = ggml_mul_mat(
+                    ctx0, lora->b,
+                    ggml_mul_mat(ctx0, lora->a, x)
+                );
+            }
+            ab_cur = ggml_scale(ctx0, ab_cur, scale);
+            ab[g] = ab[g] ? ggml_add(ctx0, ab[g], ab_cur) : ab_cur;
+        }
+
+        if (ab[g]) {
+            if (ids && !all_rows) {
+                ab[g] = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, ab[g], ab[g]->ne[0]*ab[g]->ne[1], ab[g]->ne[2]), inp_ids());
+            }
+            active[g] = true;
+            n_ab += rows->ids[g].size();
+        }
+    }
+
+    if (n_ab == 0) {
+        return nullptr;
+    }
+
+    if (n_ab == rows->n_rows && n_groups == 1) {
+        return ab[0];
+    }
+
+    // concatenate the products of the groups followed by a zero row for the rows without adapters
+    struct ggml_tensor * ab_all = nullptr;
+    int64_t offset = 0;
+
+    for (int g = 0; g < n_groups; ++g) {
+        if (!ab[g]) {
+            continue;
+        }
+        if (ab_all == nullptr) {
+            ab_all = ggml_pad(ctx0, ab[g], 0, n_ab - ab[g]->ne[1] + 1, 0, 0);
+        } else {
+            ab_all = ggml_set_2d_inplace(ctx0, ab_all, ab[g], ab_all->nb[1], offset*ab_all->nb[1]);
+        }
+        offset += ab[g]->ne[1];
+    }
+
+    // the position of each row in ab_all
+    struct ggml_tensor * & inv = rows->inp_inv[active];
+    if (inv == nullptr) {
+        std::vector<int32_t> pos(n_groups, -1);
+        for (int g = 0, i = 0; g < n_groups; ++g) {
+            if (active[g]) {
+                pos[g] = i;
+                i += rows->ids[g].size();
+            }
+        }
+
+        std::vector<int32_t> data(rows->n_rows, n_ab);
+        for (int g = 0; g < n_groups; ++g) {
+            if (active[g]) {
+                for (size_t j = 0; j < rows->ids[g].size(); ++j) {
+                    data[rows->ids[g][j]] = pos[g] + j;
+                }
+            }
+        }
+
+        inv = llm_build_inp_lora(lctx, ctx0, std::move(data));
+    }
+
+    struct ggml_tensor * res = ggml_get_rows(ctx0, ab_all, inv);
+    if (ids) {
+        res = ggml_reshape_3d(ctx0, res, w->ne[1], ids->ne[0], n_rows);
+    }
+
+    return res;
+}
+
 // do mat_mul, while optionally apply lora
 static struct ggml_tensor * llm_build_lora_mm(
         struct llama_context & lctx,
@@ -9343,6 +10122,12 @@ static struct ggml_tensor * llm_build_lora_mm(
         ab_cur = ggml_scale(ctx0, ab_cur, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
+    if (!lctx.lora_seq.empty()) {
+        struct ggml_tensor * ab_cur = llm_build_lora_seq_mm(lctx, ctx0, w, cur);
+        if (ab_cur) {
+            res = ggml_add(ctx0, res, ab_cur);
+        }
+    }
     return res;
 }
 
@@ -9370,6 +10155,12 @@ static struct ggml_tensor * llm_build_lora_mm_id(
         ab_cur = ggml_scale(ctx0, ab_cur, scale);
         res = ggml_add(ctx0, res, ab_cur);
     }
+    if (!lctx.lora_seq.empty()) {
+        struct ggml_tensor * ab_cur = llm_build_lora_seq_mm(lctx, ctx0, w, cur, ids);
+        if (ab_cur) {
+            res = ggml_add(ctx0, res, ab_cur);
+        }
+    }
     return res;
 }
 
@@ -9651,7 +10442,6 @@ static struct ggml_tensor * llm_build_kqv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -9659,6 +10449,12 @@ static struct ggml_tensor * llm_build_kqv(
     const int64_t n_embd_head_v = hparams.n_embd_head_v;
     const int64_t n_embd_v_gqa  = hparams.n_embd_v_gqa(il);
 
+    // tiered KV cache: the first columns of the mask are the cells of the cold cache
+    const llama_kv_cache * kv_cold = kv.cold.get();
+    const int64_t n_kv_cold = kv_cold ? kq_mask->ne[0] - n_kv : 0;
+
+    GGML_ASSERT(n_kv_cold >= 0 && (!kv_cold || n_kv_cold <= kv_cold->size));
+
     struct ggml_tensor * q = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
     cb(q, "q", il);
 
@@ -9670,11 +10466,20 @@ static struct ggml_tensor * llm_build_kqv(
                 0);
     cb(k, "k", il);
 
+    struct ggml_tensor * k_cold = nullptr;
+    if (n_kv_cold > 0) {
+        k_cold = ggml_view_3d(ctx, kv_cold->k_l[il],
+                n_embd_head_k, n_kv_cold, n_head_kv,
+                ggml_row_size(kv_cold->k_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv_cold->k_l[il]->type, n_embd_head_k),
+                0);
+        cb(k_cold, "k_cold", il);
+    }
+
     struct ggml_tensor * cur;
 
     if (cparams.flash_attn) {
         GGML_UNUSED(model);
-        GGML_UNUSED(n_ctx);
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
@@ -9685,8 +10490,22 @@ static struct ggml_tensor * llm_build_kqv(
                     0);
         cb(v, "v", il);
 
-        cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
-                                  hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
+        if (n_kv_cold > 0) {
+            struct ggml_tensor * v_cold =
+                ggml_view_3d(ctx, kv_cold->v_l[il],
+                        n_embd_head_v, n_kv_cold, n_head_kv,
+                        ggml_row_size(kv_cold->v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv_cold->v_l[il]->type, n_embd_head_v),
+                        0);
+            cb(v_cold, "v_cold", il);
+
+            // the online softmax runs over the cold and then the hot cells, each in the type of its cache
+            cur = ggml_flash_attn_ext_split(ctx, q, k_cold, v_cold, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
+                                            hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
+        } else {
+            cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
+                                      hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
+        }
 
         ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
 
@@ -9699,6 +10518,16 @@ static struct ggml_tensor * llm_build_kqv(
         //       while for some models F16 is enough, for others it is not, so we default to F32 here
         ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
 
+        if (n_kv_cold > 0) {
+            struct ggml_tensor * kq_cold = ggml_mul_mat(ctx, k_cold, q);
+            cb(kq_cold, "kq_cold", il);
+
+            ggml_mul_mat_set_prec(kq_cold, GGML_PREC_F32);
+
+            kq = ggml_concat(ctx, kq_cold, kq, 0);
+            cb(kq, "kq_tiered", il);
+        }
+
         if (model.arch == LLM_ARCH_GROK) {
             // need to do the following:
             // multiply by attn_output_multiplyer of 0.08838834764831845
@@ -9719,18 +10548,35 @@ static struct ggml_tensor * llm_build_kqv(
         kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         cb(kq, "kq_soft_max_ext", il);
 
-        GGML_ASSERT(kv.size == n_ctx);
-
         // split cached v into n_head heads
         struct ggml_tensor * v =
             ggml_view_3d(ctx, kv.v_l[il],
                     n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                    ggml_element_size(kv.v_l[il])*kv.size,
+                    ggml_element_size(kv.v_l[il])*kv.size*n_embd_head_v,
                     0);
         cb(v, "v", il);
 
-        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+        struct ggml_tensor * kqv;
+
+        if (n_kv_cold > 0) {
+            // the V cache of the cold tier is not transposed (its rows are quantized) - the cold cells are weighted
+            // with an outer product over its rows, in the type of the cache
+            struct ggml_tensor * v_cold =
+                ggml_view_3d(ctx, kv_cold->v_l[il],
+                        n_embd_head_v, n_kv_cold, n_head_kv,
+                        ggml_row_size(kv_cold->v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv_cold->v_l[il]->type, n_embd_head_v),
+                        0);
+            cb(v_cold, "v_cold", il);
+
+            struct ggml_tensor * kq_cold = ggml_view_3d(ctx, kq, n_kv_cold, kq->ne[1], kq->ne[2], kq->nb[1], kq->nb[2], 0);
+            struct ggml_tensor * kq_hot  = ggml_view_3d(ctx, kq, n_kv,      kq->ne[1], kq->ne[2], kq->nb[1], kq->nb[2], n_kv_cold*kq->nb[0]);
+
+            kqv = ggml_add(ctx, ggml_out_prod(ctx, v_cold, ggml_transpose(ctx, kq_cold)), ggml_mul_mat(ctx, v, kq_hot));
+        } else {
+            kqv = ggml_mul_mat(ctx, v, kq);
+        }
         cb(kqv, "kqv", il);
 
         struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
@@ -10158,6 +11004,7 @@ struct llm_build_context {
 
     const int32_t n_tokens;
     const int32_t n_kv;     // size of KV cache to consider (n_kv <= kv_self.size)
+    const int32_t n_kv_cold; // cells of the cold tier of a tiered KV cache to consider, their mask columns come first
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
@@ -10208,6 +11055,7 @@ struct llm_build_context {
         norm_rms_eps     (hparams.f_norm_rms_eps),
         n_tokens         (ubatch.n_tokens),
         n_kv             (worst_case ? kv_self.size : kv_self.n),
+        n_kv_cold        (kv_self.cold ? (worst_case ? kv_self.cold->size : kv_self.cold->n) : 0),
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
@@ -10244,6 +11092,33 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+
+        lctx.inp_lora.clear();
+
+        lctx.lora_rows_tokens  = {};
+        lctx.lora_rows_outputs = {};
+        lctx.lora_seq_failed   = false;
+
+        if (!lctx.lora_seq.empty()) {
+            std::vector<int32_t> rows(n_tokens);
+            std::iota(rows.begin(), rows.end(), 0);
+            llama_lora_rows_init(lctx.lora_rows_tokens, lctx, ubatch, rows);
+
+            // the same rows as inp_out_ids
+            if (n_outputs != n_tokens) {
+                rows.clear();
+                if (ubatch.output) {
+                    for (int i = 0; i < n_tokens; ++i) {
+                        if (ubatch.output[i]) {
+                            rows.push_back(i);
+                        }
+                    }
+                } else if (n_outputs == 1) {
+                    rows.push_back(n_tokens - 1);
+                }
+            }
+            llama_lora_rows_init(lctx.lora_rows_outputs, lctx, ubatch, rows);
+        }
     }
 
     void free() {
@@ -10251,12 +11126,14 @@ struct llm_build_context {
         ctx0 = nullptr;
     }
 
-    struct ggml_cgraph * build_k_shift() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+    struct ggml_cgraph * build_k_shift(const llama_kv_cache & kv) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
-        GGML_ASSERT(kv_self.size == n_ctx);
+        // only the cells with a pending shift are rotated
+        const auto range = llama_kv_cache_shift_range(kv);
+        const int64_t n_shift = range.second - range.first;
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_shift);
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
@@ -10265,11 +11142,11 @@ struct llm_build_context {
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * k =
-                ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                    0);
+                ggml_view_3d(ctx0, kv.k_l[il],
+                    n_embd_head_k, n_head_kv, n_shift,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*range.first);
 
             struct ggml_tensor * tmp;
             if (ggml_is_quantized(k->type)) {
@@ -10278,7 +11155,7 @@ struct llm_build_context {
                 cb(tmp, "K_f32", il);
                 for (auto & backend : lctx.backends) {
                     // Figure out which backend KV cache belongs to
-                    if (ggml_backend_supports_buft(backend.get(), ggml_backend_buffer_get_type(kv_self.k_l[il]->buffer))) {
+                    if (ggml_backend_supports_buft(backend.get(), ggml_backend_buffer_get_type(kv.k_l[il]->buffer))) {
                         ggml_backend_sched_set_tensor_backend(lctx.sched.get(), tmp, backend.get());
                         break;
                     }
@@ -10301,8 +11178,8 @@ struct llm_build_context {
         return gf;
     }
 
-    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+    struct ggml_cgraph * build_defrag(const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         for (uint32_t i = 0; i < ids.size(); ++i) {
             const uint32_t id = ids[i];
@@ -10321,40 +11198,40 @@ struct llm_build_context {
                 const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
                 const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i));
 
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*id));
 
                 ggml_tensor * view_v_src;
                 ggml_tensor * view_v_dst;
 
-                if (flash_attn) {
+                if (!kv.v_trans) {
                     // NOTE: the V cache is not transposed when using flash attention
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                    view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                             n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+                            ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                            ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i));
 
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                    view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                             n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
+                            ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                            ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*id));
                 } else {
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                    view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                             nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, i));
+                            ggml_row_size(kv.v_l[il]->type, kv.size),
+                            ggml_row_size(kv.v_l[il]->type, i));
 
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                    view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                             nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, id));
+                            ggml_row_size(kv.v_l[il]->type, kv.size),
+                            ggml_row_size(kv.v_l[il]->type, id));
                 }
 
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
@@ -10369,6 +11246,70 @@ struct llm_build_context {
         return gf;
     }
 
+    // tiered KV cache: copy the runs of cells (src, dst, n) of the hot cache to the cold cache, in the types of the cold cache
+    struct ggml_cgraph * build_kv_requant(const std::vector<std::array<uint32_t, 3>> & moves) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
+
+        const llama_kv_cache & kv_cold = *kv_self.cold;
+
+        GGML_ASSERT(!kv_cold.v_trans);
+
+        // quantized data can only be converted to F32
+        auto convert = [&](ggml_tensor * src, const ggml_tensor * dst) {
+            if (ggml_is_quantized(src->type) && src->type != dst->type) {
+                src = ggml_cast(ctx0, src, GGML_TYPE_F32);
+            }
+            return src;
+        };
+
+        for (const auto & move : moves) {
+            const uint32_t src = move[0];
+            const uint32_t dst = move[1];
+            const uint32_t nm  = move[2];
+
+            for (int il = 0; il < n_layer; ++il) {
+                const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+                const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
+                        n_embd_k_gqa, nm,
+                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*src));
+
+                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_cold.k_l[il],
+                        n_embd_k_gqa, nm,
+                        ggml_row_size(kv_cold.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv_cold.k_l[il]->type, n_embd_k_gqa*dst));
+
+                ggml_tensor * view_v_src;
+
+                if (kv_self.v_trans) {
+                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                            nm, n_embd_v_gqa,
+                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
+                            ggml_row_size(kv_self.v_l[il]->type, src));
+
+                    view_v_src = ggml_cont(ctx0, ggml_transpose(ctx0, view_v_src));
+                } else {
+                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                            n_embd_v_gqa, nm,
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*src));
+                }
+
+                ggml_tensor * view_v_dst = ggml_view_2d(ctx0, kv_cold.v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(kv_cold.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv_cold.v_l[il]->type, n_embd_v_gqa*dst));
+
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, convert(view_k_src, view_k_dst), view_k_dst));
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0, convert(view_v_src, view_v_dst), view_v_dst));
+            }
+        }
+
+        return gf;
+    }
+
     struct ggml_tensor * build_inp_pos() {
         lctx.inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(lctx.inp_pos, "inp_pos", -1);
@@ -10400,7 +11341,7 @@ struct llm_build_context {
 
     struct ggml_tensor * build_inp_KQ_mask(bool causal = true) {
         lctx.inp_KQ_mask = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv_cold + n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
             : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask, "KQ_mask", -1);
         ggml_set_input(lctx.inp_KQ_mask);
@@ -10412,7 +11353,7 @@ struct llm_build_context {
         GGML_ASSERT(hparams.n_swa > 0);
 
         lctx.inp_KQ_mask_swa = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv_cold + n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
             : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(lctx.inp_KQ_mask_swa);
@@ -10561,7 +11502,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_llama() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -10724,7 +11665,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_baichuan() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -10839,7 +11780,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_xverse() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -10942,7 +11883,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_falcon() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -11062,7 +12003,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_grok() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -11219,7 +12160,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_dbrx() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -11345,7 +12286,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_starcoder() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -11449,7 +12390,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_refact() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -11543,7 +12484,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_bert() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -11737,7 +12678,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_bloom() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -11838,7 +12779,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_mpt() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -12128,7 +13069,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_qwen() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -12240,7 +13181,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_qwen2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -12352,7 +13293,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_qwen2moe() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -12498,7 +13439,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_phi2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -12619,7 +13560,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_phi3() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa = hparams.n_embd_v_gqa();
@@ -12851,7 +13792,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_gpt2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -12956,7 +13897,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_codeshell() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -13067,7 +14008,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_orion() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -13185,7 +14126,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_internlm2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -13306,7 +14247,7 @@ struct llm_build_context {
     //      https://github.com/ggerganov/llama.cpp/issues/5276#issuecomment-1925774738
     // based on the original build_llama() function
     struct ggml_cgraph * build_minicpm() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -13450,7 +14391,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_minicpm3() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         //TODO: if the model varies, these parameters need to be read from the model
         const int64_t n_embd_base = 256;
@@ -13659,7 +14600,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_gemma() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head_k = hparams.n_embd_head_k;
 
@@ -13767,7 +14708,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_gemma2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head_k = hparams.n_embd_head_k;
 
@@ -13903,7 +14844,7 @@ struct llm_build_context {
 
 
     struct ggml_cgraph * build_starcoder2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -14022,7 +14963,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_mamba() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         struct ggml_tensor * cur;
         struct ggml_tensor * inpL;
@@ -14077,7 +15018,7 @@ struct llm_build_context {
 
     struct ggml_cgraph * build_command_r() {
 
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -14231,7 +15172,7 @@ struct llm_build_context {
     //   * removed bias
     //   * removed MoE
     struct ggml_cgraph * build_olmo() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -14359,7 +15300,7 @@ struct llm_build_context {
     //   * removed bias
     //   * added q, k norm
     struct ggml_cgraph * build_olmoe() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -14483,7 +15424,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_openelm() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -14608,7 +15549,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_gptneox() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -14750,7 +15691,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_arctic() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -14882,7 +15823,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_deepseek2() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -15110,7 +16051,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_bitnet() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -15261,7 +16202,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_t5_encoder() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -15393,7 +16334,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_t5_decoder() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -15598,7 +16539,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_jais() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -15690,7 +16631,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_chatglm() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         const int64_t n_embd_gqa  = hparams.n_embd_v_gqa();
@@ -15804,7 +16745,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_nemotron() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         const int64_t n_embd_head = hparams.n_embd_head_v;
         GGML_ASSERT(n_embd_head == hparams.n_embd_head_k);
@@ -15925,7 +16866,7 @@ struct llm_build_context {
     }
 
     struct ggml_cgraph * build_exaone() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -16052,7 +16993,7 @@ struct llm_build_context {
     }
 
     ggml_cgraph * build_rwkv6() {
-        ggml_cgraph *gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        ggml_cgraph *gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // Token shift state dimensions should be 2 * n_emb
         GGML_ASSERT(n_embd == hparams.n_embd_k_s() / 2);
@@ -16171,7 +17112,7 @@ struct llm_build_context {
     //   * removed bias
     //   * removed MoE
     struct ggml_cgraph * build_chameleon() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, lctx.max_nodes, false);
 
         // mutable variable, needed during the last layer of the computation to skip unused tokens
         int32_t n_tokens = this->n_tokens;
@@ -16343,7 +17284,24 @@ struct llm_build_context {
     }
 };
 
-static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const std::vector<uint32_t> & ids) {
+static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
+    llama_ubatch dummy = {};
+    dummy.equal_seqs = true;
+
+    llm_build_cb cb = [&](struct ggml_tensor * , const char * , int ) { };
+
+    struct llm_build_context llm(lctx, dummy, cb, false);
+
+    llm.init();
+
+    struct ggml_cgraph * result = llm.build_defrag(kv, ids);
+
+    llm.free();
+
+    return result;
+}
+
+static struct ggml_cgraph * llama_build_graph_kv_requant(llama_context & lctx, const std::vector<std::array<uint32_t, 3>> & moves) {
     llama_ubatch dummy = {};
     dummy.equal_seqs = true;
 
@@ -16353,14 +17311,14 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
 
     llm.init();
 
-    struct ggml_cgraph * result = llm.build_defrag(ids);
+    struct ggml_cgraph * result = llm.build_kv_requant(moves);
 
     llm.free();
 
     return result;
 }
 
-static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
+static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx, const llama_kv_cache & kv) {
     llama_ubatch dummy = {};
     dummy.equal_seqs = true;
 
@@ -16370,7 +17328,7 @@ static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
 
     llm.init();
 
-    struct ggml_cgraph * result = llm.build_k_shift();
+    struct ggml_cgraph * result = llm.build_k_shift(kv);
 
     llm.free();
 
@@ -16620,15 +17578,15 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
-static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+static void llama_set_k_shift(llama_context & lctx, const llama_kv_cache & kv) {
+    const auto range = llama_kv_cache_shift_range(kv);
 
     assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
 
     int32_t * data = (int32_t *) lctx.inp_K_shift->data;
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+    for (uint32_t i = range.first; i < range.second; ++i) {
+        data[i - range.first] = kv.cells[i].delta;
     }
 }
 
@@ -16693,7 +17651,23 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
     if (ubatch.pos && lctx.inp_pos) {
         const int64_t n_tokens = ubatch.n_tokens;
 
-        ggml_backend_tensor_set(lctx.inp_pos, ubatch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
+        const bool has_rope_offs = ubatch.seq_id && std::any_of(kv_self.rope_offs.begin(), kv_self.rope_offs.end(), [](llama_pos off) { return off != 0; });
+
+        if (!has_rope_offs) {
+            ggml_backend_tensor_set(lctx.inp_pos, ubatch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
+        } else {
+            // streaming context shift: the tokens are RoPEd after the positions of the discarded tokens
+            std::vector<llama_pos> pos(ubatch.pos, ubatch.pos + n_tokens);
+            for (int64_t i = 0; i < n_tokens; ++i) {
+                pos[i] += kv_self.rope_offs[ubatch.seq_id[i / ubatch.n_seq_tokens][0]];
+            }
+
+            ggml_backend_tensor_set(lctx.inp_pos, pos.data(), 0, n_tokens*ggml_element_size(lctx.inp_pos));
+        }
+    }
+
+    for (const auto & inp : lctx.inp_lora) {
+        ggml_backend_tensor_set(inp.first, inp.second.data(), 0, ggml_nbytes(inp.first));
     }
 
     if (hparams.causal_attn || cparams.pooling_type == LLAMA_POOLING_TYPE_NONE) {
@@ -16734,12 +17708,12 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
     if (lctx.inp_KQ_mask || lctx.inp_KQ_mask_swa) {
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn && !lctx.is_encoding) {
-            const int64_t n_kv         = kv_self.n;
+            const int64_t n_kv_cold    = kv_self.cold ? kv_self.cold->n : 0;
+            const int64_t n_kv         = n_kv_cold + kv_self.n; // the cells of the cold tier come first
             const int64_t n_tokens     = ubatch.n_tokens;
             const int64_t n_seq_tokens = ubatch.n_seq_tokens;
             const int64_t n_seqs       = ubatch.n_seqs;
 
-
             float * data     = nullptr;
             float * data_swa = nullptr;
 
@@ -16756,40 +17730,24 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the ubatch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int s = 0; s < n_seqs; ++s) {
-                    const llama_seq_id seq_id = ubatch.seq_id[s][0];
-
-                    for (int j = 0; j < n_seq_tokens; ++j) {
-                        const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
-
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
-                            } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
-                                }
-                            }
-
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
+            std::vector<llama_seq_id> seq_ids(n_seqs);
+            for (int s = 0; s < n_seqs; ++s) {
+                seq_ids[s] = ubatch.seq_id[s][0];
+            }
 
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-                        }
-                    }
+            for (int h = 0; h < 1; ++h) {
+                if (n_kv_cold > 0) {
+                    llama_kv_cells_build_mask(kv_self.cold->cells.data(), n_kv_cold, n_seqs, n_seq_tokens, seq_ids.data(), ubatch.pos,
+                            hparams.use_alibi, hparams.n_swa,
+                            data     ? data     + h*(n_kv*n_tokens) : nullptr,
+                            data_swa ? data_swa + h*(n_kv*n_tokens) : nullptr, n_kv);
                 }
 
+                llama_kv_cells_build_mask(kv_self.cells.data(), kv_self.n, n_seqs, n_seq_tokens, seq_ids.data(), ubatch.pos,
+                        hparams.use_alibi, hparams.n_swa,
+                        data     ? data     + h*(n_kv*n_tokens) + n_kv_cold : nullptr,
+                        data_swa ? data_swa + h*(n_kv*n_tokens) + n_kv_cold : nullptr, n_kv);
+
                 if (data) {
                     for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
                         for (int j = 0; j < n_kv; ++j) {
@@ -16811,7 +17769,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
             const int64_t n_seq_tokens = ubatch.n_seq_tokens;
             const int64_t n_seqs       = ubatch.n_seqs;
             // when using kv cache, the mask needs to match the kv cache size
-            const int64_t n_stride = hparams.causal_attn && !lctx.is_encoding ? kv_self.n : n_tokens;
+            const int64_t n_stride = hparams.causal_attn && !lctx.is_encoding ? (kv_self.cold ? kv_self.cold->n : 0) + kv_self.n : n_tokens;
 
             GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask->buffer));
 
@@ -17181,6 +18139,27 @@ static void llama_output_reorder(struct llama_context * ctx) {
     }
 }
 
+// wait for the batch submitted with llama_decode_async, its outputs stay in the back buffers until llama_decode_wait
+// the public functions that use the state of the context call it first
+static void llama_decode_async_join(llama_context & lctx) {
+    auto & task = lctx.decode_task;
+
+    std::unique_lock<std::mutex> lock(task.mutex);
+    task.cv.wait(lock, [&]{ return !task.queued; });
+}
+
+static void llama_outputs_swap(llama_context & lctx, llama_outputs & out) {
+    std::swap(lctx.buf_output,  out.buf_output);
+    std::swap(lctx.logits_size, out.logits_size);
+    std::swap(lctx.logits,      out.logits);
+    std::swap(lctx.output_ids,  out.output_ids);
+    std::swap(lctx.output_size, out.output_size);
+    std::swap(lctx.n_outputs,   out.n_outputs);
+    std::swap(lctx.embd_size,   out.embd_size);
+    std::swap(lctx.embd,        out.embd);
+    std::swap(lctx.embd_seq,    out.embd_seq);
+}
+
 static void llama_graph_compute(
           llama_context & lctx,
             ggml_cgraph * gf,
@@ -17204,6 +18183,8 @@ static void llama_graph_compute(
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
 }
 
+static void llama_kv_cache_update_internal(struct llama_context & lctx);
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -17244,6 +18225,48 @@ static int llama_decode_internal(
         }
     }
 
+    // the KV cells can only be assigned to a limited number of sequences
+    if (hparams.causal_attn) {
+        const auto & rope_offs = lctx.kv_self.rope_offs;
+
+        // the RoPE positions of the new tokens must stay within the bound of the offsets
+        const llama_pos n_pos_max = llama_kv_cache_rope_pos_max(hparams, cparams);
+
+        std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> fold;
+
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d > %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_PARALLEL_SEQUENCES - 1);
+                    return -1;
+                }
+            }
+
+            const llama_pos off = rope_offs[batch.seq_id[i][0]];
+            if (off == 0) {
+                continue;
+            }
+
+            // a token shared by several sequences has a single RoPE position
+            bool fold_token = batch.pos[i] + off >= n_pos_max;
+            for (int32_t s = 1; s < batch.n_seq_id[i]; ++s) {
+                fold_token |= rope_offs[batch.seq_id[i][s]] != off;
+            }
+
+            if (fold_token) {
+                for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                    fold.set(batch.seq_id[i][s]);
+                }
+            }
+        }
+
+        for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES && fold.any(); ++s) {
+            if (fold[s]) {
+                llama_kv_cache_rope_offs_apply(lctx.kv_self, s);
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -17330,7 +18353,7 @@ static int llama_decode_internal(
 
         // non-causal masks do not use the KV cache
         if (hparams.causal_attn) {
-            llama_kv_cache_update(&lctx);
+            llama_kv_cache_update_internal(lctx);
 
             // if we have enough unused cells before the current head ->
             //   better to start searching from the beginning of the cache, hoping to fill it
@@ -17349,6 +18372,11 @@ static int llama_decode_internal(
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
                 kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
+
+                if (kv_self.cold) {
+                    const uint32_t cell_max_cold = llama_kv_cache_cell_max(*kv_self.cold);
+                    kv_self.cold->n = cell_max_cold == 0 ? 0 : std::min(kv_self.cold->size, GGML_PAD(cell_max_cold, pad));
+                }
             }
         }
 
@@ -17359,12 +18387,26 @@ static int llama_decode_internal(
 
         ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
 
-        // the output is always the last tensor in the graph
-        struct ggml_tensor * res  = ggml_graph_node(gf, -1);
-        struct ggml_tensor * embd = ggml_graph_node(gf, -2);
+        if (lctx.lora_seq_failed) {
+            LLAMA_LOG_ERROR("%s: the per-sequence LoRA adapters cannot be applied to the graph of this model\n", __func__);
 
-        if (lctx.n_outputs == 0) {
-            // no output
+            // the tokens of the ubatch are not evaluated
+            for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+                const uint32_t s = i / ubatch.n_seq_tokens;
+                for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+                    llama_kv_cache_seq_rm(kv_self, ubatch.seq_id[s][j], ubatch.pos[i], ubatch.pos[i] + 1);
+                }
+            }
+
+            return -1;
+        }
+
+        // the output is always the last tensor in the graph
+        struct ggml_tensor * res  = ggml_graph_node(gf, -1);
+        struct ggml_tensor * embd = ggml_graph_node(gf, -2);
+
+        if (lctx.n_outputs == 0) {
+            // no output
             res  = nullptr;
             embd = nullptr;
         } else if (cparams.embeddings) {
@@ -17391,7 +18433,13 @@ static int llama_decode_internal(
 
         // update the kv ring buffer
         {
-            kv_self.head += n_tokens;
+            if (!kv_self.runs.empty()) {
+                // paged KV cache: continue after the last run of cells of the ubatch
+                kv_self.head = kv_self.runs.back().first + kv_self.runs.back().second;
+                kv_self.runs.clear();
+            } else {
+                kv_self.head += n_tokens;
+            }
 
             // Ensure kv cache head points to a valid index.
             if (kv_self.head >= kv_self.size) {
@@ -17504,7 +18552,8 @@ static int llama_decode_internal(
     //llama_synchronize(&lctx);
 
     // decide if we need to defrag the kv cache
-    if (cparams.causal_attn && cparams.defrag_thold >= 0.0f) {
+    // a paged KV cache does not need contiguous free cells, so it is never defragmented automatically
+    if (cparams.causal_attn && cparams.defrag_thold >= 0.0f && kv_self.block_size == 0) {
         const float fragmentation = kv_self.n >= 128 ? 1.0f - float(kv_self.used)/float(kv_self.n) : 0.0f;
 
         // queue defragmentation for next llama_kv_cache_update
@@ -17600,6 +18649,11 @@ static int llama_encode_internal(
 
     ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
 
+    if (lctx.lora_seq_failed) {
+        LLAMA_LOG_ERROR("%s: the per-sequence LoRA adapters cannot be applied to the graph of this model\n", __func__);
+        return -1;
+    }
+
     // the output embeddings after the final encoder normalization
     struct ggml_tensor * embd = nullptr;
 
@@ -17911,7 +18965,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
     ggml_backend_sched_reset(lctx.sched.get());
 
-    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+    ggml_cgraph * gf = llama_build_graph_defrag(lctx, kv_self, ids);
 
     llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
 #endif
@@ -17921,36 +18975,216 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
 }
 
-static void llama_kv_cache_update_internal(struct llama_context & lctx) {
-    bool need_reserve = false;
+// copy-on-write: copy the KV data of the shared cells that were detached by a sequence (see llama_kv_cache_cell_detach)
+static void llama_kv_cache_cow_internal(struct llama_context & lctx, struct llama_kv_cache & kv_self) {
+    const uint32_t n_layer = lctx.model.hparams.n_layer;
 
-    // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
-        if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
-            GGML_ABORT("Deepseek2 does not support K-shift");
+    // same graph budget as the defrag moves (see build_defrag)
+    const uint32_t max_copies = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+
+    size_t i0 = 0;
+
+    while (i0 < kv_self.cow.size()) {
+        // cell i is copied to ids[i], ids[i] == ids.size() means no copy
+        std::vector<uint32_t> ids(kv_self.size, kv_self.size);
+        std::vector<bool>     dst(kv_self.size, false);
+
+        // the copies of one graph must be independent - keep the order of the dependent ones
+        size_t i1 = i0;
+        for (; i1 < kv_self.cow.size() && i1 - i0 < max_copies; ++i1) {
+            const uint32_t src = kv_self.cow[i1].first;
+            const uint32_t id  = kv_self.cow[i1].second;
+
+            if (ids[src] != kv_self.size || dst[src] || dst[id] || ids[id] != kv_self.size) {
+                break;
+            }
+
+            ids[src] = id;
+            dst[id]  = true;
         }
 
-        {
-            ggml_backend_sched_reset(lctx.sched.get());
+        ggml_backend_sched_reset(lctx.sched.get());
+
+        ggml_cgraph * gf = llama_build_graph_defrag(lctx, kv_self, ids);
+
+        llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+
+        i0 = i1;
+    }
+
+    kv_self.cow.clear();
+}
+
+// tiered KV cache: move the cells of the hot cache that are not among the last n_hot positions of any of their
+// sequences to the cold cache
+// the cells are moved once enough of them are eligible, or when the hot cache is about to run out of free cells
+// returns true if cells were moved
+static bool llama_kv_cache_requant_internal(struct llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+    auto & kv_cold = *kv_self.cold;
+
+    // the sequences in the hot cache and their last position
+    std::bitset<LLAMA_MAX_PARALLEL_SEQUENCES> seq_all;
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        seq_all |= kv_self.cells[i].seq_id;
+    }
+
+    std::vector<llama_seq_id> seqs;
+    for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
+        if (seq_all[s]) {
+            seqs.push_back(s);
+        }
+    }
+
+    std::vector<llama_pos> pos_max(LLAMA_MAX_PARALLEL_SEQUENCES, -1);
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        const llama_kv_cell & cell = kv_self.cells[i];
+        for (const llama_seq_id s : seqs) {
+            if (cell.seq_id[s]) {
+                pos_max[s] = std::max(pos_max[s], cell.pos);
+            }
+        }
+    }
+
+    std::vector<uint32_t> src;
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        const llama_kv_cell & cell = kv_self.cells[i];
+        if (cell.pos < 0 || cell.is_empty()) {
+            continue;
+        }
+
+        bool eligible = true;
+        for (const llama_seq_id s : seqs) {
+            if (cell.seq_id[s] && cell.pos > pos_max[s] - (llama_pos) kv_self.n_hot) {
+                eligible = false;
+                break;
+            }
+        }
+
+        if (eligible) {
+            src.push_back(i);
+        }
+    }
+
+    const uint32_t n_free = kv_self.size - kv_self.used;
+
+    if (src.empty() || (src.size() < LLAMA_KV_REQUANT_CHUNK && n_free >= lctx.cparams.n_ubatch)) {
+        return false;
+    }
 
-            ggml_cgraph * gf = llama_build_graph_k_shift(lctx);
+    // the destination cells, lowest first to keep the cold cells compact
+    std::vector<uint32_t> dst;
+    for (uint32_t i = 0; i < kv_cold.size && dst.size() < src.size(); ++i) {
+        if (kv_cold.cells[i].pos < 0) {
+            dst.push_back(i);
+        }
+    }
 
-            ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+    const bool cold_full = dst.size() < src.size();
+    if (cold_full) {
+        if (!kv_self.cold_full) {
+            LLAMA_LOG_WARN("%s: the cold KV cache is full - %zu cells stay in the hot KV cache\n", __func__, src.size() - dst.size());
+        }
+        src.resize(dst.size());
+    }
+    kv_self.cold_full = cold_full;
 
-            llama_set_k_shift(lctx);
+    if (src.empty()) {
+        return false;
+    }
 
-            llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+    // group the cells in runs that are contiguous in both caches
+    std::vector<std::array<uint32_t, 3>> moves;
+    for (size_t i = 0; i < src.size(); ++i) {
+        if (!moves.empty() && moves.back()[0] + moves.back()[2] == src[i] && moves.back()[1] + moves.back()[2] == dst[i]) {
+            moves.back()[2]++;
+        } else {
+            moves.push_back({ src[i], dst[i], 1 });
+        }
+    }
+
+    const uint32_t n_layer = lctx.model.hparams.n_layer;
+
+    // each run of cells costs up to 10 graph nodes per layer
+    const size_t max_moves = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(10*n_layer);
+
+    for (size_t i0 = 0; i0 < moves.size(); i0 += max_moves) {
+        const std::vector<std::array<uint32_t, 3>> moves_graph(moves.begin() + i0, moves.begin() + std::min(moves.size(), i0 + max_moves));
+
+        ggml_backend_sched_reset(lctx.sched.get());
+
+        ggml_cgraph * gf = llama_build_graph_kv_requant(lctx, moves_graph);
+
+        llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+    }
+
+    for (size_t i = 0; i < src.size(); ++i) {
+        llama_kv_cell & cell_src = kv_self.cells[src[i]];
+        llama_kv_cell & cell_dst = kv_cold.cells[dst[i]];
+
+        cell_dst.pos    = cell_src.pos;
+        cell_dst.delta  = 0;
+        cell_dst.seq_id = cell_src.seq_id;
+
+        cell_src.pos = -1;
+        cell_src.seq_id.reset();
+    }
+
+    kv_self.used -= src.size();
+    kv_cold.used += src.size();
+
+    kv_self.head = 0;
+
+    return true;
+}
+
+static void llama_kv_cache_update_internal(struct llama_context & lctx) {
+    bool need_reserve = false;
+
+    // the hot and the cold tiers of a tiered KV cache are updated in turn
+    std::vector<llama_kv_cache *> tiers = { &lctx.kv_self };
+    if (lctx.kv_self.cold) {
+        tiers.push_back(lctx.kv_self.cold.get());
+    }
+
+    // copy the shared cells detached by a sequence - must happen before the K-shift of the copies
+    for (auto * kv : tiers) {
+        if (!kv->cow.empty()) {
+            llama_kv_cache_cow_internal(lctx, *kv);
 
             need_reserve = true;
         }
+    }
 
-        {
-            auto & kv_self = lctx.kv_self;
+    // apply K-shift if needed
+    for (auto * kv : tiers) {
+        if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && kv->has_shift) {
+            if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
+                GGML_ABORT("Deepseek2 does not support K-shift");
+            }
+
+            const auto range = llama_kv_cache_shift_range(*kv);
+
+            if (range.first < range.second) {
+                ggml_backend_sched_reset(lctx.sched.get());
+
+                ggml_cgraph * gf = llama_build_graph_k_shift(lctx, *kv);
+
+                ggml_backend_sched_alloc_graph(lctx.sched.get(), gf);
+
+                llama_set_k_shift(lctx, *kv);
 
-            kv_self.has_shift = false;
+                llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
 
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
+                need_reserve = true;
+            }
+
+            {
+                kv->has_shift = false;
+
+                for (uint32_t i = 0; i < kv->size; ++i) {
+                    kv->cells[i].delta = 0;
+                }
             }
         }
     }
@@ -17964,6 +19198,13 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
         lctx.kv_self.do_defrag = false;
     }
 
+    // move the older tokens to the cold tier
+    // no new reservation is needed: the compute buffers only grow, and the worst-case graph already covers all the
+    // cells of the cold tier
+    if (lctx.kv_self.cold) {
+        llama_kv_cache_requant_internal(lctx);
+    }
+
     // reserve a worst case graph again
     if (need_reserve) {
         // TODO: extract to a function
@@ -19041,6 +20282,8 @@ int32_t llama_lora_adapter_set(
             struct llama_context * ctx,
             struct llama_lora_adapter * adapter,
             float scale) {
+    llama_decode_async_join(*ctx);
+
     if (ctx->cparams.flash_attn) {
         LLAMA_LOG_ERROR("%s: flash_attn is not compatible with LoRA\n", __func__);
         return -1;
@@ -19052,6 +20295,8 @@ int32_t llama_lora_adapter_set(
 int32_t llama_lora_adapter_remove(
             struct llama_context * ctx,
             struct llama_lora_adapter * adapter) {
+    llama_decode_async_join(*ctx);
+
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
@@ -19061,9 +20306,68 @@ int32_t llama_lora_adapter_remove(
 }
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     ctx->lora_adapters.clear();
 }
 
+int32_t llama_lora_adapter_seq_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    llama_decode_async_join(*ctx);
+
+    if (ctx->cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: flash_attn is not compatible with LoRA\n", __func__);
+        return -1;
+    }
+    if (seq_id < 0) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id %d\n", __func__, seq_id);
+        return -1;
+    }
+    ctx->lora_seq[seq_id][adapter] = scale;
+
+    // the graphs of a new adapter may need a larger node budget
+    const size_t max_nodes = llama_graph_max_nodes(*ctx);
+    if (max_nodes > ctx->max_nodes) {
+        ctx->buf_compute_meta.resize(ggml_tensor_overhead()*max_nodes + ggml_graph_overhead_custom(max_nodes, false));
+        ctx->sched.reset(ggml_backend_sched_new(ctx->sched_backends.data(), ctx->sched_bufts.data(), ctx->sched_backends.size(),
+                    max_nodes, ctx->sched_pipeline_parallel));
+        ctx->max_nodes = max_nodes;
+
+        LLAMA_LOG_INFO("%s: graph node budget increased to %zu for the per-sequence adapters\n", __func__, max_nodes);
+    }
+
+    return 0;
+}
+
+int32_t llama_lora_adapter_seq_remove(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id) {
+    llama_decode_async_join(*ctx);
+
+    auto it = ctx->lora_seq.find(seq_id);
+    if (it == ctx->lora_seq.end() || it->second.erase(adapter) == 0) {
+        return -1;
+    }
+    if (it->second.empty()) {
+        ctx->lora_seq.erase(it);
+    }
+    return 0;
+}
+
+void llama_lora_adapter_seq_clear(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_join(*ctx);
+
+    if (seq_id < 0) {
+        ctx->lora_seq.clear();
+    } else {
+        ctx->lora_seq.erase(seq_id);
+    }
+}
+
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
     delete adapter;
 }
@@ -19114,10 +20418,14 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_n_hot                    =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.type_k_cold                 =*/ GGML_TYPE_Q8_0,
+        /*.type_v_cold                 =*/ GGML_TYPE_Q8_0,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
@@ -19198,11 +20506,15 @@ void llama_attach_threadpool(
              struct llama_context * ctx,
         ggml_threadpool_t   threadpool,
         ggml_threadpool_t   threadpool_batch) {
+    llama_decode_async_join(*ctx);
+
     ctx->threadpool       = threadpool;
     ctx->threadpool_batch = threadpool_batch ? threadpool_batch : threadpool;
 }
 
 void llama_detach_threadpool(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     ctx->threadpool       = nullptr;
     ctx->threadpool_batch = nullptr;
 }
@@ -19368,6 +20680,11 @@ struct llama_context * llama_new_context_with_model(
         return nullptr;
     }
 
+    if (params.n_seq_max > LLAMA_MAX_PARALLEL_SEQUENCES) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_PARALLEL_SEQUENCES);
+        return nullptr;
+    }
+
     llama_context * ctx = new llama_context(*model);
 
     const auto & hparams = model->hparams;
@@ -19381,6 +20698,8 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.kv_n_hot         = params.kv_n_hot;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -19485,6 +20804,29 @@ struct llama_context * llama_new_context_with_model(
         type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
     }
 
+    // tiered KV cache: the hot cache holds the last n_hot tokens of each sequence, the current ubatch
+    // and some slack so that the older tokens can be moved to the cold cache in larger chunks
+    uint32_t kv_n_hot = llama_model_is_recurrent(model) ? 0 : cparams.kv_n_hot;
+    if (kv_n_hot > 0 && llama_model_has_encoder(model)) {
+        LLAMA_LOG_WARN("%s: the tiered KV cache is not supported for encoder-decoder models - the KV cache is not tiered\n", __func__);
+        kv_n_hot = 0;
+    }
+    if (kv_n_hot > 0) {
+        const uint32_t kv_size_hot = GGML_PAD(params.n_seq_max*kv_n_hot + cparams.n_ubatch + LLAMA_KV_REQUANT_CHUNK, llama_kv_cache_get_padding(cparams));
+
+        if (kv_size_hot >= kv_size) {
+            LLAMA_LOG_WARN("%s: kv_n_hot = %u does not fit in n_ctx = %u - the KV cache is not tiered\n", __func__, kv_n_hot, kv_size);
+            kv_n_hot = 0;
+        } else if (hparams.n_embd_head_k % ggml_blck_size(params.type_k_cold) != 0 ||
+                   hparams.n_embd_head_v % ggml_blck_size(params.type_v_cold) != 0) {
+            LLAMA_LOG_WARN("%s: the head size is not a multiple of the block size of the cold cache types - the KV cache is not tiered\n", __func__);
+            kv_n_hot = 0;
+        } else {
+            kv_size = kv_size_hot;
+        }
+    }
+    cparams.kv_n_hot = kv_n_hot;
+
     GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
     GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
 
@@ -19541,6 +20883,44 @@ struct llama_context * llama_new_context_with_model(
             return nullptr;
         }
 
+        if (cparams.kv_n_hot > 0) {
+            auto & kv_self = ctx->kv_self;
+
+            kv_self.n_hot = cparams.kv_n_hot;
+            kv_self.cold  = std::make_unique<llama_kv_cache>();
+
+            // the cold cache stays in host memory, also with offload_kqv: its quantized V is multiplied with
+            // ggml_out_prod and the attention over both tiers is split in ggml_flash_attn_ext_split, which only the
+            // CPU backend supports
+            if (!llama_kv_cache_init(*kv_self.cold, ctx, params.type_k_cold, params.type_v_cold, cparams.n_ctx, false)) {
+                LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for the cold self-attention cache\n", __func__);
+                llama_free(ctx);
+                return nullptr;
+            }
+
+            // quantized rows can't be transposed: the cold V is stored by rows and the attention multiplies it with
+            // ggml_out_prod (V^T KQ^T) instead of a ggml_mul_mat with the transposed V
+            kv_self.cold->v_trans = false;
+
+            for (int il = 0; il < (int) hparams.n_layer; ++il) {
+                ggml_format_name(kv_self.cold->k_l[il], "cache_k_cold_l%d", il);
+                ggml_format_name(kv_self.cold->v_l[il], "cache_v_cold_l%d", il);
+            }
+
+            // the cells are moved between the tiers in runs, the hot cache always has to be paged
+            if (kv_self.block_size == 0) {
+                kv_self.block_size = std::min<uint32_t>(256, kv_self.size);
+            }
+
+            // no graph is built over the runs of the cold cache, they are only used to restore a sequence state
+            kv_self.cold->block_size = std::min<uint32_t>(256, kv_self.cold->size);
+            kv_self.cold->max_runs   = kv_self.cold->size;
+
+            LLAMA_LOG_INFO("%s: tiered KV cache: n_hot = %u, hot cells = %u (%s, %s), cold cells = %u (%s, %s)\n", __func__,
+                    kv_self.n_hot, kv_self.size, ggml_type_name(type_k), ggml_type_name(type_v),
+                    kv_self.cold->size, ggml_type_name(params.type_k_cold), ggml_type_name(params.type_v_cold));
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
@@ -19559,6 +20939,14 @@ struct llama_context * llama_new_context_with_model(
                 ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
         }
 
+        if (ctx->kv_self.block_size > 0) {
+            // each run of cells costs up to 8 graph nodes per layer in llm_build_kv_store - use at most half of the graph for them
+            ctx->kv_self.max_runs = std::max<uint32_t>(1, llama_model_max_nodes(*model)/(2*8*hparams.n_layer));
+
+            LLAMA_LOG_INFO("%s: paged KV cache: block size = %u cells, max runs per ubatch = %u\n", __func__,
+                    ctx->kv_self.block_size, ctx->kv_self.max_runs);
+        }
+
         // graph outputs buffer
         {
             // resized during inference when a batch uses more outputs
@@ -19592,10 +20980,11 @@ struct llama_context * llama_new_context_with_model(
                 backend_ptrs.push_back(backend.get());
             }
 
-            const size_t max_nodes = llama_model_max_nodes(*model);
+            const size_t max_nodes = llama_graph_max_nodes(*ctx);
 
             // buffer used to store the computation graph and the tensor meta data
             ctx->buf_compute_meta.resize(ggml_tensor_overhead()*max_nodes + ggml_graph_overhead_custom(max_nodes, false));
+            ctx->max_nodes = max_nodes;
 
             // TODO: move these checks to ggml_backend_sched
             // enabling pipeline parallelism in the scheduler increases memory usage, so it is only done when necessary
@@ -19625,6 +21014,10 @@ struct llama_context * llama_new_context_with_model(
 
             ctx->sched.reset(ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), max_nodes, pipeline_parallel));
 
+            ctx->sched_backends          = backend_ptrs;
+            ctx->sched_bufts             = backend_buft;
+            ctx->sched_pipeline_parallel = pipeline_parallel;
+
             if (pipeline_parallel) {
                 LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(ctx->sched.get()));
             }
@@ -19685,6 +21078,18 @@ struct llama_context * llama_new_context_with_model(
 }
 
 void llama_free(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
+    auto & task = ctx->decode_task;
+    if (task.worker.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(task.mutex);
+            task.exit = true;
+        }
+        task.cv.notify_all();
+        task.worker.join();
+    }
+
     delete ctx;
 }
 
@@ -19995,6 +21400,8 @@ static bool llama_control_vector_init(struct llama_control_vector & cvec, const
 }
 
 int32_t llama_control_vector_apply(struct llama_context * lctx, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
+    llama_decode_async_join(*lctx);
+
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
@@ -20057,6 +21464,9 @@ void llama_kv_cache_view_free(struct llama_kv_cache_view * view) {
 }
 
 void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_kv_cache_view * view) {
+    // the KV cache is modified by the decode in flight - the context is const only in the signature
+    llama_decode_async_join(const_cast<llama_context &>(*ctx));
+
     if (uint32_t(view->n_cells) < ctx->kv_self.size || view->cells == nullptr) {
         view->n_cells = int32_t(ctx->kv_self.size);
         void * p = realloc(view->cells, sizeof(struct llama_kv_cache_view_cell) * view->n_cells);
@@ -20077,7 +21487,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(ctx->kv_self.size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells[i].seq_id.count();
         token_count += curr_size;
         c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
 
@@ -20092,12 +21502,11 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
-            if (seq_idx >= view->n_seq_max) {
-                break;
+        for (llama_seq_id it = 0; it < LLAMA_MAX_PARALLEL_SEQUENCES && seq_idx < view->n_seq_max; ++it) {
+            if (kv_cells[i].has_seq_id(it)) {
+                cs_curr[seq_idx] = it;
+                seq_idx++;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
         }
         if (seq_idx != 0) {
             used_cells++;
@@ -20121,39 +21530,144 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
 }
 
 int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
+    // the KV cache is modified by the decode in flight - the context is const only in the signature
+    llama_decode_async_join(const_cast<llama_context &>(*ctx));
+
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
-        result += ctx->kv_self.cells[i].seq_id.size();
+        result += ctx->kv_self.cells[i].seq_id.count();
+    }
+
+    if (ctx->kv_self.cold) {
+        for (uint32_t i = 0; i < ctx->kv_self.cold->size; i++) {
+            result += ctx->kv_self.cold->cells[i].seq_id.count();
+        }
     }
 
     return result;
 }
 
 int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
-    return ctx->kv_self.used;
+    // the KV cache is modified by the decode in flight - the context is const only in the signature
+    llama_decode_async_join(const_cast<llama_context &>(*ctx));
+
+    return ctx->kv_self.used + (ctx->kv_self.cold ? ctx->kv_self.cold->used : 0);
+}
+
+size_t llama_get_kv_cache_size(const struct llama_context * ctx) {
+    return ctx->kv_self.total_size();
 }
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     llama_kv_cache_clear(ctx->kv_self);
 }
 
+// the sequence ids of the KV cache API index the fixed-width sequence sets of the cells
+// any_ok: a negative id matches any sequence
+static bool llama_kv_cache_seq_id_valid(const char * func, llama_seq_id seq_id, bool any_ok = false) {
+    if ((any_ok && seq_id < 0) || (0 <= seq_id && seq_id < LLAMA_MAX_PARALLEL_SEQUENCES)) {
+        return true;
+    }
+
+    LLAMA_LOG_ERROR("%s: invalid seq_id = %d, must be in [0, %d)\n", func, seq_id, LLAMA_MAX_PARALLEL_SEQUENCES);
+    return false;
+}
+
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id, true)) {
+        return false;
+    }
+
     return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
 }
 
 void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id_src) || !llama_kv_cache_seq_id_valid(__func__, seq_id_dst)) {
+        return;
+    }
+
     if (seq_id_src == seq_id_dst) {
         return;
     }
-    llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+
+    auto & kv_self = ctx->kv_self;
+
+    // the shared cells must have a single RoPE offset
+    if (!kv_self.recurrent && kv_self.rope_offs[seq_id_src] != kv_self.rope_offs[seq_id_dst]) {
+        bool dst_empty = true;
+        for (const llama_kv_cache * kv = &kv_self; kv && dst_empty; kv = kv->cold.get()) {
+            for (uint32_t i = 0; i < kv->size; ++i) {
+                if (kv->cells[i].has_seq_id(seq_id_dst)) {
+                    dst_empty = false;
+                    break;
+                }
+            }
+        }
+
+        if (dst_empty) {
+            kv_self.rope_offs[seq_id_dst] = kv_self.rope_offs[seq_id_src];
+        } else {
+            llama_kv_cache_rope_offs_apply(kv_self, seq_id_src);
+            llama_kv_cache_rope_offs_apply(kv_self, seq_id_dst);
+        }
+    }
+
+    llama_kv_cache_seq_cp(kv_self, seq_id_src, seq_id_dst, p0, p1);
+}
+
+int32_t llama_kv_cache_seq_share(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos n_prefix) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id_src) || !llama_kv_cache_seq_id_valid(__func__, seq_id_dst)) {
+        return -1;
+    }
+
+    auto & kv_self = ctx->kv_self;
+
+    if (kv_self.recurrent || seq_id_src == seq_id_dst) {
+        return -1;
+    }
+
+    // the prefix of the destination is replaced by the cells of the source
+    llama_kv_cache_seq_rm(kv_self, seq_id_dst, 0, n_prefix);
+    llama_kv_cache_seq_cp(ctx, seq_id_src, seq_id_dst, 0, n_prefix);
+
+    int32_t result = 0;
+    for (const llama_kv_cache * kv = &kv_self; kv; kv = kv->cold.get()) {
+        for (uint32_t i = 0; i < kv->size; ++i) {
+            if (kv->cells[i].has_seq_id(seq_id_src) && kv->cells[i].has_seq_id(seq_id_dst)) {
+                result++;
+            }
+        }
+    }
+
+    return result;
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id)) {
+        return;
+    }
+
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
 }
 
 void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id, true)) {
+        return;
+    }
+
     if (delta == 0) {
         return;
     }
@@ -20162,6 +21676,12 @@ void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, lla
 }
 
 void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id, true)) {
+        return;
+    }
+
     if (d == 1) {
         return;
     }
@@ -20169,15 +21689,87 @@ void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, lla
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
 }
 
+void llama_kv_cache_seq_stream(struct llama_context * ctx, llama_seq_id seq_id, llama_pos n_keep, llama_pos n_discard) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id)) {
+        return;
+    }
+
+    if (n_discard <= 0) {
+        return;
+    }
+
+    n_keep = std::max(n_keep, 0);
+
+    auto & kv_self = ctx->kv_self;
+
+    const auto & hparams = ctx->model.hparams;
+    const auto & cparams = ctx->cparams;
+
+    bool lazy = !kv_self.recurrent && hparams.rope_type != LLAMA_ROPE_TYPE_NONE;
+
+    llama_kv_cache_seq_rm(kv_self, seq_id, n_keep, n_keep + n_discard);
+
+    // each shared cell of the sequence needs a free cell for its copy
+    for (const llama_kv_cache * kv = &kv_self; kv && lazy; kv = kv->cold.get()) {
+        uint32_t n_shared = 0;
+        for (uint32_t i = 0; i < kv->size; ++i) {
+            if (kv->cells[i].seq_id.count() > 1 && kv->cells[i].has_seq_id(seq_id)) {
+                n_shared++;
+            }
+        }
+        lazy = n_shared <= kv->size - kv->used;
+    }
+
+    if (!lazy) {
+        llama_kv_cache_seq_add(kv_self, seq_id, n_keep + n_discard, -1, -n_discard);
+        return;
+    }
+
+    for (llama_kv_cache * kv = &kv_self; kv; kv = kv->cold.get()) {
+        llama_kv_cache_seq_stream_tier(*kv, seq_id, n_keep, n_discard);
+    }
+
+    kv_self.rope_offs[seq_id] += n_discard;
+
+    // keep the RoPE positions of the sequence within the bound - the other sequences are not touched
+    const llama_pos n_pos_max = llama_kv_cache_rope_pos_max(hparams, cparams);
+
+    if (llama_kv_cache_seq_pos_max(kv_self, seq_id) + kv_self.rope_offs[seq_id] >= n_pos_max) {
+        llama_kv_cache_rope_offs_apply(kv_self, seq_id);
+    }
+}
+
+int32_t llama_kv_cache_seq_n_shared(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id)) {
+        return -1;
+    }
+
+    return llama_kv_cache_seq_n_shared(ctx->kv_self, seq_id);
+}
+
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_join(*ctx);
+
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id)) {
+        return -1;
+    }
+
     return llama_kv_cache_seq_pos_max(ctx->kv_self, seq_id);
 }
 
 void llama_kv_cache_defrag(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     llama_kv_cache_defrag(ctx->kv_self);
 }
 
 void llama_kv_cache_update(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     llama_kv_cache_update_internal(*ctx);
 }
 
@@ -20292,22 +21884,23 @@ struct llama_data_write {
             for (uint32_t i = range.first; i < range.second; ++i) {
                 const auto & cell = kv_self.cells[i];
                 const llama_pos pos      = cell.pos;
-                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.count() : 0;
 
                 write(&pos,      sizeof(pos));
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
-                        write(&seq_id, sizeof(seq_id));
+                    for (llama_seq_id id = 0; id < LLAMA_MAX_PARALLEL_SEQUENCES; ++id) {
+                        if (cell.has_seq_id(id)) {
+                            write(&id, sizeof(id));
+                        }
                     }
                 }
             }
         }
     }
 
-    void write_kv_cache_data(const struct llama_context * ctx, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_data(const struct llama_context * ctx, const llama_kv_cache & kv_self, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         const struct llama_hparams & hparams = ctx->model.hparams;
 
         const uint32_t v_trans = kv_self.v_trans ? 1 : 0;
@@ -20389,8 +21982,7 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_cells(const struct llama_context * ctx, const llama_kv_cache & kv_self, llama_seq_id seq_id, uint32_t flags = 0) {
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
 
@@ -20422,10 +22014,29 @@ struct llama_data_write {
         }
         GGML_ASSERT(cell_count == cell_count_check);
 
-        write(&cell_count, sizeof(cell_count));
+        const uint32_t cell_count_flags = cell_count | flags;
+        write(&cell_count_flags, sizeof(cell_count_flags));
 
         write_kv_cache_meta(kv_self, cell_ranges, seq_id);
-        write_kv_cache_data(ctx, cell_ranges);
+        write_kv_cache_data(ctx, kv_self, cell_ranges);
+    }
+
+    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
+        const llama_kv_cache * kv_cold = ctx->kv_self.cold.get();
+
+        bool has_cold = false;
+        for (uint32_t i = 0; kv_cold && i < kv_cold->size && !has_cold; ++i) {
+            const auto & cell = kv_cold->cells[i];
+            has_cold = (seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id);
+        }
+
+        // the cells of the cold tier of a tiered KV cache follow, if there are any - the other states have the
+        // format of an untiered cache
+        write_kv_cache_cells(ctx, ctx->kv_self, seq_id, has_cold ? LLAMA_STATE_KV_COLD_FLAG : 0);
+
+        if (has_cold) {
+            write_kv_cache_cells(ctx, *kv_cold, seq_id);
+        }
     }
 };
 
@@ -20517,8 +22128,7 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+    bool read_kv_cache_meta(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
 
         if (dest_seq_id != -1) {
             // single sequence
@@ -20552,12 +22162,14 @@ struct llama_data_read {
             }
 
             // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            // Assume that this is one contiguous block of cells, unless the paged KV cache split it in runs
+            if (kv_self.runs.empty()) {
+                GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
+                GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
+                GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+                GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
+                GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            }
         } else {
             // whole KV cache restore
 
@@ -20588,7 +22200,7 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    cell.seq_id.set(seq_id);
 
                     if (kv_self.recurrent) {
                         int32_t & tail = kv_self.cells[seq_id].tail;
@@ -20616,9 +22228,16 @@ struct llama_data_read {
         return true;
     }
 
-    bool read_kv_cache_data(struct llama_context * ctx, uint32_t cell_count) {
+    bool read_kv_cache_data(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count) {
         const struct llama_hparams & hparams = ctx->model.hparams;
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+
+        // the cell ranges to restore into, in the order of the saved cells
+        std::vector<std::pair<uint32_t, uint32_t>> runs = std::move(kv_self.runs);
+        if (runs.empty()) {
+            runs.emplace_back(kv_self.head, cell_count);
+        }
+        kv_self.runs.clear();
+
         uint32_t v_trans;
         uint32_t n_layer;
         read_to(&v_trans, sizeof(v_trans));
@@ -20661,7 +22280,9 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                for (const auto & run : runs) {
+                    ggml_backend_tensor_set(kv_self.k_l[il], read(run.second * k_size_row), run.first * k_size_row, run.second * k_size_row);
+                }
             }
         }
 
@@ -20689,7 +22310,9 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    for (const auto & run : runs) {
+                        ggml_backend_tensor_set(kv_self.v_l[il], read(run.second * v_size_row), run.first * v_size_row, run.second * v_size_row);
+                    }
                 }
             }
         } else {
@@ -20726,8 +22349,10 @@ struct llama_data_read {
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        for (const auto & run : runs) {
+                            const size_t dst_offset = (run.first + j * kv_self.size) * v_size_el;
+                            ggml_backend_tensor_set(kv_self.v_l[il], read(run.second * v_size_el), dst_offset, run.second * v_size_el);
+                        }
                     }
                 }
             }
@@ -20739,7 +22364,23 @@ struct llama_data_read {
         uint32_t cell_count;
         read_to(&cell_count, sizeof(cell_count));
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        const bool has_cold = cell_count & LLAMA_STATE_KV_COLD_FLAG;
+        cell_count &= ~LLAMA_STATE_KV_COLD_FLAG;
+
+        bool res = read_kv_cache_meta(ctx, ctx->kv_self, cell_count, seq_id) && read_kv_cache_data(ctx, ctx->kv_self, cell_count);
+
+        if (res && has_cold) {
+            uint32_t cell_count_cold;
+            read_to(&cell_count_cold, sizeof(cell_count_cold));
+
+            if (!ctx->kv_self.cold) {
+                LLAMA_LOG_ERROR("%s: the state has %u cold kv cells, but the kv cache is not tiered\n", __func__, cell_count_cold);
+                res = false;
+            } else {
+                res = read_kv_cache_meta(ctx, *ctx->kv_self.cold, cell_count_cold, seq_id) &&
+                      read_kv_cache_data(ctx, *ctx->kv_self.cold, cell_count_cold);
+            }
+        }
 
         if (!res) {
             if (seq_id == -1) {
@@ -20891,6 +22532,19 @@ struct llama_data_read_file : llama_data_read {
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
 
+    // the RoPE offsets of the streaming context shifts are folded into the KV data, the saved positions are the RoPE positions
+    if (llama_kv_cache_rope_offs_apply(ctx->kv_self)) {
+        llama_kv_cache_update_internal(*ctx);
+    }
+
+    // the KV data of the detached shared cells has to be in place before it is saved
+    if (!ctx->kv_self.cow.empty()) {
+        llama_kv_cache_cow_internal(*ctx, ctx->kv_self);
+    }
+    if (ctx->kv_self.cold && !ctx->kv_self.cold->cow.empty()) {
+        llama_kv_cache_cow_internal(*ctx, *ctx->kv_self.cold);
+    }
+
     data_ctx.write_model_info(ctx);
 
     // copy outputs
@@ -20942,6 +22596,8 @@ static size_t llama_state_set_data_internal(struct llama_context * ctx, llama_da
 
 // Sets the state reading from the specified source address
 size_t llama_state_set_data(struct llama_context * ctx, const uint8_t * src, size_t size) {
+    llama_decode_async_join(*ctx);
+
     llama_data_read_buffer data_ctx(src, size);
     try {
         return llama_state_set_data_internal(ctx, data_ctx);
@@ -20994,6 +22650,8 @@ static bool llama_state_load_file_internal(struct llama_context * ctx, const cha
 }
 
 bool llama_state_load_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_decode_async_join(*ctx);
+
     try {
         return llama_state_load_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
     } catch (const std::exception & err) {
@@ -21031,6 +22689,23 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id, true)) {
+        return 0;
+    }
+
+    // the RoPE offset of the sequence is folded into its KV data, the saved positions are the RoPE positions
+    if (llama_kv_cache_rope_offs_apply(ctx->kv_self, seq_id)) {
+        llama_kv_cache_update_internal(*ctx);
+    }
+
+    // the KV data of the detached shared cells has to be in place before it is saved
+    if (!ctx->kv_self.cow.empty()) {
+        llama_kv_cache_cow_internal(*ctx, ctx->kv_self);
+    }
+    if (ctx->kv_self.cold && !ctx->kv_self.cold->cow.empty()) {
+        llama_kv_cache_cow_internal(*ctx, *ctx->kv_self.cold);
+    }
+
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
@@ -21054,12 +22729,18 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
 static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
 
+    if (!llama_kv_cache_seq_id_valid(__func__, dest_seq_id, true)) {
+        return 0;
+    }
+
     data_ctx.read_kv_cache(ctx, dest_seq_id);
 
     return data_ctx.get_size_read();
 }
 
 size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id) {
+    llama_decode_async_join(*ctx);
+
     llama_data_read_buffer data_ctx(src, size);
     try {
         return llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
@@ -21070,6 +22751,10 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 }
 
 static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    if (!llama_kv_cache_seq_id_valid(__func__, seq_id, true)) {
+        return 0;
+    }
+
     llama_file file(filepath, "wb");
 
     file.write_u32(LLAMA_STATE_SEQ_MAGIC);
@@ -21141,6 +22826,8 @@ size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepa
 }
 
 size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_decode_async_join(*ctx);
+
     try {
         return llama_state_seq_load_file_internal(ctx, filepath, dest_seq_id, tokens_out, n_token_capacity, n_token_count_out);
     } catch (const std::exception & err) {
@@ -21150,6 +22837,8 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
 }
 
 void llama_set_n_threads(struct llama_context * ctx, int32_t n_threads, int32_t n_threads_batch) {
+    llama_decode_async_join(*ctx);
+
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
 }
@@ -21163,15 +22852,21 @@ int32_t llama_n_threads_batch(struct llama_context * ctx) {
 }
 
 void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
+    llama_decode_async_join(*ctx);
+
     ctx->abort_callback      = abort_callback;
     ctx->abort_callback_data = abort_callback_data;
 }
 
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
+    llama_decode_async_join(*ctx);
+
     ctx->cparams.embeddings = embeddings;
 }
 
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
+    llama_decode_async_join(*ctx);
+
     ctx->cparams.causal_attn = causal_attn;
 }
 
@@ -21236,6 +22931,8 @@ void llama_batch_free(struct llama_batch batch) {
 int32_t llama_encode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    llama_decode_wait(ctx);
+
     const int ret = llama_encode_internal(*ctx, batch);
     if (ret != 0) {
         LLAMA_LOG_ERROR("%s: failed to encode, ret = %d\n", __func__, ret);
@@ -21247,6 +22944,8 @@ int32_t llama_encode(
 int32_t llama_decode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    llama_decode_wait(ctx);
+
     const int ret = llama_decode_internal(*ctx, batch);
     if (ret != 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
@@ -21255,7 +22954,127 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_async(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    auto & task = ctx->decode_task;
+
+    if (task.pending) {
+        LLAMA_LOG_ERROR("%s: the previous batch was not waited for\n", __func__);
+        return -1;
+    }
+
+    if (batch.n_tokens <= 0) {
+        LLAMA_LOG_ERROR("%s: n_tokens == 0\n", __func__);
+        return -1;
+    }
+
+    // the outputs of the previous batch become the front buffers, in the order of their batch
+    llama_synchronize(ctx);
+    llama_output_reorder(ctx);
+    llama_outputs_swap(*ctx, task.front);
+
+    // copy the batch, the caller can reuse it while it is decoded
+    const int32_t n_tokens = batch.n_tokens;
+
+    llama_batch b = batch;
+
+    if (batch.token) {
+        task.token.assign(batch.token, batch.token + n_tokens);
+        b.token = task.token.data();
+    }
+    if (batch.embd) {
+        task.embd.assign(batch.embd, batch.embd + (size_t) n_tokens*ctx->model.hparams.n_embd);
+        b.embd = task.embd.data();
+    }
+    if (batch.pos) {
+        task.pos.assign(batch.pos, batch.pos + n_tokens);
+        b.pos = task.pos.data();
+    }
+    if (batch.n_seq_id && batch.seq_id) {
+        task.n_seq_id.assign(batch.n_seq_id, batch.n_seq_id + n_tokens);
+        task.seq_id_data.clear();
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            task.seq_id_data.insert(task.seq_id_data.end(), batch.seq_id[i], batch.seq_id[i] + batch.n_seq_id[i]);
+        }
+        task.seq_id.resize(n_tokens + 1);
+        for (int32_t i = 0, k = 0; i < n_tokens; k += batch.n_seq_id[i], ++i) {
+            task.seq_id[i] = task.seq_id_data.data() + k;
+        }
+        task.seq_id[n_tokens] = nullptr;
+        b.n_seq_id = task.n_seq_id.data();
+        b.seq_id   = task.seq_id.data();
+    }
+    if (batch.logits) {
+        task.logits.assign(batch.logits, batch.logits + n_tokens);
+        b.logits = task.logits.data();
+    }
+
+    if (!task.worker.joinable()) {
+        task.worker = std::thread([ctx]() {
+            auto & task = ctx->decode_task;
+
+            std::unique_lock<std::mutex> lock(task.mutex);
+            while (true) {
+                task.cv.wait(lock, [&]{ return task.queued || task.exit; });
+                if (task.exit) {
+                    return;
+                }
+
+                // the submitting thread does not touch the context until the decode is joined
+                lock.unlock();
+                const int32_t ret = llama_decode_internal(*ctx, task.batch);
+                lock.lock();
+
+                task.ret    = ret;
+                task.queued = false;
+                task.cv.notify_all();
+            }
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(task.mutex);
+        task.batch   = b;
+        task.queued  = true;
+        task.pending = true;
+    }
+    task.cv.notify_all();
+
+    return 0;
+}
+
+bool llama_decode_poll(struct llama_context * ctx) {
+    auto & task = ctx->decode_task;
+
+    std::unique_lock<std::mutex> lock(task.mutex);
+    return !task.queued;
+}
+
+int32_t llama_decode_wait(struct llama_context * ctx) {
+    auto & task = ctx->decode_task;
+
+    if (!task.pending) {
+        return 0;
+    }
+
+    llama_decode_async_join(*ctx);
+
+    task.pending = false;
+
+    // account the decode in the stats
+    llama_synchronize(ctx);
+
+    if (task.ret != 0) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, task.ret);
+    }
+
+    return task.ret;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     ggml_backend_sched_synchronize(ctx->sched.get());
 
     // FIXME: if multiple single tokens are evaluated without a synchronization,
@@ -21285,47 +23104,38 @@ void llama_synchronize(struct llama_context * ctx) {
     ctx->t_compute_start_us = 0;
 }
 
-float * llama_get_logits(struct llama_context * ctx) {
-    llama_synchronize(ctx);
-
-    // reorder logits for backward compatibility
-    // TODO: maybe deprecate this
-    llama_output_reorder(ctx);
-
-    return ctx->logits;
-}
-
-float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
+// the row of output i, for the llama_get_logits_ith and llama_get_embeddings_ith functions
+static float * llama_output_ith(const char * func, const char * name, float * data, int64_t n_row,
+        const std::vector<int32_t> & output_ids, int32_t n_outputs, int32_t i) {
     int32_t j = -1;
-    llama_synchronize(ctx);
 
     try {
-        if (ctx->logits == nullptr) {
-            throw std::runtime_error("no logits");
+        if (data == nullptr) {
+            throw std::runtime_error(format("no %s", name));
         }
 
         if (i < 0) {
-            j = ctx->n_outputs + i;
+            j = n_outputs + i;
             if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", ctx->n_outputs));
+                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
             }
-        } else if ((size_t) i >= ctx->output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %zu)", ctx->output_ids.size()));
+        } else if ((size_t) i >= output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
         } else {
-            j = ctx->output_ids[i];
+            j = output_ids[i];
         }
 
         if (j < 0) {
             throw std::runtime_error(format("batch.logits[%d] != true", i));
         }
-        if (j >= ctx->n_outputs) {
+        if (j >= n_outputs) {
             // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
         }
 
-        return ctx->logits + j*ctx->model.hparams.n_vocab;
+        return data + j*n_row;
     } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+        LLAMA_LOG_ERROR("%s: invalid %s id %d, reason: %s\n", func, name, i, err.what());
 #ifndef NDEBUG
         GGML_ABORT("fatal error");
 #else
@@ -21334,61 +23144,71 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
-float * llama_get_embeddings(struct llama_context * ctx) {
+// while an asynchronous decode is pending, the outputs of the previous batch are returned without waiting for it
+
+float * llama_get_logits(struct llama_context * ctx) {
+    if (ctx->decode_task.pending) {
+        return ctx->decode_task.front.logits;
+    }
+
     llama_synchronize(ctx);
 
-    // reorder embeddings for backward compatibility
+    // reorder logits for backward compatibility
     // TODO: maybe deprecate this
     llama_output_reorder(ctx);
 
-    return ctx->embd;
+    return ctx->logits;
 }
 
-float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i) {
-    int32_t j = -1;
+float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
+    const int64_t n_vocab = ctx->model.hparams.n_vocab;
+
+    if (ctx->decode_task.pending) {
+        const auto & out = ctx->decode_task.front;
+        return llama_output_ith(__func__, "logits", out.logits, n_vocab, out.output_ids, out.n_outputs, i);
+    }
 
     llama_synchronize(ctx);
 
-    try {
-        if (ctx->embd == nullptr) {
-            throw std::runtime_error("no embeddings");
-        }
+    return llama_output_ith(__func__, "logits", ctx->logits, n_vocab, ctx->output_ids, ctx->n_outputs, i);
+}
 
-        if (i < 0) {
-            j = ctx->n_outputs + i;
-            if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", ctx->n_outputs));
-            }
-        } else if ((size_t) i >= ctx->output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %lu)", ctx->output_ids.size()));
-        } else {
-            j = ctx->output_ids[i];
-        }
+float * llama_get_embeddings(struct llama_context * ctx) {
+    if (ctx->decode_task.pending) {
+        return ctx->decode_task.front.embd;
+    }
 
-        if (j < 0) {
-            throw std::runtime_error(format("batch.logits[%d] != true", i));
-        }
-        if (j >= ctx->n_outputs) {
-            // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
-        }
+    llama_synchronize(ctx);
 
-        return ctx->embd + j*ctx->model.hparams.n_embd;
-    } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("%s: invalid embeddings id %d, reason: %s\n", __func__, i, err.what());
-#ifndef NDEBUG
-        GGML_ABORT("fatal error");
-#else
-        return nullptr;
-#endif
+    // reorder embeddings for backward compatibility
+    // TODO: maybe deprecate this
+    llama_output_reorder(ctx);
+
+    return ctx->embd;
+}
+
+float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i) {
+    const int64_t n_embd = ctx->model.hparams.n_embd;
+
+    if (ctx->decode_task.pending) {
+        const auto & out = ctx->decode_task.front;
+        return llama_output_ith(__func__, "embeddings", out.embd, n_embd, out.output_ids, out.n_outputs, i);
     }
+
+    llama_synchronize(ctx);
+
+    return llama_output_ith(__func__, "embeddings", ctx->embd, n_embd, ctx->output_ids, ctx->n_outputs, i);
 }
 
 float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id) {
-    llama_synchronize(ctx);
+    auto & embd_seq = ctx->decode_task.pending ? ctx->decode_task.front.embd_seq : ctx->embd_seq;
 
-    auto it = ctx->embd_seq.find(seq_id);
-    if (it == ctx->embd_seq.end()) {
+    if (!ctx->decode_task.pending) {
+        llama_synchronize(ctx);
+    }
+
+    auto it = embd_seq.find(seq_id);
+    if (it == embd_seq.end()) {
         return nullptr;
     }
 
@@ -21506,6 +23326,24 @@ int32_t llama_tokenize(
     return llama_tokenize_impl(model->vocab, text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_model * model,
+                 const char ** texts,
+              const int32_t  * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * offsets,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return llama_tokenize_batch_impl(model->vocab, texts, text_lens, n_texts, tokens, n_tokens_max, offsets, add_special, parse_special, n_threads);
+}
+
+void llama_tokenizer_set_cache_size(struct llama_model * model, int32_t n_words) {
+    llama_tokenizer_set_cache_size_impl(model->vocab, n_words);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_model * model,
                  llama_token   token,
@@ -21968,6 +23806,8 @@ void llama_perf_context_print(const struct llama_context * ctx) {
 }
 
 void llama_perf_context_reset(struct llama_context * ctx) {
+    llama_decode_async_join(*ctx);
+
     ctx->t_start_us  = ggml_time_us();
     ctx->t_eval_us   = ctx->n_eval = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
@@ -10,7 +10,10 @@
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -542,6 +545,715 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+//
+// regex -> DFA
+//
+// compiles the subset of the ECMAScript syntax used by the pre-tokenizer regexes into a DFA over classes of codepoints
+// the codepoints are mapped like for the std::regex fallback (non-ASCII whitespaces to 0x0B and, if the regex uses
+// unicode categories, the rest of the non-ASCII codepoints to their collapsed category), so both produce the same splits
+//
+// the alternations are resolved leftmost-first by keeping the NFA threads of each DFA state in priority order and
+// dropping the threads after a match (as in RE2), and the single-codepoint lookaheads - (?=x), (?!x) and $ - are
+// resolved when stepping over the next codepoint, or the end of the text
+//
+
+using unicode_regex_ranges = std::vector<std::pair<uint32_t, uint32_t>>; // [first, last]
+
+static unicode_regex_ranges unicode_regex_ranges_norm(unicode_regex_ranges ranges) {
+    std::sort(ranges.begin(), ranges.end());
+
+    unicode_regex_ranges res;
+    for (const auto & range : ranges) {
+        if (!res.empty() && range.first <= res.back().second + 1) {
+            res.back().second = std::max(res.back().second, range.second);
+        } else {
+            res.push_back(range);
+        }
+    }
+
+    return res;
+}
+
+static unicode_regex_ranges unicode_regex_ranges_not(const unicode_regex_ranges & ranges) {
+    const auto norm = unicode_regex_ranges_norm(ranges);
+
+    unicode_regex_ranges res;
+    uint32_t next = 0;
+    for (const auto & range : norm) {
+        if (range.first > next) {
+            res.push_back({next, range.first - 1});
+        }
+        next = range.second + 1;
+    }
+    if (next < MAX_CODEPOINTS) {
+        res.push_back({next, MAX_CODEPOINTS - 1});
+    }
+
+    return res;
+}
+
+struct unicode_regex_node {
+    enum type_t { SET, CAT, ALT, REPEAT, ASSERT };
+
+    type_t type;
+
+    unicode_regex_ranges set;    // SET, ASSERT
+    bool at_end = false;         // ASSERT: also holds at the end of the text
+
+    std::vector<unicode_regex_node> children; // CAT, ALT, REPEAT
+
+    int  min    = 0;
+    int  max    = 0;             // REPEAT: < 0 if unbounded
+    bool greedy = true;
+
+    bool nullable() const {
+        switch (type) {
+            case SET:    return false;
+            case ASSERT: return true;
+            case CAT:    return std::all_of(children.begin(), children.end(), [](const unicode_regex_node & n) { return n.nullable(); });
+            case ALT:    return std::any_of(children.begin(), children.end(), [](const unicode_regex_node & n) { return n.nullable(); });
+            case REPEAT: return min == 0 || children[0].nullable();
+        }
+        return true;
+    }
+};
+
+// throws std::invalid_argument for the constructs that are not supported, which are left to std::regex
+struct unicode_regex_parser {
+    const std::vector<uint32_t> re;
+    const bool collapsed;
+
+    size_t pos = 0;
+
+    unicode_regex_parser(const std::string & regex_expr, bool collapsed) : re(unicode_cpts_from_utf8(regex_expr)), collapsed(collapsed) {
+        if (collapsed) {
+            for (uint32_t cpt : re) {
+                if (cpt >= 128) {
+                    throw std::invalid_argument("unicode categories and non-ASCII characters");
+                }
+            }
+        }
+    }
+
+    unicode_regex_node parse() {
+        auto res = parse_alt();
+        if (pos != re.size()) {
+            throw std::invalid_argument("unexpected ')'");
+        }
+        if (res.nullable()) {
+            throw std::invalid_argument("empty matches");
+        }
+        return res;
+    }
+
+    bool at(uint32_t c) const {
+        return pos < re.size() && re[pos] == c;
+    }
+
+    uint32_t next() {
+        if (pos >= re.size()) {
+            throw std::invalid_argument("unexpected end");
+        }
+        return re[pos++];
+    }
+
+    unicode_regex_node parse_alt() {
+        unicode_regex_node res = { unicode_regex_node::ALT };
+        res.children.push_back(parse_cat());
+        while (at('|')) {
+            pos++;
+            res.children.push_back(parse_cat());
+        }
+        return res.children.size() == 1 ? std::move(res.children[0]) : std::move(res);
+    }
+
+    unicode_regex_node parse_cat() {
+        unicode_regex_node res = { unicode_regex_node::CAT };
+        while (pos < re.size() && !at('|') && !at(')')) {
+            res.children.push_back(parse_repeat());
+        }
+        return res.children.size() == 1 ? std::move(res.children[0]) : std::move(res);
+    }
+
+    int parse_int() {
+        int res = 0;
+        if (!(pos < re.size() && '0' <= re[pos] && re[pos] <= '9')) {
+            throw std::invalid_argument("expected a number");
+        }
+        while (pos < re.size() && '0' <= re[pos] && re[pos] <= '9' && res < 1000) {
+            res = 10*res + (re[pos++] - '0');
+        }
+        return res;
+    }
+
+    unicode_regex_node parse_repeat() {
+        auto atom = parse_atom();
+
+        int min = 0;
+        int max = 0;
+        switch (pos < re.size() ? re[pos] : 0) {
+            case '*': pos++; min = 0; max = -1; break;
+            case '+': pos++; min = 1; max = -1; break;
+            case '?': pos++; min = 0; max =  1; break;
+            case '{':
+                {
+                    pos++;
+                    min = max = parse_int();
+                    if (at(',')) {
+                        pos++;
+                        max = at('}') ? -1 : parse_int();
+                    }
+                    if (next() != '}' || (max >= 0 && max < min) || max > 64 || min > 64) {
+                        throw std::invalid_argument("invalid repetition");
+                    }
+                } break;
+            default:
+                return atom;
+        }
+
+        if (atom.type == unicode_regex_node::ASSERT) {
+            throw std::invalid_argument("repeated assertion");
+        }
+
+        unicode_regex_node res = { unicode_regex_node::REPEAT };
+        res.min = min;
+        res.max = max;
+        if (at('?')) {
+            pos++;
+            res.greedy = false;
+        }
+        res.children.push_back(std::move(atom));
+
+        if (at('*') || at('+') || at('?') || at('{')) {
+            throw std::invalid_argument("nested quantifiers");
+        }
+
+        return res;
+    }
+
+    unicode_regex_node parse_atom() {
+        const uint32_t c = next();
+
+        unicode_regex_node res = { unicode_regex_node::SET };
+        switch (c) {
+            case '(':
+                {
+                    bool lookahead = false;
+                    bool negative  = false;
+                    if (at('?')) {
+                        pos++;
+                        const uint32_t k = next();
+                        if (k == '=' || k == '!') {
+                            lookahead = true;
+                            negative  = k == '!';
+                        } else if (k != ':') {
+                            throw std::invalid_argument("unsupported group");
+                        }
+                    }
+                    res = parse_alt();
+                    if (next() != ')') {
+                        throw std::invalid_argument("expected ')'");
+                    }
+                    if (lookahead) {
+                        // only lookaheads of a single codepoint
+                        if (res.type != unicode_regex_node::SET) {
+                            throw std::invalid_argument("unsupported lookahead");
+                        }
+                        res.type = unicode_regex_node::ASSERT;
+                        if (negative) {
+                            res.set    = unicode_regex_ranges_not(res.set);
+                            res.at_end = true;
+                        }
+                    }
+                } break;
+            case '[':
+                res.set = parse_class();
+                break;
+            case '.':
+                res.set = unicode_regex_ranges_not({{'\n', '\n'}, {'\r', '\r'}, {0x2028, 0x2029}});
+                break;
+            case '$':
+                res.type   = unicode_regex_node::ASSERT;
+                res.at_end = true;
+                break;
+            case '\\':
+                res.set = parse_escape(nullptr);
+                break;
+            case '^': case ')': case '*': case '+': case '?': case '{':
+                throw std::invalid_argument("unsupported character");
+            default:
+                res.set = {{c, c}};
+        }
+
+        return res;
+    }
+
+    // sets is_char if the escape is a single codepoint, which can start or end a range
+    unicode_regex_ranges parse_escape(bool * is_char) {
+        static const unicode_regex_ranges k_space = {{0x09, 0x0D}, {' ', ' '}};
+        static const unicode_regex_ranges k_digit = {{'0', '9'}};
+        static const unicode_regex_ranges k_word  = {{'0', '9'}, {'A', 'Z'}, {'_', '_'}, {'a', 'z'}};
+
+        const uint32_t c = next();
+
+        uint32_t cpt = c;
+        switch (c) {
+            case 's': return k_space;
+            case 'S': return unicode_regex_ranges_not(k_space);
+            case 'd': return k_digit;
+            case 'D': return unicode_regex_ranges_not(k_digit);
+            case 'w': return k_word;
+            case 'W': return unicode_regex_ranges_not(k_word);
+            case 'p': return parse_category();
+            case 't': cpt = 0x09; break;
+            case 'n': cpt = 0x0A; break;
+            case 'v': cpt = 0x0B; break;
+            case 'f': cpt = 0x0C; break;
+            case 'r': cpt = 0x0D; break;
+            case 'x': cpt = parse_hex(2); break;
+            case 'u': cpt = parse_hex(4); break;
+            default:
+                if (('0' <= c && c <= '9') || ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')) {
+                    throw std::invalid_argument("unsupported escape");
+                }
+        }
+
+        if (is_char) {
+            *is_char = true;
+        }
+
+        return {{cpt, cpt}};
+    }
+
+    uint32_t parse_hex(int n) {
+        uint32_t res = 0;
+        for (int i = 0; i < n; ++i) {
+            const uint32_t c = next();
+            if ('0' <= c && c <= '9') {
+                res = 16*res + (c - '0');
+            } else if ('a' <= (c | 0x20) && (c | 0x20) <= 'f') {
+                res = 16*res + ((c | 0x20) - 'a' + 10);
+            } else {
+                throw std::invalid_argument("invalid hex escape");
+            }
+        }
+        return res;
+    }
+
+    // same as the categories of the collapsed text, see unicode_regex_split
+    unicode_regex_ranges parse_category() {
+        if (next() != '{') {
+            throw std::invalid_argument("expected '{'");
+        }
+        const uint32_t cat = next();
+        if (next() != '}' || !collapsed) {
+            throw std::invalid_argument("unsupported category");
+        }
+        switch (cat) {
+            case 'N': return {{0xD1, 0xD1}, {'0', '9'}};
+            case 'L': return {{0xD2, 0xD2}, {'A', 'Z'}, {'a', 'z'}};
+            case 'P': return {{0xD3, 0xD3}, {0x21, 0x23}, {0x25, 0x2A}, {0x2C, 0x2F}, {0x3A, 0x3B}, {0x3F, 0x40}, {0x5B, 0x5D}, {0x5F, 0x5F}, {0x7B, 0x7B}, {0x7D, 0x7D}};
+        }
+        throw std::invalid_argument("unsupported category");
+    }
+
+    unicode_regex_ranges parse_class() {
+        const bool negate = at('^');
+        if (negate) {
+            pos++;
+        }
+        if (at(']')) {
+            throw std::invalid_argument("empty class");
+        }
+
+        auto parse_class_atom = [&](bool & is_char) -> unicode_regex_ranges {
+            is_char = false;
+            const uint32_t c = next();
+            if (c == '\\') {
+                return parse_escape(&is_char);
+            }
+            if (c == '[') {
+                throw std::invalid_argument("nested class");
+            }
+            is_char = true;
+            return {{c, c}};
+        };
+
+        unicode_regex_ranges res;
+        while (!at(']')) {
+            bool is_char;
+            auto lo = parse_class_atom(is_char);
+            if (is_char && at('-') && pos + 1 < re.size() && re[pos + 1] != ']') {
+                pos++;
+                auto hi = parse_class_atom(is_char);
+                if (!is_char || hi[0].first < lo[0].first) {
+                    throw std::invalid_argument("invalid range");
+                }
+                lo[0].second = hi[0].first;
+            }
+            res.insert(res.end(), lo.begin(), lo.end());
+        }
+        pos++;
+
+        return negate ? unicode_regex_ranges_not(res) : unicode_regex_ranges_norm(res);
+    }
+};
+
+struct unicode_regex_dfa {
+    bool collapsed;
+
+    // the symbols are the intervals between the bounds of all the codepoint sets of the regex
+    std::vector<uint32_t> bounds;
+    uint16_t sym_ascii[128];
+    uint16_t sym_collapsed[4]; // 0xD0 - 0xD3
+
+    int32_t n_sym;   // + 1 for the end of the text
+    int32_t start;
+
+    // (next state << 1) | (match before the symbol), indexed by state * (n_sym + 1) + symbol, state 0 is dead
+    std::vector<int32_t> trans;
+    std::vector<uint8_t> accept;
+
+    uint16_t sym(uint32_t cpt) const {
+        if (cpt < 128) {
+            return sym_ascii[cpt];
+        }
+
+        const auto flags = unicode_cpt_flags(cpt);
+        if (flags.is_whitespace) {
+            return sym_ascii[0x0B];
+        }
+        if (collapsed) {
+            switch (flags.category_flag()) {
+                case codepoint_flags::NUMBER:      return sym_collapsed[1];
+                case codepoint_flags::LETTER:      return sym_collapsed[2];
+                case codepoint_flags::PUNCTUATION: return sym_collapsed[3];
+                default:                           return sym_collapsed[0];
+            }
+        }
+
+        return std::upper_bound(bounds.begin(), bounds.end(), cpt) - bounds.begin();
+    }
+
+    // returns the end of the longest leftmost-first match starting at pos, or pos if there is none
+    size_t match(const uint16_t * syms, size_t pos, size_t end) const {
+        const int32_t stride = n_sym + 1;
+
+        size_t  res = pos;
+        int32_t s   = start;
+        for (size_t i = pos; i < end; ++i) {
+            const int32_t t = trans[s*stride + syms[i]];
+            if (t & 1) {
+                res = i;
+            }
+            s = t >> 1;
+            if (s == 0) {
+                return res;
+            }
+            if (accept[s]) {
+                res = i + 1;
+            }
+        }
+        if (trans[s*stride + n_sym] & 1) {
+            res = end;
+        }
+
+        return res;
+    }
+};
+
+struct unicode_regex_compiler {
+    struct inst {
+        enum op_t { CHAR, ASSERT, SPLIT, JMP, MATCH };
+
+        op_t op;
+        int  x; // CHAR, ASSERT: set, SPLIT, JMP: target (preferred)
+        int  y; // SPLIT: target
+    };
+
+    static constexpr size_t MAX_INSTS  = 1 << 14;
+    static constexpr size_t MAX_STATES = 1 << 12;
+
+    std::vector<inst> prog;
+
+    std::vector<unicode_regex_ranges> sets;
+    std::vector<bool>                 sets_at_end;
+
+    std::vector<uint8_t> member; // sets.size() x n_sym
+
+    int32_t n_sym = 0;
+
+    int emit(inst::op_t op, int x = 0, int y = 0) {
+        if (prog.size() >= MAX_INSTS) {
+            throw std::invalid_argument("regex too large");
+        }
+        prog.push_back({op, x, y});
+        return (int) prog.size() - 1;
+    }
+
+    void emit(const unicode_regex_node & node) {
+        switch (node.type) {
+            case unicode_regex_node::SET:
+            case unicode_regex_node::ASSERT:
+                {
+                    sets.push_back(node.set);
+                    sets_at_end.push_back(node.at_end);
+                    emit(node.type == unicode_regex_node::SET ? inst::CHAR : inst::ASSERT, (int) sets.size() - 1);
+                } break;
+            case unicode_regex_node::CAT:
+                {
+                    for (const auto & child : node.children) {
+                        emit(child);
+                    }
+                } break;
+            case unicode_regex_node::ALT:
+                {
+                    std::vector<int> jmps;
+                    for (size_t i = 0; i < node.children.size(); ++i) {
+                        int split = -1;
+                        if (i + 1 < node.children.size()) {
+                            split = emit(inst::SPLIT, (int) prog.size() + 1);
+                        }
+                        emit(node.children[i]);
+                        if (split >= 0) {
+                            jmps.push_back(emit(inst::JMP));
+                            prog[split].y = (int) prog.size();
+                        }
+                    }
+                    for (int jmp : jmps) {
+                        prog[jmp].x = (int) prog.size();
+                    }
+                } break;
+            case unicode_regex_node::REPEAT:
+                {
+                    for (int i = 0; i < node.min; ++i) {
+                        emit(node.children[0]);
+                    }
+                    std::vector<int> splits;
+                    if (node.max < 0) {
+                        splits.push_back(emit(inst::SPLIT));
+                        emit(node.children[0]);
+                        emit(inst::JMP, splits[0]);
+                    } else {
+                        for (int i = node.min; i < node.max; ++i) {
+                            splits.push_back(emit(inst::SPLIT));
+                            emit(node.children[0]);
+                        }
+                    }
+                    for (int split : splits) {
+                        prog[split].x = node.greedy ? split + 1 : (int) prog.size();
+                        prog[split].y = node.greedy ? (int) prog.size() : split + 1;
+                    }
+                } break;
+        }
+    }
+
+    // appends the threads reachable from pc in priority order, returns true if a match was reached
+    bool closure(int pc, std::vector<int> & list, std::vector<uint8_t> & seen) const {
+        std::vector<int> stack = { pc };
+        while (!stack.empty()) {
+            pc = stack.back();
+            stack.pop_back();
+            if (seen[pc]) {
+                continue;
+            }
+            seen[pc] = 1;
+            switch (prog[pc].op) {
+                case inst::SPLIT: stack.push_back(prog[pc].y); stack.push_back(prog[pc].x); break;
+                case inst::JMP:   stack.push_back(prog[pc].x); break;
+                case inst::MATCH: list.push_back(pc); return true;
+                default:          list.push_back(pc);
+            }
+        }
+        return false;
+    }
+
+    // steps the threads over a symbol (n_sym for the end of the text) into next, stopping at the first match
+    // returns true if a match before the symbol was reached
+    bool step(const std::vector<int> & list, int32_t sym, std::vector<int> & next, bool & next_match, std::vector<uint8_t> & next_seen) const {
+        for (int pc : list) {
+            const auto & in = prog[pc];
+            switch (in.op) {
+                case inst::CHAR:
+                    {
+                        if (sym < n_sym && member[in.x*n_sym + sym] && !next_match) {
+                            next_match = closure(pc + 1, next, next_seen);
+                        }
+                    } break;
+                case inst::ASSERT:
+                    {
+                        if (sym < n_sym ? member[in.x*n_sym + sym] : sets_at_end[in.x]) {
+                            std::vector<int>     cont;
+                            std::vector<uint8_t> seen(prog.size(), 0);
+                            closure(pc + 1, cont, seen);
+                            if (step(cont, sym, next, next_match, next_seen)) {
+                                return true;
+                            }
+                        }
+                    } break;
+                case inst::MATCH:
+                    return true;
+                default:
+                    assert(false);
+            }
+        }
+        return false;
+    }
+
+    std::unique_ptr<unicode_regex_dfa> compile(const std::string & regex_expr, bool collapsed) {
+        const auto root = unicode_regex_parser(regex_expr, collapsed).parse();
+
+        emit(root);
+        emit(inst::MATCH);
+
+        auto dfa = std::make_unique<unicode_regex_dfa>();
+        dfa->collapsed = collapsed;
+
+        // alphabet
+        for (const auto & set : sets) {
+            for (const auto & range : set) {
+                dfa->bounds.push_back(range.first);
+                dfa->bounds.push_back(range.second + 1);
+            }
+        }
+        std::sort(dfa->bounds.begin(), dfa->bounds.end());
+        dfa->bounds.erase(std::unique(dfa->bounds.begin(), dfa->bounds.end()), dfa->bounds.end());
+        if (dfa->bounds.size() >= UINT16_MAX) {
+            throw std::invalid_argument("regex too large");
+        }
+
+        n_sym = dfa->n_sym = (int32_t) dfa->bounds.size() + 1;
+
+        for (uint32_t cpt = 0; cpt < 128; ++cpt) {
+            dfa->sym_ascii[cpt] = std::upper_bound(dfa->bounds.begin(), dfa->bounds.end(), cpt) - dfa->bounds.begin();
+        }
+        for (uint32_t i = 0; i < 4; ++i) {
+            dfa->sym_collapsed[i] = std::upper_bound(dfa->bounds.begin(), dfa->bounds.end(), 0xD0 + i) - dfa->bounds.begin();
+        }
+
+        member.assign(sets.size()*n_sym, 0);
+        for (size_t i = 0; i < sets.size(); ++i) {
+            for (int32_t s = 0; s < n_sym; ++s) {
+                const uint32_t cpt = s == 0 ? 0 : dfa->bounds[s - 1];
+                for (const auto & range : sets[i]) {
+                    if (range.first <= cpt && cpt <= range.second) {
+                        member[i*n_sym + s] = 1;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // subset construction over the ordered thread lists
+        std::map<std::vector<int>, int32_t> ids;
+        std::vector<std::vector<int>>       states;
+
+        auto add_state = [&](std::vector<int> && list) -> int32_t {
+            auto it = ids.find(list);
+            if (it != ids.end()) {
+                return it->second;
+            }
+            if (states.size() >= MAX_STATES) {
+                throw std::invalid_argument("regex too large");
+            }
+            const int32_t id = (int32_t) states.size();
+            dfa->accept.push_back(!list.empty() && prog[list.back()].op == inst::MATCH);
+            ids.emplace(list, id);
+            states.push_back(std::move(list));
+            return id;
+        };
+
+        add_state({});
+        {
+            std::vector<int>     list;
+            std::vector<uint8_t> seen(prog.size(), 0);
+            closure(0, list, seen);
+            dfa->start = add_state(std::move(list));
+        }
+
+        for (size_t s = 1; s < states.size(); ++s) {
+            dfa->trans.resize((s + 1)*(n_sym + 1), 0);
+            for (int32_t sym = 0; sym <= n_sym; ++sym) {
+                const std::vector<int> list = states[s];
+
+                std::vector<int>     next;
+                std::vector<uint8_t> next_seen(prog.size(), 0);
+                bool                 next_match = false;
+
+                const bool match = step(list, sym, next, next_match, next_seen);
+
+                dfa->trans[s*(n_sym + 1) + sym] = (add_state(std::move(next)) << 1) | (match ? 1 : 0);
+            }
+        }
+        dfa->trans.resize(states.size()*(n_sym + 1), 0);
+
+        return dfa;
+    }
+};
+
+// nullptr if the regex uses constructs that are not supported by the DFA
+// the DFAs are never removed, so the lookups of the regexes that are already compiled only take a shared lock
+static const unicode_regex_dfa * unicode_regex_dfa_get(const std::string & regex_expr, bool collapsed) {
+    static std::shared_mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex_dfa>> cache;
+
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        const auto it = cache.find(regex_expr);
+        if (it != cache.end()) {
+            return it->second.get();
+        }
+    }
+
+    std::unique_ptr<unicode_regex_dfa> dfa;
+    try {
+        dfa = unicode_regex_compiler().compile(regex_expr, collapsed);
+    } catch (const std::invalid_argument &) {
+        // the caller falls back to std::regex
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    // if another thread compiled the regex meanwhile, its DFA is kept
+    return cache.emplace(regex_expr, std::move(dfa)).first->second.get();
+}
+
+static std::vector<size_t> unicode_regex_split_dfa(const std::vector<uint32_t> & cpts, const unicode_regex_dfa & dfa, const std::vector<size_t> & offsets) {
+    std::vector<uint16_t> syms(cpts.size());
+    for (size_t i = 0; i < cpts.size(); ++i) {
+        syms[i] = dfa.sym(cpts[i]);
+    }
+
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t match_end = dfa.match(syms.data(), pos, end);
+            if (match_end == pos) {
+                pos++;
+                continue;
+            }
+            if (pos > prev) {
+                bpe_offsets.emplace_back(pos - prev);
+            }
+            bpe_offsets.emplace_back(match_end - pos);
+            prev = pos = match_end;
+        }
+
+        if (end > prev) {
+            bpe_offsets.emplace_back(end - prev);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -670,47 +1382,10 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
-    // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
-    // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
+    // "collapsed" representation of the text for the std::regex fallback, generated only if needed
     std::string text_collapsed;
-    if (need_collapse) {
-        // collapse all unicode categories
-        text_collapsed.resize(cpts.size());
-
-        for (size_t i = 0; i < cpts.size(); ++i) {
-            // keep single-byte codepoints as is
-            if (cpts[i] < 128) {
-                text_collapsed[i] = cpts[i];
-                continue;
-            }
-
-            const auto flags = unicode_cpt_flags(cpts[i]);
-
-            if (flags.is_whitespace) {
-                //NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
-                //text_collapsed[i] = (char) 0x85;  // <Next Line> as whitespace fallback
-                text_collapsed[i] = (char) 0x0B;    // <vertical tab> as whitespace fallback
-            } else if (k_ucat_cpt.find(flags.category_flag()) != k_ucat_cpt.end()) {
-                text_collapsed[i] = k_ucat_cpt.at(flags.category_flag());
-            } else {
-                text_collapsed[i] = (char) 0xD0; // fallback
-            }
-        }
-    }
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
@@ -723,18 +1398,26 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
-        // fallback to general-purpose std::regex / std::wregex
-        try {
-            // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
-            // with the corresponding collapsed representation
-            bool use_collapsed = false;
-            for (auto & ucat : k_ucat_enum) {
-                if (std::string::npos != regex_expr.find(ucat.first)) {
-                    use_collapsed = true;
-                    break;
-                }
+        // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
+        // with the corresponding collapsed representation
+        bool use_collapsed = false;
+        for (auto & ucat : k_ucat_enum) {
+            if (std::string::npos != regex_expr.find(ucat.first)) {
+                use_collapsed = true;
+                break;
             }
+        }
+
+        // then, see if the regex can be compiled to a DFA
+        const auto * dfa = unicode_regex_dfa_get(regex_expr, use_collapsed);
+
+        if (dfa) {
+            bpe_offsets = unicode_regex_split_dfa(cpts, *dfa, bpe_offsets);
+            continue;
+        }
 
+        // fallback to general-purpose std::regex / std::wregex
+        try {
             if (use_collapsed) {
                 // sanity-check that the original regex does not contain any non-ASCII characters
                 const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
@@ -744,6 +1427,33 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                     }
                 }
 
+                // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
+                // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
+                if (text_collapsed.size() != cpts.size()) {
+                    // collapse all unicode categories
+                    text_collapsed.resize(cpts.size());
+
+                    for (size_t i = 0; i < cpts.size(); ++i) {
+                        // keep single-byte codepoints as is
+                        if (cpts[i] < 128) {
+                            text_collapsed[i] = cpts[i];
+                            continue;
+                        }
+
+                        const auto flags = unicode_cpt_flags(cpts[i]);
+
+                        if (flags.is_whitespace) {
+                            //NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
+                            //text_collapsed[i] = (char) 0x85;  // <Next Line> as whitespace fallback
+                            text_collapsed[i] = (char) 0x0B;    // <vertical tab> as whitespace fallback
+                        } else if (k_ucat_cpt.find(flags.category_flag()) != k_ucat_cpt.end()) {
+                            text_collapsed[i] = k_ucat_cpt.at(flags.category_flag());
+                        } else {
+                            text_collapsed[i] = (char) 0xD0; // fallback
+                        }
+                    }
+                }
+
                 // generate a collapsed representation of the regex
                 std::string regex_expr_collapsed;
 
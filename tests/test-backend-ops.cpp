@@ -100,7 +100,7 @@ static void init_tensor_uniform(ggml_tensor * tensor, float min = -1.0f, float m
             };
 
             const size_t min_blocks_per_thread = 1;
-            const size_t n_threads = std::min<size_t>(std::thread::hardware_concurrency()/2,
+            const size_t n_threads = std::min<size_t>(std::max<size_t>(1, std::thread::hardware_concurrency()/2),
                                                       std::max<size_t>(1, n_blocks / min_blocks_per_thread));
             std::vector<std::future<void>> tasks;
             tasks.reserve(n_threads);
@@ -299,6 +299,53 @@ static bool ggml_is_view_op(enum ggml_op op) {
     return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
 }
 
+// compute the whole graph on backend1, so that the backend can fuse the ops, and each node separately on backend2
+static bool compare_graph_fused(ggml_backend_t backend1, ggml_backend_t backend2, ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data) {
+    struct ggml_backend_graph_copy copy = ggml_backend_graph_copy(backend2, graph);
+    if (copy.buffer == NULL) {
+        return false;
+    }
+
+    ggml_cgraph * g1 = graph;
+    ggml_cgraph * g2 = copy.graph;
+
+    const int n_nodes = ggml_graph_n_nodes(g1);
+
+    ggml_init_params params = {
+        /* .mem_size = */ ggml_graph_overhead_custom(1, false)*n_nodes,
+        /* .mem_base = */ NULL,
+        /* .no_alloc = */ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_backend_graph_compute(backend1, g1);
+
+    for (int i = 0; i < n_nodes; i++) {
+        ggml_cgraph * g2v = ggml_new_graph_custom(ctx, 1, false);
+        ggml_graph_add_node(g2v, ggml_graph_node(g2, i));
+
+        ggml_backend_graph_compute(backend2, g2v);
+    }
+
+    for (int i = 0; i < n_nodes; i++) {
+        ggml_tensor * t1 = ggml_graph_node(g1, i);
+        ggml_tensor * t2 = ggml_graph_node(g2, i);
+
+        if (ggml_is_view_op(t1->op)) {
+            continue;
+        }
+
+        if (!callback(i, t1, t2, user_data)) {
+            break;
+        }
+    }
+
+    ggml_free(ctx);
+    ggml_backend_graph_copy_free(copy);
+
+    return true;
+}
+
 enum test_mode {
     MODE_TEST,
     MODE_PERF,
@@ -370,6 +417,18 @@ struct test_case {
         return 0;
     }
 
+    // compute the whole graph at once on the tested backend, so that it can fuse the ops
+    virtual bool fused() {
+        return false;
+    }
+
+    // the output is also compared with out_ref, computed by other ops in the same graph - the CPU backend checks it too
+    virtual bool has_ref() {
+        return false;
+    }
+
+    ggml_tensor * out_ref = nullptr; // set by build_graph when has_ref()
+
     ggml_cgraph * gf = nullptr;
     ggml_cgraph * gb = nullptr;
 
@@ -477,6 +536,9 @@ struct test_case {
 
         // build graph
         ggml_build_forward_expand(gf, out);
+        if (out_ref) {
+            ggml_build_forward_expand(gf, out_ref);
+        }
 
         // add sentinels as graph nodes so that they are checked in the callback
         for (ggml_tensor * sentinel : sentinels) {
@@ -561,12 +623,26 @@ struct test_case {
             GGML_UNUSED(index);
         };
 
-        const bool cmp_ok = ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
+        const bool cmp_ok = fused() ?
+            compare_graph_fused(backend1, backend2, gf, callback, &ud) :
+            ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
 
         if (!cmp_ok) {
             printf("compare failed ");
         }
 
+        // the graph has been computed on backend1
+        if (out_ref && cmp_ok) {
+            std::vector<float> f_out = tensor_to_float(out);
+            std::vector<float> f_ref = tensor_to_float(out_ref);
+
+            double err = nmse(f_out.data(), f_ref.data(), f_out.size());
+            if (!(err <= ud.max_err)) {
+                printf("[%s] NMSE to the reference = %.9f > %.9f ", ggml_op_desc(out), err, ud.max_err);
+                ud.ok = false;
+            }
+        }
+
         ggml_backend_buffer_free(buf);
 
         ggml_free(ctx);
@@ -2219,6 +2295,167 @@ struct test_rope : public test_case {
     }
 };
 
+// fused ops: GGML_OP_RMS_NORM + GGML_OP_MUL, optionally preceded by GGML_OP_ADD
+struct test_fused_rms_norm : public test_case {
+    const std::array<int64_t, 4> ne;
+    const bool add;
+    const bool mul;
+    const float eps;
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "FUSED";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR4(ne, add, mul, eps);
+    }
+
+    bool fused() override {
+        return true;
+    }
+
+    test_fused_rms_norm(std::array<int64_t, 4> ne = {64, 5, 4, 3}, bool add = true, bool mul = true, float eps = 1e-6f)
+        : ne(ne), add(add), mul(mul), eps(eps) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * x = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(x, "x");
+
+        if (add) {
+            // residual broadcasted over the last dimension
+            ggml_tensor * r = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2], 1);
+            ggml_set_name(r, "r");
+
+            x = ggml_add(ctx, x, r);
+            ggml_set_name(x, "x_r");
+        }
+
+        ggml_tensor * out = ggml_rms_norm(ctx, x, eps);
+
+        if (mul) {
+            ggml_tensor * w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne[0]);
+            ggml_set_name(w, "w");
+
+            out = ggml_mul(ctx, out, w);
+        }
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+};
+
+// fused ops: GGML_OP_UNARY (SILU, GELU) + GGML_OP_MUL
+struct test_fused_unary_mul : public test_case {
+    const ggml_unary_op op;
+    const std::array<int64_t, 4> ne;
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "FUSED";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return std::string("op=") + ggml_unary_op_name(op) + "," + VARS_TO_STR1(ne);
+    }
+
+    bool fused() override {
+        return true;
+    }
+
+    test_fused_unary_mul(ggml_unary_op op, std::array<int64_t, 4> ne = {128, 5, 4, 3})
+        : op(op), ne(ne) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * g = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(g, "g");
+
+        ggml_tensor * u = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(u, "u");
+
+        ggml_tensor * a = ggml_unary(ctx, g, op);
+        ggml_set_name(a, "a");
+
+        // an independent op between the nodes of the fused op
+        u = ggml_scale(ctx, u, 0.5f);
+        ggml_set_name(u, "u_scaled");
+
+        ggml_tensor * out = ggml_mul(ctx, a, u);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+};
+
+// fused ops: GGML_OP_ROPE + GGML_OP_CPY into a KV cache view
+struct test_fused_rope_cpy : public test_case {
+    const ggml_type type_kv;
+    const std::array<int64_t, 3> ne; // head size, number of heads, number of tokens
+    const int mode;
+    const int kv_head;
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "FUSED";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR4(type_kv, ne, mode, kv_head);
+    }
+
+    bool fused() override {
+        return true;
+    }
+
+    test_fused_rope_cpy(ggml_type type_kv = GGML_TYPE_F16, std::array<int64_t, 3> ne = {64, 4, 7}, int mode = 0, int kv_head = 5)
+        : type_kv(type_kv), ne(ne), mode(mode), kv_head(kv_head) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * x = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2]);
+        ggml_set_name(x, "x");
+
+        ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, ne[2]);
+        ggml_set_name(pos, "pos");
+
+        ggml_tensor * kv = ggml_new_tensor_1d(ctx, type_kv, ne[0]*ne[1]*(kv_head + ne[2] + 3));
+        ggml_set_name(kv, "kv");
+
+        ggml_tensor * k = ggml_rope_ext(ctx, x, pos, nullptr, ne[0], mode, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+        ggml_set_name(k, "k");
+        ggml_build_forward_expand(gf, k);
+
+        // an independent op between the nodes of the fused op, like V in the KV store
+        ggml_tensor * v = ggml_scale(ctx, x, 2.0f);
+        ggml_set_name(v, "v");
+        ggml_build_forward_expand(gf, v);
+
+        ggml_tensor * kv_view = ggml_view_1d(ctx, kv, ne[0]*ne[1]*ne[2], ggml_row_size(type_kv, ne[0]*ne[1])*kv_head);
+        ggml_set_name(kv_view, "kv_view");
+
+        ggml_tensor * out = ggml_cpy(ctx, k, kv_view);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->type == GGML_TYPE_I32) {
+                std::vector<int> data(ne[2]);
+                for (int i = 0; i < ne[2]; i++) {
+                    data[i] = kv_head + i;
+                }
+                ggml_backend_tensor_set(t, data.data(), 0, ne[2] * sizeof(int));
+            } else {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+};
+
 // GGML_OP_POOL2D
 struct test_pool2d : public test_case {
     enum ggml_op_pool pool_type;
@@ -2773,6 +3010,69 @@ struct test_flash_attn_ext : public test_case {
     }
 };
 
+// GGML_OP_FLASH_ATTN_EXT over two sets of KV cells (ggml_flash_attn_ext_split)
+// the reference is the attention over the concatenated cells, dequantized to F16
+struct test_flash_attn_ext_split : public test_case {
+    const int64_t hs;  // head size
+    const int64_t nh;  // num heads
+    const int64_t kv0; // kv size of the first set
+    const int64_t kv1; // kv size of the second set
+    const int64_t nb;  // batch size
+
+    const float logit_softcap; // Gemma 2
+
+    const ggml_type type_KV0;
+    const ggml_type type_KV1;
+
+    std::string vars() override {
+        return VARS_TO_STR8(hs, nh, kv0, kv1, nb, logit_softcap, type_KV0, type_KV1);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    bool has_ref() override {
+        return true;
+    }
+
+    test_flash_attn_ext_split(int64_t hs = 128, int64_t nh = 8, int64_t kv0 = 256, int64_t kv1 = 96, int64_t nb = 8,
+                              float logit_softcap = 0.0f, ggml_type type_KV0 = GGML_TYPE_Q8_0, ggml_type type_KV1 = GGML_TYPE_F16)
+        : hs(hs), nh(nh), kv0(kv0), kv1(kv1), nb(nb), logit_softcap(logit_softcap), type_KV0(type_KV0), type_KV1(type_KV1) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hs, nb, nh, 1);
+        ggml_set_name(q, "q");
+
+        ggml_tensor * k0 = ggml_new_tensor_4d(ctx, type_KV0, hs, kv0, nh, 1);
+        ggml_set_name(k0, "k0");
+
+        ggml_tensor * v0 = ggml_new_tensor_4d(ctx, type_KV0, hs, kv0, nh, 1);
+        ggml_set_name(v0, "v0");
+
+        ggml_tensor * k1 = ggml_new_tensor_4d(ctx, type_KV1, hs, kv1, nh, 1);
+        ggml_set_name(k1, "k1");
+
+        ggml_tensor * v1 = ggml_new_tensor_4d(ctx, type_KV1, hs, kv1, nh, 1);
+        ggml_set_name(v1, "v1");
+
+        ggml_tensor * m = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kv0 + kv1, GGML_PAD(nb, GGML_KQ_MASK_PAD), 1, 1);
+        ggml_set_name(m, "m");
+
+        ggml_tensor * out = ggml_flash_attn_ext_split(ctx, q, k0, v0, k1, v1, m, 1.0f/sqrtf(hs), 0.0f, logit_softcap);
+        ggml_set_name(out, "out");
+
+        auto concat_f16 = [&](ggml_tensor * a, ggml_tensor * b) {
+            return ggml_cast(ctx, ggml_concat(ctx, ggml_cast(ctx, a, GGML_TYPE_F32), ggml_cast(ctx, b, GGML_TYPE_F32), 1), GGML_TYPE_F16);
+        };
+
+        out_ref = ggml_flash_attn_ext(ctx, q, concat_f16(k0, k1), concat_f16(v0, v1), m, 1.0f/sqrtf(hs), 0.0f, logit_softcap);
+        ggml_set_name(out_ref, "out_ref");
+
+        return out;
+    }
+};
+
 // GGML_OP_CROSS_ENTROPY_LOSS
 struct test_cross_entropy_loss : public test_case {
     const ggml_type type;
@@ -3756,6 +4056,33 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    for (int hs : { 64, 128, }) {
+        for (float logit_softcap : {0.0f, 10.0f}) {
+            for (int64_t kv1 : { 1, 96, }) {
+                for (int nb : { 1, 8, 35, }) {
+                    for (ggml_type type_KV0 : {GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+                        test_cases.emplace_back(new test_flash_attn_ext_split(hs, 8, 256, kv1, nb, logit_softcap, type_KV0, GGML_TYPE_F16));
+                    }
+                }
+            }
+        }
+    }
+
+    for (bool add : { false, true }) {
+        for (bool mul : { false, true }) {
+            test_cases.emplace_back(new test_fused_rms_norm({64, 5, 4, 3}, add, mul));
+        }
+    }
+    test_cases.emplace_back(new test_fused_rms_norm({4096, 3, 1, 1}));
+    for (ggml_unary_op op : { GGML_UNARY_OP_SILU, GGML_UNARY_OP_GELU }) {
+        test_cases.emplace_back(new test_fused_unary_mul(op));
+    }
+    for (ggml_type type_kv : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        for (int mode : { 0, 2 }) {
+            test_cases.emplace_back(new test_fused_rope_cpy(type_kv, {64, 4, 7}, mode));
+        }
+    }
+
     test_cases.emplace_back(new test_cross_entropy_loss());
     for (float wd : {0.0f, 1e-2f}) {
         test_cases.emplace_back(new test_opt_step_adamw(GGML_TYPE_F32, {10, 5, 4, 3}, 1.0f, 1e-3f, 0.9f, 0.999f, wd));
@@ -3795,6 +4122,12 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         auto test_cases = make_test_cases_eval();
         ggml_backend_t backend_cpu = ggml_backend_cpu_init();
 
+        if (ggml_backend_is_cpu(backend)) {
+            // only the fused ops and the ops with a reference compare the CPU backend with something else than itself
+            test_cases.erase(std::remove_if(test_cases.begin(), test_cases.end(),
+                        [](const std::unique_ptr<test_case> & tc) { return !tc->fused() && !tc->has_ref(); }), test_cases.end());
+        }
+
         size_t n_ok = 0;
         for (auto & test : test_cases) {
             if (test->eval(backend, backend_cpu, op_name)) {
@@ -3835,7 +4168,7 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
 static void usage(char ** argv) {
     printf("Usage: %s [mode] [-o op] [-b backend]\n", argv[0]);
     printf("    valid modes:\n");
-    printf("      - test (default, compare with CPU backend for correctness)\n");
+    printf("      - test (default, compare with CPU backend for correctness, the fused ops of the CPU backend are compared with the separate ops and the ops with a reference with it)\n");
     printf("      - grad (compare gradients from backpropagation with method of finite differences)\n");
     printf("      - perf (performance evaluation)\n");
     printf("    op names for -o are as given by ggml_op_desc() (e.g. ADD, MUL_MAT, etc)\n");
@@ -3892,7 +4225,7 @@ int main(int argc, char ** argv) {
         ggml_backend_t backend = ggml_backend_dev_init(dev, NULL);
         GGML_ASSERT(backend != NULL);
 
-        if (backend_filter == NULL && ggml_backend_is_cpu(backend) && mode != MODE_GRAD) {
+        if (backend_filter == NULL && ggml_backend_is_cpu(backend) && mode == MODE_PERF) {
             printf("  Skipping CPU backend\n");
             ggml_backend_free(backend);
             n_ok++;
@@ -0,0 +1,122 @@
+// tests the asynchronous decode against llama_decode on a real model
+// the model is passed as the first argument (or via LLAMACPP_TEST_MODELFILE)
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static llama_batch make_batch(const std::vector<llama_token> & tokens, llama_pos pos0) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        common_batch_add(batch, tokens[i], pos0 + i, { 0 }, i == tokens.size() - 1);
+    }
+
+    return batch;
+}
+
+static std::vector<float> get_logits(llama_context * ctx) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+
+    return std::vector<float>(logits, logits + n_vocab);
+}
+
+int main(int argc, char ** argv) {
+    char * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+
+    llama_model * model = llama_load_model_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx_sync  = llama_new_context_with_model(model, cparams);
+    llama_context * ctx_async = llama_new_context_with_model(model, cparams);
+
+    GGML_ASSERT(ctx_sync != nullptr && ctx_async != nullptr);
+
+    // nothing was submitted
+    GGML_ASSERT(llama_decode_poll(ctx_async));
+    GGML_ASSERT(llama_decode_wait(ctx_async) == 0);
+
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<llama_token> prompt(32);
+    for (size_t i = 0; i < prompt.size(); ++i) {
+        prompt[i] = 1 + (i*7) % (n_vocab - 1);
+    }
+
+    llama_batch batch = make_batch(prompt, 0);
+
+    GGML_ASSERT(llama_decode(ctx_sync, batch) == 0);
+    GGML_ASSERT(llama_decode_async(ctx_async, batch) == 0);
+
+    // the batch is copied - it can be reused while it is decoded
+    llama_batch_free(batch);
+
+    GGML_ASSERT(llama_decode_wait(ctx_async) == 0);
+
+    // waiting twice is harmless
+    GGML_ASSERT(llama_decode_wait(ctx_async) == 0);
+
+    const auto logits_0 = get_logits(ctx_sync);
+    GGML_ASSERT(get_logits(ctx_async) == logits_0);
+
+    // generate a few tokens, each one decoded asynchronously while the outputs of the previous one are read
+    llama_pos pos = prompt.size();
+
+    auto logits_prev = logits_0;
+
+    for (int i = 0; i < 8; ++i) {
+        const llama_token token = 1 + (i*13) % (n_vocab - 1);
+
+        batch = make_batch({ token }, pos++);
+
+        GGML_ASSERT(llama_decode(ctx_sync, batch) == 0);
+        GGML_ASSERT(llama_decode_async(ctx_async, batch) == 0);
+
+        // only one batch can be in flight
+        GGML_ASSERT(llama_decode_async(ctx_async, batch) < 0);
+
+        llama_batch_free(batch);
+
+        // the outputs of the previous batch stay current until the wait
+        GGML_ASSERT(get_logits(ctx_async) == logits_prev);
+
+        while (!llama_decode_poll(ctx_async)) {
+            std::this_thread::yield();
+        }
+
+        GGML_ASSERT(get_logits(ctx_async) == logits_prev);
+
+        GGML_ASSERT(llama_decode_wait(ctx_async) == 0);
+
+        logits_prev = get_logits(ctx_sync);
+
+        GGML_ASSERT(get_logits(ctx_async) == logits_prev);
+    }
+
+    llama_free(ctx_async);
+    llama_free(ctx_sync);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
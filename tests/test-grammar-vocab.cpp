@@ -0,0 +1,149 @@
+#include "ggml.h"
+#include "llama.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// JSON grammar from grammars/json.gbnf, with leading whitespace allowed for the SPM tokenizers
+static const char * json_grammar = R"""(
+root   ::= ws object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\\x7F\x00-\x1F] |
+    "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) # escapes
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+
+# Optional space: by convention, applied in this grammar after literal chars when allowed
+ws ::= | " " | "\n" [ \t]{0,20}
+)""";
+
+static const char * json_text = R"""({"name": "llama.cpp", "tags": ["inference", "gguf", "日本語"], "stars": 65000, "ratio": -1.5e3,
+  "nested": {"ok": true, "missing": null, "list": [1, 2, 3, {"a": "b\n\"c\""}]}, "name2": "llama.cpp", "stars2": 65000})""";
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_model * model;
+
+    llama_backend_init();
+
+    // load the vocab
+    {
+        auto mparams = llama_model_default_params();
+
+        mparams.vocab_only = true;
+
+        model = llama_load_model_from_file(fname.c_str(), mparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+    }
+
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<llama_token> tokens(strlen(json_text) + 16);
+    const int n_tokens = llama_tokenize(model, json_text, strlen(json_text), tokens.data(), tokens.size(), false, false);
+    GGML_ASSERT(n_tokens > 0);
+    tokens.resize(n_tokens);
+
+    // the grammars compiled from the same text are cached, so the second init only allocates the stacks
+    {
+        const int64_t t_start = ggml_time_us();
+        llama_sampler_free(llama_sampler_init_grammar(model, json_grammar, "root"));
+        const int64_t t_mid = ggml_time_us();
+        llama_sampler_free(llama_sampler_init_grammar(model, json_grammar, "root"));
+        const int64_t t_end = ggml_time_us();
+
+        printf("%s: grammar init: %8.3f us, cached: %8.3f us\n", __func__, (float) (t_mid - t_start), (float) (t_end - t_mid));
+    }
+
+    // smpl sees the full vocabulary at every step and goes through the token trie and the mask cache
+    // smpl_ref only sees one candidate at a time, which is always matched on its own
+    // (its text differs, so that it does not share the masks of smpl)
+    llama_sampler * smpl     = llama_sampler_init_grammar(model, json_grammar, "root");
+    llama_sampler * smpl_ref = llama_sampler_init_grammar(model, (std::string(json_grammar) + "\n").c_str(), "root");
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    int64_t t_total = 0;
+    int64_t t_max   = 0;
+    int     n_diff  = 0;
+
+    for (int i = 0; i < n_tokens; ++i) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur[id] = llama_token_data{ id, 0.0f, 0.0f };
+        }
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+        const int64_t t_start = ggml_time_us();
+        llama_sampler_apply(smpl, &cur_p);
+        const int64_t t_apply = ggml_time_us() - t_start;
+
+        t_total += t_apply;
+        t_max    = std::max(t_max, t_apply);
+
+        GGML_ASSERT(std::isfinite(cur[tokens[i]].logit) && "the grammar rejected a token of a valid JSON text");
+
+        // compare with matching the candidates one by one on a sample of the vocabulary
+        for (llama_token id = i % 7; id < n_vocab; id += 7) {
+            llama_token_data       single   = { id, 0.0f, 0.0f };
+            llama_token_data_array single_p = { &single, 1, -1, false };
+
+            llama_sampler_apply(smpl_ref, &single_p);
+
+            if (std::isfinite(single.logit) != std::isfinite(cur[id].logit)) {
+                fprintf(stderr, "%s: error: token %d at step %d: allowed = %d, expected %d\n", __func__,
+                        id, i, std::isfinite(cur[id].logit), std::isfinite(single.logit));
+                n_diff++;
+            }
+        }
+
+        llama_sampler_accept(smpl,     tokens[i]);
+        llama_sampler_accept(smpl_ref, tokens[i]);
+    }
+
+    printf("%s: n_vocab = %d, n_tokens = %d, grammar overhead: %8.3f us/token (max %8.3f us)\n",
+            __func__, n_vocab, n_tokens, t_total / (float) n_tokens, (float) t_max);
+
+    llama_sampler_free(smpl);
+    llama_sampler_free(smpl_ref);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return n_diff == 0 ? 0 : 2;
+}
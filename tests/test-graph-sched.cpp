@@ -0,0 +1,290 @@
+// Check that the graph scheduling of the CPU backend computes the same results as the lockstep execution
+// (a barrier after each node) and measure the speed of both on a small llama-like graph
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+struct graph_params {
+    int n_layer   = 4;
+    int n_embd    = 256;
+    int n_head    = 4;
+    int n_ff      = 512;
+    int n_tokens  = 2;
+};
+
+// a few decoder layers with attention over the tokens of the batch and a gated FFN
+static ggml_tensor * build_graph(ggml_context * ctx, ggml_cgraph * gf, const graph_params & hp, std::vector<ggml_tensor *> & inputs) {
+    const int n_embd_head = hp.n_embd/hp.n_head;
+
+    auto weight = [&](int ne0, int ne1) {
+        ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        inputs.push_back(t);
+        return t;
+    };
+
+    ggml_tensor * x   = weight(hp.n_embd, hp.n_tokens);
+    ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, hp.n_tokens);
+
+    for (int i = 0; i < hp.n_tokens; i++) {
+        ((int32_t *) pos->data)[i] = i;
+    }
+
+    for (int il = 0; il < hp.n_layer; il++) {
+        ggml_tensor * cur = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), weight(hp.n_embd, 1));
+
+        ggml_tensor * q = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, weight(hp.n_embd, hp.n_embd), cur), n_embd_head, hp.n_head, hp.n_tokens);
+        ggml_tensor * k = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, weight(hp.n_embd, hp.n_embd), cur), n_embd_head, hp.n_head, hp.n_tokens);
+        ggml_tensor * v = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, weight(hp.n_embd, hp.n_embd), cur), n_embd_head, hp.n_head, hp.n_tokens);
+
+        q = ggml_rope(ctx, q, pos, n_embd_head, 0);
+        k = ggml_rope(ctx, k, pos, n_embd_head, 0);
+
+        ggml_tensor * kq = ggml_mul_mat(ctx, ggml_permute(ctx, k, 0, 2, 1, 3), ggml_permute(ctx, q, 0, 2, 1, 3));
+        kq = ggml_soft_max_ext(ctx, kq, nullptr, 1.0f/sqrtf(float(n_embd_head)), 0.0f);
+
+        ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_permute(ctx, v, 1, 2, 0, 3)), kq);
+        cur = ggml_cont_2d(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3), hp.n_embd, hp.n_tokens);
+
+        x = ggml_add(ctx, x, ggml_mul_mat(ctx, weight(hp.n_embd, hp.n_embd), cur));
+
+        cur = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), weight(hp.n_embd, 1));
+
+        ggml_tensor * g = ggml_mul_mat(ctx, weight(hp.n_embd, hp.n_ff), cur);
+        ggml_tensor * u = ggml_mul_mat(ctx, weight(hp.n_embd, hp.n_ff), cur);
+
+        cur = ggml_mul(ctx, ggml_silu(ctx, g), u);
+
+        x = ggml_add(ctx, x, ggml_mul_mat(ctx, weight(hp.n_ff, hp.n_embd), cur));
+    }
+
+    x = ggml_scale(ctx, ggml_rms_norm(ctx, x, 1e-5f), 0.5f);
+
+    ggml_build_forward_expand(gf, x);
+
+    return x;
+}
+
+struct graph_runner {
+    ggml_threadpool    * threadpool = nullptr;
+    ggml_cplan           cplan;
+    std::vector<uint8_t> work_data;
+
+    graph_runner(ggml_cgraph * gf, int n_threads, bool lockstep) {
+        ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+        threadpool = ggml_threadpool_new(&tpp);
+        assert(threadpool);
+
+        cplan = ggml_graph_plan(gf, n_threads, threadpool);
+        cplan.lockstep = lockstep;
+
+        work_data.resize(cplan.work_size);
+        cplan.work_data = work_data.data();
+    }
+
+    ~graph_runner() {
+        ggml_threadpool_free(threadpool);
+    }
+
+    ggml_status compute(ggml_cgraph * gf) {
+        return ggml_graph_compute(gf, &cplan);
+    }
+};
+
+static std::vector<float> get_output(const ggml_tensor * out) {
+    std::vector<float> res(ggml_nelements(out));
+    memcpy(res.data(), out->data, ggml_nbytes(out));
+    return res;
+}
+
+static bool abort_after_n_calls(void * data) {
+    int * n_calls = (int *) data;
+    return --(*n_calls) < 0;
+}
+
+// check the results of the graph scheduling against a single thread and measure the speed
+static void test_graph(const graph_params & hp, const std::vector<int> & n_threads_bench, int n_rounds) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 256*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+    ggml_cgraph  * gf  = ggml_new_graph(ctx);
+
+    std::vector<ggml_tensor *> inputs;
+
+    ggml_tensor * out = build_graph(ctx, gf, hp, inputs);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+
+    for (ggml_tensor * t : inputs) {
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            data[i] = dist(rng);
+        }
+    }
+
+    // reference: single thread
+    std::vector<float> ref;
+    {
+        graph_runner runner(gf, 1, true);
+        assert(runner.compute(gf) == GGML_STATUS_SUCCESS);
+        ref = get_output(out);
+    }
+
+    // the rows are computed by the same kernels in both modes, so the results must be bit-identical
+    for (int n_threads : { 1, 2, 3, 4 }) {
+        for (bool lockstep : { true, false }) {
+            graph_runner runner(gf, n_threads, lockstep);
+
+            for (int i = 0; i < 3; i++) {
+                memset(out->data, 0, ggml_nbytes(out));
+                assert(runner.compute(gf) == GGML_STATUS_SUCCESS);
+                assert(get_output(out) == ref);
+            }
+        }
+    }
+
+    // all threads must stop at the same barrier when the computation is aborted
+    for (int n_threads : { 1, 4 }) {
+        graph_runner runner(gf, n_threads, false);
+
+        for (int n_calls : { 0, 1, 5 }) {
+            runner.cplan.abort_callback      = abort_after_n_calls;
+            runner.cplan.abort_callback_data = &n_calls;
+            assert(runner.compute(gf) == GGML_STATUS_ABORTED);
+        }
+
+        runner.cplan.abort_callback = nullptr;
+        assert(runner.compute(gf) == GGML_STATUS_SUCCESS);
+        assert(get_output(out) == ref);
+    }
+
+    printf("graph: n_nodes = %d, n_tokens = %d\n", ggml_graph_n_nodes(gf), hp.n_tokens);
+
+    const int n_cpu = (int) std::thread::hardware_concurrency();
+
+    for (int n_threads : n_threads_bench) {
+        // the threads spin at the barriers, with more threads than cores the timings are meaningless
+        if (n_threads > n_cpu) {
+            printf("n_threads = %2d: skipped, only %d cores available\n", n_threads, n_cpu);
+            continue;
+        }
+
+        double t_us[2];
+
+        for (bool lockstep : { true, false }) {
+            graph_runner runner(gf, n_threads, lockstep);
+
+            runner.compute(gf); // warmup
+
+            const auto t0 = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < n_rounds; i++) {
+                runner.compute(gf);
+            }
+            const auto t1 = std::chrono::high_resolution_clock::now();
+
+            t_us[lockstep ? 0 : 1] = std::chrono::duration<double, std::micro>(t1 - t0).count()/n_rounds;
+
+            assert(get_output(out) == ref);
+        }
+
+        printf("n_threads = %2d: lockstep = %8.1f us, sched = %8.1f us, speedup = %5.2fx\n",
+                n_threads, t_us[0], t_us[1], t_us[0]/t_us[1]);
+    }
+
+    ggml_free(ctx);
+}
+
+// moves of row blocks like the KV cache defragmentation: view, view and cpy per move, all independent, so the
+// chunks of nodes that are more than 128 nodes apart are computed between the same two barriers
+static void test_moves(int n_moves) {
+    const int n_embd   = 64;
+    const int n_rows   = 16; // enough rows for the copies to be split in chunks
+    const int n_rows_t = n_rows*n_moves;
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+    ggml_cgraph  * gf  = ggml_new_graph_custom(ctx, 4*n_moves, false);
+
+    ggml_tensor * src = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_rows_t);
+    ggml_tensor * dst = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_rows_t);
+
+    for (int64_t i = 0; i < ggml_nelements(src); i++) {
+        ((float *) src->data)[i] = (float) i;
+    }
+
+    // a permutation of the blocks
+    std::vector<int> perm(n_moves);
+    for (int m = 0; m < n_moves; m++) {
+        perm[m] = (m*37 + 11) % n_moves;
+    }
+
+    for (int m = 0; m < n_moves; m++) {
+        ggml_tensor * view_src = ggml_view_2d(ctx, src, n_embd, n_rows, src->nb[1], m*n_rows*src->nb[1]);
+        ggml_tensor * view_dst = ggml_view_2d(ctx, dst, n_embd, n_rows, dst->nb[1], perm[m]*n_rows*dst->nb[1]);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, view_src, view_dst));
+    }
+
+    std::vector<float> ref(ggml_nelements(dst));
+    for (int m = 0; m < n_moves; m++) {
+        memcpy(ref.data() + (size_t) perm[m]*n_rows*n_embd, (const float *) src->data + (size_t) m*n_rows*n_embd, n_rows*n_embd*sizeof(float));
+    }
+
+    for (int n_threads : { 2, 3, 4 }) {
+        graph_runner runner(gf, n_threads, false);
+
+        for (int i = 0; i < 10; i++) {
+            memset(dst->data, 0, ggml_nbytes(dst));
+            assert(runner.compute(gf) == GGML_STATUS_SUCCESS);
+            assert(get_output(dst) == ref);
+        }
+    }
+
+    printf("moves: n_moves = %d, n_nodes = %d\n", n_moves, ggml_graph_n_nodes(gf));
+
+    ggml_free(ctx);
+}
+
+int main(int argc, char ** argv) {
+    std::vector<int> n_threads_bench = { 8, 32, 64 };
+    int n_rounds = 20;
+
+    if (argc > 1) {
+        n_threads_bench = { std::atoi(argv[1]) };
+    }
+
+    if (argc > 2) {
+        n_rounds = std::atoi(argv[2]);
+    }
+
+    // decode: the barriers dominate
+    graph_params hp;
+    test_graph(hp, n_threads_bench, n_rounds);
+
+    // prompt processing: the rows of the simple ops are split in chunks
+    hp.n_tokens = 64;
+    test_graph(hp, n_threads_bench, n_rounds);
+
+    test_moves(100);
+
+    return 0;
+}
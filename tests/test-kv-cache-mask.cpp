@@ -0,0 +1,231 @@
+// Check the KQ mask built from the KV cells against a naive per-cell implementation
+// run with "perf" to also compare the speed of both
+
+#include "llama.h"
+#include "llama-kv-cells.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+// reference: the per-cell loop that used to live in llama_set_inputs, with std::set sequence membership
+static void build_mask_ref(
+        const std::vector<llama_pos> & cell_pos,
+        const std::vector<std::set<llama_seq_id>> & cell_seq,
+        int64_t n_seqs, int64_t n_seq_tokens,
+        const llama_seq_id * seq_ids, const llama_pos * pos,
+        bool use_alibi, uint32_t n_swa, float * data, float * data_swa) {
+    const int64_t n_kv = cell_pos.size();
+
+    for (int64_t s = 0; s < n_seqs; ++s) {
+        const llama_seq_id seq_id = seq_ids[s];
+
+        for (int64_t j = 0; j < n_seq_tokens; ++j) {
+            const llama_pos p = pos[s*n_seq_tokens + j];
+
+            for (int64_t i = 0; i < n_kv; ++i) {
+                float f;
+                if (!cell_seq[i].count(seq_id) || cell_pos[i] > p) {
+                    f = -INFINITY;
+                } else {
+                    f = use_alibi ? -std::abs(cell_pos[i] - p) : 0.0f;
+                }
+
+                data[(s*n_seq_tokens + j)*n_kv + i] = f;
+
+                if (data_swa) {
+                    if (p - cell_pos[i] >= (int32_t) n_swa) {
+                        f = -INFINITY;
+                    }
+                    data_swa[(s*n_seq_tokens + j)*n_kv + i] = f;
+                }
+            }
+        }
+    }
+}
+
+struct mask_case {
+    std::vector<llama_kv_cell>              cells;
+    std::vector<llama_pos>                  cell_pos;
+    std::vector<std::set<llama_seq_id>>     cell_seq;
+    std::vector<llama_seq_id>               seq_ids;
+    std::vector<llama_pos>                  pos;
+};
+
+// n_kv cells shared by n_seq_max sequences, some cells belong to several sequences and some are empty
+static mask_case make_case(std::mt19937 & rng, int64_t n_kv, int n_seq_max, int64_t n_seqs, int64_t n_seq_tokens) {
+    mask_case mc;
+
+    mc.cells.resize(n_kv);
+    mc.cell_pos.resize(n_kv);
+    mc.cell_seq.resize(n_kv);
+
+    std::uniform_int_distribution<int> dseq(0, n_seq_max - 1);
+    std::uniform_int_distribution<int> dpos(0, (int) (n_kv/n_seq_max) + 16);
+    std::uniform_int_distribution<int> dkind(0, 9);
+
+    for (int64_t i = 0; i < n_kv; ++i) {
+        const int kind = dkind(rng);
+        if (kind == 0) {
+            continue; // empty cell
+        }
+
+        const llama_pos p = dpos(rng);
+        mc.cells[i].pos = p;
+        mc.cell_pos[i]  = p;
+
+        const int n_seq_cell = kind == 1 ? 3 : 1; // shared prefix cells
+        for (int k = 0; k < n_seq_cell; ++k) {
+            const llama_seq_id id = dseq(rng);
+            mc.cells[i].seq_id.set(id);
+            mc.cell_seq[i].insert(id);
+        }
+    }
+
+    // empty cells have pos -1 and no sequence in both representations
+    for (int64_t i = 0; i < n_kv; ++i) {
+        if (mc.cell_seq[i].empty()) {
+            mc.cell_pos[i] = -1;
+        }
+    }
+
+    mc.seq_ids.resize(n_seqs);
+    mc.pos.resize(n_seqs*n_seq_tokens);
+
+    for (int64_t s = 0; s < n_seqs; ++s) {
+        mc.seq_ids[s] = dseq(rng);
+        const llama_pos p0 = dpos(rng);
+        for (int64_t j = 0; j < n_seq_tokens; ++j) {
+            mc.pos[s*n_seq_tokens + j] = p0 + j;
+        }
+    }
+
+    return mc;
+}
+
+static void test_correctness(std::mt19937 & rng) {
+    for (bool use_alibi : { false, true }) {
+        for (uint32_t n_swa : { 0u, 7u }) {
+            for (int64_t n_seqs : { 1, 4, 16 }) {
+                for (int64_t n_seq_tokens : { 1, 5 }) {
+                    const int64_t n_kv = 512;
+
+                    mask_case mc = make_case(rng, n_kv, 8, n_seqs, n_seq_tokens);
+
+                    const int64_t n = n_seqs*n_seq_tokens*n_kv;
+
+                    std::vector<float> ref(n), ref_swa(n), out(n), out_swa(n);
+
+                    build_mask_ref(mc.cell_pos, mc.cell_seq, n_seqs, n_seq_tokens, mc.seq_ids.data(), mc.pos.data(),
+                            use_alibi, n_swa, ref.data(), n_swa ? ref_swa.data() : nullptr);
+
+                    llama_kv_cells_build_mask(mc.cells.data(), n_kv, n_seqs, n_seq_tokens, mc.seq_ids.data(), mc.pos.data(),
+                            use_alibi, n_swa, out.data(), n_swa ? out_swa.data() : nullptr);
+
+                    for (int64_t i = 0; i < n; ++i) {
+                        assert(ref[i] == out[i]);
+                        if (n_swa) {
+                            assert(ref_swa[i] == out_swa[i]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // the masks of two caches share the rows: the rows of the second mask start after the columns of the first
+    {
+        const int64_t n_kv0 = 96;
+        const int64_t n_kv1 = 160;
+        const int64_t n_seqs = 4;
+        const int64_t n_seq_tokens = 3;
+        const int64_t ld = n_kv0 + n_kv1;
+
+        mask_case mc0 = make_case(rng, n_kv0, 8, n_seqs, n_seq_tokens);
+        mask_case mc1 = make_case(rng, n_kv1, 8, n_seqs, n_seq_tokens);
+
+        std::vector<float> ref0(n_seqs*n_seq_tokens*n_kv0), ref1(n_seqs*n_seq_tokens*n_kv1), out(n_seqs*n_seq_tokens*ld);
+
+        build_mask_ref(mc0.cell_pos, mc0.cell_seq, n_seqs, n_seq_tokens, mc0.seq_ids.data(), mc0.pos.data(), false, 0, ref0.data(), nullptr);
+        build_mask_ref(mc1.cell_pos, mc1.cell_seq, n_seqs, n_seq_tokens, mc0.seq_ids.data(), mc0.pos.data(), false, 0, ref1.data(), nullptr);
+
+        llama_kv_cells_build_mask(mc0.cells.data(), n_kv0, n_seqs, n_seq_tokens, mc0.seq_ids.data(), mc0.pos.data(),
+                false, 0, out.data(), nullptr, ld);
+        llama_kv_cells_build_mask(mc1.cells.data(), n_kv1, n_seqs, n_seq_tokens, mc0.seq_ids.data(), mc0.pos.data(),
+                false, 0, out.data() + n_kv0, nullptr, ld);
+
+        for (int64_t r = 0; r < n_seqs*n_seq_tokens; ++r) {
+            for (int64_t i = 0; i < n_kv0; ++i) {
+                assert(out[r*ld + i] == ref0[r*n_kv0 + i]);
+            }
+            for (int64_t i = 0; i < n_kv1; ++i) {
+                assert(out[r*ld + n_kv0 + i] == ref1[r*n_kv1 + i]);
+            }
+        }
+    }
+
+    // out of range sequence ids never match a cell
+    llama_kv_cell cell;
+    cell.pos = 0;
+    cell.seq_id.set(0);
+    assert( cell.has_seq_id(0));
+    assert(!cell.has_seq_id(-1));
+    assert(!cell.has_seq_id(LLAMA_MAX_PARALLEL_SEQUENCES));
+}
+
+static void bench(std::mt19937 & rng, int64_t n_kv, int n_seq_max) {
+    const int64_t n_seqs       = n_seq_max; // one decoded token per sequence
+    const int64_t n_seq_tokens = 1;
+
+    mask_case mc = make_case(rng, n_kv, n_seq_max, n_seqs, n_seq_tokens);
+
+    std::vector<float> out(n_seqs*n_seq_tokens*n_kv);
+
+    const int n_iter = 4;
+
+    auto bench_one = [&](auto && fn) {
+        fn(); // warmup
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < n_iter; ++it) {
+            fn();
+        }
+        const auto t1 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::micro>(t1 - t0).count()/n_iter;
+    };
+
+    const double t_ref = bench_one([&]() {
+        build_mask_ref(mc.cell_pos, mc.cell_seq, n_seqs, n_seq_tokens, mc.seq_ids.data(), mc.pos.data(),
+                false, 0, out.data(), nullptr);
+    });
+
+    const double t_new = bench_one([&]() {
+        llama_kv_cells_build_mask(mc.cells.data(), n_kv, n_seqs, n_seq_tokens, mc.seq_ids.data(), mc.pos.data(),
+                false, 0, out.data(), nullptr);
+    });
+
+    printf("n_kv = %7" PRId64 ", n_seqs = %3d: ref = %10.1f us, bitset = %10.1f us, speedup = %5.2fx\n",
+            n_kv, n_seq_max, t_ref, t_new, t_ref/t_new);
+}
+
+int main(int argc, char ** argv) {
+    std::mt19937 rng(42);
+
+    test_correctness(rng);
+
+    if (argc < 2 || std::string(argv[1]) != "perf") {
+        return 0;
+    }
+
+    for (int64_t n_kv : { 4096, 16384, 65536 }) {
+        bench(rng, n_kv, 64);
+    }
+
+    return 0;
+}
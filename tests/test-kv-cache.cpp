@@ -0,0 +1,457 @@
+// tests the sequence operations of the KV cache on a real model
+// the model is passed as the first argument (or via LLAMACPP_TEST_MODELFILE)
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static void decode(llama_context * ctx, const std::vector<llama_token> & tokens, llama_pos pos0, llama_seq_id seq_id) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        common_batch_add(batch, tokens[i], pos0 + i, { seq_id }, i == tokens.size() - 1);
+    }
+
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+    llama_batch_free(batch);
+}
+
+// the logits of the next token of seq_id at pos - the token is removed from the cache afterwards
+static std::vector<float> probe(llama_context * ctx, llama_token token, llama_pos pos, llama_seq_id seq_id) {
+    decode(ctx, { token }, pos, seq_id);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+
+    std::vector<float> result(logits, logits + n_vocab);
+
+    llama_kv_cache_seq_rm(ctx, seq_id, pos, -1);
+
+    return result;
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    GGML_ASSERT(a.size() == b.size());
+
+    float result = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        result = std::max(result, std::fabs(a[i] - b[i]));
+    }
+
+    return result;
+}
+
+// relative to the largest logit of a
+static float max_rel_diff(const float * a, const float * b, int n) {
+    float range = 0.0f;
+    float diff  = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        range = std::max(range, std::fabs(a[i]));
+        diff  = std::max(diff,  std::fabs(a[i] - b[i]));
+    }
+
+    return diff/range;
+}
+
+static float max_rel_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    GGML_ASSERT(a.size() == b.size());
+
+    return max_rel_diff(a.data(), b.data(), a.size());
+}
+
+// the logits can differ slightly when the number of cells in the KV view changes
+static const float logits_eps = 1e-4f;
+
+// relative - the rotated keys are stored in F16, so the RoPE of the tokens does not commute exactly with the shifts
+static const float stream_eps = 1e-2f;
+
+static std::vector<llama_token> make_prompt(const llama_model * model, int n) {
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<llama_token> result(n);
+    for (int i = 0; i < n; ++i) {
+        result[i] = 1 + (i*7) % (n_vocab - 1);
+    }
+
+    return result;
+}
+
+// copy-on-write: a copied sequence shares the cells of the original until one of them modifies them
+static void test_cow(llama_model * model) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = 2;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx != nullptr);
+
+    const int n_prompt = 32;
+    const auto prompt = make_prompt(model, n_prompt);
+
+    decode(ctx, prompt, 0, 0);
+
+    const auto ref = probe(ctx, prompt[1], n_prompt, 0);
+
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prompt);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 0) == 0);
+
+    // the copy shares all cells and does not use any new one
+    llama_kv_cache_seq_cp(ctx, 0, 1, -1, -1);
+
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prompt);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 0) == n_prompt);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 1) == n_prompt);
+    GGML_ASSERT(llama_kv_cache_seq_pos_max(ctx, 1) == n_prompt - 1);
+
+    // both sequences see the same keys and values
+    GGML_ASSERT(max_diff(ref, probe(ctx, prompt[1], n_prompt, 1)) == 0.0f);
+
+    // appending to the copy does not touch the shared cells
+    decode(ctx, { prompt[2], prompt[3] }, n_prompt, 1);
+
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prompt + 2);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 0) == n_prompt);
+    GGML_ASSERT(max_diff(ref, probe(ctx, prompt[1], n_prompt, 0)) < logits_eps);
+
+    // shifting the copy detaches its cells (the keys are rotated on the next update)
+    llama_kv_cache_seq_rm (ctx, 1, 0, n_prompt/2);
+    llama_kv_cache_seq_add(ctx, 1, n_prompt/2, -1, -n_prompt/2);
+    llama_kv_cache_update (ctx);
+
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 0) == 0);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 1) == 0);
+    GGML_ASSERT(llama_kv_cache_seq_pos_max(ctx, 1) == n_prompt/2 + 1);
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prompt + n_prompt/2 + 2);
+
+    // the original is unchanged
+    const float diff = max_diff(ref, probe(ctx, prompt[1], n_prompt, 0));
+    fprintf(stderr, "%s: max logit diff of the original after the shift of its copy: %g\n", __func__, diff);
+    GGML_ASSERT(diff < logits_eps);
+
+    // removing the copy releases exactly its own cells
+    llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prompt);
+    GGML_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == n_prompt - 1);
+
+    // removing the original of a fresh copy releases no cell
+    llama_kv_cache_seq_cp(ctx, 0, 1, -1, -1);
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prompt);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 1) == 0);
+    GGML_ASSERT(max_diff(ref, probe(ctx, prompt[1], n_prompt, 1)) < logits_eps);
+
+    llama_free(ctx);
+}
+
+// a prefix shared explicitly: the sequence continues from the cells of the other one as if it had evaluated them
+static void test_share(llama_model * model) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = 3;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx != nullptr);
+
+    const int n_prefix = 24;
+    const int n_suffix = 8;
+    const auto prompt = make_prompt(model, n_prefix + n_suffix);
+    const std::vector<llama_token> prefix(prompt.begin(), prompt.begin() + n_prefix);
+    const std::vector<llama_token> suffix(prompt.begin() + n_prefix, prompt.end());
+
+    GGML_ASSERT(llama_kv_cache_seq_share(ctx, 0, 0, -1) == -1);
+    GGML_ASSERT(llama_kv_cache_seq_share(ctx, 0, LLAMA_MAX_PARALLEL_SEQUENCES, -1) == -1);
+
+    decode(ctx, prefix, 0, 0);
+
+    // the tokens of the destination in the prefix are replaced
+    decode(ctx, suffix, 0, 1);
+    GGML_ASSERT(llama_kv_cache_seq_share(ctx, 0, 1, n_prefix) == n_prefix);
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == n_prefix);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 1) == n_prefix);
+
+    decode(ctx, suffix, n_prefix, 1);
+
+    // the same prompt evaluated by a sequence on its own
+    decode(ctx, prompt, 0, 2);
+
+    const float diff = max_diff(probe(ctx, prompt[0], n_prefix + n_suffix, 2), probe(ctx, prompt[0], n_prefix + n_suffix, 1));
+    fprintf(stderr, "%s: max logit diff of the shared prefix: %g\n", __func__, diff);
+    GGML_ASSERT(diff < logits_eps);
+
+    // the original keeps its cells when the copy is removed
+    llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, 0) == 0);
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == 2*n_prefix + n_suffix);
+
+    // the sequence ids out of the range of the cells are rejected without touching the cache
+    GGML_ASSERT(!llama_kv_cache_seq_rm(ctx, LLAMA_MAX_PARALLEL_SEQUENCES, -1, -1));
+    llama_kv_cache_seq_cp(ctx, 0, LLAMA_MAX_PARALLEL_SEQUENCES, -1, -1);
+    llama_kv_cache_seq_keep(ctx, LLAMA_MAX_PARALLEL_SEQUENCES);
+    llama_kv_cache_seq_add(ctx, LLAMA_MAX_PARALLEL_SEQUENCES, 0, -1, 4);
+    GGML_ASSERT(llama_kv_cache_seq_share(ctx, 0, LLAMA_MAX_PARALLEL_SEQUENCES, -1) == -1);
+    GGML_ASSERT(llama_kv_cache_seq_n_shared(ctx, LLAMA_MAX_PARALLEL_SEQUENCES) == -1);
+    GGML_ASSERT(llama_kv_cache_seq_pos_max(ctx, LLAMA_MAX_PARALLEL_SEQUENCES) == -1);
+    GGML_ASSERT(llama_state_seq_get_size(ctx, LLAMA_MAX_PARALLEL_SEQUENCES) == 0);
+    GGML_ASSERT(llama_get_kv_cache_used_cells(ctx) == 2*n_prefix + n_suffix);
+    GGML_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == n_prefix - 1);
+
+    llama_free(ctx);
+}
+
+// records the largest number of KV cells rotated by a K-shift graph (an in-place RoPE of the K cache)
+static bool count_k_shift(struct ggml_tensor * t, bool ask, void * user_data) {
+    if (ask && t->op == GGML_OP_ROPE && t->view_src && strncmp(t->view_src->name, "cache_k_l", strlen("cache_k_l")) == 0) {
+        int64_t & n_shifted = *(int64_t *) user_data;
+        n_shifted = std::max(n_shifted, t->ne[2]);
+    }
+
+    return false;
+}
+
+// streaming context shift: only the sink tokens are rotated, and the RoPE offset of a sequence is folded without touching the others
+static void test_stream(llama_model * model) {
+    int64_t n_shifted = 0;
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = llama_n_ctx_train(model); // the context of the model sets the bound of the RoPE positions
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = 2;
+
+    llama_context * ctx_ref = llama_new_context_with_model(model, cparams);
+
+    cparams.cb_eval           = count_k_shift;
+    cparams.cb_eval_user_data = &n_shifted;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+
+    GGML_ASSERT(ctx_ref != nullptr && ctx != nullptr);
+
+    const int n_prompt  = 64;
+    const int n_keep    = 4;
+    const int n_discard = 16;
+
+    const auto prompt = make_prompt(model, n_prompt);
+
+    decode(ctx_ref, prompt, 0, 0);
+    decode(ctx,     prompt, 0, 0);
+    decode(ctx,     prompt, 0, 1);
+
+    llama_kv_cache_seq_rm (ctx_ref, 0, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_add(ctx_ref, 0, n_keep + n_discard, -1, -n_discard);
+
+    llama_kv_cache_seq_stream(ctx, 0, n_keep, n_discard);
+    llama_kv_cache_update(ctx);
+
+    fprintf(stderr, "%s: cells rotated by the shift: %" PRId64 "\n", __func__, n_shifted);
+    GGML_ASSERT(n_shifted <= n_keep);
+
+    GGML_ASSERT(llama_kv_cache_seq_pos_max(ctx, 0) == n_prompt - n_discard - 1);
+
+    const auto ref = probe(ctx_ref, prompt[1], n_prompt - n_discard, 0);
+
+    float diff = max_rel_diff(ref, probe(ctx, prompt[1], n_prompt - n_discard, 0));
+    fprintf(stderr, "%s: max relative logit diff after the shift: %g\n", __func__, diff);
+    GGML_ASSERT(diff < stream_eps);
+
+    // saving the state of a sequence folds only its own offset
+    llama_kv_cache_seq_stream(ctx, 1, n_keep, n_discard/2);
+
+    const auto ref_1 = probe(ctx, prompt[1], n_prompt - n_discard/2, 1);
+
+    n_shifted = 0;
+
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 1));
+    GGML_ASSERT(llama_state_seq_get_data(ctx, state.data(), state.size(), 1) == state.size());
+
+    fprintf(stderr, "%s: cells rotated by the fold of seq 1: %" PRId64 "\n", __func__, n_shifted);
+    GGML_ASSERT(n_shifted > 0 && n_shifted <= n_prompt);
+
+    diff = max_rel_diff(ref_1, probe(ctx, prompt[1], n_prompt - n_discard/2, 1));
+    GGML_ASSERT(diff < stream_eps);
+
+    // seq 0 still has its offset
+    n_shifted = 0;
+    diff = max_rel_diff(ref, probe(ctx, prompt[1], n_prompt - n_discard, 0));
+    GGML_ASSERT(n_shifted == 0 && diff < stream_eps);
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+// endless generation with the default server settings (n_ctx == n_ctx_train): the RoPE positions go past the bound
+// of the offsets several times, and the fold of the whole sequence only happens once every n_ctx shifted positions
+// the keys are stored in F32, so that the rotations of the many shifts do not add up to the rounding errors of F16
+static void test_stream_long(llama_model * model) {
+    int64_t n_shifted = 0;
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = llama_n_ctx_train(model);
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = 1;
+    cparams.type_k    = GGML_TYPE_F32;
+
+    llama_context * ctx_ref = llama_new_context_with_model(model, cparams);
+
+    cparams.cb_eval           = count_k_shift;
+    cparams.cb_eval_user_data = &n_shifted;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+
+    GGML_ASSERT(ctx_ref != nullptr && ctx != nullptr);
+
+    const int n_ctx     = llama_n_ctx(ctx);
+    const int n_keep    = 4;
+    const int n_discard = 8;
+
+    const auto tokens = make_prompt(model, n_ctx);
+
+    // the RoPE positions reach twice the context after about 2*n_ctx tokens
+    const int n_total = 5*n_ctx;
+
+    int n_past  = 0;
+    int n_folds = 0;
+
+    float diff_max = 0.0f;
+
+    // one token at a time - the freed cells wrap around the end of the cache, a larger ubatch may not find a contiguous slot
+    for (int n_decoded = 0; n_decoded < n_total; n_decoded++) {
+        // the shift that the server does when the context is full
+        if (n_past == n_ctx) {
+            llama_kv_cache_seq_rm (ctx_ref, 0, n_keep, n_keep + n_discard);
+            llama_kv_cache_seq_add(ctx_ref, 0, n_keep + n_discard, -1, -n_discard);
+
+            llama_kv_cache_seq_stream(ctx, 0, n_keep, n_discard);
+
+            n_past -= n_discard;
+        }
+
+        n_shifted = 0;
+
+        decode(ctx_ref, { tokens[n_decoded % n_ctx] }, n_past, 0);
+        decode(ctx,     { tokens[n_decoded % n_ctx] }, n_past, 0);
+
+        // the K-shift of the stream shift is applied by the decode
+        n_folds += n_shifted > n_keep;
+
+        n_past++;
+
+        diff_max = std::max(diff_max, max_rel_diff(llama_get_logits_ith(ctx_ref, -1), llama_get_logits_ith(ctx, -1), llama_n_vocab(model)));
+    }
+
+    fprintf(stderr, "%s: n_ctx = %d, n_decoded = %d, folds = %d, max relative logit diff = %g\n", __func__, n_ctx, n_total, n_folds, diff_max);
+
+    GGML_ASSERT(n_folds >= 1 && n_folds <= n_total/n_ctx);
+    GGML_ASSERT(diff_max < stream_eps);
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+// tiered KV cache: the logits stay close to those of an untiered cache once the older tokens are in the cold tier
+static void test_tiered(llama_model * model, bool flash_attn, ggml_type type_cold, float eps) {
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx      = 1024;
+    cparams.n_batch    = 64;
+    cparams.n_ubatch   = 64;
+    cparams.flash_attn = flash_attn;
+
+    llama_context * ctx_ref = llama_new_context_with_model(model, cparams);
+
+    cparams.kv_n_hot    = 16;
+    cparams.type_k_cold = type_cold;
+    cparams.type_v_cold = type_cold;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+
+    GGML_ASSERT(ctx_ref != nullptr && ctx != nullptr);
+
+    const int n_vocab = llama_n_vocab(model);
+
+    // the hot cache is padded to 256 cells with flash attention - the prompt overflows it in both cases
+    const int n_prompt = 768;
+    const auto prompt = make_prompt(model, n_prompt);
+
+    for (int i = 0; i < n_prompt; i += cparams.n_batch) {
+        const std::vector<llama_token> chunk(prompt.begin() + i, prompt.begin() + std::min(n_prompt, i + (int) cparams.n_batch));
+
+        decode(ctx_ref, chunk, i, 0);
+        decode(ctx,     chunk, i, 0);
+    }
+
+    float diff_max = 0.0f;
+
+    for (int i = 0; i < 16; ++i) {
+        const float * logits_ref = llama_get_logits_ith(ctx_ref, -1);
+        const float * logits     = llama_get_logits_ith(ctx,     -1);
+
+        diff_max = std::max(diff_max, max_rel_diff(logits_ref, logits, n_vocab));
+
+        // continue both with the same token
+        const llama_token token = std::max_element(logits_ref, logits_ref + n_vocab) - logits_ref;
+
+        decode(ctx_ref, { token }, n_prompt + i, 0);
+        decode(ctx,     { token }, n_prompt + i, 0);
+    }
+
+    fprintf(stderr, "%s: flash_attn = %d, type_cold = %s: max relative logit diff = %g\n", __func__, flash_attn, ggml_type_name(type_cold), diff_max);
+
+    GGML_ASSERT(diff_max < eps);
+
+    // the old tokens must really be in the quantized cold cache - an untiered context gives the reference logits
+    if (ggml_is_quantized(type_cold)) {
+        GGML_ASSERT(diff_max > 0.0f);
+    }
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+int main(int argc, char ** argv) {
+    char * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+
+    llama_model * model = llama_load_model_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    test_cow(model);
+    test_share(model);
+    test_stream(model);
+    test_stream_long(model);
+
+    // the recurrent and encoder-decoder models have no tiered KV cache
+    if (!llama_model_is_recurrent(model) && !llama_model_has_encoder(model)) {
+        for (bool flash_attn : { false, true }) {
+            // the CPU flash attention accumulates in F16, so the order of the cells changes the result slightly
+            // the bound for Q8_0 is that of an untiered cache that is fully Q8_0
+            test_tiered(model, flash_attn, GGML_TYPE_F16,  flash_attn ? 1e-2f : 1e-3f);
+            test_tiered(model, flash_attn, GGML_TYPE_Q8_0, 1e-1f);
+        }
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+// tests the per-sequence LoRA adapters on a real model: a batch that mixes the sequences of several adapters must give
+// the logits of each sequence decoded on its own
+// the model is passed as the first argument (or via LLAMACPP_TEST_MODELFILE), the adapters are generated for it
+
+#include "llama.h"
+#include "ggml.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const float logits_eps = 1e-4f;
+
+// write a LoRA adapter of the given rank for the 2D weights of the model whose name ends with one of the suffixes
+// returns false if the model has none of them
+static bool make_adapter(llama_model * model, const std::string & path, const std::vector<std::string> & suffixes, int seed) {
+    const int rank = 4;
+
+    char arch[64];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) < 0) {
+        return false;
+    }
+
+    std::vector<std::pair<std::string, ggml_tensor *>> weights;
+    for (int il = -1; ; ++il) {
+        bool found = false;
+        for (const auto & suffix : suffixes) {
+            const std::string name = il < 0 ? suffix : "blk." + std::to_string(il) + "." + suffix;
+            ggml_tensor * t = llama_get_model_tensor(model, name.c_str());
+            if (t != nullptr && ggml_n_dims(t) == 2) {
+                weights.emplace_back(name, t);
+                found = true;
+            }
+        }
+        if (il >= 0 && !found) {
+            break;
+        }
+    }
+
+    if (weights.empty()) {
+        return false;
+    }
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 2*weights.size()*ggml_tensor_overhead() + 64*1024*1024,
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.architecture", arch);
+    gguf_set_val_str(gguf, "general.type",         "adapter");
+    gguf_set_val_str(gguf, "adapter.type",         "lora");
+    gguf_set_val_f32(gguf, "adapter.lora.alpha",   8.0f);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    for (const auto & it : weights) {
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, it.second->ne[0], rank);
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, rank, it.second->ne[1]);
+        ggml_set_name(a, (it.first + ".lora_a").c_str());
+        ggml_set_name(b, (it.first + ".lora_b").c_str());
+        for (ggml_tensor * t : { a, b }) {
+            for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+                ((float *) t->data)[i] = dist(rng);
+            }
+            gguf_add_tensor(gguf, t);
+        }
+    }
+
+    gguf_write_to_file(gguf, path.c_str(), false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+
+    return true;
+}
+
+// decode the prompt in the given sequences, in one batch, and return the logits of the last token of each sequence
+static std::vector<std::vector<float>> decode(llama_context * ctx, const std::vector<llama_token> & prompt, const std::vector<llama_seq_id> & seq_ids) {
+    llama_batch batch = llama_batch_init(prompt.size()*seq_ids.size(), 0, 1);
+
+    for (llama_seq_id seq_id : seq_ids) {
+        for (size_t i = 0; i < prompt.size(); ++i) {
+            const int32_t k = batch.n_tokens++;
+            batch.token   [k]    = prompt[i];
+            batch.pos     [k]    = i;
+            batch.n_seq_id[k]    = 1;
+            batch.seq_id  [k][0] = seq_id;
+            batch.logits  [k]    = i == prompt.size() - 1;
+        }
+    }
+
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<std::vector<float>> result;
+    for (size_t s = 0; s < seq_ids.size(); ++s) {
+        const float * logits = llama_get_logits_ith(ctx, (s + 1)*prompt.size() - 1);
+        result.emplace_back(logits, logits + n_vocab);
+    }
+
+    llama_batch_free(batch);
+
+    return result;
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    GGML_ASSERT(a.size() == b.size());
+
+    float result = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) {
+        result = std::max(result, std::fabs(a[i] - b[i]));
+    }
+    return result;
+}
+
+int main(int argc, char ** argv) {
+    char * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+
+    llama_model * model = llama_load_model_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, model_path);
+        return 1;
+    }
+
+    // two adapters with different weights, the second one also adapts the output (applied to the outputs only)
+    const std::string path_a = "test-lora-seq-a.gguf";
+    const std::string path_b = "test-lora-seq-b.gguf";
+
+    if (!make_adapter(model, path_a, { "attn_q.weight", "attn_v.weight", "ffn_up.weight" }, 1) ||
+        !make_adapter(model, path_b, { "attn_k.weight", "ffn_down.weight", "output.weight" }, 2)) {
+        fprintf(stderr, "%s: the model has none of the adapted weights, skipping\n", __func__);
+        llama_free_model(model);
+        return 0;
+    }
+
+    llama_lora_adapter * lora_a = llama_lora_adapter_init(model, path_a.c_str());
+    llama_lora_adapter * lora_b = llama_lora_adapter_init(model, path_b.c_str());
+    std::remove(path_a.c_str());
+    std::remove(path_b.c_str());
+    GGML_ASSERT(lora_a != nullptr && lora_b != nullptr);
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = 4;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx != nullptr);
+
+    // seq 0: a, seq 1: b, seq 2: a and b, seq 3: no adapter
+    GGML_ASSERT(llama_lora_adapter_seq_set(ctx, lora_a, 0, 1.0f) == 0);
+    GGML_ASSERT(llama_lora_adapter_seq_set(ctx, lora_b, 1, 0.5f) == 0);
+    GGML_ASSERT(llama_lora_adapter_seq_set(ctx, lora_a, 2, 0.5f) == 0);
+    GGML_ASSERT(llama_lora_adapter_seq_set(ctx, lora_b, 2, 1.0f) == 0);
+
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<llama_token> prompt(24);
+    for (size_t i = 0; i < prompt.size(); ++i) {
+        prompt[i] = (i*7919 + 13) % n_vocab;
+    }
+
+    const std::vector<llama_seq_id> seq_ids = { 0, 1, 2, 3 };
+
+    const auto mixed = decode(ctx, prompt, seq_ids);
+
+    for (llama_seq_id seq_id : seq_ids) {
+        llama_kv_cache_clear(ctx);
+
+        const auto alone = decode(ctx, prompt, { seq_id })[0];
+
+        const float diff = max_diff(mixed[seq_id], alone);
+        fprintf(stderr, "%s: seq %d: max logit diff of the mixed batch: %g\n", __func__, seq_id, diff);
+        GGML_ASSERT(diff < logits_eps);
+    }
+
+    // the adapters change the logits - the same prompt gives different logits in each sequence
+    for (llama_seq_id s0 : seq_ids) {
+        for (llama_seq_id s1 : seq_ids) {
+            if (s0 < s1) {
+                GGML_ASSERT(max_diff(mixed[s0], mixed[s1]) > 1e-2f);
+            }
+        }
+    }
+
+    llama_free(ctx);
+
+    llama_lora_adapter_free(lora_a);
+    llama_lora_adapter_free(lora_b);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Check that the matrix multiplications read the NUMA copies of mirrored weights (GGML_NUMA_STRATEGY_MIRROR), and
+// that the weights can be mirrored and unmirrored while graphs that read them are being computed
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static const int n_embd   = 256;
+static const int n_tokens = 4;
+static const int n_threads = 4;
+
+struct test_graph {
+    ggml_context * ctx;
+    ggml_cgraph  * gf;
+    ggml_tensor  * out;
+};
+
+static test_graph build_graph(ggml_tensor * w) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ false,
+    };
+    test_graph g;
+    g.ctx = ggml_init(params);
+    ggml_tensor * x = ggml_new_tensor_2d(g.ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    for (int i = 0; i < n_embd*n_tokens; i++) {
+        ((float *) x->data)[i] = float(i % 7) - 3.0f;
+    }
+    g.out = ggml_mul_mat(g.ctx, w, x);
+    g.gf = ggml_new_graph(g.ctx);
+    ggml_build_forward_expand(g.gf, g.out);
+    return g;
+}
+
+static std::vector<float> compute(const test_graph & g) {
+    ggml_graph_compute_with_ctx(g.ctx, g.gf, n_threads);
+    const float * data = (const float *) g.out->data;
+    return std::vector<float>(data, data + ggml_nelements(g.out));
+}
+
+int main(void) {
+    ggml_numa_init(GGML_NUMA_STRATEGY_MIRROR);
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 2*1024*1024,
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+    ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd);
+    for (int i = 0; i < n_embd*n_embd; i++) {
+        ((float *) w->data)[i] = float((i*37) % 101)/101.0f - 0.5f;
+    }
+    std::vector<float> w_data((const float *) w->data, (const float *) w->data + n_embd*n_embd);
+
+    test_graph g = build_graph(w);
+    const std::vector<float> ref = compute(g);
+
+    if (!ggml_numa_mirror(w->data, ggml_nbytes(w))) {
+        printf("%s: NUMA mirroring is not available, skipping\n", __func__);
+        ggml_free(g.ctx);
+        ggml_free(ctx);
+        return 0;
+    }
+
+    // while the weights are mirrored, the matrix multiplication reads the copies and not the original data
+    memset(w->data, 0, ggml_nbytes(w));
+    assert(compute(g) == ref);
+
+    ggml_numa_unmirror(w->data);
+    for (float v : compute(g)) {
+        assert(v == 0.0f);
+    }
+    memcpy(w->data, w_data.data(), ggml_nbytes(w));
+
+    // the mirrors change while another thread computes graphs with them: the copies that a graph reads must stay
+    // valid until it ends
+    std::atomic<bool> done(false);
+    std::atomic<int>  n_computed(0);
+    std::thread worker([&]() {
+        test_graph gw = build_graph(w);
+        while (!done) {
+            assert(compute(gw) == ref);
+            n_computed++;
+        }
+        ggml_free(gw.ctx);
+    });
+
+    const int n_rounds = 200;
+    for (int i = 0; i < n_rounds; i++) {
+        const bool ok = ggml_numa_mirror(w->data, ggml_nbytes(w));
+        assert(ok);
+        std::this_thread::yield();
+        ggml_numa_unmirror(w->data);
+    }
+    while (n_computed < 10) {
+        std::this_thread::yield();
+    }
+    done = true;
+    worker.join();
+
+    printf("%s: OK, %d graphs computed during %d mirror changes\n", __func__, n_computed.load(), n_rounds);
+
+    ggml_free(g.ctx);
+    ggml_free(ctx);
+    return 0;
+}
@@ -0,0 +1,625 @@
+// Check the RPC backend against servers on the loopback interface:
+// - the request pipelining: small requests are batched, the responses are matched to their requests, and the client
+//   waits for the responses when too many bytes of them are in flight
+// - the graph cache: the graphs that are sent as the changes to a cached graph compute the same as the CPU backend
+// - the weight cache: the hits, the LRU eviction and the check of the uploads
+// - the weights shared by two clients: the writes of a client do not change the weights of the other
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "ggml-rpc.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+static const int64_t n_small = 1024;     // 4 KiB - batched with the next requests
+static const int64_t n_large = 32*1024;  // 128 KiB - sent right away
+
+static const size_t server_mem = 256*1024*1024;
+
+// start a server on its own thread and wait until it accepts connections
+// the server threads do not return, they end with the process
+static bool start_server(int port, const char * cache_dir, size_t cache_size, bool share_weights) {
+    const std::string endpoint = "127.0.0.1:" + std::to_string(port);
+    const std::string dir = cache_dir ? cache_dir : "";
+
+    std::thread([=]() {
+        ggml_backend_t server_backend = ggml_backend_cpu_init();
+        assert(server_backend != nullptr);
+        ggml_backend_rpc_start_server(server_backend, endpoint.c_str(), dir.empty() ? nullptr : dir.c_str(), cache_size, share_weights, server_mem, server_mem);
+    }).detach();
+
+    size_t free_mem  = 0;
+    size_t total_mem = 0;
+    for (int i = 0; i < 100 && total_mem == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ggml_backend_rpc_get_device_memory(endpoint.c_str(), &free_mem, &total_mem);
+    }
+    if (total_mem != server_mem) {
+        fprintf(stderr, "failed to connect to the RPC server at %s\n", endpoint.c_str());
+        return false;
+    }
+    return true;
+}
+
+static std::vector<float> get_data(const ggml_tensor * t) {
+    std::vector<float> res(ggml_nelements(t));
+    ggml_backend_tensor_get(t, res.data(), 0, ggml_nbytes(t));
+    return res;
+}
+
+static std::vector<float> make_data(int64_t n, int seed) {
+    std::vector<float> res(n);
+    for (int64_t i = 0; i < n; i++) {
+        res[i] = float(seed) + float(i % 4096)/4096.0f + float(i/4096);
+    }
+    return res;
+}
+
+static void test_pipelining(const std::string & endpoint) {
+    ggml_backend_t backend = ggml_backend_rpc_init(endpoint.c_str());
+    assert(backend != nullptr);
+
+    // the outputs of 256 small tensors are 1 MiB of responses, far more than the client lets in flight
+    const int n_tensors = 256;
+
+    ggml_init_params params = {
+        /* .mem_size   = */ (2*n_tensors + 2)*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    std::vector<ggml_tensor *> inputs;
+    std::vector<ggml_tensor *> outputs;
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    for (int i = 0; i < n_tensors; i++) {
+        ggml_tensor * x = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_small);
+        inputs.push_back(x);
+        outputs.push_back(ggml_scale(ctx, x, 2.0f));
+        ggml_build_forward_expand(gf, outputs.back());
+    }
+    ggml_tensor * large = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_large);
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    assert(buf != nullptr);
+
+    std::vector<std::vector<float>> data(n_tensors, std::vector<float>(n_small));
+    std::vector<std::vector<float>> res(n_tensors, std::vector<float>(n_small));
+    std::vector<float> data_large(n_large);
+    std::vector<float> res_large(n_large);
+
+    for (int iter = 0; iter < 4; iter++) {
+        for (int i = 0; i < n_tensors; i++) {
+            for (int64_t j = 0; j < n_small; j++) {
+                data[i][j] = float(iter*n_tensors + i) + float(j)/n_small;
+            }
+        }
+        for (int64_t j = 0; j < n_large; j++) {
+            data_large[j] = float(iter) - float(j);
+        }
+
+        // writes and reads back interleaved with a large request that is not batched:
+        // each read must get the data of its own tensor, written by the requests sent before it
+        for (int i = 0; i < n_tensors; i++) {
+            ggml_backend_tensor_set_async(backend, inputs[i], data[i].data(), 0, ggml_nbytes(inputs[i]));
+            if (i == n_tensors/2) {
+                ggml_backend_tensor_set_async(backend, large, data_large.data(), 0, ggml_nbytes(large));
+                ggml_backend_tensor_get_async(backend, large, res_large.data(), 0, ggml_nbytes(large));
+            }
+            ggml_backend_tensor_get_async(backend, inputs[i], res[i].data(), 0, ggml_nbytes(inputs[i]));
+        }
+        ggml_backend_synchronize(backend);
+
+        for (int i = 0; i < n_tensors; i++) {
+            for (int64_t j = 0; j < n_small; j++) {
+                assert(res[i][j] == data[i][j]);
+            }
+        }
+        for (int64_t j = 0; j < n_large; j++) {
+            assert(res_large[j] == data_large[j]);
+        }
+
+        // the results of a graph computed asynchronously, read back before the next synchronization
+        enum ggml_status status = ggml_backend_graph_compute_async(backend, gf);
+        assert(status == GGML_STATUS_SUCCESS);
+        for (int i = 0; i < n_tensors; i++) {
+            ggml_backend_tensor_get_async(backend, outputs[i], res[i].data(), 0, ggml_nbytes(outputs[i]));
+        }
+        ggml_backend_synchronize(backend);
+
+        for (int i = 0; i < n_tensors; i++) {
+            for (int64_t j = 0; j < n_small; j++) {
+                assert(res[i][j] == 2.0f*data[i][j]);
+            }
+        }
+    }
+
+    printf("%s: OK, %d iterations of %d tensors\n", __func__, 4, n_tensors);
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+    ggml_backend_free(backend);
+}
+
+// a backend with a KV cache and queries, and the graphs of the attention over views of the KV cache
+// the graphs are built in the same memory, so that the tensors of the graphs with the same topology keep their
+// addresses - like in llama.cpp, this is what lets the client send a graph as the changes to a cached one
+struct attn_env {
+    ggml_backend_t        backend;
+    ggml_context        * ctx;
+    ggml_tensor         * kv;
+    ggml_tensor         * q;
+    ggml_backend_buffer_t buf    = nullptr;
+    ggml_gallocr_t        galloc = nullptr;
+    std::vector<uint8_t>  meta;
+
+    attn_env(ggml_backend_t backend) : backend(backend) {
+        ggml_init_params params = {
+            /* .mem_size   = */ 2*ggml_tensor_overhead(),
+            /* .mem_buffer = */ nullptr,
+            /* .no_alloc   = */ true,
+        };
+        ctx = ggml_init(params);
+        kv  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 64, 256);
+        q   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 64, 4);
+
+        meta.resize(64*ggml_tensor_overhead() + ggml_graph_overhead());
+    }
+
+    ~attn_env() {
+        ggml_gallocr_free(galloc);
+        ggml_backend_buffer_free(buf);
+        ggml_free(ctx);
+        ggml_backend_free(backend);
+    }
+
+    // (re)allocate the KV cache and the queries, the buffer of the graphs is kept
+    void alloc(int seed) {
+        ggml_backend_buffer_free(buf);
+        for (ggml_tensor * t : { kv, q }) {
+            t->buffer = nullptr;
+            t->data   = nullptr;
+        }
+        buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+        assert(buf != nullptr);
+        if (galloc == nullptr) {
+            galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+        }
+
+        const auto data_kv = make_data(ggml_nelements(kv), seed);
+        const auto data_q  = make_data(ggml_nelements(q),  seed + 1);
+        ggml_backend_tensor_set(kv, data_kv.data(), 0, ggml_nbytes(kv));
+        ggml_backend_tensor_set(q,  data_q.data(),  0, ggml_nbytes(q));
+    }
+
+    // the scores of the queries over n_kv cells of the KV cache from i_kv, followed by n_ops nodes
+    // with reduce, the queries are scaled by the sum of the cells instead, so that only the shape of the view depends
+    // on n_kv and the next nodes keep their shapes and their place in the buffer of the graphs
+    std::vector<float> compute(int n_kv, int i_kv, int n_ops, bool reduce) {
+        ggml_init_params params = {
+            /* .mem_size   = */ meta.size(),
+            /* .mem_buffer = */ meta.data(),
+            /* .no_alloc   = */ true,
+        };
+        ggml_context * ctx_graph = ggml_init(params);
+
+        ggml_tensor * k   = ggml_view_2d(ctx_graph, kv, kv->ne[0], n_kv, kv->nb[1], i_kv*kv->nb[1]);
+        ggml_tensor * cur = reduce ? ggml_mul(ctx_graph, q, ggml_sum(ctx_graph, k)) : ggml_mul_mat(ctx_graph, k, q);
+        for (int i = 0; i < n_ops; i++) {
+            cur = ggml_scale(ctx_graph, cur, 0.5f);
+        }
+
+        ggml_cgraph * gf = ggml_new_graph(ctx_graph);
+        ggml_build_forward_expand(gf, cur);
+
+        assert(ggml_gallocr_alloc_graph(galloc, gf));
+        assert(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+        std::vector<float> res = get_data(cur);
+        ggml_free(ctx_graph);
+        return res;
+    }
+};
+
+static void test_graph_cache(const std::string & endpoint) {
+    attn_env rpc(ggml_backend_rpc_init(endpoint.c_str()));
+    attn_env cpu(ggml_backend_cpu_init());
+    rpc.alloc(1);
+    cpu.alloc(1);
+
+    // both backends compute on the CPU with the same kernels, so the results must be bit-identical
+    int n_graphs = 0;
+    auto check = [&](int n_kv, int i_kv, int n_ops, bool reduce) {
+        assert(rpc.compute(n_kv, i_kv, n_ops, reduce) == cpu.compute(n_kv, i_kv, n_ops, reduce));
+        n_graphs++;
+    };
+
+    // the window of the KV cache moves: only the view and its users change, the graph is sent as the changes
+    for (int i_kv = 0; i_kv <= 64; i_kv += 8) {
+        check(64, i_kv, 4, true);
+    }
+
+    // the KV cache grows: the view changes shape, the other nodes do not
+    for (int n_kv = 16; n_kv <= 128; n_kv += 16) {
+        check(n_kv, 0, 8, true);
+    }
+
+    // the shapes of all the nodes change: more than half of the tensors, the full graph is sent again to its slot
+    for (int n_kv = 16; n_kv <= 128; n_kv += 16) {
+        check(n_kv, 8, 4, false);
+    }
+
+    // more topologies than the server has slots: the least recently used graphs are evicted - in reverse order, the
+    // last graphs are still cached and sent as the changes, the first ones are sent again in full
+    for (int n_ops = 1; n_ops <= 12; n_ops++) {
+        check(32, 0, n_ops, true);
+    }
+    for (int n_ops = 12; n_ops >= 1; n_ops--) {
+        check(32, 4, n_ops, true);
+    }
+
+    // the graphs are dropped from the cache on both sides when a buffer is freed: the same graph, in which only the
+    // KV cache and the queries change, is sent in full instead of as the changes to a graph that the server dropped
+    check(64, 0, 4, true);
+    rpc.alloc(2);
+    cpu.alloc(2);
+    for (int i_kv = 0; i_kv <= 16; i_kv += 8) {
+        check(64, i_kv, 4, true);
+    }
+
+    printf("%s: OK, %d graphs\n", __func__, n_graphs);
+}
+
+#ifndef _WIN32
+// the content of the files of the weight cache, which are named after the SHA-256 of their content
+static std::vector<std::vector<uint8_t>> read_cache(const std::string & dir) {
+    std::vector<std::vector<uint8_t>> res;
+    DIR * d = opendir(dir.c_str());
+    assert(d != nullptr);
+    while (struct dirent * e = readdir(d)) {
+        const std::string name = e->d_name;
+        if (name.size() != 64 || name.find_first_not_of("0123456789abcdef") != std::string::npos) {
+            continue;
+        }
+        FILE * f = fopen((dir + "/" + name).c_str(), "rb");
+        assert(f != nullptr);
+        std::vector<uint8_t> data;
+        uint8_t chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            data.insert(data.end(), chunk, chunk + n);
+        }
+        fclose(f);
+        res.push_back(std::move(data));
+    }
+    closedir(d);
+    return res;
+}
+
+static bool in_cache(const std::vector<std::vector<uint8_t>> & cache, const std::vector<float> & data) {
+    for (const auto & file : cache) {
+        if (file.size() == data.size()*sizeof(float) && memcmp(file.data(), data.data(), file.size()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// replace the content of the cached file of data, keeping its name and size
+static void replace_in_cache(const std::string & dir, const std::vector<float> & data, const std::vector<float> & data_new) {
+    DIR * d = opendir(dir.c_str());
+    assert(d != nullptr);
+    bool found = false;
+    while (struct dirent * e = readdir(d)) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        const std::string path = dir + "/" + e->d_name;
+        FILE * f = fopen(path.c_str(), "rb");
+        if (f == nullptr) {
+            continue;
+        }
+        std::vector<float> content(data.size() + 1);
+        const size_t n = fread(content.data(), 1, content.size()*sizeof(float), f);
+        fclose(f);
+        if (n != data.size()*sizeof(float) || memcmp(content.data(), data.data(), n) != 0) {
+            continue;
+        }
+        f = fopen(path.c_str(), "r+b");
+        assert(f != nullptr);
+        assert(fwrite(data_new.data(), sizeof(float), data_new.size(), f) == data_new.size());
+        fclose(f);
+        found = true;
+    }
+    closedir(d);
+    assert(found);
+}
+
+static void remove_cache(const std::string & dir) {
+    DIR * d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return;
+    }
+    while (struct dirent * e = readdir(d)) {
+        if (e->d_name[0] != '.') {
+            unlink((dir + "/" + e->d_name).c_str());
+        }
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+#endif
+
+// the weights of at least 10 MiB are looked up in the cache of the server by hash and uploaded if they miss
+static void test_weight_cache(int port) {
+#ifdef _WIN32
+    printf("%s: skipped, the cache directory is only inspected on POSIX systems\n", __func__);
+    (void) port;
+#else
+    char tmpl[] = "/tmp/test-rpc-cache-XXXXXX";
+    assert(mkdtemp(tmpl) != nullptr);
+    const std::string dir = tmpl;
+
+    // room for two of the three weights
+    const size_t MiB = 1024*1024;
+    if (!start_server(port, dir.c_str(), 30*MiB, false)) {
+        remove_cache(dir);
+        exit(1);
+    }
+    const std::string endpoint = "127.0.0.1:" + std::to_string(port);
+
+    ggml_backend_t backend = ggml_backend_rpc_init(endpoint.c_str());
+    assert(backend != nullptr);
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 3*ggml_tensor_overhead(),
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    // 12, 13 and 14 MiB
+    ggml_tensor * w[3];
+    for (int i = 0; i < 3; i++) {
+        w[i] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, (12 + i)*MiB/sizeof(float));
+    }
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    assert(buf != nullptr);
+    ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+
+    auto set = [](ggml_tensor * t, const std::vector<float> & data) {
+        ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+    };
+
+    const auto a0 = make_data(ggml_nelements(w[0]), 10);
+    const auto a1 = make_data(ggml_nelements(w[1]), 11);
+    const auto a2 = make_data(ggml_nelements(w[2]), 12);
+
+    // misses: the weights are uploaded and stored in the cache
+    set(w[0], a0);
+    set(w[1], a1);
+    assert(get_data(w[0]) == a0);
+    assert(get_data(w[1]) == a1);
+    {
+        const auto cache = read_cache(dir);
+        assert(cache.size() == 2 && in_cache(cache, a0) && in_cache(cache, a1));
+    }
+
+    // hit: the server uses the data of the cache instead of an upload, which is seen by changing the file
+    const auto c0 = make_data(ggml_nelements(w[0]), 20);
+    replace_in_cache(dir, a0, c0);
+    set(w[0], a0);
+    assert(get_data(w[0]) == c0);
+
+    // LRU eviction: the third weight exceeds the budget, the least recently used weight is removed - a1, since the
+    // file of a0 was used by the hit
+    set(w[2], a2);
+    assert(get_data(w[2]) == a2);
+    {
+        const auto cache = read_cache(dir);
+        assert(cache.size() == 2 && in_cache(cache, c0) && in_cache(cache, a2) && !in_cache(cache, a1));
+    }
+
+    // the uploads are checked against the hash of their lookup: the weight is written twice before the lookups are
+    // resolved, the server expects the data of the last lookup at this address and does not store the first upload
+    const auto b1 = make_data(ggml_nelements(w[1]), 30);
+    const auto d1 = make_data(ggml_nelements(w[1]), 31);
+    set(w[1], b1);
+    set(w[1], d1);
+    assert(get_data(w[1]) == d1);
+    {
+        const auto cache = read_cache(dir);
+        assert(in_cache(cache, d1) && !in_cache(cache, b1));
+    }
+
+    printf("%s: OK\n", __func__);
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+    ggml_backend_free(backend);
+
+    remove_cache(dir);
+#endif
+}
+
+// two clients with the same weight, shared by the server: the writes of a client to its weight (set_tensor,
+// graph compute and copy_tensor) give it its own copy, the weight of the other client does not change
+static void test_shared_weights(int port) {
+    if (!start_server(port, nullptr, 0, true)) {
+        exit(1);
+    }
+
+    // the connections are shared by endpoint, the two endpoints are two clients of the same server
+    struct client {
+        ggml_backend_t        backend;
+        ggml_context        * ctx;
+        ggml_tensor         * w;
+        ggml_tensor         * s;
+        ggml_backend_buffer_t buf_w;
+        ggml_backend_buffer_t buf_s;
+    };
+
+    const int64_t n_w = 12*1024*1024/sizeof(float);
+
+    client clients[2];
+    const char * hosts[2] = { "127.0.0.1", "localhost" };
+    for (int i = 0; i < 2; i++) {
+        client & c = clients[i];
+        c.backend = ggml_backend_rpc_init((std::string(hosts[i]) + ":" + std::to_string(port)).c_str());
+        assert(c.backend != nullptr);
+
+        ggml_init_params params = {
+            /* .mem_size   = */ 2*ggml_tensor_overhead(),
+            /* .mem_buffer = */ nullptr,
+            /* .no_alloc   = */ true,
+        };
+        c.ctx = ggml_init(params);
+        c.w   = ggml_new_tensor_1d(c.ctx, GGML_TYPE_F32, n_w);
+        c.s   = ggml_new_tensor_1d(c.ctx, GGML_TYPE_F32, n_small);
+
+        c.buf_w = ggml_backend_alloc_buffer(c.backend, ggml_nbytes(c.w));
+        c.buf_s = ggml_backend_alloc_buffer(c.backend, ggml_nbytes(c.s));
+        assert(c.buf_w != nullptr && c.buf_s != nullptr);
+        ggml_backend_buffer_set_usage(c.buf_w, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        ggml_backend_tensor_alloc(c.buf_w, c.w, ggml_backend_buffer_get_base(c.buf_w));
+        ggml_backend_tensor_alloc(c.buf_s, c.s, ggml_backend_buffer_get_base(c.buf_s));
+
+        const auto data_s = make_data(n_small, 100 + i);
+        ggml_backend_tensor_set(c.s, data_s.data(), 0, ggml_nbytes(c.s));
+    }
+
+    const auto a = make_data(n_w, 1);
+
+    // the weight of a client with the first n_small values of s
+    auto with_prefix = [&](const client & c) {
+        std::vector<float> res = a;
+        const auto data_s = get_data(c.s);
+        std::copy(data_s.begin(), data_s.end(), res.begin());
+        return res;
+    };
+
+    auto share = [&]() {
+        for (client & c : clients) {
+            ggml_backend_tensor_set(c.w, a.data(), 0, ggml_nbytes(c.w));
+        }
+        for (client & c : clients) {
+            assert(get_data(c.w) == a);
+        }
+    };
+
+    // the second upload of the weight is found in the pool of the server, both clients use the same data
+    share();
+
+    // set_tensor: the first client writes the first values of its weight
+    {
+        const auto data_s = get_data(clients[0].s);
+        ggml_backend_tensor_set(clients[0].w, data_s.data(), 0, n_small*sizeof(float));
+        assert(get_data(clients[0].w) == with_prefix(clients[0]));
+        assert(get_data(clients[1].w) == a);
+    }
+
+    // graph compute: the second client copies s into its weight with a graph
+    share();
+    {
+        client & c = clients[1];
+        ggml_init_params params = {
+            /* .mem_size   = */ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+            /* .mem_buffer = */ nullptr,
+            /* .no_alloc   = */ true,
+        };
+        ggml_context * ctx_graph = ggml_init(params);
+        ggml_cgraph * gf = ggml_new_graph(ctx_graph);
+        ggml_build_forward_expand(gf, ggml_cpy(ctx_graph, c.s, ggml_view_1d(ctx_graph, c.w, n_small, 0)));
+
+        ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(c.backend));
+        assert(ggml_gallocr_alloc_graph(galloc, gf));
+        assert(ggml_backend_graph_compute(c.backend, gf) == GGML_STATUS_SUCCESS);
+        ggml_gallocr_free(galloc);
+        ggml_free(ctx_graph);
+
+        assert(get_data(clients[1].w) == with_prefix(clients[1]));
+        assert(get_data(clients[0].w) == a);
+    }
+
+    // copy_tensor: the first client copies s into its weight on the server
+    share();
+    {
+        client & c = clients[0];
+        ggml_init_params params = {
+            /* .mem_size   = */ ggml_tensor_overhead(),
+            /* .mem_buffer = */ nullptr,
+            /* .no_alloc   = */ true,
+        };
+        ggml_context * ctx_view = ggml_init(params);
+        ggml_tensor * view = ggml_view_1d(ctx_view, c.w, n_small, 0);
+        ggml_backend_view_init(view);
+        ggml_backend_tensor_copy(c.s, view);
+        ggml_free(ctx_view);
+
+        assert(get_data(clients[0].w) == with_prefix(clients[0]));
+        assert(get_data(clients[1].w) == a);
+    }
+
+    // the buffers of the clients are separate: freeing the weight of the first client leaves the shared data to the
+    // second, and the new buffer of the first client does not see it
+    share();
+    {
+        client & c = clients[0];
+        ggml_backend_buffer_free(c.buf_w);
+        assert(get_data(clients[1].w) == a);
+
+        c.buf_w = ggml_backend_alloc_buffer(c.backend, ggml_nbytes(c.w));
+        assert(c.buf_w != nullptr);
+        ggml_backend_buffer_set_usage(c.buf_w, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        c.w->buffer = nullptr;
+        c.w->data   = nullptr;
+        ggml_backend_tensor_alloc(c.buf_w, c.w, ggml_backend_buffer_get_base(c.buf_w));
+
+        const auto b = make_data(n_w, 2);
+        ggml_backend_tensor_set(c.w, b.data(), 0, ggml_nbytes(c.w));
+        assert(get_data(clients[0].w) == b);
+        assert(get_data(clients[1].w) == a);
+    }
+
+    printf("%s: OK\n", __func__);
+
+    for (client & c : clients) {
+        ggml_backend_buffer_free(c.buf_w);
+        ggml_backend_buffer_free(c.buf_s);
+        ggml_free(c.ctx);
+        ggml_backend_free(c.backend);
+    }
+}
+
+int main(int argc, char ** argv) {
+    // ports that are unlikely to be used by a concurrent run
+    const int port = argc > 1 ? atoi(argv[1]) : 50052 + 4*(int) (std::chrono::steady_clock::now().time_since_epoch().count() % 1000);
+
+    if (!start_server(port, nullptr, 0, false)) {
+        return 1;
+    }
+    const std::string endpoint = "127.0.0.1:" + std::to_string(port);
+
+    test_pipelining(endpoint);
+    test_graph_cache(endpoint);
+    test_weight_cache(port + 1);
+    test_shared_weights(port + 2);
+
+    return 0;
+}
@@ -257,6 +257,55 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static void test_logits_top_k(const int n_vocab, const int k, const int n_penalized) {
+    std::vector<float> logits(n_vocab);
+    for (auto & logit : logits) {
+        logit = 10.0f*((float)(rand())/RAND_MAX - 0.5f);
+    }
+
+    // penalize the largest logits, so that the sparse path has to dig below them
+    std::vector<llama_token> ids(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        ids[token_id] = token_id;
+    }
+    std::sort(ids.begin(), ids.end(), [&](llama_token a, llama_token b) { return logits[a] > logits[b]; });
+
+    auto run = [&](llama_token_data_array * cur_p) {
+        auto * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(n_vocab, LLAMA_TOKEN_NULL, LLAMA_TOKEN_NULL, n_penalized, 50.0f, 0.0f, 0.0f, true, false));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(k));
+        for (int i = 0; i < n_penalized; i++) {
+            llama_sampler_accept(chain, ids[i]);
+        }
+        llama_sampler_apply(chain, cur_p);
+        llama_sampler_free(chain);
+    };
+
+    std::vector<llama_token_data> full;
+    full.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        full.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    llama_token_data_array full_p = { full.data(), full.size(), -1, false };
+    run(&full_p);
+
+    std::vector<llama_token_data> sparse(k + n_penalized);
+    const int n = llama_logits_top_k(logits.data(), n_vocab, k + n_penalized, sparse.data());
+    GGML_ASSERT(n == std::min(k + n_penalized, n_vocab));
+    for (int i = 1; i < n; i++) {
+        GGML_ASSERT(sparse[i - 1].logit >= sparse[i].logit);
+    }
+    llama_token_data_array sparse_p = { sparse.data(), (size_t) n, -1, false };
+    run(&sparse_p);
+
+    GGML_ASSERT(full_p.size == sparse_p.size);
+    for (size_t i = 0; i < full_p.size; i++) {
+        GGML_ASSERT(full_p.data[i].logit == sparse_p.data[i].logit);
+    }
+
+    printf("Logits top-k OK with n_vocab=%06d k=%03d n_penalized=%02d\n", n_vocab, k, n_penalized);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -277,6 +326,40 @@ static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vec
 
 #define BENCH(__cnstr, __data, __n_iter) bench((__cnstr), #__cnstr, (__data), (__n_iter))
 
+// top-k of a raw logits row: materializing every candidate first vs selecting directly from the logits
+static void bench_logits_top_k(const std::vector<llama_token_data> & data, int k, int n_iter) {
+    const int n_vocab = data.size();
+
+    std::vector<float> logits(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        logits[i] = data[i].logit;
+    }
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    auto * cnstr = llama_sampler_init_top_k(k);
+
+    int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_iter; i++) {
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_sampler_apply(cnstr, &cur_p);
+    }
+    int64_t t_end = ggml_time_us();
+    printf("%-43s: %8.3f us/iter\n", "full vocabulary + llama_sampler_init_top_k", (t_end - t_start) / (float)n_iter);
+
+    llama_sampler_free(cnstr);
+
+    t_start = ggml_time_us();
+    for (int i = 0; i < n_iter; i++) {
+        llama_logits_top_k(logits.data(), n_vocab, k, cur.data());
+    }
+    t_end = ggml_time_us();
+    printf("%-43s: %8.3f us/iter\n", "llama_logits_top_k", (t_end - t_start) / (float)n_iter);
+}
+
 static void test_perf() {
     const int n_vocab = 1 << 17;
 
@@ -293,6 +376,8 @@ static void test_perf() {
     BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
     BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
+
+    bench_logits_top_k(data, 40, 32);
 }
 
 int main(void) {
@@ -377,6 +462,12 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_logits_top_k(    10,   1,  0);
+    test_logits_top_k(    10,  40,  0);
+    test_logits_top_k( 32000,  40,  0);
+    test_logits_top_k( 32000,  40, 64);
+    test_logits_top_k(152064, 200, 16);
+
     printf("OK\n");
 
     test_perf();
@@ -252,6 +252,31 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // batched tokenization, the tokenizer sessions of each thread are reused for several tests
+    // (repeated to get enough text for several threads)
+    if (!k_tests.empty()) {
+        std::vector<std::string>              texts;
+        std::vector<std::vector<llama_token>> expected;
+
+        size_t n_bytes = 0;
+        while (n_bytes < 64*1024) {
+            for (const auto & test_kv : k_tests) {
+                texts.push_back(test_kv.first);
+                expected.push_back(test_kv.second);
+                n_bytes += test_kv.first.size() + 1;
+            }
+        }
+
+        const auto res = common_tokenize_batch(ctx, texts, add_special, false, 4);
+
+        for (size_t i = 0; i < texts.size(); ++i) {
+            if (res[i] != expected[i]) {
+                fprintf(stderr, "%s : failed batched test: '%s'\n", __func__, texts[i].c_str());
+                success = false;
+            }
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
@@ -3,7 +3,9 @@
 #include "unicode.h"
 #include "console.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <codecvt>
 #include <cstdio>
 #include <cstring>
@@ -14,19 +16,23 @@
 #include <atomic>
 
 int main(int argc, char **argv) {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <vocab-file> [--ignore-merges]\n", argv[0]);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file> [--ignore-merges] [--bench]\n", argv[0]);
         return 1;
     }
 
     const std::string fname = argv[1];
     bool ignore_merges = false;
-    if (argc == 3) {
-        if (std::strcmp(argv[2], "--ignore-merges") != 0) {
-            fprintf(stderr, "Usage: %s <vocab-file> [--ignore-merges]\n", argv[0]);
+    bool bench         = false; // measure the throughput of the tokenizer with and without the word cache
+    for (int i = 2; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--ignore-merges") == 0) {
+            ignore_merges = true;
+        } else if (std::strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else {
+            fprintf(stderr, "Usage: %s <vocab-file> [--ignore-merges] [--bench]\n", argv[0]);
             return 1;
         }
-        ignore_merges = true;
     }
 
     fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
@@ -106,6 +112,57 @@ int main(int argc, char **argv) {
         }
     }
 
+    // the cached words give the same tokens, on a text that repeats the frequent tokens the way natural text does
+    // with --bench, the text is larger and the tokenization is timed without the cache, with a cold and a warm cache
+    {
+        std::string text;
+
+        uint32_t seed = 42;
+        while (text.size() < (bench ? 1024*1024 : 64*1024)) {
+            seed = seed*1664525u + 1013904223u;
+            const llama_token id = (llama_token) std::pow((double) n_vocab, (seed >> 8) / (double) (1 << 24)) - 1;
+            const std::string str = common_detokenize(ctx, std::vector<int>(1, id));
+            try {
+                unicode_cpts_from_utf8(str);
+            } catch (const std::invalid_argument &) {
+                continue;
+            }
+            text += str;
+            text += " ";
+        }
+
+        const char * names[3] = { "no cache", "cold", "warm" };
+        std::vector<llama_token> tokens[3];
+
+        for (int pass = 0; pass < 3; ++pass) {
+            // the words of the tokens above are in the cache, it is cleared before the cold pass
+            if (pass < 2) {
+                llama_tokenizer_set_cache_size(model, pass == 0 ? 0 : 32768);
+            }
+
+            const int64_t t_start = ggml_time_us();
+            tokens[pass] = common_tokenize(ctx, text, false, false);
+            const int64_t t_end = ggml_time_us();
+
+            if (bench) {
+                printf("%s : tokenize (%-8s): %zu bytes -> %zu tokens in %8.3f ms, %6.2f MB/s\n", __func__, names[pass],
+                        text.size(), tokens[pass].size(), (t_end - t_start) / 1000.0, text.size() / (double) std::max<int64_t>(1, t_end - t_start));
+            }
+        }
+
+        if (tokens[0] != tokens[1] || tokens[0] != tokens[2]) {
+            fprintf(stderr, "%s : error: tokenizing the same text with and without the word cache gave different tokens\n", __func__);
+            return 4;
+        }
+
+        if (bench) {
+            llama_free(ctx);
+            llama_free_model(model);
+            llama_backend_free();
+            return 0;
+        }
+    }
+
     // unicode
     {
         const int nthread = std::thread::hardware_concurrency();
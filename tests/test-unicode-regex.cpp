@@ -0,0 +1,115 @@
+// Check the pre-tokenizer regexes compiled to a DFA against the hand-written splitters and std::regex
+
+#include "unicode.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const std::string k_gpt2   = "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)";
+static const std::string k_llama3 = "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+
+// the same regex, but not recognized by unicode_regex_split_custom, so it goes through the DFA
+static std::string as_dfa(const std::string & re) {
+    return "(?:" + re + ")";
+}
+
+// the same regex on texts without '\x01', but with a backreference, which leaves it to std::regex
+static std::string as_stl(const std::string & re) {
+    return "(?:" + re + ")|(\\x01)\\1";
+}
+
+static std::string random_text(std::mt19937 & rng, size_t n) {
+    static const std::vector<uint32_t> cpts = {
+        ' ', ' ', ' ', '\t', '\n', '\r', 'a', 'b', 'e', 'l', 'r', 's', 't', 'v', 'S', 'T', 'D', '0', '1', '9',
+        '\'', '.', ',', '!', '?', '$', '+', '<', '|', '(', '-', '_',
+        0x00A0, 0x3000, 0x0085, // whitespaces
+        0x00E9, 0x4E2D, 0xAC00, 0x0391, // letters
+        0x0660, 0x00B2, // numbers
+        0x2019, 0x3002, 0xFF01, 0x2026, // punctuation
+        0x1F600, 0x0301, 0x00D7, // symbols, marks
+    };
+
+    std::string res;
+    for (size_t i = 0; i < n; ++i) {
+        res += unicode_cpt_to_utf8(cpts[rng() % cpts.size()]);
+    }
+
+    return res;
+}
+
+static void check(const std::string & text, const std::vector<std::string> & res, const std::vector<std::string> & ref, const char * what) {
+    if (res != ref) {
+        fprintf(stderr, "%s: error: %s splits differ for text '%s'\n", __func__, what, text.c_str());
+        for (const auto & word : res) {
+            fprintf(stderr, " '%s'", word.c_str());
+        }
+        fprintf(stderr, "\nexpected:\n");
+        for (const auto & word : ref) {
+            fprintf(stderr, " '%s'", word.c_str());
+        }
+        fprintf(stderr, "\n");
+        assert(false);
+    }
+}
+
+int main(void) {
+    std::mt19937 rng(42);
+
+    // the DFA must produce the same splits as the hand-written splitters and as std::regex
+    for (const auto & re : { k_gpt2, k_llama3 }) {
+        for (int i = 0; i < 1000; ++i) {
+            const std::string text = random_text(rng, rng() % 48);
+
+            const auto ref = unicode_regex_split(text, { re });
+
+            check(text, unicode_regex_split(text, { as_dfa(re) }), ref, "DFA");
+            check(text, unicode_regex_split(text, { as_stl(re) }), ref, "std::regex");
+        }
+    }
+
+    // regexes without unicode categories, lookaheads, lazy quantifiers and chained splits
+    for (const std::vector<std::string> & res : std::vector<std::vector<std::string>> {
+            { "[\r\n]", "\\s?[!-/:-~！-／：-～‘-‟　-。]+", "\\s+$", "[一-龥ࠀ-一가-퟿]+", "\\p{N}+" },
+            { " ?[^(\\s|.,!?…。，、।۔،)]+", "\\p{N}" },
+            { "[\\p{P}\\$\\+<=>\\^~\\|]+", k_gpt2, "[0-9][0-9][0-9]" },
+            { "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" },
+            { "a+?b|[0-9]{2,}s?", "(?:ab|a)c?" },
+        }) {
+        std::vector<std::string> res_stl;
+        for (const auto & re : res) {
+            res_stl.push_back(as_stl(re));
+        }
+
+        for (int i = 0; i < 1000; ++i) {
+            const std::string text = random_text(rng, rng() % 48);
+
+            check(text, unicode_regex_split(text, res), unicode_regex_split(text, res_stl), "DFA");
+        }
+    }
+
+    // throughput
+    {
+        std::string text;
+        while (text.size() < 256*1024) {
+            text += random_text(rng, 64);
+        }
+
+        for (const auto & re : { k_gpt2, as_dfa(k_gpt2), as_stl(k_gpt2) }) {
+            const auto t_start = std::chrono::high_resolution_clock::now();
+            const auto words   = unicode_regex_split(text, { re });
+            const auto t_end   = std::chrono::high_resolution_clock::now();
+
+            const double t_s = std::chrono::duration<double>(t_end - t_start).count();
+
+            printf("%s: %-10s: %zu words, %8.3f MB/s\n", __func__,
+                    re == k_gpt2 ? "custom" : re == as_dfa(k_gpt2) ? "DFA" : "std::regex", words.size(), text.size()/t_s/1e6);
+        }
+    }
+
+    return 0;
+}